@@ -22,6 +22,8 @@
 #ifndef _NFT_TIMERANGE_MT_H
 #define _NFT_TIMERANGE_MT_H
 
+#include <linux/seqlock.h>
+
 #define RANGE_LENGTH 51
 
 #define HOURS 1
@@ -49,6 +51,13 @@ struct nft_timerange_info
 	char days[7];
 	char type;
 	bool invert;
+
+	/* verdict cached until next_transition, protected by lock */
+	seqlock_t lock;
+	time64_t valid_from;
+	time64_t next_transition;
+	int minuteswest;
+	bool match;
 };
 
 void to_lowercase(char* str);
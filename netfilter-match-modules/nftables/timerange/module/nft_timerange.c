@@ -55,33 +55,58 @@ static const struct nla_policy nft_timerange_policy[NFTA_TIMERANGE_MAX + 1] = {
 	[NFTA_TIMERANGE_WEEKLYRANGES]	= { .type = NLA_STRING, .len = TIMERANGE_TEXT_SIZE },
 };
 
-static bool timerange_mt(struct nft_timerange_info *priv, struct sk_buff *skb)
+/*
+ * Is pos inside one of the sorted, -1 terminated inclusive ranges.  Also
+ * sets next_boundary to the first position after pos at which that can
+ * change, or to period if there is none before the ranges repeat.
+ */
+static int timerange_in_ranges(const long* ranges, long pos, long period, long* next_boundary)
 {
-	ktime_t stamp_time;
+	int match_found = 0;
+	int test_index;
+	*next_boundary = period;
+	for(test_index=0; ranges[test_index] != -1; test_index=test_index+2)
+	{
+		if(pos < ranges[test_index])
+		{
+			*next_boundary = ranges[test_index];
+			break;
+		}
+		if(pos <= ranges[test_index+1])
+		{
+			match_found = 1;
+			*next_boundary = ranges[test_index+1] + 1 < period ? ranges[test_index+1] + 1 : period;
+			break;
+		}
+	}
+	return match_found;
+}
+
+/*
+ * Work out whether now is inside the configured time ranges, and the time
+ * of the next boundary at which that may change.  Only called when the
+ * cached result has expired, so this is where the divisions happen.
+ */
+static bool timerange_update(struct nft_timerange_info *priv, time64_t now, int minuteswest)
+{
+	s64 stamp_time;
+	s64 days_since_epoch;
 	int weekday;
 	int seconds_since_midnight;
-	s64 days_since_epoch;
-	s64 weeks_since_epoch;
-	int test_index;
-	int match_found;
+	long next_boundary = 86400;
+	long position;
+	bool match_found = false;
 
-	struct timespec64 test_time;
-	
-	ktime_get_real_ts64(&test_time);
-	stamp_time = test_time.tv_sec;
-	stamp_time = stamp_time -  (60 * sys_tz.tz_minuteswest);  /* Adjust for local timezone */
+	stamp_time = now - (60 * minuteswest);  /* Adjust for local timezone */
 	days_since_epoch = div_s64_rem(stamp_time,86400,&seconds_since_midnight); /* 86400 seconds per day */
-	weeks_since_epoch = div_s64_rem(4 + days_since_epoch,7,&weekday);      /* 1970-01-01 (time=0) was a Thursday (4). */
+	div_s64_rem(4 + days_since_epoch,7,&weekday);      /* 1970-01-01 (time=0) was a Thursday (4). */
+	position = seconds_since_midnight;
 
-	/*printk("time=%lld, since midnight = %d, day=%d, minuteswest=%d\n", ktime_to_ns(stamp_time), seconds_since_midnight, weekday, sys_tz.tz_minuteswest);*/
+	/*printk("time=%lld, since midnight = %d, day=%d, minuteswest=%d\n", now, seconds_since_midnight, weekday, minuteswest);*/
 
-	match_found = 0;
 	if(priv->type == HOURS)
 	{
-		for(test_index=0; priv->ranges[test_index] != -1 && match_found == 0 && seconds_since_midnight >= priv->ranges[test_index]; test_index=test_index+2)
-		{
-			match_found = seconds_since_midnight >= priv->ranges[test_index] && seconds_since_midnight <= priv->ranges[test_index+1] ? 1 : match_found;
-		}
+		match_found = timerange_in_ranges(priv->ranges, position, 86400, &next_boundary);
 	}
 	else if(priv->type == WEEKDAYS)
 	{
@@ -89,24 +114,43 @@ static bool timerange_mt(struct nft_timerange_info *priv, struct sk_buff *skb)
 	}
 	else if(priv->type == DAYS_HOURS)
 	{
-		match_found = priv->days[weekday];
-		if(match_found == 1)
-		{
-			match_found = 0;
-			for(test_index=0; priv->ranges[test_index] != -1 && match_found == 0 && seconds_since_midnight >= priv->ranges[test_index]; test_index=test_index+2)
-			{
-				match_found = seconds_since_midnight >= priv->ranges[test_index] && seconds_since_midnight <= priv->ranges[test_index+1] ? 1 : match_found;
-			}
-		}
+		match_found = timerange_in_ranges(priv->ranges, position, 86400, &next_boundary) && priv->days[weekday];
 	}
 	else if(priv->type == WEEKLY_RANGE)
 	{
-		ktime_t seconds_since_sunday_midnight = seconds_since_midnight + (weekday*86400);
-		for(test_index=0; priv->ranges[test_index] != -1 && match_found == 0 && seconds_since_sunday_midnight >= priv->ranges[test_index]; test_index=test_index+2)
-		{
-			match_found = seconds_since_sunday_midnight >= priv->ranges[test_index] && seconds_since_sunday_midnight <= priv->ranges[test_index+1] ? 1 : match_found;
-		}
-		
+		position = seconds_since_midnight + (weekday*86400);
+		match_found = timerange_in_ranges(priv->ranges, position, 7*86400, &next_boundary);
+	}
+
+	write_seqlock_bh(&priv->lock);
+	priv->match = match_found;
+	priv->valid_from = now;
+	priv->next_transition = now + (next_boundary - position);
+	priv->minuteswest = minuteswest;
+	write_sequnlock_bh(&priv->lock);
+
+	return match_found;
+}
+
+static bool timerange_mt(struct nft_timerange_info *priv, struct sk_buff *skb)
+{
+	time64_t now = ktime_get_real_seconds();
+	int minuteswest = READ_ONCE(sys_tz.tz_minuteswest);
+	unsigned int seq;
+	bool match_found;
+	bool valid;
+
+	/* between transitions the verdict only changes if the clock is set or the timezone changes */
+	do
+	{
+		seq = read_seqbegin(&priv->lock);
+		valid = now >= priv->valid_from && now < priv->next_transition && minuteswest == priv->minuteswest;
+		match_found = priv->match;
+	} while(read_seqretry(&priv->lock, seq));
+
+	if(!valid)
+	{
+		match_found = timerange_update(priv, now, minuteswest);
 	}
 	
 	match_found ^= priv->invert;
@@ -654,6 +698,11 @@ static int nft_timerange_init(const struct nft_ctx *ctx, const struct nft_expr *
 
 	priv->invert = invert;
 
+	/* nothing cached yet, the first packet works out the verdict */
+	seqlock_init(&priv->lock);
+	priv->valid_from = 0;
+	priv->next_transition = 0;
+
 	if(strlen(hours) > 0)
 	{
 		parsed = parse_time_ranges(hours, 0);
@@ -32,6 +32,7 @@
 #define WEBURL_ALL_PART 4
 #define WEBURL_DOMAIN_PART 5
 #define WEBURL_PATH_PART 6
+#define WEBURL_DOMAIN_TYPE 7
 
 enum nft_weburl_attributes {
 	NFTA_WEBURL_UNSPEC,
@@ -49,6 +50,27 @@ enum nft_weburl_flags {
 	NFT_WEBURL_F_MP_ALL				= (1 << 4),
 	NFT_WEBURL_F_MP_DOMAINONLY		= (1 << 5),
 	NFT_WEBURL_F_MP_PATHONLY		= (1 << 6),
+	NFT_WEBURL_F_MT_MATCHESDOMAIN	= (1 << 7),
+	NFT_WEBURL_F_LIST				= (1 << 8),
+};
+
+#define WEBURL_SCHEME_HTTP 0
+#define WEBURL_SCHEME_HTTPS 1
+#define WEBURL_NUM_SCHEMES 2
+
+struct weburl_dfa;
+struct weburl_list;
+
+/* a parsed request, host and path point into the packet and are not NUL terminated */
+struct weburl_request
+{
+	const char* host;
+	unsigned int host_len;
+	const char* path;
+	unsigned int path_len;
+	unsigned char scheme;
+	unsigned char lower;	/* host must be lowercased before matching (TLS SNI) */
+	unsigned char www;	/* host starts with "www." */
 };
 
 struct nft_weburl_info
@@ -57,5 +79,9 @@ struct nft_weburl_info
 	unsigned char match_type;
 	unsigned char match_part;
 	bool invert;
+	struct weburl_dfa* dfa;		/* compiled test_str, WEBURL_REGEX_TYPE only */
+	struct weburl_list* list;	/* test_str, or the entries of the file it names, all other types */
+	bool list_file;			/* NFT_WEBURL_F_LIST, test_str is a file name */
+	u32 generation;			/* tags this rule's entries in the verdict cache */
 };
 #endif /*_NFT_WEBURL_H*/
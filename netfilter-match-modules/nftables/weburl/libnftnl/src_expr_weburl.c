@@ -150,12 +150,23 @@ nftnl_expr_weburl_snprintf(char *buf, size_t len,
 			ret = snprintf(buf + offset, remain, "matches-exactly ");
 			SNPRINTF_BUFFER_SIZE(ret, remain, offset);
 		}
+		else if(weburl->flags & NFT_WEBURL_F_MT_MATCHESDOMAIN)
+		{
+			ret = snprintf(buf + offset, remain, "matches-domain ");
+			SNPRINTF_BUFFER_SIZE(ret, remain, offset);
+		}
 
 		if(inv)
 		{
 			ret = snprintf(buf + offset, remain, "!= ");
 			SNPRINTF_BUFFER_SIZE(ret, remain, offset);
 		}
+
+		if(weburl->flags & NFT_WEBURL_F_LIST)
+		{
+			ret = snprintf(buf + offset, remain, "list ");
+			SNPRINTF_BUFFER_SIZE(ret, remain, offset);
+		}
 	}
 	if (e->flags & (1 << NFTNL_EXPR_WEBURL_MATCH)) {
 		ret = snprintf(buf + offset, remain, "%s", weburl->match);
@@ -33,10 +33,13 @@
 
 #include <linux/netfilter/nf_tables.h>
 #include <net/netfilter/nf_tables.h>
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_timestamp.h>
+#include <net/netns/generic.h>
 #include <linux/netfilter/nft_weburl.h>
 
-#include "weburl_deps/regexp.c"
-#include "weburl_deps/tree_map.h"
+#include "weburl_deps/weburl_dfa.c"
+#include "weburl_deps/weburl_list.c"
 
 
 #include <linux/ip.h>
@@ -47,493 +50,419 @@ MODULE_AUTHOR("Michael Gray");
 MODULE_DESCRIPTION("Match URL in HTTP(S) requests, designed for use with Gargoyle web interface (www.gargoyle-router.com)");
 MODULE_ALIAS_NFT_EXPR("weburl");
 
-string_map* compiled_map = NULL;
-
 #define WEBURL_TEXT_SIZE MAX_TEST_STR
 static const struct nla_policy nft_weburl_policy[NFTA_WEBURL_MAX + 1] = {
 	[NFTA_WEBURL_FLAGS]			= { .type = NLA_U32 },
 	[NFTA_WEBURL_MATCH]			= { .type = NLA_STRING, .len = WEBURL_TEXT_SIZE },
 };
 
-int strnicmp(const char * cs,const char * ct,size_t count)
-{
-	register signed char __res = 0;
+/* longest payload we look at when it has to be copied out of a non-linear skb */
+#define WEBURL_MAX_PAYLOAD 4096
 
-	while (count)
-	{
-		if ((__res = toupper( *cs ) - toupper( *ct++ ) ) != 0 || !*cs++)
-		{
-			break;
-		}
-		count--;
-	}
-	return __res;
-}
+static char __percpu* weburl_payload_buf;
 
-char *strnistr(const char *s, const char *find, size_t slen)
+/*
+ * Parse an HTTP request.  Returns 0 if data does not start with a method we
+ * match on.  Host and path are left pointing into data, the packet is only
+ * walked once and nothing is copied.
+ */
+static int weburl_parse_http(const char* data, int len, struct weburl_request* req)
 {
-	char c, sc;
-	size_t len;
+	const char* p = data;
+	const char* end = data + len;
 
-	if ((c = *find++) != '\0') 
+	if(strncasecmp(data, "GET ", 4) != 0 && strncasecmp(data, "POST ", 5) != 0 && strncasecmp(data, "HEAD ", 5) != 0)
 	{
-		len = strlen(find);
-		do
-		{
-			do
-			{
-				if (slen < 1 || (sc = *s) == '\0')
-				{
-					return (NULL);
-				}
-				--slen;
-				++s;
-			}
-			while ( toupper(sc) != toupper(c));
-      			
-			if (len > slen)
-			{
-				return (NULL);
-			}
-      	}
-		while (strnicmp(s, find, len) != 0);
-      		
-		s--;
+		return 0;
 	}
-	return ((char *)s);
-}
+	memset(req, 0, sizeof(struct weburl_request));
+	req->scheme = WEBURL_SCHEME_HTTP;
 
-int do_match_test(unsigned char match_type, const char* reference, char* query)
-{
-	int matches = 0;
-	struct regexp* r;
-	switch(match_type)
+	/* path is the second field of the request line */
+	while(p < end && *p != ' ')
 	{
-		case WEBURL_CONTAINS_TYPE:
-			matches = (strstr(query, reference) != NULL);
-			break;
-		case WEBURL_REGEX_TYPE:
-
-			if(compiled_map == NULL)
-			{
-				compiled_map = initialize_map(0);
-				if(compiled_map == NULL) /* test for malloc failure */
-				{
-					return 0;
-				}
-			}
-			r = (struct regexp*)get_map_element(compiled_map, reference);
-			if(r == NULL)
-			{
-				int rlen = strlen(reference);
-				r= regcomp((char*)reference, &rlen);
-				if(r == NULL) /* test for malloc failure */
-				{
-					return 0;
-				}
-				set_map_element(compiled_map, reference, (void*)r);
-			}
-			matches = regexec(r, query);
-			break;
-		case WEBURL_EXACT_TYPE:
-			matches = (strstr(query, reference) != NULL) && strlen(query) == strlen(reference);
-			break;
+		p++;
 	}
-	return matches;
-}
-
-int http_match(const struct nft_weburl_info* priv, const unsigned char* packet_data, int packet_length)
-{
-	int test = 0; 
-
-	/* printk("found a http web page request\n"); */
-	char* path;
-	char* host;
-	int path_start_index;
-	int path_end_index;
-	int last_header_index;
-	char last_two_buf[2];
-	int end_found;
-	char* host_match;
-	char* test_prefixes[6];
-	int prefix_index;
-
-	path = (char*)kcalloc(625,sizeof(char),GFP_ATOMIC);
-	host = (char*)kcalloc(625,sizeof(char),GFP_ATOMIC);
-	/* get path portion of URL */
-	path_start_index = (int)(strstr((char*)packet_data, " ") - (char*)packet_data);
-	while( packet_data[path_start_index] == ' ')
-	{
-		path_start_index++;
-	}
-	path_end_index= (int)(strstr( (char*)(packet_data+path_start_index), " ") -  (char*)packet_data);
-	if(path_end_index > 0) 
-	{
-		int path_length = path_end_index-path_start_index;
-		path_length = path_length < 625 ? path_length : 624; /* prevent overflow */
-		memcpy(path, packet_data+path_start_index, path_length);
-		path[path_length] = '\0';
+	while(p < end && *p == ' ')
+	{
+		p++;
 	}
-	
-	/* get header length */
-	last_header_index = 2;
-	memcpy(last_two_buf,(char*)packet_data, 2);
-	end_found = 0;
-	while(end_found == 0 && last_header_index < packet_length)
-	{
-		char next = (char)packet_data[last_header_index];
-		if(next == '\n')
-		{
-			end_found = last_two_buf[1] == '\n' || (last_two_buf[0] == '\n' && last_two_buf[1] == '\r') ? 1 : 0;
-		}
-		if(end_found == 0)
-		{
-			last_two_buf[0] = last_two_buf[1];
-			last_two_buf[1] = next;
-			last_header_index++;
-		}
+	req->path = p;
+	while(p < end && *p != ' ' && *p != '\r' && *p != '\n')
+	{
+		p++;
 	}
-	
-	/* get host portion of URL */
-	host_match = strnistr( (char*)packet_data, "Host:", last_header_index);
-	if(host_match != NULL)
+	req->path_len = (p < end && *p == ' ') ? p - req->path : 0;
+
+	/* host is the value of the Host header, up to an optional port */
+	while((p = memchr(p, '\n', end - p)) != NULL)
 	{
-		int host_end_index;
-		host_match = host_match + 5; /* character after "Host:" */
-		while(host_match[0] == ' ')
+		p++;
+		if(p == end || *p == '\r' || *p == '\n')
 		{
-			host_match = host_match+1;
+			break; /* end of headers */
 		}
-		
-		host_end_index = 0;
-		while(	host_match[host_end_index] != '\n' && 
-			host_match[host_end_index] != '\r' && 
-			host_match[host_end_index] != ' ' && 
-			host_match[host_end_index] != ':' && 
-			((char*)host_match - (char*)packet_data)+host_end_index < last_header_index 
-			)
+		if(end - p > 5 && strncasecmp(p, "Host:", 5) == 0)
 		{
-			host_end_index++;
-		}
-		host_end_index = host_end_index < 625 ? host_end_index : 624; /* prevent overflow */
-		memcpy(host, host_match, host_end_index);
-		host[host_end_index] = '\0';
-	}
-
-	/* printk("host = \"%s\", path =\"%s\"\n", host, path); */
-	
-	switch(priv->match_part)
-	{
-		case WEBURL_DOMAIN_PART:
-			test = do_match_test(priv->match_type, priv->test_str, host);
-			if(!test && strstr(host, "www.") == host)
-			{
-				test = do_match_test(priv->match_type, priv->test_str, ((char*)host+4) );	
-			}
-			break;
-		case WEBURL_PATH_PART:
-			test = do_match_test(priv->match_type, priv->test_str, path);
-			if( !test && path[0] == '/' )
-			{
-				test = do_match_test(priv->match_type, priv->test_str, ((char*)path+1) );
-			}
-			break;
-		case WEBURL_ALL_PART:
-			test_prefixes[0] = "http://";
-			test_prefixes[1] = "";
-			test_prefixes[2] = NULL;
-
-			for(prefix_index=0; test_prefixes[prefix_index] != NULL && test == 0; prefix_index++)
+			p += 5;
+			while(p < end && *p == ' ')
 			{
-				char* test_url;
-				test_url = (char*)kcalloc(1250,sizeof(char),GFP_ATOMIC);
-				test_url[0] = '\0';
-				strcat(test_url, test_prefixes[prefix_index]);
-				strcat(test_url, host);
-				if(strcmp(path, "/") != 0)
-				{
-					strcat(test_url, path);
-				}
-				test = do_match_test(priv->match_type, priv->test_str, test_url);
-				if(!test && strcmp(path, "/") == 0)
-				{
-					strcat(test_url, path);
-					test = do_match_test(priv->match_type, priv->test_str, test_url);
-				}
-				
-				/* printk("test_url = \"%s\", test=%d\n", test_url, test); */
-				free(test_url);
+				p++;
 			}
-			if(!test && strstr(host, "www.") == host)
+			req->host = p;
+			while(p < end && *p != '\r' && *p != '\n' && *p != ' ' && *p != ':')
 			{
-				char* www_host = ((char*)host+4);
-				for(prefix_index=0; test_prefixes[prefix_index] != NULL && test == 0; prefix_index++)
-				{
-					char* test_url;
-					test_url = (char*)kcalloc(1250,sizeof(char),GFP_ATOMIC);
-					test_url[0] = '\0';
-					strcat(test_url, test_prefixes[prefix_index]);
-					strcat(test_url, www_host);
-					if(strcmp(path, "/") != 0)
-					{
-						strcat(test_url, path);
-					}
-					test = do_match_test(priv->match_type, priv->test_str, test_url);
-					if(!test && strcmp(path, "/") == 0)
-					{
-						strcat(test_url, path);
-						test = do_match_test(priv->match_type, priv->test_str, test_url);
-					}
-				
-					/* printk("test_url = \"%s\", test=%d\n", test_url, test); */
-					free(test_url);
-				}
+				p++;
 			}
+			req->host_len = p - req->host;
 			break;
+		}
 	}
-
-	free(path);
-	free(host);
-	/* 
-	 * If invert flag is set, return true if it didn't match 
-	 */
-	test ^= priv->invert;
-
-	return test;
+	return 1;
 }
 
-int https_match(const struct nft_weburl_info* priv, const unsigned char* packet_data, int packet_length)
+static unsigned int weburl_be16(const unsigned char* p)
 {
-	int test = 0;
+	return (p[0] << 8) | p[1];
+}
 
-	/* printk("found a https web page request\n"); */
-	char* host;
-	char* test_prefixes[6];
-	int prefix_index, x, packet_limit;
-	unsigned short cslen, ext_type, ext_len, maxextlen;
-	unsigned char conttype, hndshktype, sidlen, cmplen;
-	const unsigned char* packet_ptr;
+/*
+ * Parse a TLS ClientHello.  Returns 0 if data is not a ClientHello, otherwise
+ * host is the server name from the SNI extension (empty if there is none).
+ * Every length field is checked against len before it is followed.
+ */
+static int weburl_parse_tls(const unsigned char* data, int len, struct weburl_request* req)
+{
+	int pos;
+	int ext_end;
 
-	host = (char*)kcalloc(625,sizeof(char),GFP_ATOMIC);
-	host[0] = '\0';
-	packet_ptr = packet_data;
+	/* record type 22 (handshake), handshake type 1 (ClientHello) */
+	if(len < 44 || data[0] != 22 || data[5] != 1)
+	{
+		return 0;
+	}
+	memset(req, 0, sizeof(struct weburl_request));
+	req->scheme = WEBURL_SCHEME_HTTPS;
+	req->lower = 1;
 
-	if (packet_length < 43)
+	pos = 44 + data[43];				/* skip session id */
+	if(pos + 2 > len)
 	{
-		/*printk("Packet less than 43 bytes, exiting\n");*/
-		free(host);
-		return test;
+		return 1;
 	}
-	conttype = packet_data[0];
-	hndshktype = packet_data[5];
-	sidlen = packet_data[43];
-	/*printk("conttype=%d, hndshktype=%d, sidlen=%d ",conttype,hndshktype,sidlen);*/
-	if(conttype != 22)
+	pos += 2 + weburl_be16(data + pos);	/* skip cipher suites */
+	if(pos + 1 > len)
 	{
-		/*printk("conttype not 22, exiting\n");*/
-		free(host);
-		return test;
+		return 1;
 	}
-	if(hndshktype != 1)
-	{
-		/*printk("hndshktype not 1, exiting\n");*/
-		free(host);
-		return test;		//We aren't in a Client Hello
-	}
-
-	packet_ptr = packet_data + 1 + 43 + sidlen;		//Skip to Cipher Suites Length
-	cslen = ntohs(*(unsigned short*)packet_ptr);	//Length of Cipher Suites (2 byte)
-	packet_ptr = packet_ptr + 2 + cslen;	//Skip to Compression Methods
-	cmplen = *packet_ptr;	//Length of Compression Methods (1 byte)
-	packet_ptr = packet_ptr + 1 + cmplen;	//Skip to Extensions Length **IMPORTANT**
-	maxextlen = ntohs(*(unsigned short*)packet_ptr);	//Length of extensions (2 byte)
-	packet_ptr = packet_ptr + 2;	//Skip to beginning of first extension and start looping
-	ext_type = 1;
-	/*printk("cslen=%d, cmplen=%d, maxextlen=%d, pktlen=%d,ptrpos=%d\n",cslen,cmplen,maxextlen,packet_length,packet_ptr - packet_data);*/
-	//Limit the pointer bounds to the smaller of either the extensions length or the packet length
-	packet_limit = ((packet_ptr - packet_data) + maxextlen) < packet_length ? ((packet_ptr - packet_data) + maxextlen) : packet_length;
-
-	//Extension Type and Extension Length are both 2 byte. SNI Extension is "0"
-	while(((packet_ptr - packet_data) < packet_limit) && (ext_type != 0))
-	{
-		ext_type = ntohs(*(unsigned short*)packet_ptr);
-		packet_ptr = packet_ptr + 2;
-		ext_len = ntohs(*(unsigned short*)packet_ptr);
-		packet_ptr = packet_ptr + 2;
-		/*printk("ext_type=%d, ext_len=%d\n",ext_type,ext_len);*/
+	pos += 1 + data[pos];				/* skip compression methods */
+	if(pos + 2 > len)
+	{
+		return 1;
+	}
+	ext_end = pos + 2 + weburl_be16(data + pos);
+	ext_end = ext_end < len ? ext_end : len;
+	pos += 2;
+
+	while(pos + 4 <= ext_end)
+	{
+		unsigned int ext_type = weburl_be16(data + pos);
+		unsigned int ext_len = weburl_be16(data + pos + 2);
+		pos += 4;
 		if(ext_type == 0)
 		{
-			unsigned short snilen;
-			/*printk("FOUND SNI EXT\n");*/
-			packet_ptr = packet_ptr + 3;	//Skip to length of SNI
-			snilen = ntohs(*(unsigned short*)packet_ptr);
-			/*printk("snilen=%d\n",snilen);*/
-			packet_ptr = packet_ptr + 2;	//Skip to beginning of SNI
-			if((((packet_ptr - packet_data) + snilen) < packet_limit) && (snilen > 0))
+			/* server name list length, name type (0 = host name), name length */
+			if(pos + 5 <= ext_end && data[pos + 2] == 0)
 			{
-				/*printk("FOUND SNI\n");*/
-				snilen = snilen < 625 ? snilen : 624; // prevent overflow
-				memcpy(host, packet_ptr, snilen);
-				host[snilen] = '\0';
-				for(x=0; host[x] != '\0'; x++)
+				unsigned int sni_len = weburl_be16(data + pos + 3);
+				if(pos + 5 + sni_len <= ext_end)
 				{
-					host[x] = (char)tolower(host[x]);
+					req->host = (const char*)data + pos + 5;
+					req->host_len = sni_len;
 				}
-				/*printk("sni=%s\n",host);*/
 			}
+			break;
 		}
-		else
-		{
-			packet_ptr = packet_ptr + ext_len;
-		}
+		pos += ext_len;
 	}
+	return 1;
+}
 
-	/* printk("host = \"%s\"\n", host); */
+/*
+ * Regex rules see the same variants of the url the string rules did before
+ * they were compiled into lists:  with and without the scheme, with and
+ * without a leading "www.", and for the root path with and without the "/".
+ */
+static int weburl_regex_match(const struct weburl_dfa* dfa, unsigned char match_part, const struct weburl_request* req)
+{
+	static const char* prefixes[WEBURL_NUM_SCHEMES] = { "http://", "https://" };
+	int root_path = (req->path_len == 1 && req->path[0] == '/');
+	unsigned int skip;
+	int p;
 
-	switch(priv->match_part)
+	switch(match_part)
 	{
 		case WEBURL_DOMAIN_PART:
-			test = do_match_test(priv->match_type, priv->test_str, host);
-			if(!test && strstr(host, "www.") == host)
+			return	weburl_dfa_match(dfa, "", req->host, req->host_len, NULL, 0, req->lower) ||
+				(req->www && weburl_dfa_match(dfa, "", req->host + 4, req->host_len - 4, NULL, 0, req->lower));
+		case WEBURL_PATH_PART:
+			if(req->scheme == WEBURL_SCHEME_HTTPS)
 			{
-				test = do_match_test(priv->match_type, priv->test_str, ((char*)host+4) );
+				return 0; /* we will never have a path for HTTPS */
 			}
-			break;
-		case WEBURL_PATH_PART:
-			test = 0;	//we will never have a Path for HTTPS
-			break;
-		case WEBURL_ALL_PART:
-			test_prefixes[0] = "https://";
-			test_prefixes[1] = "";
-			test_prefixes[2] = NULL;
-
-			for(prefix_index=0; test_prefixes[prefix_index] != NULL && test == 0; prefix_index++)
+			return	weburl_dfa_match(dfa, "", NULL, 0, req->path, req->path_len, 0) ||
+				(req->path_len > 0 && req->path[0] == '/' && weburl_dfa_match(dfa, "", NULL, 0, req->path + 1, req->path_len - 1, 0));
+	}
+	for(skip = 0; skip <= (req->www ? 4 : 0); skip += 4)
+	{
+		for(p = 0; p < 2; p++)
+		{
+			const char* prefix = p == 0 ? prefixes[req->scheme] : "";
+			if(	(root_path && weburl_dfa_match(dfa, prefix, req->host + skip, req->host_len - skip, NULL, 0, req->lower)) ||
+				weburl_dfa_match(dfa, prefix, req->host + skip, req->host_len - skip, req->path, req->path_len, req->lower)
+				)
 			{
-				char* test_url;
-				test_url = (char*)kcalloc(1250,sizeof(char),GFP_ATOMIC);
-				test_url[0] = '\0';
-				strcat(test_url, test_prefixes[prefix_index]);
-				strcat(test_url, host);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
 
-				test = do_match_test(priv->match_type, priv->test_str, test_url);
+static int do_match_test(const struct nft_weburl_info* priv, const struct weburl_request* req)
+{
+	if(priv->match_type == WEBURL_REGEX_TYPE)
+	{
+		/* compiled in nft_weburl_init, matching is a single pass over each variant */
+		return weburl_regex_match(priv->dfa, priv->match_part, req);
+	}
+	/* one pass over the request tests every entry in the list */
+	return weburl_list_match(priv->list, priv->match_part, req);
+}
 
-				/* printk("test_url = \"%s\", test=%d\n", test_url, test); */
-				free(test_url);
-			}
-			if(!test && strstr(host, "www.") == host)
-			{
-				char* www_host = ((char*)host+4);
-				for(prefix_index=0; test_prefixes[prefix_index] != NULL && test == 0; prefix_index++)
-				{
-					char* test_url;
-					test_url = (char*)kcalloc(1250,sizeof(char),GFP_ATOMIC);
-					test_url[0] = '\0';
-					strcat(test_url, test_prefixes[prefix_index]);
-					strcat(test_url, www_host);
+/*
+ * Verdict cache.  The verdict of a rule is decided by the Host header or SNI
+ * of a connection, so once a request has been seen on a connection every
+ * later packet that is not itself a request gets the same verdict without
+ * looking at its payload.  Each rule instance gets a new generation number
+ * when it is created, and a slot holds
+ *
+ *	flow id (32 bits) | rule generation (31 bits) | verdict (1 bit)
+ *
+ * so entries left behind by a deleted or replaced rule can never match.  A
+ * slot is a single atomic64, a collision just evicts the older entry.
+ *
+ * Conntrack ids are reused (same tuple at the same address), so the flow
+ * id also hashes in the time the connection was created.  That needs the
+ * conntrack timestamp extension, which the first weburl rule in a netns
+ * switches on and the last one switches back off (unless it was already
+ * on); connections created while it is off are simply not cached.
+ */
+#define WEBURL_CACHE_SIZE 4096
 
-					test = do_match_test(priv->match_type, priv->test_str, test_url);
+static atomic64_t weburl_verdicts[WEBURL_CACHE_SIZE];
+static atomic_t weburl_generation = ATOMIC_INIT(0);
 
-					/* printk("test_url = \"%s\", test=%d\n", test_url, test); */
-					free(test_url);
-				}
-			}
-			break;
+static u32 weburl_new_generation(void)
+{
+	u32 generation;
+	do
+	{
+		generation = atomic_inc_return(&weburl_generation) & 0x7fffffff;
+	} while(generation == 0);
+	return generation;
+}
+
+#if IS_REACHABLE(CONFIG_NF_CONNTRACK)
+/* weburl rules in a netns, and whether conntrack timestamps were on before the first */
+struct weburl_net
+{
+	unsigned int num_rules;
+	bool tstamp_was_on;
+};
+
+static unsigned int weburl_net_id __read_mostly;
+static struct pernet_operations weburl_net_ops = {
+	.id = &weburl_net_id,
+	.size = sizeof(struct weburl_net),
+};
+
+/* rules are destroyed from the nf_tables destroy work, not under the commit mutex */
+static DEFINE_MUTEX(weburl_net_mutex);
+
+static void weburl_net_get(struct net* net)
+{
+	struct weburl_net* wn = net_generic(net, weburl_net_id);
+	mutex_lock(&weburl_net_mutex);
+	if(wn->num_rules++ == 0)
+	{
+		wn->tstamp_was_on = net->ct.sysctl_tstamp != 0;
+		nf_ct_set_tstamp(net, true);
 	}
+	mutex_unlock(&weburl_net_mutex);
+}
 
-	free(host);
-	/*
-	 * If invert flag is set, return true if it didn't match
-	 */
-	test ^= priv->invert;
+static void weburl_net_put(struct net* net)
+{
+	struct weburl_net* wn = net_generic(net, weburl_net_id);
+	mutex_lock(&weburl_net_mutex);
+	if(--wn->num_rules == 0 && !wn->tstamp_was_on)
+	{
+		nf_ct_set_tstamp(net, false);
+	}
+	mutex_unlock(&weburl_net_mutex);
+}
 
-	return test;
+static atomic64_t* weburl_cache_slot(const struct nf_conn* ct, u32 generation, u64* key)
+{
+	const struct nf_conn_tstamp* tstamp = nf_conn_tstamp_find(ct);
+	u32 flow_id;
+	if(tstamp == NULL)
+	{
+		return NULL;
+	}
+	flow_id = jhash_3words(nf_ct_get_id(ct), (u32)tstamp->start, (u32)(tstamp->start >> 32), 0);
+	*key = ((u64)flow_id << 31) | generation;
+	return &weburl_verdicts[jhash_2words(flow_id, generation, 0) & (WEBURL_CACHE_SIZE-1)];
 }
 
-static bool weburl_mt4(struct nft_weburl_info *priv, const struct sk_buff *skb, uint16_t iphdroffset)
+static int weburl_cache_get(const struct nf_conn* ct, u32 generation, bool* test)
 {
-	int test = 0;
-	struct iphdr* iph;	
+	atomic64_t* slot;
+	u64 key;
+	u64 entry;
+	if(ct == NULL || (slot = weburl_cache_slot(ct, generation, &key)) == NULL)
+	{
+		return 0;
+	}
+	entry = atomic64_read(slot);
+	if((entry >> 1) != key)
+	{
+		return 0;
+	}
+	*test = entry & 1;
+	return 1;
+}
 
-	/* linearize skb if necessary */
-	struct sk_buff *linear_skb = (struct sk_buff *)skb;
-	if(skb_is_nonlinear(linear_skb))
+static void weburl_cache_set(const struct nf_conn* ct, u32 generation, bool test)
+{
+	atomic64_t* slot;
+	u64 key;
+	if(ct != NULL && (slot = weburl_cache_slot(ct, generation, &key)) != NULL)
 	{
-		if(skb_linearize(linear_skb)) return test;
+		atomic64_set(slot, (key << 1) | (test ? 1 : 0));
 	}
+}
+#else
+#define weburl_net_get(net)
+#define weburl_net_put(net)
+#define weburl_cache_get(ct, generation, test) 0
+#define weburl_cache_set(ct, generation, test)
+#endif
+
+/* can the payload starting with the 6 bytes at start be a request we parse */
+static int weburl_is_request(const unsigned char* start, unsigned short dest)
+{
+	return	strncasecmp((const char*)start, "GET ", 4) == 0 || strncasecmp((const char*)start, "POST ", 5) == 0 || strncasecmp((const char*)start, "HEAD ", 5) == 0 ||
+		(dest == 443 && start[0] == 22 && start[5] == 1);
+}
 
-	/* ignore packets that are not TCP */
-	iph = (struct iphdr*)(skb_network_header(linear_skb) + iphdroffset);
-	if(iph->protocol == IPPROTO_TCP)
+static bool weburl_payload_match(const struct nft_weburl_info *priv, const struct sk_buff *skb, int payload_offset, int payload_length, unsigned short dest)
+{
+	struct weburl_request req;
+	const struct nf_conn* ct = NULL;
+	unsigned char _start[6];
+	const unsigned char* start = NULL;
+	const unsigned char* payload;
+	bool test = false;
+
+#if IS_REACHABLE(CONFIG_NF_CONNTRACK)
+	enum ip_conntrack_info ctinfo;
+	ct = nf_ct_get(skb, &ctinfo);
+#endif
+	payload_length = payload_length < (int)skb->len - payload_offset ? payload_length : (int)skb->len - payload_offset;
+
+	/* if payload length <= 10 bytes it can't be a request, otherwise check for one */
+	if(payload_length > 10)
 	{
-		/* get payload */
-		struct tcphdr* tcp_hdr		= (struct tcphdr*)( ((unsigned char*)iph) + (iph->ihl*4) );
-		unsigned short payload_offset 	= (tcp_hdr->doff*4) + (iph->ihl*4);
-		unsigned char* payload 		= ((unsigned char*)iph) + payload_offset;
-		unsigned short payload_length	= ntohs(iph->tot_len) - payload_offset;
+		start = skb_header_pointer(skb, payload_offset, sizeof(_start), _start);
+	}
+	if(start == NULL || !weburl_is_request(start, dest))
+	{
+		/* connection already decided by an earlier request, or nothing to match yet */
+		weburl_cache_get(ct, priv->generation, &test);
+		return test;
+	}
 
-		/* if payload length <= 10 bytes don't bother doing a check, otherwise check for match */
-		if(payload_length > 10)
+	/* payload in the linear area is used in place, otherwise copy as much as we look at */
+	if(payload_offset + payload_length > skb_headlen(skb) && payload_length > WEBURL_MAX_PAYLOAD)
+	{
+		payload_length = WEBURL_MAX_PAYLOAD;
+	}
+	local_bh_disable();
+	payload = skb_header_pointer(skb, payload_offset, payload_length, this_cpu_ptr(weburl_payload_buf));
+	if(payload != NULL)
+	{
+		if(weburl_parse_http((const char*)payload, payload_length, &req) || (dest == 443 && weburl_parse_tls(payload, payload_length, &req)))
 		{
-			if(strnicmp((char*)payload, "GET ", 4) == 0 || strnicmp(  (char*)payload, "POST ", 5) == 0 || strnicmp((char*)payload, "HEAD ", 5) == 0)
-			{
-				test = http_match(priv, payload, payload_length);
-			}
-			else if ((unsigned short)ntohs(tcp_hdr->dest) == 443)
-			{
-				test = https_match(priv, payload, payload_length);
-			}
+			req.www = req.host_len >= 4 && (req.lower ? strncasecmp(req.host, "www.", 4) : strncmp(req.host, "www.", 4)) == 0;
+			test = do_match_test(priv, &req);
+
+			/* 
+			 * If invert flag is set, return true if it didn't match 
+			 */
+			test ^= priv->invert;
+
+			weburl_cache_set(ct, priv->generation, test);
 		}
 	}
+	local_bh_enable();
 
 	/* printk("returning %d from weburl\n\n\n", test); */
 	return test;
 }
 
-static bool weburl_mt6(struct nft_weburl_info *priv, const struct sk_buff *skb, uint16_t ipv6hdroffset)
+static bool weburl_mt4(const struct nft_weburl_info *priv, const struct sk_buff *skb, uint16_t iphdroffset)
 {
-	int test = 0;
-	struct ipv6hdr* iph;
-	int thoff = ipv6hdroffset;
-	int ip6proto;
+	struct iphdr _iph, *iph;
+	struct tcphdr _tcph, *tcp_hdr;
+	int nhoff = skb_network_offset(skb) + iphdroffset;
+	int thoff;
 
-	/* linearize skb if necessary */
-	struct sk_buff *linear_skb = (struct sk_buff *)skb;
-	if(skb_is_nonlinear(linear_skb))
+	/* ignore packets that are not TCP */
+	iph = skb_header_pointer(skb, nhoff, sizeof(_iph), &_iph);
+	if(iph == NULL || iph->protocol != IPPROTO_TCP)
 	{
-		if(skb_linearize(linear_skb)) return test;
+		return false;
 	}
+	thoff = nhoff + iph->ihl*4;
+	tcp_hdr = skb_header_pointer(skb, thoff, sizeof(_tcph), &_tcph);
+	if(tcp_hdr == NULL)
+	{
+		return false;
+	}
+	return weburl_payload_match(priv, skb, thoff + tcp_hdr->doff*4, nhoff + ntohs(iph->tot_len) - (thoff + tcp_hdr->doff*4), ntohs(tcp_hdr->dest));
+}
 
-	/* ignore packets that are not TCP */
-	iph = (struct ipv6hdr*)(skb_network_header(linear_skb) + ipv6hdroffset);
-	ip6proto = ipv6_find_hdr(linear_skb, &thoff, -1, NULL, NULL);
-	if(ip6proto == IPPROTO_TCP)
-	{
-		/* get payload */
-		struct tcphdr* tcp_hdr;
-		tcp_hdr = skb_header_pointer(linear_skb, thoff, sizeof(struct tcphdr), tcp_hdr);
-		if(tcp_hdr != NULL)
-		{
-			unsigned short payload_offset 	= (tcp_hdr->doff*4) + thoff;
-			unsigned char* payload 		= ((unsigned char*)iph) + payload_offset;
-			unsigned short payload_length	= ntohs(iph->payload_len);
+static bool weburl_mt6(const struct nft_weburl_info *priv, const struct sk_buff *skb, uint16_t ipv6hdroffset)
+{
+	struct ipv6hdr _iph, *iph;
+	struct tcphdr _tcph, *tcp_hdr;
+	int nhoff = skb_network_offset(skb) + ipv6hdroffset;
+	int thoff = ipv6hdroffset;
 
-			/* if payload length <= 10 bytes don't bother doing a check, otherwise check for match */
-			if(payload_length > 10)
-			{
-				if(strnicmp((char*)payload, "GET ", 4) == 0 || strnicmp(  (char*)payload, "POST ", 5) == 0 || strnicmp((char*)payload, "HEAD ", 5) == 0)
-				{
-					test = http_match(priv, payload, payload_length);
-				}
-				else if ((unsigned short)ntohs(tcp_hdr->dest) == 443)
-				{
-					test = https_match(priv, payload, payload_length);
-				}
-			}
-		}
+	/* ignore packets that are not TCP */
+	iph = skb_header_pointer(skb, nhoff, sizeof(_iph), &_iph);
+	if(iph == NULL || ipv6_find_hdr(skb, &thoff, -1, NULL, NULL) != IPPROTO_TCP)
+	{
+		return false;
 	}
-
-	/* printk("returning %d from weburl\n\n\n", test); */
-	return test;
+	tcp_hdr = skb_header_pointer(skb, thoff, sizeof(_tcph), &_tcph);
+	if(tcp_hdr == NULL)
+	{
+		return false;
+	}
+	return weburl_payload_match(priv, skb, thoff + tcp_hdr->doff*4, nhoff + (int)sizeof(struct ipv6hdr) + ntohs(iph->payload_len) - (thoff + tcp_hdr->doff*4), ntohs(tcp_hdr->dest));
 }
 
 static void nft_weburl_eval(const struct nft_expr *expr, struct nft_regs *regs, const struct nft_pktinfo *pkt) {
@@ -575,6 +504,7 @@ static int nft_weburl_init(const struct nft_ctx *ctx, const struct nft_expr *exp
 	struct nft_weburl_info *priv = nft_expr_priv(expr);
 	char *matchstr;
 	bool invert = false;
+	bool use_list = false;
 	int valid_arg = 0;
 	unsigned char match_type = 0;
 	unsigned char match_part = 0;
@@ -591,6 +521,8 @@ static int nft_weburl_init(const struct nft_ctx *ctx, const struct nft_expr *exp
 		u32 flag = ntohl(nla_get_be32(tb[NFTA_WEBURL_FLAGS]));
 		if(flag & NFT_WEBURL_F_INV)
 			invert = true;
+		if(flag & NFT_WEBURL_F_LIST)
+			use_list = true;
 
 		if(flag & NFT_WEBURL_F_MT_CONTAINS)
 			match_type = WEBURL_CONTAINS_TYPE;
@@ -598,6 +530,8 @@ static int nft_weburl_init(const struct nft_ctx *ctx, const struct nft_expr *exp
 			match_type = WEBURL_REGEX_TYPE;
 		else if(flag & NFT_WEBURL_F_MT_MATCHESEXACTLY)
 			match_type = WEBURL_EXACT_TYPE;
+		else if(flag & NFT_WEBURL_F_MT_MATCHESDOMAIN)
+			match_type = WEBURL_DOMAIN_TYPE;
 		
 		if(flag & NFT_WEBURL_F_MP_ALL)
 			match_part = WEBURL_ALL_PART;
@@ -609,29 +543,89 @@ static int nft_weburl_init(const struct nft_ctx *ctx, const struct nft_expr *exp
 	
 	if(match_type == 0 || match_part == 0)
 		goto PARSE_OUT;
+	/* domains can only be matched against the host, regexes can't be combined into a list */
+	if(match_type == WEBURL_DOMAIN_TYPE && match_part != WEBURL_DOMAIN_PART)
+		goto PARSE_OUT;
+	if(use_list && match_type == WEBURL_REGEX_TYPE)
+		goto PARSE_OUT;
 	if(tb[NFTA_WEBURL_MATCH] != NULL) nla_strscpy(matchstr, tb[NFTA_WEBURL_MATCH], WEBURL_TEXT_SIZE);
 
 	priv->invert = invert;
 	priv->match_type = match_type;
 	priv->match_part = match_part;
 
+	priv->dfa = NULL;
+	priv->list = NULL;
+	priv->list_file = use_list;
+	priv->generation = weburl_new_generation();
+
 	if(strlen(matchstr) > 0)
 	{
 		memcpy(priv->test_str, matchstr, WEBURL_TEXT_SIZE);
 		valid_arg = 1;
 	}
 
+	if(valid_arg && match_type == WEBURL_REGEX_TYPE)
+	{
+		struct weburl_dfa* dfa = weburl_dfa_compile(priv->test_str);
+		if(IS_ERR(dfa))
+		{
+			printk("nft_weburl: unable to compile regular expression \"%s\" (error %ld)\n", priv->test_str, PTR_ERR(dfa));
+			kfree(matchstr);
+			return PTR_ERR(dfa);
+		}
+		priv->dfa = dfa;
+	}
+	else if(valid_arg)
+	{
+		/* a single string is a one entry list, normalized the same way as a list file */
+		struct weburl_list* list = use_list ?	weburl_list_load(priv->test_str, match_type, match_part) :
+							weburl_list_create(priv->test_str, strlen(priv->test_str), 0, match_type, match_part);
+		if(IS_ERR(list))
+		{
+			printk("nft_weburl: unable to %s \"%s\" (error %ld)\n", use_list ? "load list" : "compile match string", priv->test_str, PTR_ERR(list));
+			kfree(matchstr);
+			return PTR_ERR(list);
+		}
+		priv->list = list;
+	}
+
 PARSE_OUT:
 	kfree(matchstr);
 
+	if(valid_arg)
+	{
+		/* new connections get a creation time, the verdict cache keys on it */
+		weburl_net_get(ctx->net);
+	}
 	return (valid_arg ? 0 : -EINVAL);
 }
 
+static void nft_weburl_destroy(const struct nft_ctx *ctx, const struct nft_expr *expr)
+{
+	struct nft_weburl_info *priv = nft_expr_priv(expr);
+
+	if(priv->dfa != NULL)
+	{
+		weburl_dfa_free(priv->dfa);
+		priv->dfa = NULL;
+	}
+	if(priv->list != NULL)
+	{
+		weburl_list_free(priv->list);
+		priv->list = NULL;
+	}
+	weburl_net_put(ctx->net);
+}
+
 static int nft_weburl_dump(struct sk_buff *skb, const struct nft_expr *expr, bool reset) {
 	const struct nft_weburl_info *priv = nft_expr_priv(expr);
 	int retval = 0;
 	u32 flags = priv->invert ? NFT_WEBURL_F_INV : 0;
 
+	if(priv->list_file)
+		flags |= NFT_WEBURL_F_LIST;
+
 	switch(priv->match_type)
 	{
 		case WEBURL_CONTAINS_TYPE:
@@ -643,6 +637,9 @@ static int nft_weburl_dump(struct sk_buff *skb, const struct nft_expr *expr, boo
 		case WEBURL_EXACT_TYPE:
 			flags |= NFT_WEBURL_F_MT_MATCHESEXACTLY;
 			break;
+		case WEBURL_DOMAIN_TYPE:
+			flags |= NFT_WEBURL_F_MT_MATCHESDOMAIN;
+			break;
 	}
 	
 	switch(priv->match_part)
@@ -675,6 +672,7 @@ static const struct nft_expr_ops nft_weburl_op = {
 	.eval = nft_weburl_eval,
 	.size = NFT_EXPR_SIZE(sizeof(struct nft_weburl_info)),
 	.init = nft_weburl_init,
+	.destroy = nft_weburl_destroy,
 	.dump = nft_weburl_dump,
 	.type = &nft_weburl_type,
 };
@@ -688,18 +686,39 @@ static struct nft_expr_type nft_weburl_type __read_mostly =  {
 
 static int __init init(void)
 {
-	compiled_map = NULL;
-	return nft_register_expr(&nft_weburl_type);
+	int ret;
+
+	weburl_payload_buf = __alloc_percpu(WEBURL_MAX_PAYLOAD, 1);
+	if(weburl_payload_buf == NULL)
+	{
+		return -ENOMEM;
+	}
+#if IS_REACHABLE(CONFIG_NF_CONNTRACK)
+	ret = register_pernet_subsys(&weburl_net_ops);
+	if(ret < 0)
+	{
+		free_percpu(weburl_payload_buf);
+		return ret;
+	}
+#endif
+	ret = nft_register_expr(&nft_weburl_type);
+	if(ret < 0)
+	{
+#if IS_REACHABLE(CONFIG_NF_CONNTRACK)
+		unregister_pernet_subsys(&weburl_net_ops);
+#endif
+		free_percpu(weburl_payload_buf);
+	}
+	return ret;
 }
 
 static void __exit fini(void)
 {
 	nft_unregister_expr(&nft_weburl_type);
-	if(compiled_map != NULL)
-	{
-		unsigned long num_destroyed;
-		destroy_map(compiled_map, DESTROY_MODE_FREE_VALUES, &num_destroyed);
-	}
+#if IS_REACHABLE(CONFIG_NF_CONNTRACK)
+	unregister_pernet_subsys(&weburl_net_ops);
+#endif
+	free_percpu(weburl_payload_buf);
 }
 
 module_init(init);
@@ -0,0 +1,717 @@
+/*  weburl_dfa --	Bounded-state DFA regular expression engine for weburl
+ *
+ *  Copyright © 2025 by Michael Gray <support@lantisproject.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ *  Accepts the same syntax as the Spencer regexp engine previously used by
+ *  weburl: literals, '.', '[...]', '[^...]', '^', '$', '*', '+', '?', '|',
+ *  '(...)' and '\' escapes.  Patterns are parsed into a Thompson NFA and
+ *  converted to a DFA by subset construction when the rule is created, so
+ *  matching is a single table walk over the input: linear time, no
+ *  backtracking and no allocation in the packet path.
+ *
+ *  Bytes that no pattern element can tell apart share a column in the
+ *  transition table, which keeps the table small for typical URL patterns.
+ */
+
+#include <linux/bitops.h>
+#include <linux/ctype.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+
+#define WEBURL_DFA_NUM_SYMS		256
+#define WEBURL_DFA_SYM_WORDS	BITS_TO_LONGS(WEBURL_DFA_NUM_SYMS)
+
+/* limits on what a single pattern may compile to */
+#define WEBURL_DFA_MAX_STATES	1024
+#define WEBURL_DFA_MAX_CELLS	(1 << 16)
+#define WEBURL_DFA_MAX_DEPTH	32
+
+/* per-state flags */
+#define WEBURL_DFA_MATCH		0x01	/* pattern has matched */
+#define WEBURL_DFA_MATCH_EOL	0x02	/* pattern matches if the string ends here */
+
+#define WEBURL_NFA_SYM		0
+#define WEBURL_NFA_EPS		1
+#define WEBURL_NFA_BOL		2
+#define WEBURL_NFA_EOL		3
+#define WEBURL_NFA_MATCH	4
+
+#define WEBURL_AT_BOL		0x01
+#define WEBURL_AT_EOL		0x02
+
+struct weburl_dfa
+{
+	unsigned short num_classes;
+	unsigned short num_states;
+	unsigned char match_empty;
+	unsigned char class_map[WEBURL_DFA_NUM_SYMS];
+	unsigned short* trans;
+	unsigned char* flags;
+};
+
+struct weburl_nfa_node
+{
+	unsigned char type;
+	int charset;
+	int out;
+	int out1;
+};
+
+struct weburl_nfa_frag
+{
+	int start;
+	int end;	/* always an EPS node whose out is not yet connected */
+	int haswidth;
+};
+
+struct weburl_dfa_scratch
+{
+	unsigned short class_map[WEBURL_DFA_NUM_SYMS];
+	unsigned short reps[WEBURL_DFA_NUM_SYMS];
+	short split[2*WEBURL_DFA_NUM_SYMS];
+};
+
+struct weburl_dfa_builder
+{
+	const char* pattern;
+	int pos;
+	int len;
+	int depth;
+	int error;
+
+	struct weburl_nfa_node* nodes;
+	int num_nodes;
+	int max_nodes;
+
+	unsigned long* charsets;
+	int num_charsets;
+	int max_charsets;
+};
+
+static struct weburl_nfa_frag weburl_nfa_reg(struct weburl_dfa_builder* b);
+
+static int weburl_nfa_node(struct weburl_dfa_builder* b, unsigned char type, int out, int out1)
+{
+	struct weburl_nfa_node* n;
+	if(b->num_nodes >= b->max_nodes)
+	{
+		b->error = -E2BIG;
+		return -1;
+	}
+	n = &b->nodes[b->num_nodes];
+	n->type = type;
+	n->charset = -1;
+	n->out = out;
+	n->out1 = out1;
+	return b->num_nodes++;
+}
+
+static unsigned long* weburl_nfa_charset(struct weburl_dfa_builder* b, int* index)
+{
+	if(b->num_charsets >= b->max_charsets)
+	{
+		b->error = -E2BIG;
+		return NULL;
+	}
+	*index = b->num_charsets++;
+	return b->charsets + (*index)*WEBURL_DFA_SYM_WORDS;
+}
+
+static struct weburl_nfa_frag weburl_nfa_empty(struct weburl_dfa_builder* b)
+{
+	struct weburl_nfa_frag f;
+	f.start = f.end = weburl_nfa_node(b, WEBURL_NFA_EPS, -1, -1);
+	f.haswidth = 0;
+	return f;
+}
+
+/* a single node of the given type (SYM, BOL or EOL) followed by an open EPS */
+static struct weburl_nfa_frag weburl_nfa_single(struct weburl_dfa_builder* b, unsigned char type, int charset)
+{
+	struct weburl_nfa_frag f;
+	f.end = weburl_nfa_node(b, WEBURL_NFA_EPS, -1, -1);
+	f.start = weburl_nfa_node(b, type, f.end, -1);
+	f.haswidth = (type == WEBURL_NFA_SYM);
+	if(f.start >= 0)
+	{
+		b->nodes[f.start].charset = charset;
+	}
+	return f;
+}
+
+static struct weburl_nfa_frag weburl_nfa_concat(struct weburl_dfa_builder* b, struct weburl_nfa_frag f1, struct weburl_nfa_frag f2)
+{
+	struct weburl_nfa_frag f;
+	if(b->error)
+	{
+		return f1;
+	}
+	b->nodes[f1.end].out = f2.start;
+	f.start = f1.start;
+	f.end = f2.end;
+	f.haswidth = f1.haswidth || f2.haswidth;
+	return f;
+}
+
+static struct weburl_nfa_frag weburl_nfa_alt(struct weburl_dfa_builder* b, struct weburl_nfa_frag f1, struct weburl_nfa_frag f2)
+{
+	struct weburl_nfa_frag f;
+	f.end = weburl_nfa_node(b, WEBURL_NFA_EPS, -1, -1);
+	f.start = weburl_nfa_node(b, WEBURL_NFA_EPS, f1.start, f2.start);
+	f.haswidth = f1.haswidth && f2.haswidth;
+	if(b->error)
+	{
+		return f1;
+	}
+	b->nodes[f1.end].out = f.end;
+	b->nodes[f2.end].out = f.end;
+	return f;
+}
+
+static struct weburl_nfa_frag weburl_nfa_repeat(struct weburl_dfa_builder* b, struct weburl_nfa_frag f1, char op)
+{
+	struct weburl_nfa_frag f;
+	int split;
+	if(!f1.haswidth && op != '?')
+	{
+		b->error = -EINVAL; /* *+ operand could be empty */
+		return f1;
+	}
+	f.end = weburl_nfa_node(b, WEBURL_NFA_EPS, -1, -1);
+	split = weburl_nfa_node(b, WEBURL_NFA_EPS, f1.start, f.end);
+	f.haswidth = (op == '+');
+	if(b->error)
+	{
+		return f1;
+	}
+	switch(op)
+	{
+		case '*':
+			b->nodes[f1.end].out = split;
+			f.start = split;
+			break;
+		case '+':
+			b->nodes[f1.end].out = split;
+			f.start = f1.start;
+			break;
+		default: /* '?' */
+			b->nodes[f1.end].out = f.end;
+			f.start = split;
+			break;
+	}
+	return f;
+}
+
+static struct weburl_nfa_frag weburl_nfa_bracket(struct weburl_dfa_builder* b)
+{
+	struct weburl_nfa_frag f = { -1, -1, 0 };
+	const unsigned char* p = (const unsigned char*)b->pattern;
+	unsigned long* set;
+	int charset;
+	int negate = 0;
+	int prev = -1;
+	int sym;
+
+	set = weburl_nfa_charset(b, &charset);
+	if(set == NULL)
+	{
+		return f;
+	}
+
+	if(b->pos < b->len && p[b->pos] == '^')
+	{
+		negate = 1;
+		b->pos++;
+	}
+	if(b->pos < b->len && (p[b->pos] == ']' || p[b->pos] == '-'))
+	{
+		prev = p[b->pos++];
+		__set_bit(prev, set);
+	}
+	while(b->pos < b->len && p[b->pos] != ']')
+	{
+		if(p[b->pos] == '-' && prev >= 0 && b->pos+1 < b->len && p[b->pos+1] != ']')
+		{
+			int range_end = p[b->pos+1];
+			if(prev > range_end)
+			{
+				b->error = -EINVAL; /* invalid [] range */
+				return f;
+			}
+			for(sym = prev; sym <= range_end; sym++)
+			{
+				__set_bit(sym, set);
+			}
+			prev = range_end;
+			b->pos += 2;
+		}
+		else
+		{
+			prev = p[b->pos++];
+			__set_bit(prev, set);
+		}
+	}
+	if(b->pos >= b->len)
+	{
+		b->error = -EINVAL; /* unmatched [] */
+		return f;
+	}
+	b->pos++;
+
+	__clear_bit(0, set);
+	if(negate)
+	{
+		for(sym = 1; sym < 256; sym++)
+		{
+			__change_bit(sym, set);
+		}
+	}
+	return weburl_nfa_single(b, WEBURL_NFA_SYM, charset);
+}
+
+static struct weburl_nfa_frag weburl_nfa_atom(struct weburl_dfa_builder* b)
+{
+	struct weburl_nfa_frag f = { -1, -1, 0 };
+	unsigned long* set;
+	int charset;
+	unsigned char c = (unsigned char)b->pattern[b->pos++];
+
+	switch(c)
+	{
+		case '^':
+			return weburl_nfa_single(b, WEBURL_NFA_BOL, -1);
+		case '$':
+			return weburl_nfa_single(b, WEBURL_NFA_EOL, -1);
+		case '[':
+			return weburl_nfa_bracket(b);
+		case '(':
+			if(++b->depth > WEBURL_DFA_MAX_DEPTH)
+			{
+				b->error = -E2BIG;
+				return f;
+			}
+			f = weburl_nfa_reg(b);
+			if(b->error)
+			{
+				return f;
+			}
+			if(b->pos >= b->len || b->pattern[b->pos] != ')')
+			{
+				b->error = -EINVAL; /* unmatched () */
+				return f;
+			}
+			b->pos++;
+			b->depth--;
+			return f;
+		case '?':
+		case '+':
+		case '*':
+			b->error = -EINVAL; /* ?+* follows nothing */
+			return f;
+	}
+
+	set = weburl_nfa_charset(b, &charset);
+	if(set == NULL)
+	{
+		return f;
+	}
+	switch(c)
+	{
+		case '.':
+			bitmap_fill(set, 256);
+			__clear_bit(0, set);
+			break;
+		case '\\':
+			if(b->pos >= b->len)
+			{
+				b->error = -EINVAL; /* trailing \ */
+				return f;
+			}
+			__set_bit((unsigned char)b->pattern[b->pos++], set);
+			break;
+		default:
+			__set_bit(c, set);
+			break;
+	}
+	return weburl_nfa_single(b, WEBURL_NFA_SYM, charset);
+}
+
+static struct weburl_nfa_frag weburl_nfa_branch(struct weburl_dfa_builder* b)
+{
+	struct weburl_nfa_frag f = weburl_nfa_empty(b);
+	while(b->error == 0 && b->pos < b->len && b->pattern[b->pos] != '|' && b->pattern[b->pos] != ')')
+	{
+		struct weburl_nfa_frag piece = weburl_nfa_atom(b);
+		if(b->error == 0 && b->pos < b->len && strchr("*+?", b->pattern[b->pos]) != NULL)
+		{
+			piece = weburl_nfa_repeat(b, piece, b->pattern[b->pos++]);
+			if(b->pos < b->len && strchr("*+?", b->pattern[b->pos]) != NULL)
+			{
+				b->error = -EINVAL; /* nested *?+ */
+			}
+		}
+		f = weburl_nfa_concat(b, f, piece);
+	}
+	return f;
+}
+
+static struct weburl_nfa_frag weburl_nfa_reg(struct weburl_dfa_builder* b)
+{
+	struct weburl_nfa_frag f = weburl_nfa_branch(b);
+	while(b->error == 0 && b->pos < b->len && b->pattern[b->pos] == '|')
+	{
+		b->pos++;
+		f = weburl_nfa_alt(b, f, weburl_nfa_branch(b));
+	}
+	return f;
+}
+
+/*
+ * Add node and everything reachable from it without consuming a byte to set.
+ * '^' and '$' nodes are only passed through when at says we are at the
+ * beginning / end of the string, otherwise they are left in the set as is.
+ */
+static void weburl_nfa_closure(const struct weburl_dfa_builder* b, unsigned long* set, int node, int at, int* stack)
+{
+	int top = 0;
+	if(node < 0 || test_bit(node, set))
+	{
+		return;
+	}
+	__set_bit(node, set);
+	stack[top++] = node;
+	while(top > 0)
+	{
+		const struct weburl_nfa_node* n = &b->nodes[stack[--top]];
+		int next[2] = { -1, -1 };
+		int i;
+		switch(n->type)
+		{
+			case WEBURL_NFA_EPS:
+				next[0] = n->out;
+				next[1] = n->out1;
+				break;
+			case WEBURL_NFA_BOL:
+				next[0] = (at & WEBURL_AT_BOL) ? n->out : -1;
+				break;
+			case WEBURL_NFA_EOL:
+				next[0] = (at & WEBURL_AT_EOL) ? n->out : -1;
+				break;
+		}
+		for(i = 0; i < 2; i++)
+		{
+			if(next[i] >= 0 && !test_bit(next[i], set))
+			{
+				__set_bit(next[i], set);
+				stack[top++] = next[i];
+			}
+		}
+	}
+}
+
+/* does the pattern match if the string ends while the NFA is in set */
+static int weburl_nfa_match_at_eol(const struct weburl_dfa_builder* b, const unsigned long* set, unsigned long* tmp, int match_node, int* stack)
+{
+	int node;
+	bitmap_zero(tmp, b->num_nodes);
+	for_each_set_bit(node, set, b->num_nodes)
+	{
+		if(b->nodes[node].type == WEBURL_NFA_EOL)
+		{
+			weburl_nfa_closure(b, tmp, b->nodes[node].out, WEBURL_AT_EOL, stack);
+		}
+	}
+	return test_bit(match_node, tmp);
+}
+
+/*
+ * Split the byte alphabet into classes of bytes that belong to exactly
+ * the same charsets.  Returns the number of classes.
+ */
+static int weburl_dfa_classes(const struct weburl_dfa_builder* b, struct weburl_dfa_scratch* scratch)
+{
+	unsigned short* class_map = scratch->class_map;
+	unsigned short* reps = scratch->reps;
+	short* split = scratch->split;
+	int num_classes = 1;
+	int cs;
+	int sym;
+
+	memset(class_map, 0, sizeof(unsigned short)*WEBURL_DFA_NUM_SYMS);
+	for(cs = 0; cs < b->num_charsets; cs++)
+	{
+		const unsigned long* set = b->charsets + cs*WEBURL_DFA_SYM_WORDS;
+		int new_classes = 0;
+		memset(split, -1, sizeof(short)*2*num_classes);
+		for(sym = 0; sym < WEBURL_DFA_NUM_SYMS; sym++)
+		{
+			int key = class_map[sym]*2 + (test_bit(sym, set) ? 1 : 0);
+			if(split[key] < 0)
+			{
+				split[key] = new_classes++;
+			}
+			class_map[sym] = split[key];
+		}
+		num_classes = new_classes;
+	}
+
+	for(sym = WEBURL_DFA_NUM_SYMS-1; sym >= 0; sym--)
+	{
+		reps[class_map[sym]] = sym;
+	}
+	return num_classes;
+}
+
+static int weburl_dfa_find_state(const unsigned long* sets, int words, const int* hash_table, unsigned int hash_mask, const unsigned long* set, unsigned int* slot)
+{
+	unsigned int h = jhash(set, words*sizeof(unsigned long), 0) & hash_mask;
+	while(hash_table[h] >= 0)
+	{
+		if(memcmp(sets + hash_table[h]*words, set, words*sizeof(unsigned long)) == 0)
+		{
+			return hash_table[h];
+		}
+		h = (h+1) & hash_mask;
+	}
+	*slot = h;
+	return -1;
+}
+
+/*
+ * Compile pattern into a DFA.  Must be called from process context.
+ * Returns an ERR_PTR on failure: -EINVAL for a malformed pattern, -E2BIG if
+ * the pattern needs more states than we are willing to allocate.
+ */
+static struct weburl_dfa* weburl_dfa_compile(const char* pattern)
+{
+	struct weburl_dfa_builder b;
+	struct weburl_nfa_frag any;
+	struct weburl_nfa_frag f;
+	struct weburl_dfa* dfa = NULL;
+	struct weburl_dfa_scratch* scratch = NULL;
+	unsigned long* any_set;
+	unsigned long* important = NULL;
+	unsigned long* sets = NULL;
+	unsigned long* target = NULL;
+	unsigned short* trans = NULL;
+	unsigned char* flags = NULL;
+	int* stack = NULL;
+	int* hash_table = NULL;
+	unsigned int hash_mask;
+	unsigned char match_empty;
+	int num_classes, max_states, num_states, words;
+	int match_node, any_charset, state, cls, node;
+
+	memset(&b, 0, sizeof(b));
+	b.pattern = pattern;
+	b.len = strlen(pattern);
+	b.max_nodes = 4*b.len + 8;
+	b.max_charsets = b.len + 1;
+	b.nodes = kvcalloc(b.max_nodes, sizeof(struct weburl_nfa_node), GFP_KERNEL);
+	b.charsets = kvcalloc(b.max_charsets*WEBURL_DFA_SYM_WORDS, sizeof(unsigned long), GFP_KERNEL);
+	scratch = kmalloc(sizeof(struct weburl_dfa_scratch), GFP_KERNEL);
+	if(b.nodes == NULL || b.charsets == NULL || scratch == NULL)
+	{
+		b.error = -ENOMEM;
+		goto out;
+	}
+
+	/* unanchored search: any number of bytes followed by the pattern */
+	any_set = weburl_nfa_charset(&b, &any_charset);
+	bitmap_fill(any_set, 256);
+	any = weburl_nfa_repeat(&b, weburl_nfa_single(&b, WEBURL_NFA_SYM, any_charset), '*');
+
+	f = weburl_nfa_reg(&b);
+	if(b.error == 0 && b.pos < b.len)
+	{
+		b.error = -EINVAL; /* unmatched () */
+	}
+	f = weburl_nfa_concat(&b, any, f);
+	match_node = weburl_nfa_node(&b, WEBURL_NFA_MATCH, -1, -1);
+	if(b.error)
+	{
+		goto out;
+	}
+	b.nodes[f.end].out = match_node;
+
+	num_classes = weburl_dfa_classes(&b, scratch);
+	max_states = WEBURL_DFA_MAX_CELLS / num_classes;
+	max_states = max_states < WEBURL_DFA_MAX_STATES ? max_states : WEBURL_DFA_MAX_STATES;
+	words = BITS_TO_LONGS(b.num_nodes);
+	hash_mask = roundup_pow_of_two(2*max_states) - 1;
+
+	important = bitmap_zalloc(b.num_nodes, GFP_KERNEL);
+	target = bitmap_zalloc(b.num_nodes, GFP_KERNEL);
+	sets = kvcalloc(max_states*words, sizeof(unsigned long), GFP_KERNEL);
+	trans = kvcalloc(max_states*num_classes, sizeof(unsigned short), GFP_KERNEL);
+	flags = kvcalloc(max_states, sizeof(unsigned char), GFP_KERNEL);
+	stack = kvcalloc(b.num_nodes, sizeof(int), GFP_KERNEL);
+	hash_table = kvmalloc_array(hash_mask+1, sizeof(int), GFP_KERNEL);
+	if(important == NULL || target == NULL || sets == NULL || trans == NULL || flags == NULL || stack == NULL || hash_table == NULL)
+	{
+		b.error = -ENOMEM;
+		goto out;
+	}
+	memset(hash_table, -1, (hash_mask+1)*sizeof(int));
+	for(node = 0; node < b.num_nodes; node++)
+	{
+		unsigned char type = b.nodes[node].type;
+		if(type == WEBURL_NFA_SYM || type == WEBURL_NFA_EOL || type == WEBURL_NFA_MATCH)
+		{
+			__set_bit(node, important);
+		}
+	}
+
+	/* the empty string is at both the beginning and the end */
+	weburl_nfa_closure(&b, target, f.start, WEBURL_AT_BOL | WEBURL_AT_EOL, stack);
+	match_empty = test_bit(match_node, target) ? 1 : 0;
+
+	/*
+	 * State 0 is the dead state (empty set), state 1 the start state.  Only
+	 * SYM, EOL and MATCH nodes are kept in a state's set, the rest are implied.
+	 */
+	num_states = 0;
+	for(state = 0; state < 2; state++)
+	{
+		unsigned int slot;
+		unsigned long* set = sets + state*words;
+		if(state == 1)
+		{
+			weburl_nfa_closure(&b, set, f.start, WEBURL_AT_BOL, stack);
+			bitmap_and(set, set, important, b.num_nodes);
+		}
+		weburl_dfa_find_state(sets, words, hash_table, hash_mask, set, &slot);
+		hash_table[slot] = state;
+		num_states++;
+	}
+
+	for(state = 1; state < num_states; state++)
+	{
+		const unsigned long* set = sets + state*words;
+		if(test_bit(match_node, set))
+		{
+			/* once matched always matched, the row is never looked at */
+			flags[state] = WEBURL_DFA_MATCH | WEBURL_DFA_MATCH_EOL;
+			continue;
+		}
+		flags[state] = weburl_nfa_match_at_eol(&b, set, target, match_node, stack) ? WEBURL_DFA_MATCH_EOL : 0;
+
+		for(cls = 0; cls < num_classes; cls++)
+		{
+			unsigned int slot;
+			int next;
+			bitmap_zero(target, b.num_nodes);
+			for_each_set_bit(node, set, b.num_nodes)
+			{
+				const struct weburl_nfa_node* n = &b.nodes[node];
+				if(n->type == WEBURL_NFA_SYM && test_bit(scratch->reps[cls], b.charsets + n->charset*WEBURL_DFA_SYM_WORDS))
+				{
+					weburl_nfa_closure(&b, target, n->out, 0, stack);
+				}
+			}
+			bitmap_and(target, target, important, b.num_nodes);
+
+			next = weburl_dfa_find_state(sets, words, hash_table, hash_mask, target, &slot);
+			if(next < 0)
+			{
+				if(num_states >= max_states)
+				{
+					b.error = -E2BIG;
+					goto out;
+				}
+				next = num_states++;
+				bitmap_copy(sets + next*words, target, b.num_nodes);
+				hash_table[slot] = next;
+			}
+			trans[state*num_classes + cls] = next;
+		}
+	}
+
+	dfa = kvmalloc(sizeof(struct weburl_dfa) + num_states*num_classes*sizeof(unsigned short) + num_states, GFP_KERNEL);
+	if(dfa == NULL)
+	{
+		b.error = -ENOMEM;
+		goto out;
+	}
+	dfa->num_classes = num_classes;
+	dfa->num_states = num_states;
+	dfa->match_empty = match_empty;
+	for(cls = 0; cls < WEBURL_DFA_NUM_SYMS; cls++)
+	{
+		dfa->class_map[cls] = (unsigned char)scratch->class_map[cls];
+	}
+	dfa->trans = (unsigned short*)(dfa + 1);
+	dfa->flags = (unsigned char*)(dfa->trans + num_states*num_classes);
+	memcpy(dfa->trans, trans, num_states*num_classes*sizeof(unsigned short));
+	memcpy(dfa->flags, flags, num_states);
+
+out:
+	kvfree(b.nodes);
+	kvfree(b.charsets);
+	kfree(scratch);
+	bitmap_free(important);
+	bitmap_free(target);
+	kvfree(sets);
+	kvfree(trans);
+	kvfree(flags);
+	kvfree(stack);
+	kvfree(hash_table);
+	return b.error ? ERR_PTR(b.error) : dfa;
+}
+
+static void weburl_dfa_free(struct weburl_dfa* dfa)
+{
+	kvfree(dfa);
+}
+
+/* run len bytes at str through the DFA from state, stops once the outcome is known */
+static unsigned int weburl_dfa_feed(const struct weburl_dfa* dfa, unsigned int state, const char* str, size_t len, int lower)
+{
+	const unsigned short* trans = dfa->trans;
+	const unsigned char* flags = dfa->flags;
+	unsigned int num_classes = dfa->num_classes;
+	size_t i;
+
+	for(i = 0; i < len && state != 0 && !(flags[state] & WEBURL_DFA_MATCH); i++)
+	{
+		unsigned char c = lower ? tolower(str[i]) : str[i];
+		state = trans[state*num_classes + dfa->class_map[c]];
+	}
+	return state;
+}
+
+/*
+ * Returns 1 if the pattern matches anywhere in prefix followed by host and
+ * path, 0 otherwise.  The three pieces are walked in place, host is
+ * lowercased on the fly if lower is set.
+ */
+static int weburl_dfa_match(const struct weburl_dfa* dfa, const char* prefix, const char* host, size_t host_len, const char* path, size_t path_len, int lower)
+{
+	size_t prefix_len = strlen(prefix);
+	unsigned int state;
+
+	if(prefix_len + host_len + path_len == 0)
+	{
+		return dfa->match_empty;
+	}
+	state = weburl_dfa_feed(dfa, 1, prefix, prefix_len, 0);
+	state = weburl_dfa_feed(dfa, state, host, host_len, lower);
+	state = weburl_dfa_feed(dfa, state, path, path_len, 0);
+	return (dfa->flags[state] & WEBURL_DFA_MATCH_EOL) ? 1 : 0;
+}
@@ -0,0 +1,583 @@
+/*  weburl_list --	String / domain / URL list matching for weburl
+ *
+ *  Copyright © 2025 by Michael Gray <support@lantisproject.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ *  Every non-regex weburl rule is compiled into a list when it is created,
+ *  either from its single test string or from a file with one entry per
+ *  line (blank lines and lines starting with '#' are ignored).  A request is
+ *  then matched against every entry in one pass:
+ *
+ *  contains         - Aho-Corasick automaton over all entries
+ *  matches-exactly  - hash set of entries
+ *  matches-domain   - hash set of domains, the host and each of its parent
+ *                     domains (www.example.com, example.com, com) is looked
+ *                     up once, so the cost depends on the number of labels
+ *                     in the host and not on the size of the list
+ *
+ *  Queries are passed as (up to) two slices of packet data, the strings
+ *  are never assembled or copied.
+ */
+
+#include <linux/ctype.h>
+#include <linux/fs.h>
+#include <linux/kernel_read_file.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+/*
+ * A compiled list may take at most WEBURL_LIST_MAX_MEMORY, the automaton
+ * for contains costs about 20 bytes per byte of the list.  List files are
+ * only read from the directories in weburl_list_dirs.
+ */
+#define WEBURL_LIST_MAX_MEMORY		(8*1024*1024)
+#define WEBURL_LIST_MAX_FILE_SIZE	(2*1024*1024)
+
+static const char* weburl_list_dirs[] = { "/etc/weburl/", "/tmp/weburl/" };
+
+/* which requests an exact entry applies to, see weburl_list_create */
+#define WEBURL_LIST_ANY_SCHEME		0x01
+#define WEBURL_LIST_SCHEME(scheme)	(0x02 << (scheme))
+
+static const char* weburl_schemes[WEBURL_NUM_SCHEMES] = { "http://", "https://" };
+
+struct weburl_ac_node
+{
+	u32 child;		/* first child, 0 = none */
+	u32 sibling;	/* next child of our parent, 0 = none */
+	u32 fail;
+	unsigned char ch;
+	unsigned char out;	/* an entry ends here or at a node on our fail chain */
+};
+
+struct weburl_list
+{
+	unsigned char match_type;
+	u32 num_entries;
+	char* strings;		/* entries, NUL separated */
+	u32* offsets;		/* start of each entry in strings */
+	unsigned char* schemes;	/* scheme mask of each entry, matches-exactly only */
+
+	/* matches-exactly / matches-domain */
+	u32* hash_table;	/* entry index + 1, 0 = empty slot */
+	u32 hash_mask;
+
+	/* contains */
+	struct weburl_ac_node* ac;
+	u32 num_ac_nodes;
+	u32 ac_root[256];	/* root transitions, 0 = stay at root */
+	u32 ac_scheme[WEBURL_NUM_SCHEMES];	/* state after the scheme of a full url */
+};
+
+#define weburl_fold(c, lower) ((unsigned char)((lower) ? tolower(c) : (c)))
+
+static u32 weburl_list_hash(u32 h, const char* str, size_t len, int lower)
+{
+	size_t i;
+	for(i = 0; i < len; i++)
+	{
+		h ^= weburl_fold(str[i], lower);
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * str comes from the packet and may hold NULs, so stop at the end of
+ * entry rather than let a NUL in str match its terminator
+ */
+static int weburl_list_compare(const char* entry, const char* str, size_t len, int lower)
+{
+	size_t i;
+	for(i = 0; i < len; i++)
+	{
+		if(entry[i] == '\0' || (unsigned char)entry[i] != weburl_fold(str[i], lower))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Look up the string a followed by b (b may be empty) in the hash set.
+ * Returns the scheme mask of the matching entry, 0 if there is none.
+ */
+static unsigned char weburl_list_lookup(const struct weburl_list* list, const char* a, size_t a_len, const char* b, size_t b_len, int lower)
+{
+	u32 h = weburl_list_hash(weburl_list_hash(2166136261U, a, a_len, lower), b, b_len, lower) & list->hash_mask;
+	while(list->hash_table[h] != 0)
+	{
+		u32 e = list->hash_table[h] - 1;
+		const char* entry = list->strings + list->offsets[e];
+		if(	weburl_list_compare(entry, a, a_len, lower) == 0 &&
+			strnlen(entry + a_len, b_len + 1) == b_len &&
+			weburl_list_compare(entry + a_len, b, b_len, lower) == 0
+			)
+		{
+			return list->schemes[e];
+		}
+		h = (h+1) & list->hash_mask;
+	}
+	return 0;
+}
+
+static u32 weburl_ac_goto(const struct weburl_list* list, u32 node, unsigned char c)
+{
+	u32 child;
+	if(node == 0)
+	{
+		return list->ac_root[c];
+	}
+	for(child = list->ac[node].child; child != 0; child = list->ac[child].sibling)
+	{
+		if(list->ac[child].ch == c)
+		{
+			return child;
+		}
+	}
+	return 0;
+}
+
+/* feed str to the automaton from node, stops as soon as an entry has matched */
+static u32 weburl_ac_feed(const struct weburl_list* list, u32 node, const char* str, size_t len, int lower)
+{
+	size_t i;
+	for(i = 0; i < len && !list->ac[node].out; i++)
+	{
+		unsigned char c = weburl_fold(str[i], lower);
+		u32 next = weburl_ac_goto(list, node, c);
+		while(next == 0 && node != 0)
+		{
+			node = list->ac[node].fail;
+			next = weburl_ac_goto(list, node, c);
+		}
+		node = next;
+	}
+	return node;
+}
+
+static int weburl_ac_build(struct weburl_list* list, u32 max_nodes)
+{
+	u32* queue;
+	u32 head = 0;
+	u32 tail = 0;
+	u32 e;
+
+	list->ac = kvcalloc(max_nodes, sizeof(struct weburl_ac_node), GFP_KERNEL);
+	queue = kvmalloc_array(max_nodes, sizeof(u32), GFP_KERNEL);
+	if(list->ac == NULL || queue == NULL)
+	{
+		kvfree(queue);
+		return -ENOMEM;
+	}
+	list->num_ac_nodes = 1;
+
+	/* build the trie */
+	for(e = 0; e < list->num_entries; e++)
+	{
+		const unsigned char* p = (const unsigned char*)(list->strings + list->offsets[e]);
+		u32 node = 0;
+		for( ; *p != '\0'; p++)
+		{
+			u32 next = weburl_ac_goto(list, node, *p);
+			if(next == 0)
+			{
+				next = list->num_ac_nodes++;
+				list->ac[next].ch = *p;
+				if(node == 0)
+				{
+					list->ac_root[*p] = next;
+				}
+				else
+				{
+					list->ac[next].sibling = list->ac[node].child;
+					list->ac[node].child = next;
+				}
+			}
+			node = next;
+		}
+		list->ac[node].out = 1;
+	}
+
+	/* breadth first, so a node's fail target is always done before it */
+	for(e = 0; e < 256; e++)
+	{
+		if(list->ac_root[e] != 0)
+		{
+			queue[tail++] = list->ac_root[e];
+		}
+	}
+	while(head < tail)
+	{
+		u32 node = queue[head++];
+		u32 child;
+		for(child = list->ac[node].child; child != 0; child = list->ac[child].sibling)
+		{
+			u32 f = list->ac[node].fail;
+			u32 target = weburl_ac_goto(list, f, list->ac[child].ch);
+			while(target == 0 && f != 0)
+			{
+				f = list->ac[f].fail;
+				target = weburl_ac_goto(list, f, list->ac[child].ch);
+			}
+			list->ac[child].fail = target;
+			list->ac[child].out |= list->ac[target].out;
+			queue[tail++] = child;
+		}
+	}
+
+	/* a full url always starts with its scheme, so where that leaves us is fixed */
+	for(e = 0; e < WEBURL_NUM_SCHEMES; e++)
+	{
+		list->ac_scheme[e] = weburl_ac_feed(list, 0, weburl_schemes[e], strlen(weburl_schemes[e]), 0);
+	}
+
+	kvfree(queue);
+	return 0;
+}
+
+static int weburl_hash_build(struct weburl_list* list)
+{
+	u32 e;
+	list->hash_mask = roundup_pow_of_two(2*list->num_entries) - 1;
+	list->hash_table = kvcalloc(list->hash_mask + 1, sizeof(u32), GFP_KERNEL);
+	if(list->hash_table == NULL)
+	{
+		return -ENOMEM;
+	}
+	for(e = 0; e < list->num_entries; e++)
+	{
+		const char* entry = list->strings + list->offsets[e];
+		size_t len = strlen(entry);
+		u32 h = weburl_list_hash(2166136261U, entry, len, 0) & list->hash_mask;
+		while(list->hash_table[h] != 0)
+		{
+			u32 other = list->hash_table[h] - 1;
+			if(strcmp(list->strings + list->offsets[other], entry) == 0)
+			{
+				/* duplicate, possibly with a different scheme */
+				list->schemes[other] |= list->schemes[e];
+				break;
+			}
+			h = (h+1) & list->hash_mask;
+		}
+		if(list->hash_table[h] == 0)
+		{
+			list->hash_table[h] = e + 1;
+		}
+	}
+	return 0;
+}
+
+static void weburl_list_free(struct weburl_list* list)
+{
+	if(list != NULL)
+	{
+		kvfree(list->strings);
+		kvfree(list->offsets);
+		kvfree(list->schemes);
+		kvfree(list->hash_table);
+		kvfree(list->ac);
+		kfree(list);
+	}
+}
+
+/* the most memory a list of buf_len bytes with max_entries lines can take once compiled */
+static size_t weburl_list_cost(size_t buf_len, u32 max_entries, unsigned char match_type)
+{
+	size_t cost = buf_len + 1 + (size_t)max_entries * (sizeof(u32) + sizeof(unsigned char));
+	if(match_type == WEBURL_CONTAINS_TYPE)
+	{
+		/* a trie node and a queue slot for every byte, at worst */
+		cost += (buf_len + 1) * (sizeof(struct weburl_ac_node) + sizeof(u32));
+	}
+	else
+	{
+		cost += (size_t)roundup_pow_of_two(2*max_entries) * sizeof(u32);
+	}
+	return cost;
+}
+
+/*
+ * Build a list from buf, which holds one entry or, if split_lines is set,
+ * one entry per line.  Entries are normalized here so that the packet path
+ * never has to expand the query:  domains are lowercased and lose any
+ * leading "*." or ".", and for exact full url matches a leading scheme is
+ * removed and remembered as the only scheme the entry applies to.
+ * Must be called from process context, returns an ERR_PTR on failure
+ * (-EFBIG if it would take more than WEBURL_LIST_MAX_MEMORY).
+ */
+static struct weburl_list* weburl_list_create(const char* buf, size_t buf_len, int split_lines, unsigned char match_type, unsigned char match_part)
+{
+	struct weburl_list* list;
+	const char* p = buf;
+	const char* end = buf + buf_len;
+	u32 max_entries = 1;
+	u32 str_len = 0;
+	int fold = (match_type == WEBURL_DOMAIN_TYPE);
+	int ret = 0;
+
+	for(p = buf; split_lines && p < end; p++)
+	{
+		max_entries += (*p == '\n') ? 1 : 0;
+	}
+	if(weburl_list_cost(buf_len, max_entries, match_type) > WEBURL_LIST_MAX_MEMORY)
+	{
+		return ERR_PTR(-EFBIG);
+	}
+
+	list = kzalloc(sizeof(struct weburl_list), GFP_KERNEL);
+	if(list == NULL)
+	{
+		return ERR_PTR(-ENOMEM);
+	}
+	list->match_type = match_type;
+	list->strings = kvmalloc(buf_len + 1, GFP_KERNEL);
+	list->offsets = kvmalloc_array(max_entries, sizeof(u32), GFP_KERNEL);
+	list->schemes = kvmalloc_array(max_entries, sizeof(unsigned char), GFP_KERNEL);
+	if(list->strings == NULL || list->offsets == NULL || list->schemes == NULL)
+	{
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for(p = buf; p < end; )
+	{
+		const char* line_end = split_lines ? memchr(p, '\n', end - p) : NULL;
+		const char* next_line;
+		unsigned char scheme_mask = WEBURL_LIST_ANY_SCHEME;
+		if(line_end == NULL)
+		{
+			line_end = end;
+		}
+		next_line = line_end + 1;
+
+		if(split_lines)
+		{
+			while(p < line_end && isspace(*p))
+			{
+				p++;
+			}
+			while(line_end > p && isspace(line_end[-1]))
+			{
+				line_end--;
+			}
+			if(p < line_end && *p == '#')
+			{
+				p = line_end;
+			}
+		}
+		if(fold)
+		{
+			/* "*.example.com" and ".example.com" both mean example.com and its subdomains */
+			if(line_end - p > 1 && p[0] == '*' && p[1] == '.')
+			{
+				p += 2;
+			}
+			while(p < line_end && *p == '.')
+			{
+				p++;
+			}
+		}
+		if(match_type == WEBURL_EXACT_TYPE && match_part == WEBURL_ALL_PART)
+		{
+			int s;
+			for(s = 0; s < WEBURL_NUM_SCHEMES; s++)
+			{
+				size_t scheme_len = strlen(weburl_schemes[s]);
+				if(line_end - p > scheme_len && strncmp(p, weburl_schemes[s], scheme_len) == 0)
+				{
+					p += scheme_len;
+					scheme_mask = WEBURL_LIST_SCHEME(s);
+					break;
+				}
+			}
+		}
+		if(p < line_end && memchr(p, '\0', line_end - p) == NULL)
+		{
+			char* entry = list->strings + str_len;
+			size_t len = line_end - p;
+			size_t i;
+			for(i = 0; i < len; i++)
+			{
+				entry[i] = fold ? tolower(p[i]) : p[i];
+			}
+			entry[len] = '\0';
+			list->schemes[list->num_entries] = scheme_mask;
+			list->offsets[list->num_entries++] = str_len;
+			str_len += len + 1;
+		}
+		p = next_line;
+	}
+	if(list->num_entries == 0)
+	{
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if(match_type == WEBURL_CONTAINS_TYPE)
+	{
+		ret = weburl_ac_build(list, str_len + 1);
+	}
+	else
+	{
+		ret = weburl_hash_build(list);
+	}
+
+out:
+	if(ret != 0)
+	{
+		weburl_list_free(list);
+		return ERR_PTR(ret);
+	}
+	return list;
+}
+
+/* returns 1 if path is a file in one of weburl_list_dirs, 0 otherwise */
+static int weburl_list_path_allowed(const char* path)
+{
+	size_t d;
+	if(strstr(path, "/..") != NULL)
+	{
+		return 0;
+	}
+	for(d = 0; d < ARRAY_SIZE(weburl_list_dirs); d++)
+	{
+		size_t dir_len = strlen(weburl_list_dirs[d]);
+		if(strncmp(path, weburl_list_dirs[d], dir_len) == 0 && path[dir_len] != '\0')
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Load the list in file path, see weburl_list_create.  Fails with -EACCES
+ * if path is not in one of weburl_list_dirs and -EFBIG if the file is
+ * larger than WEBURL_LIST_MAX_FILE_SIZE.
+ */
+static struct weburl_list* weburl_list_load(const char* path, unsigned char match_type, unsigned char match_part)
+{
+	struct weburl_list* list;
+	void* file_buf = NULL;
+	size_t file_size = 0;
+	ssize_t read_len;
+
+	if(!weburl_list_path_allowed(path))
+	{
+		return ERR_PTR(-EACCES);
+	}
+	read_len = kernel_read_file_from_path(path, 0, &file_buf, WEBURL_LIST_MAX_FILE_SIZE, &file_size, READING_UNKNOWN);
+	if(read_len < 0)
+	{
+		return ERR_PTR(read_len);
+	}
+	if(file_size > read_len)
+	{
+		/* only the start was read, don't load part of the list */
+		vfree(file_buf);
+		return ERR_PTR(-EFBIG);
+	}
+	list = weburl_list_create(file_buf, read_len, 1, match_type, match_part);
+	vfree(file_buf);
+	return list;
+}
+
+/* returns 1 if the request matches any entry in list for match_part, 0 otherwise */
+static int weburl_list_match(const struct weburl_list* list, unsigned char match_part, const struct weburl_request* req)
+{
+	const char* host = req->host;
+	size_t host_len = req->host_len;
+	int lower = req->lower;
+	int www = req->www;
+	int root_path = (req->path_len == 1 && req->path[0] == '/');
+	unsigned char mask;
+	size_t i;
+	u32 node;
+
+	if(match_part == WEBURL_PATH_PART && req->scheme == WEBURL_SCHEME_HTTPS)
+	{
+		return 0; /* we will never have a path for HTTPS */
+	}
+
+	switch(list->match_type)
+	{
+		case WEBURL_CONTAINS_TYPE:
+			/*
+			 * Variants without the scheme, the "www." or the "/" are
+			 * substrings of the full url, except the url without "www."
+			 * which still has the scheme in front of it.
+			 */
+			switch(match_part)
+			{
+				case WEBURL_DOMAIN_PART:
+					node = weburl_ac_feed(list, 0, host, host_len, lower);
+					return list->ac[node].out;
+				case WEBURL_PATH_PART:
+					node = weburl_ac_feed(list, 0, req->path, req->path_len, 0);
+					return list->ac[node].out;
+			}
+			for(i = 0; i <= (www ? 4 : 0); i += 4)
+			{
+				node = weburl_ac_feed(list, list->ac_scheme[req->scheme], host + i, host_len - i, lower);
+				node = weburl_ac_feed(list, node, req->path, req->path_len, 0);
+				if(list->ac[node].out)
+				{
+					return 1;
+				}
+			}
+			return 0;
+
+		case WEBURL_EXACT_TYPE:
+			switch(match_part)
+			{
+				case WEBURL_DOMAIN_PART:
+					return	weburl_list_lookup(list, host, host_len, NULL, 0, lower) ||
+						(www && weburl_list_lookup(list, host + 4, host_len - 4, NULL, 0, lower));
+				case WEBURL_PATH_PART:
+					return	weburl_list_lookup(list, req->path, req->path_len, NULL, 0, 0) ||
+						(req->path_len > 0 && req->path[0] == '/' && weburl_list_lookup(list, req->path + 1, req->path_len - 1, NULL, 0, 0));
+			}
+			mask = 0;
+			for(i = 0; i <= (www ? 4 : 0); i += 4)
+			{
+				if(root_path)
+				{
+					mask |= weburl_list_lookup(list, host + i, host_len - i, NULL, 0, lower);
+				}
+				mask |= weburl_list_lookup(list, host + i, host_len - i, req->path, req->path_len, lower);
+			}
+			return (mask & (WEBURL_LIST_ANY_SCHEME | WEBURL_LIST_SCHEME(req->scheme))) ? 1 : 0;
+
+		case WEBURL_DOMAIN_TYPE:
+			if(weburl_list_lookup(list, host, host_len, NULL, 0, 1))
+			{
+				return 1;
+			}
+			for(i = 0; i+1 < host_len; i++)
+			{
+				if(host[i] == '.' && weburl_list_lookup(list, host + i + 1, host_len - i - 1, NULL, 0, 1))
+				{
+					return 1;
+				}
+			}
+			return 0;
+	}
+	return 0;
+}
@@ -23,10 +23,16 @@ bw_restore()
 	fi
 
 	if [ -e "$tmp_cron" ] ; then
+		# one bw_backup process saves every id in the list, instead of one bw_get per id
+		backup_list="${backup_script%.sh}.ids"
+		if ! grep -q "bw_backup" "$backup_script" 2>/dev/null ; then
+			rm -f "$backup_list"
+			echo "bw_backup -l \"$backup_list\" >/dev/null 2>&1" >> "$backup_script"
+		fi
 		if [ "$backup_to_tmp" = "1" ] || [ "$backup_to_tmp_only" = "1" ] ; then
-			echo "bw_get -i \"$bw_id\" -h -f \"/tmp/data/bwmon/$bw_id.bw\" >/dev/null 2>&1" >> "$backup_script"
+			echo "h $bw_id /tmp/data/bwmon/$bw_id.bw" >> "$backup_list"
 		else
-			echo "bw_get -i \"$bw_id\" -h -f \"/usr/data/bwmon/$bw_id.bw\" >/dev/null 2>&1" >> "$backup_script"
+			echo "h $bw_id /usr/data/bwmon/$bw_id.bw" >> "$backup_list"
 		fi
 	fi
 }
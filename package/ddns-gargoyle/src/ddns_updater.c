@@ -54,6 +54,11 @@
 #include <sys/stat.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 
 #include <time.h>
 
@@ -81,6 +86,8 @@
 
 #define MAX_LOOKUP_URL_LENGTH	65
 
+#define ADDRESS_WATCH_CHECK_INTERVAL	3600	//seconds, default watch_check_interval: ips are only checked this often when we hear of address changes
+
 int daemon_pid_file;
 
 char default_ip_lookup_url_data[][MAX_LOOKUP_URL_LENGTH] = {
@@ -159,6 +166,7 @@ typedef struct
 	char* service_provider;			//name of service from ddns_service_provider
 	int ipv6;	// is the config for IPv6 or not
 	int check_interval; 			// seconds
+	int watch_check_interval;		// seconds, check_interval while address changes are watched
 	int force_interval; 			// seconds
 	int ip_source; 			// INTERFACE or CHECK_URL
 	char** ip_url;			// url or (whitespace separated) list of urls if ip_source is CHECK_URL
@@ -174,8 +182,24 @@ typedef struct
 	char* service_name;
 	time_t next_time;
 	time_t last_full_update;
+	int requests;				// clients waiting for the result of its next update
 } update_node;
 
+#define MAX_UPDATE_WORKERS	4		// most services updated at the same time
+
+typedef struct
+{
+	pid_t pid;				// worker process, 0 once it has been reaped
+	int output_fd;				// pipe it reports its result through, -1 once closed
+	char* output;				// what it has reported so far
+	update_node* node;			// service being updated, NULL if the worker is free
+	char* test_domain;			// domain the service's remote ip is stored under
+	int perform_force_update;
+	int local_ip_given;			// it was given a local ip obtained moments ago
+	int rerun;				// a forced update was requested while it ran
+	int recheck;				// its local ip changed while it ran
+} update_worker;
+
 typedef struct
 {
 	long int msg_type;
@@ -188,9 +212,15 @@ typedef struct
         == htonl (0x20000000))
 #endif /* IS ADDR GLOBAL */
 
-//global variables for daemon (used in signal handler) 
+#ifndef TFD_TIMER_CANCEL_ON_SET
+#define TFD_TIMER_CANCEL_ON_SET (1 << 1)
+#endif
+
+//global variables for daemon (set when its signals are read from the signalfd)
 int terminated; 
 int output_requested; 
+int addresses_changed;			// set when the netlink socket has address changes to read
+update_worker update_workers[MAX_UPDATE_WORKERS];
 
 string_map* load_service_providers(char* filename);
 string_map* load_service_configurations(char* filename, string_map* service_providers);
@@ -219,7 +249,24 @@ void run_request_through_daemon(char **service_names, int force_update, char dis
 void run_daemon(string_map *service_configs, string_map *service_providers, int force_update, char run_in_background);
 
 void daemonize(char run_in_background);
-void signal_handler(int sig);
+void get_daemon_signals(sigset_t* daemon_signals);
+void wait_for_daemon_event(int epoll_fd, int timer_fd, int signal_fd, int netlink_fd, time_t next_time);
+
+int open_address_watch(void);
+void read_address_watch(int netlink_fd, int* ipv4_changed, int* ipv6_changed);
+string_map* get_interface_ips(int ipv6);
+char** get_changed_interfaces(string_map** interface_ips, int ipv6);
+void check_address_changes(int netlink_fd, string_map* service_configs, priority_queue* update_queue, string_map** interface_ips, string_map** interface_ips6, string_map* local_ip_updates, string_map* local_ip6_updates, time_t current_time, time_t reference_time);
+
+update_worker* get_free_update_worker(void);
+update_worker* find_update_worker(char* service_name);
+void request_update(priority_queue* update_queue, priority_queue* request_queue, char* service_name, int force_requested, int message_count, time_t current_time);
+void run_update_worker(int output_fd, ddns_service_config* service_config, string_map* service_providers, char* test_domain, char* remote_ip, char* local_ip, int perform_force_update);
+void start_update_worker(update_worker* worker, int epoll_fd, ddns_service_config* service_config, string_map* service_providers, update_node* next_update, char* test_domain, char* remote_ip, char* local_ip, int perform_force_update);
+void read_update_worker(update_worker* worker, int epoll_fd);
+void reap_update_workers(void);
+int update_worker_finished(update_worker* worker);
+void stop_update_workers(priority_queue* update_queue);
 int create_path(const char *name, int mode);
 
 void free_service_configs(string_map* service_configs);
@@ -726,6 +773,42 @@ void run_daemon(string_map *service_configs, string_map* service_providers, int
 		exit(0);
 	}
 
+	//the daemon sleeps in epoll until the next update is due (timer_fd),
+	//an update worker reports or a signal arrives (signal_fd), daemonize()
+	//has blocked those signals
+	sigset_t daemon_signals;
+	get_daemon_signals(&daemon_signals);
+	int signal_fd = signalfd(-1, &daemon_signals, SFD_NONBLOCK|SFD_CLOEXEC);
+	int timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK|TFD_CLOEXEC);
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(signal_fd < 0 || timer_fd < 0 || epoll_fd < 0)
+	{
+		syslog(LOG_ERR, "Could not set up event loop, exiting");
+		exit(1);
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = signal_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev);
+	ev.data.fd = timer_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+
+	//hear about interface address changes (netlink_fd) so an ip change is
+	//acted on right away instead of at the next check, if we can't we poll as before
+	int netlink_fd = open_address_watch();
+	if(netlink_fd >= 0)
+	{
+		ev.data.fd = netlink_fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, netlink_fd, &ev);
+	}
+	else
+	{
+		syslog(LOG_WARNING, "Could not watch interface addresses, only checking them periodically");
+	}
+	string_map* interface_ips = get_interface_ips(0);
+	string_map* interface_ips6 = get_interface_ips(1);
+
 	//we store times of last updates in a special directory
 	//if it doesn't exist, create it now
 	create_path(UPDATE_INFO_DIR, 0700);
@@ -782,6 +865,7 @@ void run_daemon(string_map *service_configs, string_map* service_providers, int
 		update_node* next_update = (update_node*)malloc(sizeof(update_node));
 		next_update->service_name = strdup(service_config->name);
 		next_update->next_time = current_time; //we at least perform checks right away, as daemon starts
+		next_update->requests = 0;
 		if(perform_force_update)
 		{
 			next_update->last_full_update = 0; //last updated in 1970!
@@ -812,200 +896,245 @@ void run_daemon(string_map *service_configs, string_map* service_providers, int
 
 	//printf("starting update loop\n");
 
+	int worker_index;
+	for(worker_index = 0; worker_index < MAX_UPDATE_WORKERS; worker_index++)
+	{
+		memset(&(update_workers[worker_index]), 0, sizeof(update_worker));
+		update_workers[worker_index].output_fd = -1;
+	}
+
 	terminated = 0;
 	output_requested = 0;
-	time_t last_checked = time(NULL);
+	addresses_changed = 0;
 	while(terminated == 0)
 	{
 		time_t current_time = time(NULL);
-		if(current_time != last_checked)
+
+		//merge the results of finished updates back into the schedule
+		for(worker_index = 0; worker_index < MAX_UPDATE_WORKERS; worker_index++)
 		{
-			last_checked = current_time;
-			priority_queue_node *check_rq = peek_priority_queue_node(request_queue);
-			priority_queue_node *check_uq = check_rq == NULL ? peek_priority_queue_node(update_queue) : check_rq;
-			while(current_time >= ((update_node*)check_uq->value)->next_time || check_rq != NULL)
+			update_worker* worker = &(update_workers[worker_index]);
+			if(!update_worker_finished(worker))
 			{
-				//updates can take a bit of time since we're doing network i/o so constantly update current time
-				current_time = time(NULL); 
-				
-				//de-queue the next update to do
-				priority_queue_node *p;
-			       	if(check_rq != NULL)
+				continue;
+			}
+			update_node* next_update = worker->node;
+			ddns_service_config* service_config = get_map_element(service_configs, next_update->service_name);
+			int perform_force_update = worker->perform_force_update;
+			char* test_domain = worker->test_domain;
+
+			//parse what the worker reported
+			int update_status = UPDATE_FAILED;
+			char* local_ip = NULL;
+			char* given_local_ip = NULL;
+			char* remote_ip = NULL;
+			unsigned long num_lines = 0;
+			char** lines = worker->output != NULL ? split_on_separators(worker->output, "\n", 1, -1, 0, &num_lines) : NULL;
+			unsigned long line_index;
+			for(line_index = 0; line_index < num_lines; line_index++)
+			{
+				unsigned long num_pieces;
+				char** pieces = split_on_separators(lines[line_index], " ", 1, 3, 1, &num_pieces);
+				if(num_pieces == 2 && safe_strcmp(pieces[0], "status") == 0)
 				{
-					p = shift_priority_queue_node(request_queue);
-
+					update_status = atoi(pieces[1]);
 				}
-				else
+				else if(num_pieces == 2 && safe_strcmp(pieces[0], "local") == 0 && local_ip == NULL)
 				{
-					p = shift_priority_queue_node(update_queue);
+					local_ip = strdup(pieces[1]);
 				}
-				update_node* next_update = (update_node*)free_priority_queue_node(p);
-				next_update->next_time = current_time;
-			
-				//determine whether to force an update or just check	
-				ddns_service_config* service_config = get_map_element(service_configs, next_update->service_name);
-				int perform_force_update = current_time - next_update->last_full_update >= service_config->force_interval ? 1 : 0;
-			
-				char* test_domain = get_map_element(service_config->variable_definitions, "domain");
-				//Check if a specific test domain is specified, and use it
-				char* test_domain_def = get_map_element(service_config->variable_definitions, "test_domain");
-				if(test_domain_def != NULL)
+				else if(num_pieces == 2 && safe_strcmp(pieces[0], "remote") == 0 && remote_ip == NULL)
 				{
-					test_domain = test_domain_def;
+					remote_ip = strdup(pieces[1]);
 				}
-				
-				if(perform_force_update)
+				else if(num_pieces == 3 && safe_strcmp(pieces[0], "meta") == 0)
 				{
-					syslog(LOG_INFO, "Forcing update:");
+					//meta variable the update cached, keep it for the next one
+					if(get_string_map_element(service_config->cached_meta_variables, pieces[1]) == NULL)
+					{
+						set_string_map_element(service_config->cached_meta_variables, pieces[1], strdup(pieces[2]));
+					}
 				}
-				else
+				free_null_terminated_string_array(pieces);
+			}
+			if(lines != NULL)
+			{
+				free_null_terminated_string_array(lines);
+			}
+
+			if(perform_force_update)
+			{
+				syslog(LOG_INFO, "Forcing update:");
+			}
+			else
+			{
+				syslog(LOG_INFO, "Checking whether update needed:");
+			}
+			syslog(LOG_INFO, "\tservice provider=%s", service_config->service_provider);
+			if(get_map_element(service_config->variable_definitions, "domain") != NULL || get_map_element(service_config->variable_definitions, "test_domain") != NULL)
+			{
+				syslog(LOG_INFO, "\tdomain=%s", test_domain);
+			}
+
+			//remember the remote ip the worker looked up, or the one we gave it
+			if(remote_ip != NULL)
+			{
+				char* old_element = NULL;
+				if(service_config->ipv6)
 				{
-					syslog(LOG_INFO, "Checking whether update needed:");
+					old_element = (char*)set_map_element(remote_ips6, test_domain, (void*)remote_ip);
 				}
-				syslog(LOG_INFO, "\tservice provider=%s", service_config->service_provider);
-				if(test_domain != NULL)
+				else
 				{
-					syslog(LOG_INFO, "\tdomain=%s", test_domain);
+					old_element = (char*)set_map_element(remote_ips, test_domain, (void*)remote_ip);
 				}
-
-				//determine remote ip
-				if(test_domain == NULL) 
+				if(old_element != NULL)
 				{
-					/* 
-					 * if domain not defined, e.g. we're updating OpenDNS and 
-					 * not typical dynamic dns service use service name as 
-					 * unique identifier for storing remote_ip
-					 */ 
-					test_domain = service_config->name;
+					free(old_element);
 				}
-				char* remote_ip = NULL;
+			}
+			else if(service_config->ipv6)
+			{
+				remote_ip = get_map_element(remote_ips6, test_domain);
+			}
+			else
+			{
+				remote_ip = get_map_element(remote_ips, test_domain);
+			}
+
+			//remember the local ip the worker determined, unless it was one we gave it
+			//or it may be from before the address changed
+			char *interface_name = service_config->ip_source == INTERFACE ? service_config->ip_interface : "internet";
+			if(local_ip != NULL && worker->local_ip_given == 0 && worker->recheck == 0)
+			{
+				time_t* update_time = NULL;
 				if(service_config->ipv6)
 				{
-					remote_ip = get_map_element(remote_ips6, test_domain);
+					update_time = (time_t*)get_map_element(local_ip6_updates, interface_name);
 				}
 				else
 				{
-					remote_ip = get_map_element(remote_ips, test_domain);
+					update_time = (time_t*)get_map_element(local_ip_updates, interface_name);
+				}
+				if(update_time != NULL)
+				{
+					*update_time = current_time;
 				}
-				if(remote_ip == NULL && perform_force_update == 0)
+				else
 				{
-					if(test_domain != NULL)
+					update_time = (time_t*)malloc(sizeof(time_t));
+					*update_time = current_time;
+					if(service_config->ipv6)
 					{
-						remote_ip = lookup_domain_ip(test_domain, service_config->ipv6);
-						if(remote_ip != NULL)
-						{
-							if(service_config->ipv6)
-							{
-								set_map_element(remote_ips6, test_domain, remote_ip);
-							}
-							else
-							{
-								set_map_element(remote_ips, test_domain, remote_ip);
-							}
-						}
+						set_map_element(local_ip6_updates, interface_name, (void*)update_time);
+					}
+					else
+					{
+						set_map_element(local_ip_updates, interface_name, (void*)update_time);
 					}
 				}
-	
-				//determine local ip, loading from saved list if ip was obtained less than 3 seconds ago (in case of multiple simultaneous updates)
-				char *interface_name = service_config->ip_source == INTERFACE ? service_config->ip_interface : "internet";
-				char *local_ip = NULL;
+				char* old_element = NULL;
 				if(service_config->ipv6)
 				{
-					local_ip = (char*)get_map_element(local_ips6, interface_name);
+					old_element = (char*)set_map_element(local_ips6, interface_name, (void*)local_ip);
 				}
 				else
 				{
-					local_ip = (char*)get_map_element(local_ips, interface_name);
+					old_element = (char*)set_map_element(local_ips, interface_name, (void*)local_ip);
 				}
-				int using_predefined_local_ip = (local_ip == NULL) ? 0 : 1;
-				if(using_predefined_local_ip == 1)
+				if(old_element != NULL )
 				{
-					time_t* update_time = NULL;
-					if(service_config->ipv6)
-					{
-						update_time = (time_t*)get_map_element(local_ip6_updates, interface_name);
-					}
-					else
-					{
-						update_time = (time_t*)get_map_element(local_ip_updates, interface_name);
-					}
-					if(update_time != NULL)
-					{
-						using_predefined_local_ip = (current_time - *update_time) < 3 ? 1 : 0;
-					}
-					else
-					{
-						using_predefined_local_ip = 0;
-					}
+					free(old_element);
 				}
-				if(using_predefined_local_ip == 0)
+			}
+			else
+			{
+				given_local_ip = local_ip;
+			}
+			if(local_ip != NULL) { syslog(LOG_INFO, "\tlocal IP  = %s", local_ip);       }
+			if(local_ip == NULL) { syslog(LOG_INFO, "\tlocal IP cannot be determined");  }
+			
+			if(remote_ip != NULL){ syslog(LOG_INFO, "\tremote IP = %s\n", remote_ip);     }
+			if(remote_ip == NULL){ syslog(LOG_INFO, "\tremote IP cannot be determined");  }
+
+			if(update_status == UPDATE_FAILED)     {  syslog(LOG_INFO, "\tUpdate failed\n\n"); }
+			if(update_status == UPDATE_NOT_NEEDED) {  syslog(LOG_INFO, "\tUpdate not needed, IPs match\n\n"); }
+			if(update_status == UPDATE_SUCCESSFUL) {  syslog(LOG_INFO, "\tUpdate successful\n\n"); }
+
+			//when we watch the interface addresses a change of the interface ip is seen right away,
+			//and any address change also rechecks the ips from the internet, so checks are only a
+			//safety net then (for a change behind NAT), unless this one failed
+			int check_interval = service_config->check_interval;
+			if(netlink_fd >= 0 && update_status != UPDATE_FAILED && check_interval < service_config->watch_check_interval)
+			{
+				check_interval = service_config->watch_check_interval;
+			}
+
+			//schedule next update	
+			if(update_status == UPDATE_SUCCESSFUL)
+			{
+				void* old_element = NULL;
+				if(service_config->ipv6)
 				{
-					local_ip = get_local_ip(service_config->ip_source, service_config->ip_source == INTERFACE ? (void*)service_config->ip_interface : (void*)service_config->ip_url, service_config->ipv6);
-					if(local_ip != NULL)
-					{
-						time_t* update_time = NULL;
-						if(service_config->ipv6)
-						{
-							update_time = (time_t*)get_map_element(local_ip6_updates, interface_name);
-						}
-						else
-						{
-							update_time = (time_t*)get_map_element(local_ip_updates, interface_name);
-						}
-						if(update_time != NULL)
-						{
-							*update_time = current_time;
-						}
-						else
-						{
-							update_time = (time_t*)malloc(sizeof(time_t));
-							*update_time = current_time;
-							if(service_config->ipv6)
-							{
-								set_map_element(local_ip6_updates, interface_name, (void*)update_time);
-							}
-							else
-							{
-								set_map_element(local_ip_updates, interface_name, (void*)update_time);
-							}
-						}
-						char* old_element = NULL;
-						if(service_config->ipv6)
-						{
-							old_element = (char*)set_map_element(local_ips6, interface_name, (void*)local_ip);
-						}
-						else
-						{
-							old_element = (char*)set_map_element(local_ips, interface_name, (void*)local_ip);
-						}
-						if(old_element != NULL )
-						{
-							free(old_element);
-						}
-					}
+					old_element = (char*)set_map_element(remote_ips6, test_domain, (void*)strdup(local_ip));
+				}
+				else
+				{
+					old_element = (char*)set_map_element(remote_ips, test_domain, (void*)strdup(local_ip));
 				}
-				if(local_ip != NULL) { syslog(LOG_INFO, "\tlocal IP  = %s", local_ip);       }
-				if(local_ip == NULL) { syslog(LOG_INFO, "\tlocal IP cannot be determined");  }
 				
-				if(remote_ip != NULL){ syslog(LOG_INFO, "\tremote IP = %s\n", remote_ip);     }
-				if(remote_ip == NULL){ syslog(LOG_INFO, "\tremote IP cannot be determined");  }
-
-
+				if(old_element != NULL)
+				{
+					free(old_element);
+				}
 
-				//actually do update
-				int update_status = UPDATE_FAILED;
-				if(local_ip != NULL)
+				//update the last update time file
+				char* filename = dynamic_strcat(2, UPDATE_INFO_DIR, service_config->name);
+				FILE* update_file = fopen(filename, "w");
+				free(filename);
+				if(update_file != NULL)
 				{
-					update_status = do_single_update(service_config, service_providers, remote_ip, local_ip, perform_force_update, 0);
+					fprintf(update_file, "%ld", (long)current_time);
+					fclose(update_file);
 				}
-				if(update_status == UPDATE_FAILED)     {  syslog(LOG_INFO, "\tUpdate failed\n\n"); }
-				if(update_status == UPDATE_NOT_NEEDED) {  syslog(LOG_INFO, "\tUpdate not needed, IPs match\n\n"); }
-				if(update_status == UPDATE_SUCCESSFUL) {  syslog(LOG_INFO, "\tUpdate successful\n\n"); }
 
+				time_t next_force_time = current_time + service_config->force_interval;
+				time_t next_check_time = current_time + check_interval;
+				next_update->next_time = next_force_time < next_check_time ? next_force_time : next_check_time;
+				next_update->last_full_update = current_time;
+			}
+			else //treat unnecessary update exactly like failed update, except in case of failure make sure we wait a full check_interval before retry
+			{
+				time_t next_force_time;
+			       	if(update_status == UPDATE_NOT_NEEDED)
+				{
+					next_force_time = next_update->last_full_update + service_config->force_interval;
+				}
+				else //update_failed
+				{
+					next_force_time = current_time + service_config->force_interval;
+				}
+				time_t next_check_time = current_time + check_interval;
+				next_update->next_time = next_force_time < next_check_time ? next_force_time : next_check_time;
+			}
+			if(worker->recheck)
+			{
+				//it may have used the ip from before the change
+				next_update->next_time = current_time;
+			}
 
-				//if this update was in response to a request, send
+			if(worker->rerun)
+			{
+				//a forced update was requested while this one ran, the requests are answered after it
+				next_update->next_time = current_time;
+				next_update->last_full_update = 0;
+				push_priority_queue(request_queue, 0, next_update->service_name, next_update);
+			}
+			else
+			{
+				//if this update was in response to requests, send
 				//result to message queue
-				if(check_rq != NULL)
+				for( ; next_update->requests > 0; next_update->requests--)
 				{
 					message_t resp_msg;
 					resp_msg.msg_type = RESPONSE_MSG_TYPE;
@@ -1015,85 +1144,132 @@ void run_daemon(string_map *service_configs, string_map* service_providers, int
 					msgsnd(mq, (void *)&resp_msg, MAX_MSG_LINE, 0);
 				}
 
+				//printf("waiting %d seconds before next update\n", (int)(next_update->next_time - current_time));
 
-				//schedule next update	
-				if(update_status == UPDATE_SUCCESSFUL)
-				{
-					void* old_element = NULL;
-					if(service_config->ipv6)
-					{
-						old_element = (char*)set_map_element(remote_ips6, test_domain, (void*)strdup(local_ip));
-					}
-					else
-					{
-						old_element = (char*)set_map_element(remote_ips, test_domain, (void*)strdup(local_ip));
-					}
-					
-					if(old_element != NULL)
-					{
-						free(old_element);
-					}
+				push_priority_queue(update_queue, next_update->next_time-reference_time, next_update->service_name, next_update);
+			}
 
-					//update the last update time file
-					char* filename = dynamic_strcat(2, UPDATE_INFO_DIR, service_config->name);
-					FILE* update_file = fopen(filename, "w");
-					free(filename);
-					if(update_file != NULL)
-					{
-						fprintf(update_file, "%ld", (long)current_time);
-						fclose(update_file);
-					}
+			free(given_local_ip);
+			free(worker->output);
+			free(worker->test_domain);
+			memset(worker, 0, sizeof(update_worker));
+			worker->output_fd = -1;
+		}
+
+		//start updates that are due, requests first, while there are free workers
+		update_worker* free_worker = get_free_update_worker();
+		priority_queue_node *check_rq = peek_priority_queue_node(request_queue);
+		priority_queue_node *check_uq = check_rq == NULL ? peek_priority_queue_node(update_queue) : check_rq;
+		while(free_worker != NULL && check_uq != NULL && (current_time >= ((update_node*)check_uq->value)->next_time || check_rq != NULL))
+		{
+			//de-queue the next update to do
+			priority_queue_node *p;
+		       	if(check_rq != NULL)
+			{
+				p = shift_priority_queue_node(request_queue);
+			}
+			else
+			{
+				p = shift_priority_queue_node(update_queue);
+			}
+			update_node* next_update = (update_node*)free_priority_queue_node(p);
+			next_update->next_time = current_time;
+		
+			//determine whether to force an update or just check	
+			ddns_service_config* service_config = get_map_element(service_configs, next_update->service_name);
+			int perform_force_update = current_time - next_update->last_full_update >= service_config->force_interval ? 1 : 0;
+		
+			char* test_domain = get_map_element(service_config->variable_definitions, "domain");
+			//Check if a specific test domain is specified, and use it
+			char* test_domain_def = get_map_element(service_config->variable_definitions, "test_domain");
+			if(test_domain_def != NULL)
+			{
+				test_domain = test_domain_def;
+			}
+			if(test_domain == NULL) 
+			{
+				/* 
+				 * if domain not defined, e.g. we're updating OpenDNS and 
+				 * not typical dynamic dns service use service name as 
+				 * unique identifier for storing remote_ip
+				 */ 
+				test_domain = service_config->name;
+			}
 
-					time_t next_force_time = current_time + service_config->force_interval;
-					time_t next_check_time = current_time + service_config->check_interval;
-					next_update->next_time = next_force_time < next_check_time ? next_force_time : next_check_time;
-					next_update->last_full_update = current_time;
+			//the worker looks up the remote ip if we don't know it yet
+			char* remote_ip = NULL;
+			if(service_config->ipv6)
+			{
+				remote_ip = get_map_element(remote_ips6, test_domain);
+			}
+			else
+			{
+				remote_ip = get_map_element(remote_ips, test_domain);
+			}
+
+			//use the saved local ip if it was obtained less than 3 seconds ago (in case of multiple simultaneous updates)
+			//otherwise the worker determines it
+			char *interface_name = service_config->ip_source == INTERFACE ? service_config->ip_interface : "internet";
+			char *local_ip = NULL;
+			if(service_config->ipv6)
+			{
+				local_ip = (char*)get_map_element(local_ips6, interface_name);
+			}
+			else
+			{
+				local_ip = (char*)get_map_element(local_ips, interface_name);
+			}
+			if(local_ip != NULL)
+			{
+				time_t* update_time = NULL;
+				if(service_config->ipv6)
+				{
+					update_time = (time_t*)get_map_element(local_ip6_updates, interface_name);
 				}
-				else //treat unnecessary update exactly like failed update, except in case of failure make sure we wait a full check_interval before retry
+				else
 				{
-					if(remote_ip != NULL)
-					{
-						char* old_element = NULL;
-						if(service_config->ipv6)
-						{
-							old_element = (char*)set_map_element(remote_ips6, test_domain, (void*)remote_ip);
-						}
-						else
-						{
-							old_element = (char*)set_map_element(remote_ips, test_domain, (void*)remote_ip);
-						}
-						
-						if(old_element != NULL && old_element != remote_ip)
-						{
-							free(old_element);
-						}
-					}
-					
-	
-					time_t next_force_time;
-				       	if(update_status == UPDATE_NOT_NEEDED)
-					{
-						next_force_time = next_update->last_full_update + service_config->force_interval;
-					}
-					else //update_failed
-					{
-						next_force_time = current_time + service_config->force_interval;
-					}
-					time_t next_check_time = current_time + service_config->check_interval;
-					next_update->next_time = next_force_time < next_check_time ? next_force_time : next_check_time;
+					update_time = (time_t*)get_map_element(local_ip_updates, interface_name);
 				}
+				if(update_time == NULL || (current_time - *update_time) >= 3)
+				{
+					local_ip = NULL;
+				}
+			}
 
-				//printf("waiting %d seconds before next update\n", (int)(next_update->next_time - current_time));
+			start_update_worker(free_worker, epoll_fd, service_config, service_providers, next_update, test_domain, remote_ip, local_ip, perform_force_update);
 
-				push_priority_queue(update_queue, next_update->next_time-reference_time, next_update->service_name, next_update);
-				
-				check_rq = peek_priority_queue_node(request_queue);
-				check_uq = peek_priority_queue_node(update_queue);
-			}
+			free_worker = get_free_update_worker();
+			check_rq = peek_priority_queue_node(request_queue);
+			check_uq = check_rq == NULL ? peek_priority_queue_node(update_queue) : check_rq;
 		}
 
-		//sleep for 400 milliseconds, or until signal is caught
-		usleep(400*1000); 
+		//a worker that couldn't be started is already finished, and nothing would wake us
+		//for it, so merge it right away rather than sleep
+		int finished_worker = 0;
+		for(worker_index = 0; worker_index < MAX_UPDATE_WORKERS; worker_index++)
+		{
+			finished_worker = finished_worker || update_worker_finished(&(update_workers[worker_index]));
+		}
+		if(finished_worker)
+		{
+			continue;
+		}
+
+		//sleep until the next update is due (if a worker is free to do it), a worker finishes, or until signal is caught
+		time_t next_time = 0;
+		if(free_worker != NULL && (check_uq = peek_priority_queue_node(update_queue)) != NULL)
+		{
+			next_time = ((update_node*)check_uq->value)->next_time;
+		}
+		wait_for_daemon_event(epoll_fd, timer_fd, signal_fd, netlink_fd, next_time);
+		current_time = time(NULL);
+
+		//check the services whose local ip may have changed right away
+		if(addresses_changed == 1)
+		{
+			check_address_changes(netlink_fd, service_configs, update_queue, &interface_ips, &interface_ips6, local_ip_updates, local_ip6_updates, current_time, reference_time);
+			addresses_changed = 0;
+		}
 		
 		//handle request from non-daemon if there was one
 		if(output_requested == 1)
@@ -1131,20 +1307,7 @@ void run_daemon(string_map *service_configs, string_map* service_providers, int
 						ddns_service_config *service_config = all_configs[config_index];
 						if(service_config != NULL)
 						{
-							priority_queue_node *p = remove_priority_queue_node_with_id(update_queue, service_config->name);
-							update_node* next_update = (update_node*)free_priority_queue_node(p);
-							if(next_update == NULL)
-							{
-								//BAD!!!
-								exit(1);
-							}
-							next_update->next_time = current_time;
-	
-							if(force_requested == 1)
-							{
-								next_update->last_full_update = 0;
-							}
-							push_priority_queue(request_queue, message_count, next_update->service_name, next_update);
+							request_update(update_queue, request_queue, service_config->name, force_requested, message_count, current_time);
 						}
 						else
 						{
@@ -1167,15 +1330,7 @@ void run_daemon(string_map *service_configs, string_map* service_providers, int
 					if(service_config != NULL)
 					{
 						//printf("service config %s not null\n", req_name);
-						priority_queue_node *p = remove_priority_queue_node_with_id(update_queue, req_name);
-						update_node* next_update = (update_node*)free_priority_queue_node(p);
-						next_update->next_time = current_time;
-	
-						if(force_requested == 1)
-						{
-							next_update->last_full_update = 0;
-						}
-						push_priority_queue(request_queue, message_count, next_update->service_name, next_update);
+						request_update(update_queue, request_queue, req_name, force_requested, message_count, current_time);
 					}
 					else
 					{
@@ -1194,10 +1349,21 @@ void run_daemon(string_map *service_configs, string_map* service_providers, int
 			//printf("done scheduling output request\n");
 		}	
 	}
+
+	//stop updates still running, their services are freed with the rest below
+	stop_update_workers(update_queue);
 	
 	struct msqid_ds queue_data;
 	msgctl(mq, IPC_RMID, &queue_data);
 
+	close(epoll_fd);
+	close(timer_fd);
+	close(signal_fd);
+	if(netlink_fd >= 0)
+	{
+		close(netlink_fd);
+	}
+
 	//close system log
 	closelog();
 
@@ -1222,6 +1388,8 @@ void run_daemon(string_map *service_configs, string_map* service_providers, int
 	destroy_string_map(local_ips6, DESTROY_MODE_FREE_VALUES, &num_destroyed);
 	destroy_string_map(remote_ips, DESTROY_MODE_FREE_VALUES, &num_destroyed);
 	destroy_string_map(remote_ips6, DESTROY_MODE_FREE_VALUES, &num_destroyed);
+	destroy_string_map(interface_ips, DESTROY_MODE_FREE_VALUES, &num_destroyed);
+	destroy_string_map(interface_ips6, DESTROY_MODE_FREE_VALUES, &num_destroyed);
 
 
 	unsigned long num_r;
@@ -1289,26 +1457,561 @@ void daemonize(char run_in_background) //background variable is useful for debug
 		exit(1);
 	}
 
-	//set signal handlers
-	signal(SIGTERM,signal_handler);
-	signal(SIGINT, signal_handler);
-	signal(SIGUSR1,signal_handler);
+	//block the signals we handle, run_daemon() reads them from a signalfd
+	//they stay pending until then, so a request sent now is not lost
+	sigset_t daemon_signals;
+	get_daemon_signals(&daemon_signals);
+	sigprocmask(SIG_BLOCK, &daemon_signals, NULL);
 }
 
-void signal_handler(int sig)
+/*
+ * Signals the daemon reads from its signalfd.  They are blocked while
+ * it runs and unblocked again in update workers.
+ */
+void get_daemon_signals(sigset_t* daemon_signals)
 {
-	if(sig == SIGTERM || sig == SIGINT )
+	sigemptyset(daemon_signals);
+	sigaddset(daemon_signals, SIGTERM);
+	sigaddset(daemon_signals, SIGINT);
+	sigaddset(daemon_signals, SIGUSR1);
+	sigaddset(daemon_signals, SIGCHLD);
+}
+
+/*
+ * Sleep until next_time, when the next scheduled update is due (0 if
+ * nothing is), until an update worker reports, until an interface address
+ * changes (sets addresses_changed), or until a signal arrives:
+ * SIGUSR1 from a client that has queued requests (sets output_requested),
+ * SIGCHLD from a worker exiting, SIGTERM or SIGINT (sets terminated).
+ * The timer is on the wall clock like next_time, and also wakes us
+ * when the clock is set (e.g. by NTP after boot) so we can look at
+ * the schedule again.
+ */
+void wait_for_daemon_event(int epoll_fd, int timer_fd, int signal_fd, int netlink_fd, time_t next_time)
+{
+	struct itimerspec due;
+	memset(&due, 0, sizeof(due));
+	due.it_value.tv_sec = next_time; //zero disarms the timer
+	timerfd_settime(timer_fd, TFD_TIMER_ABSTIME|TFD_TIMER_CANCEL_ON_SET, &due, NULL);
+
+	struct epoll_event events[MAX_UPDATE_WORKERS+3];
+	int num_events = epoll_wait(epoll_fd, events, MAX_UPDATE_WORKERS+3, -1);
+	int event_index;
+	for(event_index = 0; event_index < num_events; event_index++)
 	{
-		terminated = 1; //exit cleanly on SIGTERM signal
+		if(events[event_index].data.fd == signal_fd)
+		{
+			struct signalfd_siginfo info;
+			while(read(signal_fd, &info, sizeof(info)) == sizeof(info))
+			{
+				if(info.ssi_signo == SIGUSR1)
+				{
+					output_requested = 1; //do output
+				}
+				else if(info.ssi_signo == SIGCHLD)
+				{
+					reap_update_workers();
+				}
+				else
+				{
+					terminated = 1; //exit cleanly on SIGTERM signal
+				}
+			}
+		}
+		else if(events[event_index].data.fd == timer_fd)
+		{
+			//fails with ECANCELED if the clock was set, either way the caller checks the schedule
+			uint64_t expirations;
+			if(read(timer_fd, &expirations, sizeof(expirations)) < 0)
+			{
+				expirations = 0;
+			}
+		}
+		else if(netlink_fd >= 0 && events[event_index].data.fd == netlink_fd)
+		{
+			addresses_changed = 1; //read by check_address_changes()
+		}
+		else
+		{
+			int worker_index;
+			for(worker_index = 0; worker_index < MAX_UPDATE_WORKERS; worker_index++)
+			{
+				if(update_workers[worker_index].output_fd == events[event_index].data.fd)
+				{
+					read_update_worker(&(update_workers[worker_index]), epoll_fd);
+				}
+			}
+		}
 	}
-	else if(sig == SIGUSR1)
+}
+
+update_worker* get_free_update_worker(void)
+{
+	int worker_index;
+	for(worker_index = 0; worker_index < MAX_UPDATE_WORKERS; worker_index++)
 	{
-		output_requested = 1; //do output
-		//printf("output signal received\n");
+		if(update_workers[worker_index].node == NULL)
+		{
+			return &(update_workers[worker_index]);
+		}
+	}
+	return NULL;
+}
+
+update_worker* find_update_worker(char* service_name)
+{
+	int worker_index;
+	for(worker_index = 0; worker_index < MAX_UPDATE_WORKERS; worker_index++)
+	{
+		update_node* node = update_workers[worker_index].node;
+		if(node != NULL && safe_strcmp(node->service_name, service_name) == 0)
+		{
+			return &(update_workers[worker_index]);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * A client wants the service updated now.  Move its update to the
+ * request queue and count the client as waiting for the result.
+ * If a worker is updating the service right now the client gets that
+ * result, unless it wants a forced update and that one isn't.  Then
+ * the service is updated again as soon as the worker is done.
+ */
+void request_update(priority_queue* update_queue, priority_queue* request_queue, char* service_name, int force_requested, int message_count, time_t current_time)
+{
+	priority_queue_node *p = remove_priority_queue_node_with_id(update_queue, service_name);
+	if(p == NULL)
+	{
+		p = remove_priority_queue_node_with_id(request_queue, service_name);
+	}
+	if(p != NULL)
+	{
+		update_node* next_update = (update_node*)free_priority_queue_node(p);
+		next_update->next_time = current_time;
+		if(force_requested == 1)
+		{
+			next_update->last_full_update = 0;
+		}
+		next_update->requests++;
+		push_priority_queue(request_queue, message_count, next_update->service_name, next_update);
 	}
 	else
 	{
-		//ignore other signals
+		update_worker* worker = find_update_worker(service_name);
+		if(worker != NULL)
+		{
+			worker->node->requests++;
+			if(force_requested == 1 && worker->perform_force_update == 0)
+			{
+				worker->rerun = 1;
+			}
+		}
+	}
+}
+
+/*
+ * Runs in the worker process: check / update one service and report the
+ * result to the daemon through output_fd, one "name value" per line:
+ * status, local (ip), remote (ip, if it had to be looked up) and meta
+ * (cached meta variable name and value).  Never returns.
+ */
+void run_update_worker(int output_fd, ddns_service_config* service_config, string_map* service_providers, char* test_domain, char* remote_ip, char* local_ip, int perform_force_update)
+{
+	//the worker, and the scripts it runs, get the default signal handling back
+	sigset_t daemon_signals;
+	get_daemon_signals(&daemon_signals);
+	sigprocmask(SIG_UNBLOCK, &daemon_signals, NULL);
+
+	char* looked_up_remote_ip = NULL;
+	if(remote_ip == NULL && perform_force_update == 0)
+	{
+		remote_ip = looked_up_remote_ip = lookup_domain_ip(test_domain, service_config->ipv6);
+	}
+	if(local_ip == NULL)
+	{
+		local_ip = get_local_ip(service_config->ip_source, service_config->ip_source == INTERFACE ? (void*)service_config->ip_interface : (void*)service_config->ip_url, service_config->ipv6);
+	}
+
+	int update_status = UPDATE_FAILED;
+	if(local_ip != NULL)
+	{
+		update_status = do_single_update(service_config, service_providers, remote_ip, local_ip, perform_force_update, 0);
+	}
+
+	FILE* output = fdopen(output_fd, "w");
+	if(output != NULL)
+	{
+		fprintf(output, "status %d\n", update_status);
+		if(local_ip != NULL)
+		{
+			fprintf(output, "local %s\n", local_ip);
+		}
+		if(looked_up_remote_ip != NULL)
+		{
+			fprintf(output, "remote %s\n", looked_up_remote_ip);
+		}
+		unsigned long num_keys;
+		char** meta_names = (char**)get_string_map_keys(service_config->cached_meta_variables, &num_keys);
+		int name_index;
+		for(name_index = 0; meta_names[name_index] != NULL; name_index++)
+		{
+			fprintf(output, "meta %s %s\n", meta_names[name_index], (char*)get_string_map_element(service_config->cached_meta_variables, meta_names[name_index]));
+		}
+		free_null_terminated_string_array(meta_names);
+		fclose(output);
+	}
+	_exit(0);
+}
+
+/*
+ * Fork a worker to check / update the service in next_update, so a slow
+ * provider or script doesn't hold up the others.  If the worker can't be
+ * started it is finished straight away, and with nothing reported the
+ * update counts as failed.
+ */
+void start_update_worker(update_worker* worker, int epoll_fd, ddns_service_config* service_config, string_map* service_providers, update_node* next_update, char* test_domain, char* remote_ip, char* local_ip, int perform_force_update)
+{
+	worker->node = next_update;
+	worker->test_domain = strdup(test_domain);
+	worker->perform_force_update = perform_force_update;
+	worker->local_ip_given = local_ip != NULL ? 1 : 0;
+	worker->rerun = 0;
+	worker->output = strdup("");
+	worker->output_fd = -1;
+	worker->pid = 0;
+
+	int pipe_fds[2];
+	if(pipe(pipe_fds) < 0)
+	{
+		return;
+	}
+	//scripts the worker runs don't get either end
+	fcntl(pipe_fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(pipe_fds[1], F_SETFD, FD_CLOEXEC);
+	worker->pid = fork();
+	if(worker->pid < 0)
+	{
+		worker->pid = 0;
+		close(pipe_fds[0]);
+		close(pipe_fds[1]);
+		return;
+	}
+	if(worker->pid == 0)
+	{
+		close(pipe_fds[0]);
+		run_update_worker(pipe_fds[1], service_config, service_providers, test_domain, remote_ip, local_ip, perform_force_update);
+	}
+	close(pipe_fds[1]);
+	fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK);
+	worker->output_fd = pipe_fds[0];
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = worker->output_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, worker->output_fd, &ev);
+}
+
+/* Read what the worker has reported, closing its pipe once it is done. */
+void read_update_worker(update_worker* worker, int epoll_fd)
+{
+	char buf[256];
+	ssize_t num_read;
+	while((num_read = read(worker->output_fd, buf, sizeof(buf)-1)) > 0)
+	{
+		buf[num_read] = '\0';
+		char* output = dynamic_strcat(2, worker->output, buf);
+		free(worker->output);
+		worker->output = output;
+	}
+	if(num_read == 0 || (errno != EAGAIN && errno != EINTR))
+	{
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, worker->output_fd, NULL);
+		close(worker->output_fd);
+		worker->output_fd = -1;
+	}
+}
+
+/* Collect the workers that have exited, without waiting for the others. */
+void reap_update_workers(void)
+{
+	int worker_index;
+	for(worker_index = 0; worker_index < MAX_UPDATE_WORKERS; worker_index++)
+	{
+		update_worker* worker = &(update_workers[worker_index]);
+		int status;
+		if(worker->pid > 0 && waitpid(worker->pid, &status, WNOHANG) == worker->pid)
+		{
+			worker->pid = 0;
+		}
+	}
+}
+
+/* A worker is finished once it has exited and its pipe is closed, until its result is merged. */
+int update_worker_finished(update_worker* worker)
+{
+	return worker->node != NULL && worker->pid == 0 && worker->output_fd < 0 ? 1 : 0;
+}
+
+/* Kill the workers still running and put their services back in the update queue. */
+void stop_update_workers(priority_queue* update_queue)
+{
+	int worker_index;
+	for(worker_index = 0; worker_index < MAX_UPDATE_WORKERS; worker_index++)
+	{
+		update_worker* worker = &(update_workers[worker_index]);
+		if(worker->node == NULL)
+		{
+			continue;
+		}
+		if(worker->pid > 0)
+		{
+			kill(worker->pid, SIGTERM);
+			waitpid(worker->pid, NULL, 0);
+		}
+		if(worker->output_fd >= 0)
+		{
+			close(worker->output_fd);
+		}
+		push_priority_queue(update_queue, 0, worker->node->service_name, worker->node);
+		free(worker->output);
+		free(worker->test_domain);
+		memset(worker, 0, sizeof(update_worker));
+		worker->output_fd = -1;
+	}
+}
+
+/*
+ * Open a netlink socket that hears of IPv4 and IPv6 addresses being
+ * added to or removed from interfaces.  Returns -1 if that can't be done.
+ */
+int open_address_watch(void)
+{
+	int netlink_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if(netlink_fd < 0)
+	{
+		return -1;
+	}
+
+	struct sockaddr_nl local;
+	memset(&local, 0, sizeof(local));
+	local.nl_family = AF_NETLINK;
+	local.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+	if(bind(netlink_fd, (struct sockaddr*)&local, sizeof(local)) < 0)
+	{
+		close(netlink_fd);
+		return -1;
+	}
+	fcntl(netlink_fd, F_SETFL, fcntl(netlink_fd, F_GETFL) | O_NONBLOCK);
+	fcntl(netlink_fd, F_SETFD, FD_CLOEXEC);
+	return netlink_fd;
+}
+
+/*
+ * Read all the address messages waiting on netlink_fd and note which
+ * families they were for.  If the socket overflowed we missed some,
+ * so both families are taken to have changed.
+ */
+void read_address_watch(int netlink_fd, int* ipv4_changed, int* ipv6_changed)
+{
+	char buffer[8192];
+	int length;
+	*ipv4_changed = 0;
+	*ipv6_changed = 0;
+	while((length = recv(netlink_fd, buffer, sizeof(buffer), 0)) != 0)
+	{
+		if(length < 0)
+		{
+			if(errno == ENOBUFS)
+			{
+				*ipv4_changed = 1;
+				*ipv6_changed = 1;
+				continue;
+			}
+			break; //EAGAIN, all read
+		}
+
+		struct nlmsghdr* message;
+		for(message = (struct nlmsghdr*)buffer; NLMSG_OK(message, length); message = NLMSG_NEXT(message, length))
+		{
+			if(message->nlmsg_type == RTM_NEWADDR || message->nlmsg_type == RTM_DELADDR)
+			{
+				struct ifaddrmsg* address = (struct ifaddrmsg*)NLMSG_DATA(message);
+				if(address->ifa_family == AF_INET)
+				{
+					*ipv4_changed = 1;
+				}
+				else if(address->ifa_family == AF_INET6)
+				{
+					*ipv6_changed = 1;
+				}
+			}
+		}
+	}
+}
+
+/*
+ * The ip of every interface that has one, interface name -> ip, picked
+ * the way get_interface_ip() picks it.
+ */
+string_map* get_interface_ips(int ipv6)
+{
+	string_map* interface_ips = initialize_map(1);
+	struct ifaddrs* ifap;
+	struct ifaddrs* ifa;
+	if(getifaddrs(&ifap) < 0)
+	{
+		return interface_ips;
+	}
+	for(ifa = ifap; ifa; ifa = ifa->ifa_next)
+	{
+		char* ip = NULL;
+		if(ifa->ifa_addr == NULL || get_map_element(interface_ips, ifa->ifa_name) != NULL)
+		{
+			continue;
+		}
+		if(ifa->ifa_addr->sa_family == AF_INET && !ipv6)
+		{
+			ip = (char*)malloc(INET_ADDRSTRLEN);
+			inet_ntop(AF_INET, &((struct sockaddr_in*)ifa->ifa_addr)->sin_addr, ip, INET_ADDRSTRLEN);
+		}
+		else if(ifa->ifa_addr->sa_family == AF_INET6 && ipv6 && IN6_IS_ADDR_GLOBAL(&((struct sockaddr_in6*)ifa->ifa_addr)->sin6_addr))
+		{
+			ip = (char*)malloc(INET6_ADDRSTRLEN);
+			inet_ntop(AF_INET6, &((struct sockaddr_in6*)ifa->ifa_addr)->sin6_addr, ip, INET6_ADDRSTRLEN);
+		}
+		if(ip != NULL)
+		{
+			set_map_element(interface_ips, ifa->ifa_name, ip);
+		}
+	}
+	freeifaddrs(ifap);
+	return interface_ips;
+}
+
+/*
+ * Replace *interface_ips with the ips the interfaces have now and return
+ * the names of the interfaces whose ip is not what it was (one that got
+ * or lost its ip included), NULL terminated.  Most address messages are
+ * just lifetimes being renewed, those give an empty list.
+ */
+char** get_changed_interfaces(string_map** interface_ips, int ipv6)
+{
+	string_map* old_ips = *interface_ips;
+	string_map* new_ips = get_interface_ips(ipv6);
+	unsigned long num_old;
+	unsigned long num_new;
+	char** old_names = get_map_keys(old_ips, &num_old);
+	char** new_names = get_map_keys(new_ips, &num_new);
+	char** changed = (char**)malloc((num_old + num_new + 1) * sizeof(char*));
+	unsigned long num_changed = 0;
+	unsigned long name_index;
+	for(name_index = 0; name_index < num_new; name_index++)
+	{
+		if(safe_strcmp(get_map_element(old_ips, new_names[name_index]), get_map_element(new_ips, new_names[name_index])) != 0)
+		{
+			changed[num_changed++] = strdup(new_names[name_index]);
+		}
+	}
+	for(name_index = 0; name_index < num_old; name_index++)
+	{
+		if(get_map_element(new_ips, old_names[name_index]) == NULL)
+		{
+			changed[num_changed++] = strdup(old_names[name_index]);
+		}
+	}
+	changed[num_changed] = NULL;
+
+	free_null_terminated_string_array(old_names);
+	free_null_terminated_string_array(new_names);
+	unsigned long num_destroyed;
+	destroy_string_map(old_ips, DESTROY_MODE_FREE_VALUES, &num_destroyed);
+	*interface_ips = new_ips;
+	return changed;
+}
+
+/*
+ * Read the address changes waiting on netlink_fd, and make the check of
+ * every service whose local ip actually changed due now: services using
+ * the ip of an interface that changed, and services getting their ip from
+ * the internet whenever some interface other than loopback changed (behind
+ * NAT that is all we can go by).  Services being updated right now are
+ * checked again once their worker is done.  Local ips saved in the last
+ * few seconds are not handed to workers any more, they may be the old ones.
+ */
+void check_address_changes(int netlink_fd, string_map* service_configs, priority_queue* update_queue, string_map** interface_ips, string_map** interface_ips6, string_map* local_ip_updates, string_map* local_ip6_updates, time_t current_time, time_t reference_time)
+{
+	int ipv4_changed;
+	int ipv6_changed;
+	read_address_watch(netlink_fd, &ipv4_changed, &ipv6_changed);
+
+	int ipv6;
+	for(ipv6 = 0; ipv6 <= 1; ipv6++)
+	{
+		if((ipv6 ? ipv6_changed : ipv4_changed) == 0)
+		{
+			continue;
+		}
+		string_map* ip_updates = ipv6 ? local_ip6_updates : local_ip_updates;
+		char** changed = get_changed_interfaces(ipv6 ? interface_ips6 : interface_ips, ipv6);
+
+		int internet_changed = 0;
+		int changed_index;
+		for(changed_index = 0; changed[changed_index] != NULL; changed_index++)
+		{
+			char* name = changed[changed_index];
+			syslog(LOG_INFO, "%s address of %s changed", ipv6 ? "IPv6" : "IPv4", name);
+			internet_changed = internet_changed || safe_strcmp(name, "lo") != 0;
+
+			time_t* update_time = (time_t*)get_map_element(ip_updates, name);
+			if(update_time != NULL)
+			{
+				*update_time = 0;
+			}
+		}
+		time_t* update_time = (time_t*)get_map_element(ip_updates, "internet");
+		if(internet_changed && update_time != NULL)
+		{
+			*update_time = 0;
+		}
+
+		unsigned long num_configs;
+		ddns_service_config** all_configs = (ddns_service_config**)get_map_values(service_configs, &num_configs);
+		unsigned long config_index;
+		for(config_index = 0; config_index < num_configs; config_index++)
+		{
+			ddns_service_config* service_config = all_configs[config_index];
+			int affected = service_config->ipv6 == ipv6 && (service_config->ip_source == INTERFACE ? 0 : internet_changed);
+			for(changed_index = 0; changed[changed_index] != NULL && affected == 0; changed_index++)
+			{
+				affected = service_config->ipv6 == ipv6 && service_config->ip_source == INTERFACE && safe_strcmp(service_config->ip_interface, changed[changed_index]) == 0;
+			}
+			if(affected == 0)
+			{
+				continue;
+			}
+
+			//services in the request queue are due already
+			priority_queue_node *p = remove_priority_queue_node_with_id(update_queue, service_config->name);
+			if(p != NULL)
+			{
+				update_node* next_update = (update_node*)free_priority_queue_node(p);
+				next_update->next_time = current_time;
+				push_priority_queue(update_queue, next_update->next_time - reference_time, next_update->service_name, next_update);
+			}
+			else
+			{
+				update_worker* worker = find_update_worker(service_config->name);
+				if(worker != NULL)
+				{
+					worker->recheck = 1;
+				}
+			}
+		}
+		free(all_configs);
+		free_null_terminated_string_array(changed);
 	}
 }
 
@@ -1859,19 +2562,22 @@ void free_default_ip_lookup_urls(void)
 	}
 }
 
+/*
+ * urls end with an empty string (default lookup urls) or NULL (ip_url from the
+ * config, each allocated to fit), so rotate the pointers rather than copy strings
+ */
 char* get_next_url_and_rotate(char **urls)
 {
-	char next[MAX_LOOKUP_URL_LENGTH];
+	char* next = urls[0];
 	int url_index;
 
-	strcpy(next, urls[0]);
-	for(url_index=0; urls[url_index+1][0] != '\0' ; url_index++)
+	for(url_index=0; urls[url_index+1] != NULL && urls[url_index+1][0] != '\0' ; url_index++)
 	{
-		strcpy(urls[url_index], urls[url_index+1]);
+		urls[url_index] = urls[url_index+1];
 	}
-	strcpy(urls[url_index], next);
+	urls[url_index] = next;
 	
-	return urls[url_index];
+	return next;
 }
 
 char* get_random_user_agent(void)
@@ -1995,6 +2701,7 @@ string_map* load_service_configurations(char* filename, string_map* service_prov
 				//initialize values of service_conf to null values
 				service_conf->service_provider = NULL;
 				service_conf->check_interval = -1;
+				service_conf->watch_check_interval = -1;
 				service_conf->force_interval = -1;
 				service_conf->ip_source = -1;
 				service_conf->ip_url = NULL;
@@ -2032,6 +2739,14 @@ string_map* load_service_configurations(char* filename, string_map* service_prov
 							}
 							free(variable[1]);
 						}
+						else if(safe_strcmp(variable[0], "watch_check_interval") == 0 && variable[1] != NULL)
+						{
+							if(sscanf(variable[1], "%d", &read) > 0)
+							{
+								service_conf->watch_check_interval = read;
+							}
+							free(variable[1]);
+						}
 						else if(safe_strcmp(variable[0], "force_interval") == 0 && variable[1] != NULL)
 						{
 							if(sscanf(variable[1], "%d", &read) > 0)
@@ -2105,6 +2820,22 @@ string_map* load_service_configurations(char* filename, string_map* service_prov
 					free(check_unit);
 				}
 
+				char* watch_check_unit = remove_map_element(service_conf->variable_definitions, "watch_check_unit");
+				if(watch_check_unit != NULL && service_conf->watch_check_interval > 0)
+				{
+					int watch_check_multiple = get_multiple_for_unit(watch_check_unit);
+					service_conf->watch_check_interval = service_conf->watch_check_interval* watch_check_multiple;
+				}
+				free(watch_check_unit);
+				if(service_conf->watch_check_interval <= 0)
+				{
+					service_conf->watch_check_interval = ADDRESS_WATCH_CHECK_INTERVAL;
+				}
+				if(service_conf->watch_check_interval < service_conf->check_interval)
+				{
+					service_conf->watch_check_interval = service_conf->check_interval;
+				}
+
 				
 				//test if service_conf has all necessary components
 				void* service_provider = NULL;
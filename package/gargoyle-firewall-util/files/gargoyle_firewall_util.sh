@@ -378,18 +378,28 @@ insert_restriction_rules()
 				target="ACCEPT"
 			fi
 
-			make_nftables_rules -p "$package_name" -s "$section" -t "$table" -c "$chain" -g "$target" $ingress
-			make_nftables_rules -p "$package_name" -s "$section" -t "$table" -c "$chain" -g "$target" $ingress -r
-
-			uci del "$package_name"."$section".connmark 2>/dev/null
-			uci del "$package_name"."$section".not_connmark	 2>/dev/null
+			echo "-s $section -c $chain -g $target $ingress" >> /tmp/restriction_init.batch
+			batch_sections="$batch_sections $section"
 		fi
 	}
 
+	# all sections are computed by one make_nftables_rules and added in one nft transaction
+	rm -f /tmp/restriction_init.batch
+	batch_sections=""
 	config_load "$package_name"
 	config_foreach parse_rule_config "whitelist_rule"
 	config_foreach parse_rule_config "restriction_rule"
 
+	if [ -e /tmp/restriction_init.batch ] ; then
+		make_nftables_rules -p "$package_name" -t "inet fw4" -b /tmp/restriction_init.batch
+		make_nftables_rules -p "$package_name" -t "inet fw4" -b /tmp/restriction_init.batch -r
+		rm -f /tmp/restriction_init.batch
+	fi
+	for section in $batch_sections ; do
+		uci del "$package_name"."$section".connmark 2>/dev/null
+		uci del "$package_name"."$section".not_connmark	 2>/dev/null
+	done
+
 	rm -rf /tmp/restriction_init.lock
 }
 
@@ -31,7 +31,7 @@
 #define strdup safe_strdup
 
 list* get_all_sections_of_type(struct uci_context *ctx, char* package, char* section_type);
-void  backup_quota(char* quota_id, char* quota_backup_dir);
+void  backup_quota(char* quota_id, char* quota_backup_dir, ip_bw* ip_buf, unsigned long num_ips);
 char* get_uci_option(struct uci_context* ctx,char* package_name, char* section_name, char* option_name);
 char* get_option_value_string(struct uci_option* uopt);
 
@@ -40,8 +40,10 @@ int main(void)
 {
 	struct uci_context *ctx = uci_alloc_context();
 	list* quota_sections = get_all_sections_of_type(ctx, "firewall", "quota");
-	system("mkdir -p /usr/data/quotas");
+	mkdir("/usr/data", 0777);
+	mkdir("/usr/data/quotas", 0777);
 	unlock_bandwidth_semaphore_on_exit();
+	list* backup_ids = initialize_list();
 	while(quota_sections->length > 0)
 	{
 		char* next_quota = shift_list(quota_sections);
@@ -91,11 +93,7 @@ int main(void)
 				char* defined = get_uci_option(ctx, "firewall", next_quota, types[type_index]);
 				if(defined != NULL)
 				{
-					char* type_id = dynamic_strcat(2, backup_id, postfixes[type_index]);
-					
-					backup_quota(type_id, "/usr/data/quotas" );
-
-					free(type_id);
+					push_list(backup_ids, dynamic_strcat(2, backup_id, postfixes[type_index]));
 					free(defined);
 				}
 
@@ -106,10 +104,33 @@ int main(void)
 		free(next_quota);
 	}
 	
+	/* read every quota in one locked session, so the backup is a consistent snapshot */
+	unsigned long num_ids;
+	char** ids = (char**)destroy_list(backup_ids, DESTROY_MODE_RETURN_VALUES, &num_ids);
+	unsigned long* num_ips = (unsigned long*)malloc(sizeof(unsigned long)*(num_ids+1));
+	ip_bw** ip_bufs = (ip_bw**)malloc(sizeof(ip_bw*)*(num_ids+1));
+	get_all_bandwidth_usage_for_rule_ids(ids, num_ids, num_ips, ip_bufs, 5000);
+
+	unsigned long id_index;
+	for(id_index=0; id_index < num_ids; id_index++)
+	{
+		if(ip_bufs[id_index] != NULL)
+		{
+			backup_quota(ids[id_index], "/usr/data/quotas", ip_bufs[id_index], num_ips[id_index]);
+			free(ip_bufs[id_index]);
+		}
+	}
+	free_null_terminated_string_array(ids);
+	free(ip_bufs);
+	free(num_ips);
+
 	unsigned long num;
 	destroy_list(quota_sections, DESTROY_MODE_FREE_VALUES, &num);
 	uci_free_context(ctx);
 
+	/* save_usage_to_file only rewrites what changed and doesn't sync the file headers, do it once for all quotas */
+	sync();
+
 	return 0;
 }
 
@@ -134,7 +155,7 @@ list* get_all_sections_of_type(struct uci_context *ctx, char* package, char* sec
 	return sections_of_type;
 }
 
-void backup_quota(char* id, char* quota_backup_dir)
+void backup_quota(char* id, char* quota_backup_dir, ip_bw* ip_buf, unsigned long num_ips)
 {
 	/* if we ever bother to allow quotas to apply to subnets 
 	 * specified with '/', this may be necessary 
@@ -150,15 +171,7 @@ void backup_quota(char* id, char* quota_backup_dir)
 	}
 
 	char* quota_file_path = dynamic_strcat(3, quota_backup_dir, "/quota_", quota_file_name);
-	
-	unsigned long num_ips;
-	ip_bw *ip_buf = NULL;
-	int query_succeeded = get_all_bandwidth_usage_for_rule_id(id, &num_ips, &ip_buf, 5000);
-	if(query_succeeded)
-	{
-		save_usage_to_file(ip_buf, num_ips, quota_file_path);
-		free(ip_buf);
-	}
+	save_usage_to_file(ip_buf, num_ips, quota_file_path);
 	free(quota_file_path);
 	free(quota_file_name);	
 }
@@ -39,6 +39,11 @@
 #define MATCH_IP6_INDEX 1
 #define MATCH_MAC_INDEX 2
 
+#define USAGE_STR "USAGE: %s -p [PACKAGE] -s [SECTION] -t [TABLE] -c [CHAIN] -g [TARGET] [OPTIONS]\n       -o [TARGET_OPTIONS]\n       -i indicates that this rule applies to ingress packets\n       -r implies computed commands should be executed instead of just printed\n       -b [FILE] batch mode, read one set of -s/-c/-g/-o/-i options per line from FILE (- for stdin)\n          and emit the rules for all of them as a single nft -f transaction\n       -u print usage and exit\n\n"
+
+/* uci is loaded once and shared by every section looked up */
+struct uci_context* uci_ctx = NULL;
+
 string_map* get_rule_definition(char* config, char* section);
 char* get_option_value_string(struct uci_option* uopt);
 int parse_option(char* option_name, char* option_value, string_map* definition);
@@ -52,6 +57,10 @@ int truncate_if_starts_with(char* test_str, char* prefix);
 
 char* invert_bitmask(const char* input, int force_32bit);
 
+void parse_batch_line(char* line, char** section, char** chain, char** target, char** target_options, int* is_ingress);
+char* shell_rule_to_nft(char* rule);
+int apply_nft_batch(list* batch, int run_commands);
+
 char** compute_rules(string_map *rule_def, char* table, char* chain, int is_ingress, char* target, char* target_options);
 int compute_multi_rules(char** def, list* multi_rules, char** single_check, int never_single, char* rule_prefix, char* test_prefix1, char* test_prefix2, int is_negation1, int is_negation2, int mask_byte_index, char* proto, int requires_proto, int quoted_args);
 
@@ -64,10 +73,11 @@ int main(int argc, char **argv)
 	char* chain		= NULL;
 	char* target		= NULL;
 	char* target_options	= NULL;
+	char* batch_file	= NULL;
 	int is_ingress		= 0;
 	int run_commands	= 0;
 	int usage_printed	= 0;
-	while((c = getopt(argc, argv, "P:p:S:s:T:t:C:c:G:g:O:o:IiRrUu")) != -1) //section, page, css includes, javascript includes, title, output interface variables
+	while((c = getopt(argc, argv, "P:p:S:s:T:t:C:c:G:g:O:o:B:b:IiRrUu")) != -1) //section, page, css includes, javascript includes, title, output interface variables
 	{
 		switch(c)
 		{
@@ -95,6 +105,10 @@ int main(int argc, char **argv)
 			case 'o':
 				target_options = strdup(optarg);
 				break;
+			case 'B':
+			case 'b':
+				batch_file = strdup(optarg);
+				break;
 			case 'I':
 			case 'i':
 				is_ingress = 1;
@@ -106,13 +120,79 @@ int main(int argc, char **argv)
 			case 'U':
 			case 'u':
 			default:
-				fprintf(stderr, "USAGE: %s -p [PACKAGE] -s [SECTION] -t [TABLE] -c [CHAIN] -g [TARGET] [OPTIONS]\n       -o [TARGET_OPTIONS]\n       -i indicates that this rule applies to ingress packets\n       -r implies computed commands should be executed instead of just printed\n       -u print usage and exit\n\n", argv[0]);
+				fprintf(stderr, USAGE_STR, argv[0]);
 				usage_printed = 1;
 				break;
 
 		}
 	}
-	if(package != NULL && section != NULL && table != NULL && chain != NULL && target != NULL)
+	if(batch_file != NULL && package != NULL && table != NULL)
+	{
+		/*
+		 * batch mode: every line of the batch file names one section with the same
+		 * -s/-c/-g/-o/-i options as the command line, -p and -t apply to all of them.
+		 * All rules go out as a single nft -f transaction instead of one nft per rule.
+		 */
+		FILE* in = strcmp(batch_file, "-") == 0 ? stdin : fopen(batch_file, "r");
+		if(in == NULL)
+		{
+			fprintf(stderr, "ERROR: Could not open batch file %s\n", batch_file);
+			return 1;
+		}
+		unsigned long read_length;
+		char* batch_data = (char*)read_entire_file(in, 2048, &read_length);
+		if(in != stdin)
+		{
+			fclose(in);
+		}
+
+		list* batch = initialize_list();
+		unsigned long num_lines;
+		unsigned long line_index;
+		char linebreaks[] = { '\n', '\r' };
+		char** batch_lines = split_on_separators(batch_data, linebreaks, 2, -1, 0, &num_lines);
+		free(batch_data);
+		for(line_index=0; line_index < num_lines; line_index++)
+		{
+			char* line_section = NULL;
+			char* line_chain = chain;
+			char* line_target = target;
+			char* line_target_options = target_options;
+			int line_is_ingress = is_ingress;
+			parse_batch_line(batch_lines[line_index], &line_section, &line_chain, &line_target, &line_target_options, &line_is_ingress);
+			if(line_section == NULL)
+			{
+				continue;
+			}
+
+			string_map* def = line_chain != NULL && line_target != NULL ? get_rule_definition(package, line_section) : NULL;
+			if(def != NULL)
+			{
+				char** rules = compute_rules(def, table, line_chain, 0, line_target, line_target_options);
+				int rindex = 0;
+				for(rindex=0; rules[rindex] != NULL; rindex++)
+				{
+					char* nft_rule = shell_rule_to_nft(rules[rindex]);
+					if(nft_rule != NULL)
+					{
+						push_list(batch, nft_rule);
+					}
+					else
+					{
+						fprintf(stderr, "ERROR: Rule for batch section %s has a value nft can not quote, skipping:%s\n", line_section, rules[rindex]);
+					}
+				}
+			}
+			else
+			{
+				fprintf(stderr, "ERROR: Invalid package / section / chain / target for batch section %s\n", line_section);
+			}
+		}
+		free_null_terminated_string_array(batch_lines);
+
+		apply_nft_batch(batch, run_commands);
+	}
+	else if(package != NULL && section != NULL && table != NULL && chain != NULL && target != NULL)
 	{
 		string_map* def = get_rule_definition(package, section);
 		if(def !=  NULL)
@@ -139,12 +219,172 @@ int main(int argc, char **argv)
 	}
 	else if(!usage_printed)
 	{
-		fprintf(stderr, "USAGE: %s -p [PACKAGE] -s [SECTION] -t [TABLE] -c [CHAIN] -g [TARGET] [OPTIONS]\n       -o [TARGET_OPTIONS]\n       -i indicates that this rule applies to ingress packets\n       -r implies computed commands should be executed instead of just printed\n       -u print usage and exit\n\n", argv[0]);
+		fprintf(stderr, USAGE_STR, argv[0]);
+	}
+	if(uci_ctx != NULL)
+	{
+		uci_free_context(uci_ctx);
 	}
 
 	return 0;
 }
 
+/*
+ * Pick the per-section options out of one batch file line.  Options not on
+ * the line keep the values they were called with (those from the command line).
+ */
+void parse_batch_line(char* line, char** section, char** chain, char** target, char** target_options, int* is_ingress)
+{
+	unsigned long num_pieces;
+	unsigned long piece_index;
+	char whitespace[] = { '\t', ' ' };
+	char** pieces = split_on_separators(line, whitespace, 2, -1, 0, &num_pieces);
+	for(piece_index=0; piece_index < num_pieces; piece_index++)
+	{
+		char* piece = pieces[piece_index];
+		char* arg = piece_index+1 < num_pieces ? pieces[piece_index+1] : NULL;
+		if(piece[0] != '-' || piece[1] == '\0' || piece[2] != '\0')
+		{
+			continue;
+		}
+		switch(piece[1])
+		{
+			case 'S':
+			case 's':
+				if(arg != NULL) { *section = strdup(arg); piece_index++; }
+				break;
+			case 'C':
+			case 'c':
+				if(arg != NULL) { *chain = strdup(arg); piece_index++; }
+				break;
+			case 'G':
+			case 'g':
+				if(arg != NULL) { *target = strdup(arg); piece_index++; }
+				break;
+			case 'O':
+			case 'o':
+				if(arg != NULL) { *target_options = strdup(arg); piece_index++; }
+				break;
+			case 'I':
+			case 'i':
+				*is_ingress = 1;
+				break;
+		}
+	}
+	free_null_terminated_string_array(pieces);
+}
+
+/*
+ * Rules are computed for sh -c, so quotes and operators in them are backslash
+ * escaped.  nft -f reads them without a shell in between, so strip the escapes
+ * the same way sh would.  In an nft file a '#' outside a string starts a
+ * comment, so a word holding one is quoted: nft then rejects a bad value
+ * instead of silently dropping the rest of the rule.  nft strings can't hold
+ * a '"', a rule with one in a quoted value gives NULL.
+ */
+char* shell_rule_to_nft(char* rule)
+{
+	char* converted = (char*)malloc(2*strlen(rule) + 3);
+	char* in = rule;
+	char* out = converted;
+	char* word_start = converted;
+	int in_string = 0;
+	int quoting_word = 0;
+	while(*in != '\0')
+	{
+		char c = *in;
+		if(c == '\\' && *(in+1) != '\0')
+		{
+			in++;
+			c = *in;
+			if(c == '"')
+			{
+				in_string = !in_string;
+			}
+		}
+		else if(c == '"' && in_string)
+		{
+			free(converted);
+			return NULL;
+		}
+		else if(!in_string && (c == ' ' || c == '\t'))
+		{
+			if(quoting_word)
+			{
+				*out++ = '"';
+				quoting_word = 0;
+			}
+			word_start = out + 1;
+		}
+		else if(!in_string && c == '#' && !quoting_word)
+		{
+			memmove(word_start + 1, word_start, out - word_start);
+			*word_start = '"';
+			out++;
+			quoting_word = 1;
+		}
+		*out++ = c;
+		in++;
+	}
+	if(quoting_word)
+	{
+		*out++ = '"';
+	}
+	*out = '\0';
+	return converted;
+}
+
+/*
+ * Feed all rules to nft -f, which applies them as one atomic transaction, or
+ * print them in nft -f syntax if they aren't to be run.  Should the transaction
+ * be rejected fall back to adding each rule on its own, as non-batch mode does.
+ */
+int apply_nft_batch(list* batch, int run_commands)
+{
+	int ret = 0;
+	unsigned long num_rules;
+	unsigned long rule_index;
+	char** rules = (char**)destroy_list(batch, DESTROY_MODE_RETURN_VALUES, &num_rules);
+	if(run_commands == 0)
+	{
+		for(rule_index=0; rule_index < num_rules; rule_index++)
+		{
+			printf("%s\n", rules[rule_index]);
+		}
+	}
+	else if(num_rules > 0)
+	{
+		FILE* nft = popen("nft -f -", "w");
+		if(nft != NULL)
+		{
+			for(rule_index=0; rule_index < num_rules; rule_index++)
+			{
+				fprintf(nft, "%s\n", rules[rule_index]);
+			}
+			ret = pclose(nft);
+		}
+		else
+		{
+			ret = -1;
+		}
+
+		if(ret != 0)
+		{
+			for(rule_index=0; rule_index < num_rules; rule_index++)
+			{
+				nft = popen("nft -f -", "w");
+				if(nft != NULL)
+				{
+					fprintf(nft, "%s\n", rules[rule_index]);
+					pclose(nft);
+				}
+			}
+		}
+	}
+	free_null_terminated_string_array(rules);
+	return ret;
+}
+
 /* 
  * Note we've currently maxed out out one whole byte of address space
  * in the connmark at this point.  If we want to match in
@@ -622,14 +862,17 @@ int compute_multi_rules(char** def, list* multi_rules, char** single_check, int
 string_map* get_rule_definition(char* package, char* section)
 {
 	string_map* definition = NULL;
-	struct uci_context *ctx;
 	struct uci_package *p = NULL;
-	ctx = uci_alloc_context();
-	if(uci_load(ctx, package, &p) == UCI_OK)
+	if(uci_ctx == NULL)
+	{
+		uci_ctx = uci_alloc_context();
+	}
+	p = uci_lookup_package(uci_ctx, package);
+	if(p != NULL || uci_load(uci_ctx, package, &p) == UCI_OK)
 	{
 		struct uci_ptr ptr;
 		char* lookup_str = dynamic_strcat(3, package, ".", section);
-		int ret_value = uci_lookup_ptr(ctx, &ptr, lookup_str, 1);
+		int ret_value = uci_lookup_ptr(uci_ctx, &ptr, lookup_str, 1);
 		if(ret_value == UCI_OK)
 		{
 			struct uci_section *s = ptr.s;
@@ -650,7 +893,6 @@ string_map* get_rule_definition(char* package, char* section)
 			}
 		}
 	}
-	uci_free_context(ctx);
 	
 	return definition;
 }
@@ -908,10 +1150,17 @@ char*** parse_ips_and_macs(char* addr_str)
 	return return_value;
 }
 
+/*
+ * Like addresses, multiple ports/port ranges are folded into one anonymous
+ * set, e.g. {80,443,1000-2000}, so they're a single test (a hash/interval
+ * lookup in the kernel) rather than one rule and connmark bit per port
+ */
 char** parse_ports(char* port_str)
 {
 	unsigned long num_pieces;
 	char** ports = split_on_separators(port_str, ",", 1, -1, 0, &num_pieces);
+	list* port_list = initialize_list();
+	string_map* seen_ports = initialize_string_map(0);
 	int port_index = 0;
 	for(port_index=0; ports[port_index] != NULL; port_index++)
 	{
@@ -921,6 +1170,31 @@ char** parse_ports(char* port_str)
 			dash_ptr[0] = '-';
 		}
 		trim_flanking_whitespace( ports[port_index] );
+
+		/* duplicate elements would make nft reject the set */
+		if(ports[port_index][0] != '\0' && get_string_map_element(seen_ports, ports[port_index]) == NULL)
+		{
+			set_string_map_element(seen_ports, ports[port_index], ports[port_index]);
+			push_list(port_list, ports[port_index]);
+		}
+		else
+		{
+			free(ports[port_index]);
+		}
+	}
+	free(ports);
+	unsigned long num_destroyed;
+	destroy_string_map(seen_ports, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
+
+	unsigned long num_ports;
+	ports = (char**)destroy_list(port_list, DESTROY_MODE_RETURN_VALUES, &num_ports);
+	if(num_ports > 1)
+	{
+		char* match_port_str = join_strs(",", ports, -1, 1, 1);
+		ports = (char**)malloc(2*sizeof(char*));
+		ports[0] = dynamic_strcat(3, "{", match_port_str, "}");
+		ports[1] = NULL;
+		free(match_port_str);
 	}
 	return ports;
 }
@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include <erics_tools.h>
 #include <uci.h>
@@ -30,66 +31,436 @@
 #define malloc safe_malloc
 #define strdup safe_strdup
 
+/* compiled quota definitions are cached here, keyed on the firewall config's stat */
+#define QUOTA_CACHE_FILE	"/tmp/print_quotas.cache"
+#define FIREWALL_CONFIG_FILE	"/etc/config/firewall"
+#define FIREWALL_DELTA_FILE	"/tmp/.uci/firewall"
+
+/* everything print_quotas needs from one quota section */
+typedef struct
+{
+	char* id;
+	char* ip;
+	char* time_js;
+	char* limits[3];
+} quota_definition;
+
+/* a distinct quota id, and the range of its rows in the sorted usage array */
+typedef struct
+{
+	unsigned long hash;
+	char* name;
+	unsigned long first_entry;
+	unsigned long end_entry;
+} quota_id;
+
+/*
+ * while collecting, one ip's usage under one limit of a quota (type_index,
+ * bw, limit, limit_64).  After merging, one row of output per id and ip
+ * (used, used_bw, percents, limits)
+ */
+typedef struct
+{
+	unsigned long id_hash;
+	unsigned long ip_hash;
+	unsigned long sequence;
+	char ip[INET6_ADDRSTRLEN];
+
+	int type_index;
+	uint64_t bw;
+	double limit;
+	int64_t limit_64;
+
+	unsigned char used[3];
+	uint64_t used_bw[3];
+	double percents[3];
+	int64_t limits[3];
+} quota_usage;
+
 list* get_all_sections_of_type(struct uci_context *ctx, char* package, char* section_type);
 void  backup_quota(char* quota_id, char* quota_backup_dir);
 char* get_uci_option(struct uci_context* ctx,char* package_name, char* section_name, char* option_name);
 char* get_option_value_string(struct uci_option* uopt);
-
-
-int main(void)
+char* get_quota_id(struct uci_context* ctx, char* section, char** ip_ret);
+quota_definition* load_quota_definitions(struct uci_context* ctx, unsigned long* num_quotas);
+char* get_quota_cache_key(void);
+quota_definition* read_quota_cache(char* cache_key, unsigned long* num_quotas);
+void write_quota_cache(char* cache_key, quota_definition* quotas, unsigned long num_quotas);
+unsigned long quota_key_hash(const char* key);
+int compare_quota_ids(const void* a, const void* b);
+unsigned long merge_quota_ids(quota_id* ids, unsigned long num_ids);
+int compare_quota_usage(const void* a, const void* b);
+unsigned long merge_quota_usage(quota_usage* entries, unsigned long num_entries);
+
+
+int main(int argc, char** argv)
 {
-	struct uci_context *ctx = uci_alloc_context();
-	list* quota_sections = get_all_sections_of_type(ctx, "firewall", "quota");
-	unlock_bandwidth_semaphore_on_exit();
+	int use_cache = 1;
+	int c;
+	while((c = getopt(argc, argv, "nN")) != -1)
+	{
+		switch(c)
+		{
+			case 'n':
+			case 'N':
+				use_cache = 0;
+				break;
+			default:
+				fprintf(stderr, "USAGE: %s [-n]\n\t-n don't use or update the compiled quota cache\n", argv[0]);
+				return 1;
+		}
+	}
 
-	/* for each ip have uint64_t[6], */
-	string_map *id_ip_to_bandwidth = initialize_string_map(1);
-	string_map *id_ip_to_percents  = initialize_string_map(1);	
-	string_map *id_ip_to_limits    = initialize_string_map(1);
-	list *id_to_time               = initialize_list();
+	/* output goes out in large blocks rather than line by line */
+	setvbuf(stdout, NULL, _IOFBF, 65536);
+
+	/* 
+	 * parsing the quota sections through uci is most of the work, so the
+	 * result is cached and only redone when the firewall config changes
+	 */
+	struct uci_context *ctx = NULL;
+	unsigned long num_quotas = 0;
+	char* cache_key = use_cache ? get_quota_cache_key() : NULL;
+	quota_definition* quotas = cache_key != NULL ? read_quota_cache(cache_key, &num_quotas) : NULL;
+	if(quotas == NULL)
+	{
+		ctx = uci_alloc_context();
+		quotas = load_quota_definitions(ctx, &num_quotas);
+		if(cache_key != NULL)
+		{
+			write_quota_cache(cache_key, quotas, num_quotas);
+		}
+	}
+	unlock_bandwidth_semaphore_on_exit();
 
-	while(quota_sections->length > 0)
+	char* postfixes[] = { "_combined", "_ingress", "_egress" };
+
+	/*
+	 * collect every rule id we need and read them all from the kernel in
+	 * one locked session, instead of taking the lock once per limit.
+	 * Limits are parsed here, once per quota rather than once per ip
+	 */
+	char** query_ids = (char**)malloc(sizeof(char*)*(3*num_quotas+1));
+	long* query_indices = (long*)malloc(sizeof(long)*(3*num_quotas+1));
+	double* limit_values = (double*)malloc(sizeof(double)*(3*num_quotas+1));
+	int64_t* limit_values_64 = (int64_t*)malloc(sizeof(int64_t)*(3*num_quotas+1));
+	unsigned long num_query_ids = 0;
+	unsigned long quota_index;
+	for(quota_index=0; quota_index < num_quotas; quota_index++)
 	{
-		char* next_quota = shift_list(quota_sections);
-		
+		int type_index;
+		for(type_index=0; type_index < 3; type_index++)
+		{
+			unsigned long limit_index = 3*quota_index + type_index;
+			char* limit = quotas[quota_index].limits[type_index];
+			query_indices[limit_index] = -1;
+			if(limit != NULL)
+			{
+				query_indices[limit_index] = num_query_ids;
+				query_ids[num_query_ids] = dynamic_strcat(2, quotas[quota_index].id, postfixes[type_index]);
+				num_query_ids++;
+
+				long long limit_64 = 0;
+				limit_values[limit_index] = 0;
+				sscanf(limit, "%lf", limit_values + limit_index);
+				sscanf(limit, "%lld", &limit_64);
+				limit_values_64[limit_index] = limit_64;
+			}
+		}
+	}
+	unsigned long* usage_num_ips = (unsigned long*)malloc(sizeof(unsigned long)*(num_query_ids+1));
+	ip_bw** usage_data = (ip_bw**)malloc(sizeof(ip_bw*)*(num_query_ids+1));
+	get_all_bandwidth_usage_for_rule_ids(query_ids, num_query_ids, usage_num_ips, usage_data, 5000);
+
+
+	/*
+	 * one entry per (quota, limit, ip) the kernel reported, flattened into a
+	 * single array that is sorted by id then ip and merged, in place of
+	 * per-id maps of per-ip maps
+	 */
+	unsigned long num_entries = 0;
+	unsigned long query_index;
+	for(query_index=0; query_index < num_query_ids; query_index++)
+	{
+		num_entries = num_entries + (usage_data[query_index] != NULL ? usage_num_ips[query_index] : 0);
+	}
+	quota_usage* entries = (quota_usage*)malloc(sizeof(quota_usage)*(num_entries+1));
+	quota_id* ids = (quota_id*)malloc(sizeof(quota_id)*(num_quotas+1));
+	num_entries = 0;
+	for(quota_index=0; quota_index < num_quotas; quota_index++)
+	{
+		char* id = quotas[quota_index].id;
+		unsigned long id_hash = quota_key_hash(id);
+		ids[quota_index].hash = id_hash;
+		ids[quota_index].name = id;
 
-		/* base id for quota is the ip associated with it*/
-		char *id = get_uci_option(ctx, "firewall", next_quota, "id");
-		char* ip = get_uci_option(ctx, "firewall", next_quota, "ip");	
-		if(ip == NULL)
+		int type_index;
+		for(type_index=0; type_index < 3; type_index++)
 		{
-			ip = strdup("ALL");
+			unsigned long limit_index = 3*quota_index + type_index;
+			if(query_indices[limit_index] < 0)
+			{
+				continue;
+			}
+			ip_bw* ip_buf = usage_data[query_indices[limit_index]];
+			unsigned long num_ips = ip_buf != NULL ? usage_num_ips[query_indices[limit_index]] : 0;
+			unsigned long ip_index;
+			for(ip_index = 0; ip_index < num_ips; ip_index++)
+			{
+				ip_bw* next = ip_buf + ip_index;
+				quota_usage* entry = entries + num_entries;
+				if(*next->ip == 0)
+				{
+					snprintf(entry->ip, sizeof(entry->ip), "%s", quotas[quota_index].ip);
+				}
+				else if(next->family == AF_INET)
+				{
+					struct in_addr addr;
+					addr.s_addr = *next->ip;
+					inet_ntop(AF_INET, &addr, entry->ip, sizeof(entry->ip));
+				}
+				else
+				{
+					struct in6_addr addr;
+					memcpy(addr.s6_addr32, next->ip, sizeof(addr.s6_addr32));
+					inet_ntop(AF_INET6, &addr, entry->ip, sizeof(entry->ip));
+				}
+				entry->id_hash = id_hash;
+				entry->ip_hash = quota_key_hash(entry->ip);
+				entry->sequence = num_entries;
+				entry->type_index = type_index;
+				entry->bw = next->bw;
+				entry->limit = limit_values[limit_index];
+				entry->limit_64 = limit_values_64[limit_index];
+				num_entries++;
+			}
 		}
-		else if(strcmp(ip, "") == 0)
+	}
+
+	/*
+	 * ids and ips are keyed and ordered by their hash, exactly as the
+	 * string_maps this replaces printed them.  Entries that land on the
+	 * same id and ip merge, later values for a limit replacing earlier ones
+	 */
+	unsigned long num_ids = num_quotas;
+	qsort(ids, num_ids, sizeof(quota_id), compare_quota_ids);
+	num_ids = merge_quota_ids(ids, num_ids);
+	qsort(entries, num_entries, sizeof(quota_usage), compare_quota_usage);
+	num_entries = merge_quota_usage(entries, num_entries);
+
+	/* rows for ids[id_index] are entries[ids[id_index].first_entry] up to the next id's */
+	unsigned long entry_index = 0;
+	unsigned long id_index;
+	for(id_index=0; id_index < num_ids; id_index++)
+	{
+		while(entry_index < num_entries && entries[entry_index].id_hash < ids[id_index].hash)
 		{
-			free(ip);
-			ip = strdup("ALL");
+			entry_index++;
 		}
-		if(id == NULL)
+		ids[id_index].first_entry = entry_index;
+		while(entry_index < num_entries && entries[entry_index].id_hash == ids[id_index].hash)
 		{
-			id = strdup(ip);
+			entry_index++;
 		}
-		else if(strcmp(id, "") == 0)
+		ids[id_index].end_entry = entry_index;
+	}
+
+
+	printf("var quotaIdList = [ ");
+	for(id_index=0; id_index < num_ids; id_index++)
+	{
+		printf("%s\"%s\"", id_index > 0 ? ", " : "", ids[id_index].name);
+	}
+	printf(" ];\n");
+
+	printf("var quotaIpLists = [];\n");
+	for(id_index=0; id_index < num_ids; id_index++)
+	{
+		printf("quotaIpLists[\"%s\"] = [ ", ids[id_index].name);
+		for(entry_index=ids[id_index].first_entry; entry_index < ids[id_index].end_entry; entry_index++)
 		{
-			free(id);
-			id = strdup(ip);
+			printf("%s\"%s\"", entry_index > ids[id_index].first_entry ? ", " : "", entries[entry_index].ip);
 		}
+		printf("];\n");
+	}
 
+	printf("var quotaTimes    = new Array();\n");
+	printf("var quotaUsed     = new Array();\n");
+	printf("var quotaLimits   = new Array();\n");
+	printf("var quotaPercents = new Array();\n");
 
+	for(quota_index=0; quota_index < num_quotas; quota_index++)
+	{
+		printf("%s\n", quotas[quota_index].time_js);
+	}
 
+	for(id_index=0; id_index < num_ids; id_index++)
+	{
+		char* next_id = ids[id_index].name;
+		printf("quotaUsed[ \"%s\" ] = [];\n", next_id);
+		printf("quotaPercents[ \"%s\" ] = [];\n", next_id);
+		printf("quotaLimits[ \"%s\" ] = [];\n", next_id);
 
+		for(entry_index=ids[id_index].first_entry; entry_index < ids[id_index].end_entry; entry_index++)
+		{
+			quota_usage* row = entries + entry_index;
+			int type_index;
+			printf("quotaUsed[ \"%s\" ][ \"%s\" ] = [ ", next_id, row->ip);
+			for(type_index=0; type_index < 3; type_index++)
+			{
+				if(!row->used[type_index])
+				{
+					printf("%s-1", type_index > 0 ? ", " : "");
+				}
+				else
+				{
+					printf("%s%lld", type_index > 0 ? ", " : "", (long long int)row->used_bw[type_index]);
+				}
+			}
+			printf(" ];\n");
 
-		string_map* ip_to_bandwidth = get_string_map_element(id_ip_to_bandwidth, id);
-		ip_to_bandwidth = ip_to_bandwidth == NULL ? initialize_string_map(1) : ip_to_bandwidth;
-		set_string_map_element(id_ip_to_bandwidth, id, ip_to_bandwidth);
+			printf("quotaPercents[ \"%s\" ][ \"%s\" ] = [ ", next_id, row->ip);
+			for(type_index=0; type_index < 3; type_index++)
+			{
+				printf("%s%6.3lf", type_index > 0 ? ", " : "", row->percents[type_index]);
+			}
+			printf(" ];\n");
 
-		string_map* ip_to_percents = get_string_map_element(id_ip_to_percents, id);
-		ip_to_percents = ip_to_percents == NULL ? initialize_string_map(1) : ip_to_percents;
-		set_string_map_element(id_ip_to_percents, id, ip_to_percents);
+			printf("quotaLimits[ \"%s\" ][ \"%s\" ] = [ ", next_id, row->ip);
+			for(type_index=0; type_index < 3; type_index++)
+			{
+				printf("%s%lld", type_index > 0 ? ", " : "", (long long int)row->limits[type_index]);
+			}
+			printf(" ];\n");
+		}
+	}
+
+
+	if(ctx != NULL)
+	{
+		uci_free_context(ctx);
+	}
+
+	return 0;
+}
+
+/* the sdbm hash string_map keys on, so output order matches what it always was */
+unsigned long quota_key_hash(const char* key)
+{
+	unsigned long hashed_key = 0;
+	while(*key != '\0')
+	{
+		unsigned int nextch = (unsigned char)*key;
+		hashed_key = nextch + (hashed_key << 6) + (hashed_key << 16) - hashed_key;
+		key++;
+	}
+	return hashed_key;
+}
+
+int compare_quota_ids(const void* a, const void* b)
+{
+	const quota_id* id_a = (const quota_id*)a;
+	const quota_id* id_b = (const quota_id*)b;
+	return id_a->hash < id_b->hash ? -1 : (id_a->hash > id_b->hash ? 1 : 0);
+}
 
-		string_map* ip_to_limits = get_string_map_element(id_ip_to_limits, id);
-		ip_to_limits = ip_to_limits == NULL ? initialize_string_map(1) : ip_to_limits;
-		set_string_map_element(id_ip_to_limits, id, ip_to_limits);
+/* drops repeated ids from a sorted list, returns the new length */
+unsigned long merge_quota_ids(quota_id* ids, unsigned long num_ids)
+{
+	unsigned long num_merged = 0;
+	unsigned long id_index;
+	for(id_index=0; id_index < num_ids; id_index++)
+	{
+		if(num_merged == 0 || ids[num_merged-1].hash != ids[id_index].hash)
+		{
+			ids[num_merged] = ids[id_index];
+			num_merged++;
+		}
+	}
+	return num_merged;
+}
+
+int compare_quota_usage(const void* a, const void* b)
+{
+	const quota_usage* usage_a = (const quota_usage*)a;
+	const quota_usage* usage_b = (const quota_usage*)b;
+	if(usage_a->id_hash != usage_b->id_hash)
+	{
+		return usage_a->id_hash < usage_b->id_hash ? -1 : 1;
+	}
+	if(usage_a->ip_hash != usage_b->ip_hash)
+	{
+		return usage_a->ip_hash < usage_b->ip_hash ? -1 : 1;
+	}
+	return usage_a->sequence < usage_b->sequence ? -1 : (usage_a->sequence > usage_b->sequence ? 1 : 0);
+}
+
+/*
+ * folds each run of sorted entries with the same id and ip into one row,
+ * computing percents as it goes.  Returns the number of rows
+ */
+unsigned long merge_quota_usage(quota_usage* entries, unsigned long num_entries)
+{
+	unsigned long num_rows = 0;
+	unsigned long entry_index;
+	for(entry_index=0; entry_index < num_entries; entry_index++)
+	{
+		quota_usage* entry = entries + entry_index;
+		quota_usage* row = num_rows > 0 ? entries + num_rows - 1 : NULL;
+		if(row == NULL || row->id_hash != entry->id_hash || row->ip_hash != entry->ip_hash)
+		{
+			row = entries + num_rows;
+			if(row != entry)
+			{
+				*row = *entry;
+			}
+			int reset_index;
+			for(reset_index=0; reset_index < 3; reset_index++)
+			{
+				row->used[reset_index] = 0;
+				row->used_bw[reset_index] = 0;
+				row->percents[reset_index] = -1;
+				row->limits[reset_index] = -1;
+			}
+			num_rows++;
+		}
+
+		/* a row never overwrites a later entry, and starting one leaves its collected fields alone */
+		int type_index = entry->type_index;
+		double bw_percent = (double)(long long)entry->bw;
+		if(entry->limit > 0)
+		{
+			bw_percent = (bw_percent*100.0)/entry->limit;
+			bw_percent = bw_percent > 100.0 ? 100.0 : bw_percent;
+		}
+		else
+		{
+			bw_percent = 100.0;
+		}
+		row->used[type_index] = 1;
+		row->used_bw[type_index] = entry->bw;
+		row->percents[type_index] = bw_percent;
+		row->limits[type_index] = entry->limit_64;
+	}
+	return num_rows;
+}
+
+quota_definition* load_quota_definitions(struct uci_context* ctx, unsigned long* num_quotas)
+{
+	char* types[] = { "combined_limit", "ingress_limit", "egress_limit" };
+	list* quota_sections = get_all_sections_of_type(ctx, "firewall", "quota");
+	quota_definition* quotas = (quota_definition*)malloc(sizeof(quota_definition)*(quota_sections->length+1));
+	*num_quotas = 0;
+	while(quota_sections->length > 0)
+	{
+		char* next_quota = shift_list(quota_sections);
+		quota_definition* quota = quotas + *num_quotas;
+
+		/* base id for quota is the ip associated with it*/
+		char* ip = NULL;
+		char* id = get_quota_id(ctx, next_quota, &ip);
+		quota->id = id;
+		quota->ip = ip;
 
 		char* offpeak_hours         = get_uci_option(ctx, "firewall", next_quota, "offpeak_hours");
 		char* offpeak_weekdays      = get_uci_option(ctx, "firewall", next_quota, "offpeak_weekdays");
@@ -113,7 +484,7 @@ int main(void)
 			hours_var = hours_var == NULL ? strdup("") : hours_var;
 			weekdays_var = weekdays_var == NULL ? strdup("") : weekdays_var;
 			weekly_ranges_var = weekly_ranges_var == NULL ? strdup("") : weekly_ranges_var;
-			push_list(id_to_time, dynamic_strcat(11, "quotaTimes[\"", id, "\"] = [\"", hours_var, "\", \"", weekdays_var, "\", \"", weekly_ranges_var ,"\", \"", active_var, "\"];"));
+			quota->time_js = dynamic_strcat(11, "quotaTimes[\"", id, "\"] = [\"", hours_var, "\", \"", weekdays_var, "\", \"", weekly_ranges_var ,"\", \"", active_var, "\"];");
 			
 			free(hours_var);
 			free(weekdays_var);
@@ -122,240 +493,199 @@ int main(void)
 		}
 		else
 		{
-			push_list(id_to_time, dynamic_strcat(3, "quotaTimes[\"", id, "\"] = [\"\", \"\", \"\", \"always\"];"));
+			quota->time_js = dynamic_strcat(3, "quotaTimes[\"", id, "\"] = [\"\", \"\", \"\", \"always\"];");
 		}
 
-		char* types[] = { "combined_limit", "ingress_limit", "egress_limit" };
-		char* postfixes[] = { "_combined", "_ingress", "_egress" };
-		
-		
 		int type_index;
 		for(type_index=0; type_index < 3; type_index++)
 		{
-			char* limit = get_uci_option(ctx, "firewall", next_quota, types[type_index]);
-			if(limit != NULL)
-			{
-				char* type_id = dynamic_strcat(2, id, postfixes[type_index]);
-				ip_bw* ip_buf;
-				unsigned long num_ips = 0;
-				int query_succeeded = get_all_bandwidth_usage_for_rule_id(type_id, &num_ips, &ip_buf, 5000);
-				if(query_succeeded && num_ips > 0)
-				{
-					unsigned long ip_index = 0;
-					for(ip_index = 0; ip_index < num_ips; ip_index++)
-					{
-						ip_bw next = ip_buf[ip_index];
-						char* next_ip = NULL;
-						if(*next.ip == 0)
-						{
-							next_ip = strdup(ip);
-						}
-						else
-						{
-							if(next.family == AF_INET)
-							{
-								char ipstr[INET_ADDRSTRLEN];
-								struct in_addr addr;
-								addr.s_addr = *next.ip;
-								inet_ntop(next.family, &addr, ipstr, INET_ADDRSTRLEN);
-								next_ip = strdup(ipstr);
-							}
-							else
-							{
-								char ipstr[INET6_ADDRSTRLEN];
-								struct in6_addr addr;
-								addr.s6_addr32[0] = *(next.ip);
-								addr.s6_addr32[1] = *(next.ip+1);
-								addr.s6_addr32[2] = *(next.ip+2);
-								addr.s6_addr32[3] = *(next.ip+3);
-								inet_ntop(next.family, &addr, ipstr, INET6_ADDRSTRLEN);
-								next_ip = strdup(ipstr);
-							}
-						}
-						
-						
-						uint64_t *bw_list = get_string_map_element(ip_to_bandwidth,next_ip);
-						if(bw_list == NULL)
-						{
-							bw_list = (uint64_t*)malloc(sizeof(uint64_t)*6);
-							bw_list[0] = 0;
-							bw_list[1] = 0;
-							bw_list[2] = 0;
-							bw_list[3] = 0;
-							bw_list[4] = 0;
-							bw_list[5] = 0;
-							set_string_map_element(ip_to_bandwidth, next_ip, bw_list);
-						}
-						bw_list[type_index] = 1;
-						bw_list[type_index+3] = next.bw;
-						
-						char bw_str[50];
-						sprintf(bw_str, "%lld", next.bw);
-						double bw_percent;
-						double bw_limit;
-						uint64_t bw_limit_64;
-						sscanf(bw_str, "%lf", &bw_percent);
-						sscanf(limit, "%lf", &bw_limit);
-						sscanf(limit, "%lld", &bw_limit_64);
-						if(bw_limit > 0)
-						{
-							bw_percent = (bw_percent*100.0)/bw_limit;
-							bw_percent = bw_percent > 100.0 ? 100.0 : bw_percent;
-						}
-						else
-						{
-							bw_percent = 100.0;
-						}
-					
-						double* percent_list = get_string_map_element(ip_to_percents, next_ip);
-						if(percent_list == NULL)
-						{
-							percent_list = (double*)malloc(sizeof(double)*3);
-							percent_list[0] = -1;
-							percent_list[1] = -1;
-							percent_list[2] = -1;
-							set_string_map_element(ip_to_percents, next_ip, percent_list);
-						}
-						percent_list[type_index] = bw_percent;
-
-						uint64_t* limit_list = get_string_map_element(ip_to_limits, next_ip);
-						if(limit_list == NULL)
-						{
-							limit_list = (uint64_t*)malloc(sizeof(uint64_t)*3);
-							limit_list[0] = -1;
-							limit_list[1] = -1;
-							limit_list[2] = -1;
-							set_string_map_element(ip_to_limits, next_ip, limit_list);
-						}
-						limit_list[type_index] = bw_limit_64;
-					}
-				}
-				free(type_id);
-				free(limit);
-
-			}
+			quota->limits[type_index] = get_uci_option(ctx, "firewall", next_quota, types[type_index]);
 		}
-		free(id);
-		free(ip);
 		free(next_quota);
+		*num_quotas = *num_quotas + 1;
 	}
-	
-
-	unsigned long num_ids;
-	char** id_list = (char**)get_string_map_keys(id_ip_to_bandwidth, &num_ids);
-	printf("var quotaIdList = [ ");
-	char print_comma[10] = "";
-	unsigned long id_index;
-	for(id_index=0; id_index < num_ids; id_index++)
-	{
-		printf("%s\"%s\"", print_comma, id_list[id_index]);
-		sprintf(print_comma, ", ");
-	}
-	printf(" ];\n");
+	unsigned long num;
+	destroy_list(quota_sections, DESTROY_MODE_FREE_VALUES, &num);
+	return quotas;
+}
 
-	printf("var quotaIpLists = [];\n");
-	for(id_index=0; id_index < num_ids; id_index++)
+/* 
+ * identifies the firewall config as uci would load it: the committed file
+ * and any uncommitted changes.  mtime alone can miss two saves within a
+ * second, so inode, size and nanoseconds are part of the key too
+ */
+char* get_quota_cache_key(void)
+{
+	char* files[] = { FIREWALL_CONFIG_FILE, FIREWALL_DELTA_FILE };
+	char key_parts[2][100];
+	int file_index;
+	for(file_index=0; file_index < 2; file_index++)
 	{
-		string_map* ip_to_bandwidth = get_string_map_element(id_ip_to_bandwidth, id_list[id_index]);
-		if(ip_to_bandwidth != NULL)
+		struct stat st;
+		if(stat(files[file_index], &st) == 0)
 		{
-			unsigned long num_ips = 0;
-			unsigned long ip_index = 0;
-			char** ip_list = (char**)get_string_map_keys(ip_to_bandwidth, &num_ips);
-			printf("quotaIpLists[\"%s\"] = [ ", id_list[id_index]);
-			sprintf(print_comma, "");
-			for(ip_index=0; ip_index < num_ips; ip_index++)
-			{
-				printf("%s\"%s\"", print_comma, ip_list[ip_index]);
-				sprintf(print_comma, ", ");
-			}
-			printf("];\n");
+			sprintf(key_parts[file_index], "%llu:%llu:%lld.%09ld", (unsigned long long)st.st_ino, (unsigned long long)st.st_size, (long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
 		}
-	}	
-
-	printf("var quotaTimes    = new Array();\n");
-	printf("var quotaUsed     = new Array();\n");
-	printf("var quotaLimits   = new Array();\n");
-	printf("var quotaPercents = new Array();\n");
+		else if(file_index == 0)
+		{
+			return NULL;
+		}
+		else
+		{
+			sprintf(key_parts[file_index], "none");
+		}
+	}
+	return dynamic_strcat(3, key_parts[0], " ", key_parts[1]);
+}
 
-	char* next_time = shift_list(id_to_time);
-	while(next_time != NULL)
+/*
+ * cache is the key on the first line, then one line per quota:
+ * id, ip, time js, then each limit prefixed with '=' (empty if unset), tab separated.
+ * An "end" line marks a complete file.
+ */
+quota_definition* read_quota_cache(char* cache_key, unsigned long* num_quotas)
+{
+	quota_definition* quotas = NULL;
+	*num_quotas = 0;
+	FILE* cache_file = fopen(QUOTA_CACHE_FILE, "r");
+	if(cache_file == NULL)
 	{
-		printf("%s\n", next_time);
-		next_time = shift_list(id_to_time);
+		return NULL;
 	}
+	unsigned long length;
+	char* cache_data = (char*)read_entire_file(cache_file, 4096, &length);
+	fclose(cache_file);
 
-	for(id_index=0; id_index < num_ids; id_index++)
+	char* line_ptr = cache_data;
+	char* key_line = strsep(&line_ptr, "\n");
+	if(line_ptr != NULL && strcmp(key_line, cache_key) == 0)
 	{
-		char* next_id = id_list[id_index];
-		string_map* ip_to_bandwidth = get_string_map_element(id_ip_to_bandwidth, next_id);
-		string_map* ip_to_percents = get_string_map_element(id_ip_to_percents, next_id);
-		string_map* ip_to_limits = get_string_map_element(id_ip_to_limits, next_id);
-		
-		printf("quotaUsed[ \"%s\" ] = [];\n", next_id);
-		printf("quotaPercents[ \"%s\" ] = [];\n", next_id);
-		printf("quotaLimits[ \"%s\" ] = [];\n", next_id);
-		
-		
-		if(ip_to_bandwidth != NULL)
+		unsigned long max_quotas = 0;
+		char* scan;
+		for(scan = line_ptr; *scan != '\0'; scan++)
 		{
-			unsigned long num_ips;
-			unsigned long ip_index = 0;
-			char** ip_list = (char**)get_string_map_keys(ip_to_bandwidth, &num_ips);
-			for(ip_index=0; ip_index < num_ips; ip_index++)
+			max_quotas = *scan == '\n' ? max_quotas + 1 : max_quotas;
+		}
+		quotas = (quota_definition*)malloc(sizeof(quota_definition)*(max_quotas+1));
+
+		int valid = 1;
+		int complete = 0;
+		char* line;
+		while(valid && !complete && (line = strsep(&line_ptr, "\n")) != NULL && line_ptr != NULL)
+		{
+			if(strcmp(line, "end") == 0)
 			{
-				char* next_ip = ip_list[ip_index];
-				uint64_t* used   = (uint64_t*)get_string_map_element(ip_to_bandwidth, next_ip);
-				double* percents = (double*)get_string_map_element(ip_to_percents, next_ip);
-				uint64_t* limits = (uint64_t*)get_string_map_element(ip_to_limits, next_ip);
+				complete = 1;
+				continue;
+			}
 
-				if(used != NULL)
+			quota_definition* quota = quotas + *num_quotas;
+			char* fields[6];
+			int field_index;
+			for(field_index=0; field_index < 6 && line != NULL; field_index++)
+			{
+				fields[field_index] = strsep(&line, "\t");
+			}
+			valid = field_index == 6 && line == NULL;
+			if(valid)
+			{
+				quota->id = strdup(fields[0]);
+				quota->ip = strdup(fields[1]);
+				quota->time_js = strdup(fields[2]);
+				for(field_index=3; field_index < 6; field_index++)
 				{
-					int type_index;
-					printf("quotaUsed[ \"%s\" ][ \"%s\" ] = [ ", next_id, next_ip);
-					sprintf(print_comma, "");
-					for(type_index=0; type_index < 3; type_index++)
-					{
-						if(!used[type_index])
-						{
-							printf("%s-1", print_comma);
-						}
-						else
-						{
-							printf("%s%lld", print_comma, (long long int)used[type_index+3]);
-						}
-						sprintf(print_comma, ", ");
-					}
-					printf(" ];\n");
-
-					printf("quotaPercents[ \"%s\" ][ \"%s\" ] = [ ", next_id, next_ip);
-					sprintf(print_comma, "");
-					for(type_index=0; type_index < 3; type_index++)
-					{
-						printf("%s%6.3lf", print_comma, percents[type_index]);
-						sprintf(print_comma, ", ");
-					}
-					printf(" ];\n");
-
-					printf("quotaLimits[ \"%s\" ][ \"%s\" ] = [ ", next_id, next_ip);
-					sprintf(print_comma, "");
-					for(type_index=0; type_index < 3; type_index++)
-					{
-						printf("%s%lld", print_comma,limits[type_index]);
-						sprintf(print_comma, ", ");
-					}
-					printf(" ];\n");
+					quota->limits[field_index-3] = fields[field_index][0] == '=' ? strdup(fields[field_index]+1) : NULL;
 				}
+				*num_quotas = *num_quotas + 1;
 			}
 		}
+		if(!valid || !complete)
+		{
+			/* quota strings are left for exit to clean up */
+			free(quotas);
+			quotas = NULL;
+			*num_quotas = 0;
+		}
 	}
+	free(cache_data);
+	return quotas;
+}
 
+void write_quota_cache(char* cache_key, quota_definition* quotas, unsigned long num_quotas)
+{
+	/* values with tabs or newlines can't be represented, just don't cache those */
+	unsigned long quota_index;
+	for(quota_index=0; quota_index < num_quotas; quota_index++)
+	{
+		char* values[6] = { quotas[quota_index].id, quotas[quota_index].ip, quotas[quota_index].time_js, quotas[quota_index].limits[0], quotas[quota_index].limits[1], quotas[quota_index].limits[2] };
+		int value_index;
+		for(value_index=0; value_index < 6; value_index++)
+		{
+			if(values[value_index] != NULL && strpbrk(values[value_index], "\t\n") != NULL)
+			{
+				unlink(QUOTA_CACHE_FILE);
+				return;
+			}
+		}
+	}
 
-	unsigned long num;
-	destroy_list(quota_sections, DESTROY_MODE_FREE_VALUES, &num);
-	uci_free_context(ctx);
+	/* unique temporary name, so concurrent page loads never write the same file */
+	char* tmp_path = dynamic_strcat(2, QUOTA_CACHE_FILE, ".XXXXXX");
+	int tmp_fd = mkstemp(tmp_path);
+	FILE* cache_file = tmp_fd >= 0 ? fdopen(tmp_fd, "w") : NULL;
+	if(tmp_fd >= 0 && cache_file == NULL)
+	{
+		close(tmp_fd);
+		unlink(tmp_path);
+	}
+	if(cache_file != NULL)
+	{
+		fprintf(cache_file, "%s\n", cache_key);
+		for(quota_index=0; quota_index < num_quotas; quota_index++)
+		{
+			quota_definition* quota = quotas + quota_index;
+			fprintf(cache_file, "%s\t%s\t%s", quota->id, quota->ip, quota->time_js);
+			int type_index;
+			for(type_index=0; type_index < 3; type_index++)
+			{
+				fprintf(cache_file, "\t%s%s", quota->limits[type_index] != NULL ? "=" : "", quota->limits[type_index] != NULL ? quota->limits[type_index] : "");
+			}
+			fprintf(cache_file, "\n");
+		}
+		fprintf(cache_file, "end\n");
+		if(fclose(cache_file) != 0 || rename(tmp_path, QUOTA_CACHE_FILE) != 0)
+		{
+			unlink(tmp_path);
+		}
+	}
+	free(tmp_path);
+}
 
-	return 0;
+/* base id for quota is the ip associated with it, ip defaults to ALL */
+char* get_quota_id(struct uci_context* ctx, char* section, char** ip_ret)
+{
+	char *id = get_uci_option(ctx, "firewall", section, "id");
+	char* ip = get_uci_option(ctx, "firewall", section, "ip");	
+	if(ip == NULL)
+	{
+		ip = strdup("ALL");
+	}
+	else if(strcmp(ip, "") == 0)
+	{
+		free(ip);
+		ip = strdup("ALL");
+	}
+	if(id == NULL)
+	{
+		id = strdup(ip);
+	}
+	else if(strcmp(id, "") == 0)
+	{
+		free(id);
+		id = strdup(ip);
+	}
+	*ip_ret = ip;
+	return id;
 }
 
 list* get_all_sections_of_type(struct uci_context *ctx, char* package, char* section_type)
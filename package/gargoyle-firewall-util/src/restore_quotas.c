@@ -40,14 +40,33 @@
 #define EGRESS_INDEX   1
 #define COMBINED_INDEX 2
 
+typedef struct
+{
+	char* id;
+	unsigned char is_individual_other;
+	unsigned long num_ip_groups;
+} pending_restore;
+
+/* inclusive address range, host byte order words, most significant first (ipv4 uses word 0 only) */
+typedef struct
+{
+	uint32_t start[4];
+	uint32_t end[4];
+} ip_interval;
+
 void restore_backup_for_id(char* id, char* quota_backup_dir, unsigned char is_individual_other, list* defined_ip_groups);
 uint32_t* ip_to_host_int(char* ip_str, int* family);
 uint32_t* ip_range_to_host_ints(char* ip_str, int* family);
-list* filter_group_from_list(list** orig_ip_list, char* ip_group_str);
+ip_interval* compile_ip_groups(char** group_strs, unsigned long num_groups, int family, unsigned long* num_intervals);
+int compare_ip_words(const uint32_t* a, const uint32_t* b);
+int compare_ip_intervals(const void* a, const void* b);
+int ip_in_intervals(uint32_t* ip_words, ip_interval* intervals, unsigned long num_intervals);
 int get_ipstr_family(char* ip_str);
 char* invert_bitmask(const char* input, int force_32bit);
 
-void delete_chain_from_table(char* family, char* table, char* delete_chain);
+void delete_chains_from_table(char* family, char* table, char** delete_chains, int num_chains);
+void add_nft_command(char* command, int free_command_str);
+int apply_nft_batch(void);
 void run_shell_command(char* command, int free_command_str);
 void free_split_pieces(char** split_pieces);
 
@@ -57,6 +76,9 @@ char* get_option_value_string(struct uci_option* uopt);
 
 int dry_run;
 
+/* nft commands accumulated for a single nft -f transaction */
+list* nft_batch;
+
 int main(int argc, char** argv)
 {
 	char* wan_if = NULL;
@@ -119,36 +141,40 @@ int main(int argc, char** argv)
 	char crontab_dir[] = "/etc/crontabs/";
 	char crontab_file_path[] = "/etc/crontabs/root";
 	char* quota_family_table = dynamic_strcat(3,quota_family," ",quota_table);
-	delete_chain_from_table(quota_family, quota_table, "mangle_egress_quotas");
-	delete_chain_from_table(quota_family, quota_table, "mangle_ingress_quotas");
-	delete_chain_from_table(quota_family, quota_table, "mangle_combined_quotas");
-	delete_chain_from_table(quota_family, quota_table, "mangle_forward_quotas");
-	delete_chain_from_table(quota_family, quota_table, "nat_quota_redirects");
-	delete_chain_from_table(quota_family, quota_table, "mangle_quotaqos_prerouting");
+	char* quota_chains[] = { "mangle_egress_quotas", "mangle_ingress_quotas", "mangle_combined_quotas", "mangle_forward_quotas", "nat_quota_redirects", "mangle_quotaqos_prerouting" };
+
+	/* old rules are whacked and new ones added in the same transaction, so quotas never go unenforced */
+	nft_batch = initialize_list();
+	delete_chains_from_table(quota_family, quota_table, quota_chains, 6);
 
 	if(wan_if == NULL)
 	{
 		fprintf(stderr, "ERRROR: No wan interface specified\n");
+		apply_nft_batch();
 		return 0;
 	}
 	if(local_subnet == NULL)
 	{
 		fprintf(stderr, "ERRROR: No local subnet specified\n");
+		apply_nft_batch();
 		return 0;
 	}
 	if(local_subnet6 == NULL)
 	{
 		fprintf(stderr, "ERRROR: No local subnet6 specified\n");
+		apply_nft_batch();
 		return 0;
 	}
 	if(death_mark == NULL)
 	{
 		fprintf(stderr, "ERRROR: No death mark specified\n");
+		apply_nft_batch();
 		return 0;
 	}
 	if(death_mask == NULL)
 	{
 		fprintf(stderr, "ERRROR: No death mask specified\n");
+		apply_nft_batch();
 		return 0;
 	}
 
@@ -233,46 +259,47 @@ int main(int argc, char** argv)
 		}
 
 		/* initialize chains */
-		run_shell_command(dynamic_strcat(5, "nft add chain ", quota_family_table, " ", quota_chain_prefix, "forward_quotas 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(5, "nft add chain ", quota_family_table, " ", quota_chain_prefix, "egress_quotas 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(5, "nft add chain ", quota_family_table, " ", quota_chain_prefix, "ingress_quotas 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(5, "nft add chain ", quota_family_table, " ", quota_chain_prefix, "combined_quotas 2>/dev/null"), 1);
-
-		run_shell_command(dynamic_strcat(3, "nft add chain ", quota_family_table, " nat_quota_redirects 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(3, "nft add rule ", quota_family_table, " nat_quota_redirects ct mark set ct mark \\& 0x00FFFFFF \\| 0x0 2>/dev/null"), 1); // Yes the | 0x0 is not needed, but keeping the pattern consistent
-		run_shell_command(dynamic_strcat(3, "nft insert rule ", quota_family_table, " dstnat_lan jump nat_quota_redirects 2>/dev/null"), 1);
-
-		char* no_death_mark_test = dynamic_strcat(3, " ct mark \\& ", death_mask, " == 0x0 ");
-		run_shell_command(dynamic_strcat(10, "nft insert rule ", quota_family_table, " ", quota_chain_prefix, "input iifname ", wan_if, no_death_mark_test, " jump ", quota_chain_prefix, "combined_quotas  2>/dev/null"), 1); // position 2
-		run_shell_command(dynamic_strcat(10, "nft insert rule ", quota_family_table, " ", quota_chain_prefix, "input iifname ", wan_if, no_death_mark_test, " jump ", quota_chain_prefix, "ingress_quotas  2>/dev/null"), 1); // position 1
-		run_shell_command(dynamic_strcat(10, "nft insert rule ", quota_family_table, " ", quota_chain_prefix, "output oifname ", wan_if, no_death_mark_test, " jump ", quota_chain_prefix, "combined_quotas  2>/dev/null"), 1); // position 2
-		run_shell_command(dynamic_strcat(10, "nft insert rule ", quota_family_table, " ", quota_chain_prefix, "output oifname ", wan_if, no_death_mark_test, " jump ", quota_chain_prefix, "egress_quotas  2>/dev/null"), 1); // position 1
-
-		run_shell_command(dynamic_strcat(7, "nft insert rule ", quota_family_table, " ", quota_chain_prefix, "forward jump ", quota_chain_prefix, "forward_quotas 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(10, "nft add rule ", quota_family_table, " ", quota_chain_prefix, "forward_quotas oifname ", wan_if, no_death_mark_test, " jump ", quota_chain_prefix, "egress_quotas 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(10, "nft add rule ", quota_family_table, " ", quota_chain_prefix, "forward_quotas iifname ", wan_if, no_death_mark_test, " jump ", quota_chain_prefix, "ingress_quotas 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(8, "nft add rule ", quota_family_table, " ", quota_chain_prefix, "forward_quotas iifname ", wan_if, no_death_mark_test, " ct mark set ct mark \\& 0xF0FFFFFF \\| 0x0F000000 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(8, "nft add rule ", quota_family_table, " ", quota_chain_prefix, "forward_quotas oifname ", wan_if, no_death_mark_test, " ct mark set ct mark \\& 0xF0FFFFFF \\| 0x0F000000 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(7, "nft add rule ", quota_family_table, " ", quota_chain_prefix, "forward_quotas ct mark \\& 0x0F000000 == 0x0F000000 jump ", quota_chain_prefix, "combined_quotas 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(5, "nft add rule ", quota_family_table, " ", quota_chain_prefix, "forward_quotas ct mark set ct mark \\& 0xF0FFFFFF \\| 0x0 2>/dev/null"), 1);
+		add_nft_command(dynamic_strcat(5, "add chain ", quota_family_table, " ", quota_chain_prefix, "forward_quotas"), 1);
+		add_nft_command(dynamic_strcat(5, "add chain ", quota_family_table, " ", quota_chain_prefix, "egress_quotas"), 1);
+		add_nft_command(dynamic_strcat(5, "add chain ", quota_family_table, " ", quota_chain_prefix, "ingress_quotas"), 1);
+		add_nft_command(dynamic_strcat(5, "add chain ", quota_family_table, " ", quota_chain_prefix, "combined_quotas"), 1);
+
+		add_nft_command(dynamic_strcat(3, "add chain ", quota_family_table, " nat_quota_redirects"), 1);
+		add_nft_command(dynamic_strcat(3, "add rule ", quota_family_table, " nat_quota_redirects ct mark set ct mark & 0x00FFFFFF | 0x0"), 1); // Yes the | 0x0 is not needed, but keeping the pattern consistent
+		add_nft_command(dynamic_strcat(3, "insert rule ", quota_family_table, " dstnat_lan jump nat_quota_redirects"), 1);
+
+		char* no_death_mark_test = dynamic_strcat(3, " ct mark & ", death_mask, " == 0x0 ");
+		add_nft_command(dynamic_strcat(10, "insert rule ", quota_family_table, " ", quota_chain_prefix, "input iifname ", wan_if, no_death_mark_test, " jump ", quota_chain_prefix, "combined_quotas "), 1); // position 2
+		add_nft_command(dynamic_strcat(10, "insert rule ", quota_family_table, " ", quota_chain_prefix, "input iifname ", wan_if, no_death_mark_test, " jump ", quota_chain_prefix, "ingress_quotas "), 1); // position 1
+		add_nft_command(dynamic_strcat(10, "insert rule ", quota_family_table, " ", quota_chain_prefix, "output oifname ", wan_if, no_death_mark_test, " jump ", quota_chain_prefix, "combined_quotas "), 1); // position 2
+		add_nft_command(dynamic_strcat(10, "insert rule ", quota_family_table, " ", quota_chain_prefix, "output oifname ", wan_if, no_death_mark_test, " jump ", quota_chain_prefix, "egress_quotas "), 1); // position 1
+
+		add_nft_command(dynamic_strcat(7, "insert rule ", quota_family_table, " ", quota_chain_prefix, "forward jump ", quota_chain_prefix, "forward_quotas"), 1);
+		add_nft_command(dynamic_strcat(10, "add rule ", quota_family_table, " ", quota_chain_prefix, "forward_quotas oifname ", wan_if, no_death_mark_test, " jump ", quota_chain_prefix, "egress_quotas"), 1);
+		add_nft_command(dynamic_strcat(10, "add rule ", quota_family_table, " ", quota_chain_prefix, "forward_quotas iifname ", wan_if, no_death_mark_test, " jump ", quota_chain_prefix, "ingress_quotas"), 1);
+		add_nft_command(dynamic_strcat(8, "add rule ", quota_family_table, " ", quota_chain_prefix, "forward_quotas iifname ", wan_if, no_death_mark_test, " ct mark set ct mark & 0xF0FFFFFF | 0x0F000000"), 1);
+		add_nft_command(dynamic_strcat(8, "add rule ", quota_family_table, " ", quota_chain_prefix, "forward_quotas oifname ", wan_if, no_death_mark_test, " ct mark set ct mark & 0xF0FFFFFF | 0x0F000000"), 1);
+		add_nft_command(dynamic_strcat(7, "add rule ", quota_family_table, " ", quota_chain_prefix, "forward_quotas ct mark & 0x0F000000 == 0x0F000000 jump ", quota_chain_prefix, "combined_quotas"), 1);
+		add_nft_command(dynamic_strcat(5, "add rule ", quota_family_table, " ", quota_chain_prefix, "forward_quotas ct mark set ct mark & 0xF0FFFFFF | 0x0"), 1);
 		free(no_death_mark_test);
 
-		run_shell_command(dynamic_strcat(7, "nft add rule ", quota_family_table, " ", quota_chain_prefix, "egress_quotas ct mark set ct mark \\& ", inverted_death_mask, " \\| 0x0 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(7, "nft add rule ", quota_family_table, " ", quota_chain_prefix, "ingress_quotas ct mark set ct mark \\& ", inverted_death_mask, " \\| 0x0 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(7, "nft add rule ", quota_family_table, " ", quota_chain_prefix, "combined_quotas ct mark set ct mark \\& ", inverted_death_mask, " \\| 0x0 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(5, "nft add rule ", quota_family_table, " ", quota_chain_prefix, "egress_quotas ct mark set ct mark \\& 0x00FFFFFF \\| 0x0 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(5, "nft add rule ", quota_family_table, " ", quota_chain_prefix, "ingress_quotas ct mark set ct mark \\& 0x00FFFFFF \\| 0x0 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(5, "nft add rule ", quota_family_table, " ", quota_chain_prefix, "combined_quotas ct mark set ct mark \\& 0x00FFFFFF \\| 0x0 2>/dev/null"), 1);
+		add_nft_command(dynamic_strcat(7, "add rule ", quota_family_table, " ", quota_chain_prefix, "egress_quotas ct mark set ct mark & ", inverted_death_mask, " | 0x0"), 1);
+		add_nft_command(dynamic_strcat(7, "add rule ", quota_family_table, " ", quota_chain_prefix, "ingress_quotas ct mark set ct mark & ", inverted_death_mask, " | 0x0"), 1);
+		add_nft_command(dynamic_strcat(7, "add rule ", quota_family_table, " ", quota_chain_prefix, "combined_quotas ct mark set ct mark & ", inverted_death_mask, " | 0x0"), 1);
+		add_nft_command(dynamic_strcat(5, "add rule ", quota_family_table, " ", quota_chain_prefix, "egress_quotas ct mark set ct mark & 0x00FFFFFF | 0x0"), 1);
+		add_nft_command(dynamic_strcat(5, "add rule ", quota_family_table, " ", quota_chain_prefix, "ingress_quotas ct mark set ct mark & 0x00FFFFFF | 0x0"), 1);
+		add_nft_command(dynamic_strcat(5, "add rule ", quota_family_table, " ", quota_chain_prefix, "combined_quotas ct mark set ct mark & 0x00FFFFFF | 0x0"), 1);
 
 		// This rule is also created by qos_gargoyle. We don't care who makes it as long as someone does
-		run_shell_command(dynamic_strcat(5, "nft add chain ", quota_family_table, " ", quota_chain_prefix, "quotaqos_prerouting 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(5, "nft add rule ", quota_family_table, " ", quota_chain_prefix, "quotaqos_prerouting meta mark set 0x0 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(9, "nft insert rule ", quota_family_table, " ", quota_chain_prefix, "prerouting iifname ", wan_if, " jump ", quota_chain_prefix, "quotaqos_prerouting 2>/dev/null"), 1);
+		add_nft_command(dynamic_strcat(5, "add chain ", quota_family_table, " ", quota_chain_prefix, "quotaqos_prerouting"), 1);
+		add_nft_command(dynamic_strcat(5, "add rule ", quota_family_table, " ", quota_chain_prefix, "quotaqos_prerouting meta mark set 0x0"), 1);
+		add_nft_command(dynamic_strcat(9, "insert rule ", quota_family_table, " ", quota_chain_prefix, "prerouting iifname ", wan_if, " jump ", quota_chain_prefix, "quotaqos_prerouting"), 1);
 
 		/* add rules */
-		char* set_death_mark = dynamic_strcat(5, " ct mark set ct mark \\& ", inverted_death_mask, " \\| ", death_mark, " ");
+		char* set_death_mark = dynamic_strcat(5, " ct mark set ct mark & ", inverted_death_mask, " | ", death_mark, " ");
 		list* other_quota_section_names = initialize_list();
 		list* defined_ip_groups = initialize_list();
+		list* pending_restores = initialize_list();
 
 		unlock_bandwidth_semaphore_on_exit();
 		while(quota_sections->length > 0 || other_quota_section_names->length > 0)
@@ -559,16 +586,16 @@ int main(int argc, char** argv)
 									char* ingress_test = dynamic_strcat(3, " ip daddr ", ip4_list, " ");
 									if(strcmp(types[type_index], "egress_limit") == 0)
 									{
-										run_shell_command(dynamic_strcat(7, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], egress_test, " ct mark set ct mark \\& 0xF0FFFFFF \\| 0x0F000000 2>/dev/null"), 1);
+										add_nft_command(dynamic_strcat(7, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], egress_test, " ct mark set ct mark & 0xF0FFFFFF | 0x0F000000"), 1);
 									}
 									else if(strcmp(types[type_index], "ingress_limit") == 0)
 									{
-										run_shell_command(dynamic_strcat(7, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ingress_test, " ct mark set ct mark \\& 0xF0FFFFFF \\| 0x0F000000 2>/dev/null"), 1);
+										add_nft_command(dynamic_strcat(7, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ingress_test, " ct mark set ct mark & 0xF0FFFFFF | 0x0F000000"), 1);
 									}
 									else if(strcmp(types[type_index], "combined_limit") == 0)
 									{
-										run_shell_command(dynamic_strcat(9, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], " iifname ", wan_if, ingress_test, " ct mark set ct mark \\& 0xF0FFFFFF \\| 0x0F000000 2>/dev/null"), 1);
-										run_shell_command(dynamic_strcat(9, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], " oifname ", wan_if, egress_test, " ct mark set ct mark \\& 0xF0FFFFFF \\| 0x0F000000 2>/dev/null"), 1);
+										add_nft_command(dynamic_strcat(9, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], " iifname ", wan_if, ingress_test, " ct mark set ct mark & 0xF0FFFFFF | 0x0F000000"), 1);
+										add_nft_command(dynamic_strcat(9, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], " oifname ", wan_if, egress_test, " ct mark set ct mark & 0xF0FFFFFF | 0x0F000000"), 1);
 									}
 									free(ingress_test);
 									foundip4 = 1;
@@ -584,16 +611,16 @@ int main(int argc, char** argv)
 									char* ingress_test = dynamic_strcat(3, " ip6 daddr ", ip6_list, " ");
 									if(strcmp(types[type_index], "egress_limit") == 0)
 									{
-										run_shell_command(dynamic_strcat(7, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], egress_test, " ct mark set ct mark \\& 0xF0FFFFFF \\| 0x0F000000 2>/dev/null"), 1);
+										add_nft_command(dynamic_strcat(7, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], egress_test, " ct mark set ct mark & 0xF0FFFFFF | 0x0F000000"), 1);
 									}
 									else if(strcmp(types[type_index], "ingress_limit") == 0)
 									{
-										run_shell_command(dynamic_strcat(7, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ingress_test, " ct mark set ct mark \\& 0xF0FFFFFF \\| 0x0F000000 2>/dev/null"), 1);
+										add_nft_command(dynamic_strcat(7, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ingress_test, " ct mark set ct mark & 0xF0FFFFFF | 0x0F000000"), 1);
 									}
 									else if(strcmp(types[type_index], "combined_limit") == 0)
 									{
-										run_shell_command(dynamic_strcat(9, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], " iifname ", wan_if, ingress_test, " ct mark set ct mark \\& 0xF0FFFFFF \\| 0x0F000000 2>/dev/null"), 1);
-										run_shell_command(dynamic_strcat(9, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], " oifname ", wan_if, egress_test, " ct mark set ct mark \\& 0xF0FFFFFF \\| 0x0F000000 2>/dev/null"), 1);
+										add_nft_command(dynamic_strcat(9, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], " iifname ", wan_if, ingress_test, " ct mark set ct mark & 0xF0FFFFFF | 0x0F000000"), 1);
+										add_nft_command(dynamic_strcat(9, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], " oifname ", wan_if, egress_test, " ct mark set ct mark & 0xF0FFFFFF | 0x0F000000"), 1);
 									}
 									free(ingress_test);
 									foundip6 = 1;
@@ -604,7 +631,7 @@ int main(int argc, char** argv)
 									ip6_list = NULL;
 								}
 								
-								char* rule_end = strdup(" ct mark \\& 0x0F000000 == 0x0F000000 ");
+								char* rule_end = strdup(" ct mark & 0x0F000000 == 0x0F000000 ");
 								ip_test = dcat_and_free(&ip_test, &rule_end, 1, 1);
 							}
 							else if(strcmp(types[type_index], "egress_limit") == 0)
@@ -617,21 +644,21 @@ int main(int argc, char** argv)
 							}
 							else if(strcmp(types[type_index], "combined_limit") == 0)
 							{
-								run_shell_command(dynamic_strcat(9, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], " iifname ", wan_if, dst_test, " ct mark set ct mark \\& 0xF0FFFFFF \\| 0x0F000000 2>/dev/null"), 1);
-								run_shell_command(dynamic_strcat(9, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], " oifname ", wan_if, src_test, " ct mark set ct mark \\& 0xF0FFFFFF \\| 0x0F000000 2>/dev/null"), 1);
+								add_nft_command(dynamic_strcat(9, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], " iifname ", wan_if, dst_test, " ct mark set ct mark & 0xF0FFFFFF | 0x0F000000"), 1);
+								add_nft_command(dynamic_strcat(9, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], " oifname ", wan_if, src_test, " ct mark set ct mark & 0xF0FFFFFF | 0x0F000000"), 1);
 								
-								char* rule_end = strdup(" ct mark \\& 0x0F000000 == 0x0F000000 ");
+								char* rule_end = strdup(" ct mark & 0x0F000000 == 0x0F000000 ");
 								ip_test = dcat_and_free(&ip_test, &rule_end, 1, 1);
 							}
 							
-							run_shell_command(dynamic_strcat(7, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip_test, " ct mark set ct mark \\& 0x0FFFFFFF \\| 0xF0000000 2>/dev/null"), 1);
+							add_nft_command(dynamic_strcat(7, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip_test, " ct mark set ct mark & 0x0FFFFFFF | 0xF0000000"), 1);
 							free(dst_test);
 							free(src_test);
 						}
 						else if( strcmp(ip, "ALL_OTHERS_COMBINED") == 0 || strcmp(ip, "ALL_OTHERS_INDIVIDUAL") == 0 )
 						{
-							char* rule_end = strdup(" ct mark \\& 0xF0000000 == 0x0");
-							char* subnet_end = strdup("\\\" ");
+							char* rule_end = strdup(" ct mark & 0xF0000000 == 0x0");
+							char* subnet_end = strdup("\" ");
 							ip_test = dcat_and_free(&ip_test, &rule_end, 1, 1);
 							if(strcmp(ip, "ALL_OTHERS_INDIVIDUAL") == 0)
 							{
@@ -658,8 +685,8 @@ int main(int argc, char** argv)
 									applies_to = strdup("individual-local");
 								}
 									
-								char *subnet_option = strdup(" subnet \\\"");
-								char *subnet6_option = strdup(" subnet6 \\\"");
+								char *subnet_option = strdup(" subnet \"");
+								char *subnet6_option = strdup(" subnet6 \"");
 								subnet_definition = dcat_and_free(&subnet_definition, &subnet_option, 1, 1);
 								subnet_definition = dcat_and_free(&subnet_definition, &local_subnet, 1, 0);
 								subnet_definition = dcat_and_free(&subnet_definition, &subnet_end, 1, 0);
@@ -695,22 +722,22 @@ int main(int argc, char** argv)
 									{
 										if(type_index == EGRESS_INDEX)
 										{
-											run_shell_command(dynamic_strcat(11, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip_test, time_match_str, " bandwidth id \\\"", other_type_id, "\\\" bcheck-with-src-dst-swap ", set_egress_mark), 1);
+											add_nft_command(dynamic_strcat(11, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip_test, time_match_str, " bandwidth id \"", other_type_id, "\" bcheck-with-src-dst-swap ", set_egress_mark), 1);
 										}
 										else
 										{
-											run_shell_command(dynamic_strcat(11, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip_test, time_match_str, " bandwidth id \\\"", other_type_id, "\\\" bcheck-with-src-dst-swap ", set_ingress_mark), 1);
+											add_nft_command(dynamic_strcat(11, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip_test, time_match_str, " bandwidth id \"", other_type_id, "\" bcheck-with-src-dst-swap ", set_ingress_mark), 1);
 										}
 									}
 									if(foundip6 && strcmp(ip_test, ip6_test) != 0)
 									{
 										if(type_index == EGRESS_INDEX)
 										{
-											run_shell_command(dynamic_strcat(11, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip6_test, time_match_str, " bandwidth id \\\"", other_type_id, "\\\" bcheck-with-src-dst-swap ", set_egress_mark), 1);
+											add_nft_command(dynamic_strcat(11, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip6_test, time_match_str, " bandwidth id \"", other_type_id, "\" bcheck-with-src-dst-swap ", set_egress_mark), 1);
 										}
 										else
 										{
-											run_shell_command(dynamic_strcat(11, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip6_test, time_match_str, " bandwidth id \\\"", other_type_id, "\\\" bcheck-with-src-dst-swap ", set_ingress_mark), 1);
+											add_nft_command(dynamic_strcat(11, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip6_test, time_match_str, " bandwidth id \"", other_type_id, "\" bcheck-with-src-dst-swap ", set_ingress_mark), 1);
 										}
 									}
 									free(other_type_id);
@@ -731,34 +758,34 @@ int main(int argc, char** argv)
 								{
 									if(strcmp(types[type_index], "egress_limit") == 0)
 									{
-										run_shell_command(dynamic_strcat(17, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip_test, time_match_str, " bandwidth id \\\"", type_id, "\\\" type ", applies_to, subnet_definition, subnet6_definition, " greater-than ", limit, reset, set_egress_mark), 1);
+										add_nft_command(dynamic_strcat(17, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip_test, time_match_str, " bandwidth id \"", type_id, "\" type ", applies_to, subnet_definition, subnet6_definition, " greater-than ", limit, reset, set_egress_mark), 1);
 									}
 									else if(strcmp(types[type_index], "ingress_limit") == 0)
 									{
-										run_shell_command(dynamic_strcat(17, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip_test, time_match_str, " bandwidth id \\\"", type_id, "\\\" type ", applies_to, subnet_definition, subnet6_definition, " greater-than ", limit, reset, set_ingress_mark), 1);
+										add_nft_command(dynamic_strcat(17, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip_test, time_match_str, " bandwidth id \"", type_id, "\" type ", applies_to, subnet_definition, subnet6_definition, " greater-than ", limit, reset, set_ingress_mark), 1);
 									}
 									else //combined
 									{
-										run_shell_command(dynamic_strcat(16, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip_test, time_match_str, " bandwidth id \\\"", type_id, "\\\" type ", applies_to, subnet_definition, subnet6_definition, " greater-than ", limit, reset), 1);
-										run_shell_command(dynamic_strcat(14, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], " oifname ", wan_if, " ", ip_test, time_match_str, " bandwidth id \\\"", type_id, "\\\" bcheck ", set_egress_mark), 1);                     //egress
-										run_shell_command(dynamic_strcat(14, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], " iifname ", wan_if, " ", ip_test, time_match_str, " bandwidth id \\\"", type_id, "\\\" bcheck-with-src-dst-swap ", set_ingress_mark), 1);  //ingress
+										add_nft_command(dynamic_strcat(16, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip_test, time_match_str, " bandwidth id \"", type_id, "\" type ", applies_to, subnet_definition, subnet6_definition, " greater-than ", limit, reset), 1);
+										add_nft_command(dynamic_strcat(14, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], " oifname ", wan_if, " ", ip_test, time_match_str, " bandwidth id \"", type_id, "\" bcheck ", set_egress_mark), 1);                     //egress
+										add_nft_command(dynamic_strcat(14, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], " iifname ", wan_if, " ", ip_test, time_match_str, " bandwidth id \"", type_id, "\" bcheck-with-src-dst-swap ", set_ingress_mark), 1);  //ingress
 									}
 								}
 								if(foundip6 && strcmp(ip_test, ip6_test) != 0)
 								{
 									if(strcmp(types[type_index], "egress_limit") == 0)
 									{
-										run_shell_command(dynamic_strcat(17, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip6_test, time_match_str, " bandwidth id \\\"", type_id, "\\\" type ", applies_to, subnet_definition, subnet6_definition, " greater-than ", limit, reset, set_egress_mark), 1);
+										add_nft_command(dynamic_strcat(17, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip6_test, time_match_str, " bandwidth id \"", type_id, "\" type ", applies_to, subnet_definition, subnet6_definition, " greater-than ", limit, reset, set_egress_mark), 1);
 									}
 									else if(strcmp(types[type_index], "ingress_limit") == 0)
 									{
-										run_shell_command(dynamic_strcat(17, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip6_test, time_match_str, " bandwidth id \\\"", type_id, "\\\" type ", applies_to, subnet_definition, subnet6_definition, " greater-than ", limit, reset, set_ingress_mark), 1);
+										add_nft_command(dynamic_strcat(17, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip6_test, time_match_str, " bandwidth id \"", type_id, "\" type ", applies_to, subnet_definition, subnet6_definition, " greater-than ", limit, reset, set_ingress_mark), 1);
 									}
 									else //combined
 									{
-										run_shell_command(dynamic_strcat(16, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip6_test, time_match_str, " bandwidth id \\\"", type_id, "\\\" type ", applies_to, subnet_definition, subnet6_definition, " greater-than ", limit, reset), 1);
-										run_shell_command(dynamic_strcat(14, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], " oifname ", wan_if, " ", ip6_test, time_match_str, " bandwidth id \\\"", type_id, "\\\" bcheck ", set_egress_mark), 1);                     //egress
-										run_shell_command(dynamic_strcat(14, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], " iifname ", wan_if, " ", ip6_test, time_match_str, " bandwidth id \\\"", type_id, "\\\" bcheck-with-src-dst-swap ", set_ingress_mark), 1);  //ingress
+										add_nft_command(dynamic_strcat(16, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip6_test, time_match_str, " bandwidth id \"", type_id, "\" type ", applies_to, subnet_definition, subnet6_definition, " greater-than ", limit, reset), 1);
+										add_nft_command(dynamic_strcat(14, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], " oifname ", wan_if, " ", ip6_test, time_match_str, " bandwidth id \"", type_id, "\" bcheck ", set_egress_mark), 1);                     //egress
+										add_nft_command(dynamic_strcat(14, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], " iifname ", wan_if, " ", ip6_test, time_match_str, " bandwidth id \"", type_id, "\" bcheck-with-src-dst-swap ", set_ingress_mark), 1);  //ingress
 									}
 								}
 								free(set_egress_mark);
@@ -769,55 +796,59 @@ int main(int argc, char** argv)
 								//insert quota block rule
 								if(foundip4)
 								{
-									run_shell_command(dynamic_strcat(17, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip_test, time_match_str, " bandwidth id \\\"", type_id, "\\\" type ", applies_to, subnet_definition, subnet6_definition, " greater-than ", limit, reset, set_death_mark), 1);
+									add_nft_command(dynamic_strcat(17, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip_test, time_match_str, " bandwidth id \"", type_id, "\" type ", applies_to, subnet_definition, subnet6_definition, " greater-than ", limit, reset, set_death_mark), 1);
 								}
 								if(foundip6 && strcmp(ip_test, ip6_test) != 0)
 								{
-									run_shell_command(dynamic_strcat(17, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip6_test, time_match_str, " bandwidth id \\\"", type_id, "\\\" type ", applies_to, subnet_definition, subnet6_definition, " greater-than ", limit, reset, set_death_mark), 1);
+									add_nft_command(dynamic_strcat(17, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], ip6_test, time_match_str, " bandwidth id \"", type_id, "\" type ", applies_to, subnet_definition, subnet6_definition, " greater-than ", limit, reset, set_death_mark), 1);
 								}
 
 								//insert redirect rule
 								if(strcmp(ip, "ALL") == 0 || strcmp(ip, "ALL_OTHERS_INDIVIDUAL") == 0)
 								{
 									char* check_str = (strcmp(types[type_index], "ingress_limit") == 0) ? strdup(" bcheck-with-src-dst-swap ") : strdup(" bcheck ");
-									run_shell_command(dynamic_strcat(9, "nft add rule ", quota_family_table, " nat_quota_redirects tcp dport {80,443} ", time_match_str, " bandwidth ", check_str, " id \\\"", type_id, "\\\" redirect"), 1);
+									add_nft_command(dynamic_strcat(9, "add rule ", quota_family_table, " nat_quota_redirects tcp dport {80,443} ", time_match_str, " bandwidth ", check_str, " id \"", type_id, "\" redirect"), 1);
 									free(check_str);
 								}
 								else if(strcmp(ip, "ALL_OTHERS_COMBINED") == 0)
 								{
-									run_shell_command(dynamic_strcat(7, "nft add rule ", quota_family_table, " nat_quota_redirects tcp dport {80,443} ", time_match_str, " ct mark \\& 0xF0000000 == 0x0 bandwidth bcheck id \\\"", type_id, "\\\" redirect"), 1);
+									add_nft_command(dynamic_strcat(7, "add rule ", quota_family_table, " nat_quota_redirects tcp dport {80,443} ", time_match_str, " ct mark & 0xF0000000 == 0x0 bandwidth bcheck id \"", type_id, "\" redirect"), 1);
 								}
 								else
 								{
 									if(ip4_list != NULL)
 									{
-										run_shell_command(dynamic_strcat(5, "nft add rule ", quota_family_table, " nat_quota_redirects ip saddr ", ip4_list, " ct mark set ct mark \\& 0xF0FFFFFF \\| 0x0F000000 2>/dev/null"), 1);
+										add_nft_command(dynamic_strcat(5, "add rule ", quota_family_table, " nat_quota_redirects ip saddr ", ip4_list, " ct mark set ct mark & 0xF0FFFFFF | 0x0F000000"), 1);
 									}
 									if(ip6_list != NULL)
 									{
-										run_shell_command(dynamic_strcat(5, "nft add rule ", quota_family_table, " nat_quota_redirects ip6 saddr ", ip6_list, " ct mark set ct mark \\& 0xF0FFFFFF \\| 0x0F000000 2>/dev/null"), 1);
+										add_nft_command(dynamic_strcat(5, "add rule ", quota_family_table, " nat_quota_redirects ip6 saddr ", ip6_list, " ct mark set ct mark & 0xF0FFFFFF | 0x0F000000"), 1);
 									}
 									
 									if(ip4_list == NULL && ip6_list == NULL)
 									{
-										run_shell_command(dynamic_strcat(7, "nft add rule ", quota_family_table, " nat_quota_redirects ", ((foundip6 && strcmp(ip_test, ip6_test) != 0) ? "ip6" : "ip"), " saddr ", ip, " ct mark set ct mark \\& 0xF0FFFFFF \\| 0x0F000000 2>/dev/null"), 1);
+										add_nft_command(dynamic_strcat(7, "add rule ", quota_family_table, " nat_quota_redirects ", ((foundip6 && strcmp(ip_test, ip6_test) != 0) ? "ip6" : "ip"), " saddr ", ip, " ct mark set ct mark & 0xF0FFFFFF | 0x0F000000"), 1);
 									}
-									run_shell_command(dynamic_strcat(7, "nft add rule ", quota_family_table, " nat_quota_redirects tcp dport {80,443} ", time_match_str, " ct mark \\& 0x0F000000 == 0x0F000000 bandwidth bcheck id \\\"", type_id, "\\\" redirect"), 1);
-									run_shell_command(dynamic_strcat(3, "nft add rule ", quota_family_table, " nat_quota_redirects ct mark \\& 0x0F000000 == 0x0F000000 ct mark set ct mark \\& 0x0FFFFFFF \\| 0xF0000000 2>/dev/null"), 1);
-									run_shell_command(dynamic_strcat(3, "nft add rule ", quota_family_table, " nat_quota_redirects ct mark set ct mark \\& 0xF0FFFFFF \\| 0x0 2>/dev/null"), 1);
+									add_nft_command(dynamic_strcat(7, "add rule ", quota_family_table, " nat_quota_redirects tcp dport {80,443} ", time_match_str, " ct mark & 0x0F000000 == 0x0F000000 bandwidth bcheck id \"", type_id, "\" redirect"), 1);
+									add_nft_command(dynamic_strcat(3, "add rule ", quota_family_table, " nat_quota_redirects ct mark & 0x0F000000 == 0x0F000000 ct mark set ct mark & 0x0FFFFFFF | 0xF0000000"), 1);
+									add_nft_command(dynamic_strcat(3, "add rule ", quota_family_table, " nat_quota_redirects ct mark set ct mark & 0xF0FFFFFF | 0x0"), 1);
 								}
 							}
 
 							//restore from backup
 							if(do_restore)
 							{
-								restore_backup_for_id(type_id, "/usr/data/quotas", is_individual_other, defined_ip_groups);
+								pending_restore* restore = (pending_restore*)malloc(sizeof(pending_restore));
+								restore->id = strdup(type_id);
+								restore->is_individual_other = is_individual_other;
+								restore->num_ip_groups = defined_ip_groups->length;
+								push_list(pending_restores, restore);
 							}
 							free(limit);
 						}
 						if(strstr(ip_test, "ct mark") != NULL || strstr(ip6_test, "ct mark") != NULL)
 						{
-							run_shell_command(dynamic_strcat(6, "nft add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], " ct mark set ct mark \\& 0xF0FFFFFF \\| 0x0 2>/dev/null"), 1);
+							add_nft_command(dynamic_strcat(6, "add rule ", quota_family_table, " ", quota_chain_prefix, chains[type_index], " ct mark set ct mark & 0xF0FFFFFF | 0x0"), 1);
 						}
 
 						free(ip_test);
@@ -850,16 +881,42 @@ int main(int argc, char** argv)
 			free(next_quota);
 		}
 
-		run_shell_command(dynamic_strcat(3, "nft add rule ", quota_family_table, " nat_quota_redirects ct mark set ct mark \\& 0x00FFFFFF \\| 0x0 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(5, "nft add rule ", quota_family_table, " ", quota_chain_prefix, "egress_quotas ct mark set ct mark \\& 0x00FFFFFF \\| 0x0 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(5, "nft add rule ", quota_family_table, " ", quota_chain_prefix, "ingress_quotas ct mark set ct mark \\& 0x00FFFFFF \\| 0x0 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(5, "nft add rule ", quota_family_table, " ", quota_chain_prefix, "combined_quotas ct mark set ct mark \\& 0x00FFFFFF \\| 0x0 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(7, "nft insert rule ", quota_family_table, " forward ct mark \\& ", death_mask, " == ", death_mark, " reject 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(7, "nft add rule ", quota_family_table, " ", quota_chain_prefix, "combined_quotas oifname ", wan_if, " ct mark set ct mark \\& 0xFFFFFF80 \\| mark \\& 0x7F 2>/dev/null"), 1);
-		run_shell_command(dynamic_strcat(7, "nft add rule ", quota_family_table, " ", quota_chain_prefix, "combined_quotas iifname ", wan_if, " ct mark set ct mark \\& 0xFFFF80FF \\| mark \\& 0x7F00 2>/dev/null"), 1);
+		add_nft_command(dynamic_strcat(3, "add rule ", quota_family_table, " nat_quota_redirects ct mark set ct mark & 0x00FFFFFF | 0x0"), 1);
+		add_nft_command(dynamic_strcat(5, "add rule ", quota_family_table, " ", quota_chain_prefix, "egress_quotas ct mark set ct mark & 0x00FFFFFF | 0x0"), 1);
+		add_nft_command(dynamic_strcat(5, "add rule ", quota_family_table, " ", quota_chain_prefix, "ingress_quotas ct mark set ct mark & 0x00FFFFFF | 0x0"), 1);
+		add_nft_command(dynamic_strcat(5, "add rule ", quota_family_table, " ", quota_chain_prefix, "combined_quotas ct mark set ct mark & 0x00FFFFFF | 0x0"), 1);
+		add_nft_command(dynamic_strcat(7, "insert rule ", quota_family_table, " forward ct mark & ", death_mask, " == ", death_mark, " reject"), 1);
+		add_nft_command(dynamic_strcat(7, "add rule ", quota_family_table, " ", quota_chain_prefix, "combined_quotas oifname ", wan_if, " ct mark set ct mark & 0xFFFFFF80 | mark & 0x7F"), 1);
+		add_nft_command(dynamic_strcat(7, "add rule ", quota_family_table, " ", quota_chain_prefix, "combined_quotas iifname ", wan_if, " ct mark set ct mark & 0xFFFF80FF | mark & 0x7F00"), 1);
 
 		free(quota_family_table);
 
+		/*
+		 * backups can only be restored once the bandwidth rules they refer to exist,
+		 * so apply the batch first, then restore in the order quotas were defined,
+		 * each seeing only the ip groups that were defined before it
+		 */
+		apply_nft_batch();
+		while(pending_restores->length > 0)
+		{
+			pending_restore* restore = (pending_restore*)shift_list(pending_restores);
+			list* prior_ip_groups = initialize_list();
+			unsigned long num_groups;
+			unsigned long group_index;
+			char** group_strs = (char**)get_list_values(defined_ip_groups, &num_groups);
+			for(group_index=0; group_index < restore->num_ip_groups && group_index < num_groups; group_index++)
+			{
+				push_list(prior_ip_groups, group_strs[group_index]);
+			}
+			restore_backup_for_id(restore->id, "/usr/data/quotas", restore->is_individual_other, prior_ip_groups);
+
+			unsigned long num_destroyed;
+			destroy_list(prior_ip_groups, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
+			free(group_strs);
+			free(restore->id);
+			free(restore);
+		}
+
 		//make sure crontab is up to date
 		if(crontab_line != NULL)
 		{
@@ -936,6 +993,8 @@ int main(int argc, char** argv)
 		}
 	}
 
+	apply_nft_batch();
+
 	/* commit changes to uci, to remove ignore_backup_at_next_restore variables permanently */
 	if (uci_lookup_ptr(ctx, &ptr, "firewall", true) == UCI_OK)
 	{
@@ -958,39 +1017,43 @@ void restore_backup_for_id(char* id, char* quota_backup_dir, unsigned char is_in
 		if(is_individual_other)
 		{
 			//filter out any ips in the "other" data, that have now been assigned quotas of their own.
-			list* ip_bw_list = initialize_list();
-			int ip_index;
-			for(ip_index=0; ip_index < num_ips; ip_index++)
-			{
-				ip_bw* ptr = loaded_backup_data + ip_index;
-				push_list(ip_bw_list, ptr);
-			}
-			
+			//all groups are compiled into one sorted, merged interval table per family, so each
+			//backed up ip costs one binary search no matter how many groups are defined
 			unsigned long num_groups = 0;
 			char** group_strs = (char**)get_list_values(defined_ip_groups, &num_groups);
-			unsigned long group_index;
-			
-			for(group_index = 0; group_index < num_groups; group_index++)
-			{
-				filter_group_from_list(&ip_bw_list, group_strs[group_index]);
-			}
-			
-			
-			//rebuild the backup data array from the filtered list
-			if(num_ips != ip_bw_list->length)
+			unsigned long num_ip4_intervals = 0;
+			unsigned long num_ip6_intervals = 0;
+			ip_interval* ip4_intervals = compile_ip_groups(group_strs, num_groups, AF_INET, &num_ip4_intervals);
+			ip_interval* ip6_intervals = compile_ip_groups(group_strs, num_groups, AF_INET6, &num_ip6_intervals);
+
+			unsigned long ip_index;
+			unsigned long num_kept = 0;
+			for(ip_index=0; ip_index < num_ips; ip_index++)
 			{
-				num_ips = ip_bw_list->length;
-				ip_bw* adj_backup = (ip_bw*)malloc( (1+ip_bw_list->length)*sizeof(ip_bw) );
-				while(ip_bw_list->length > 0)
+				ip_bw* next = loaded_backup_data + ip_index;
+				uint32_t ip_words[4] = { ntohl(next->ip[0]), 0, 0, 0 };
+				int filtered;
+				if(next->family == AF_INET6)
+				{
+					ip_words[1] = ntohl(next->ip[1]);
+					ip_words[2] = ntohl(next->ip[2]);
+					ip_words[3] = ntohl(next->ip[3]);
+					filtered = ip_in_intervals(ip_words, ip6_intervals, num_ip6_intervals);
+				}
+				else
+				{
+					filtered = ip_in_intervals(ip_words, ip4_intervals, num_ip4_intervals);
+				}
+				if(!filtered)
 				{
-					ip_bw* next = pop_list(ip_bw_list);
-					adj_backup[ ip_bw_list->length ] = *next;
+					loaded_backup_data[num_kept] = *next;
+					num_kept++;
 				}
-				free(loaded_backup_data);
-				loaded_backup_data = adj_backup;
 			}
-			
-			destroy_list(ip_bw_list, DESTROY_MODE_IGNORE_VALUES, &num_groups);
+			num_ips = num_kept;
+
+			free(ip4_intervals);
+			free(ip6_intervals);
 			free(group_strs); //don't want to destroy values, they're still contained in list, so just destroy container array
 		}
 		set_bandwidth_usage_for_rule_id(id, 1, num_ips, last_backup, loaded_backup_data, 5000);
@@ -998,83 +1061,129 @@ void restore_backup_for_id(char* id, char* quota_backup_dir, unsigned char is_in
 	free(quota_file_path);
 }
 
-list* filter_group_from_list(list** orig_ip_bw_list, char* ip_group_str)
+ip_interval* compile_ip_groups(char** group_strs, unsigned long num_groups, int family, unsigned long* num_intervals)
 {
-	char* dyn_group_str = strdup(ip_group_str);
+	unsigned long max_intervals = 16;
+	ip_interval* intervals = (ip_interval*)malloc(max_intervals*sizeof(ip_interval));
+	*num_intervals = 0;
 
-	/* remove spaces in ip range definitions */
-	while(strstr(dyn_group_str, " -") != NULL)
-	{
-		char* tmp_group_str = dyn_group_str;
-		dyn_group_str = dynamic_replace(dyn_group_str, " -", "-");
-		free(tmp_group_str);
-	}
-	while(strstr(dyn_group_str, "- ") != NULL)
-	{
-		char* tmp_group_str = dyn_group_str;
-		dyn_group_str = dynamic_replace(dyn_group_str, "- ", "-");
-		free(tmp_group_str);
-	}
-	while(strstr(dyn_group_str, " -") != NULL)
-	{
-		char* tmp_group_str = dyn_group_str;
-		dyn_group_str = dynamic_replace(dyn_group_str, " /", "/");
-		free(tmp_group_str);
-	}
-	while(strstr(dyn_group_str, "- ") != NULL)
-	{
-		char* tmp_group_str = dyn_group_str;
-		dyn_group_str = dynamic_replace(dyn_group_str, "/ ", "/");
-		free(tmp_group_str);
-	}
-
-	char group_breaks[]= ",\t ";
-	unsigned long num_groups = 0;
-	char** split_group = split_on_separators(dyn_group_str, group_breaks, 3, -1, 0, &num_groups);
 	unsigned long group_index;
-	
 	for(group_index = 0; group_index < num_groups; group_index++)
 	{
-		int ip_family = 0;
-		uint32_t* range = ip_range_to_host_ints( split_group[group_index], &ip_family );
-		list* new_ip_bw_list = initialize_list();
-		while((*orig_ip_bw_list)->length > 0)
+		/* remove spaces in ip range definitions */
+		char* dyn_group_str = strdup(group_strs[group_index]);
+		char* spaced[] = { " -", "- ", " /", "/ " };
+		char* unspaced[] = { "-", "-", "/", "/" };
+		int space_index;
+		for(space_index=0; space_index < 4; space_index++)
 		{
-			ip_bw* next_ip_bw = shift_list(*orig_ip_bw_list);
-			uint32_t* test_ip = next_ip_bw->ip;
-			if(ip_family == AF_INET)
+			while(strstr(dyn_group_str, spaced[space_index]) != NULL)
 			{
-				if(ntohl(*test_ip) >= ntohl(range[0]) && ntohl(*test_ip) <= ntohl(range[4]))
-				{
-					//overlap found! filter the ip by not adding it back!
-				}
-				else
-				{
-					push_list(new_ip_bw_list, next_ip_bw);
-				}
+				char* tmp_group_str = dyn_group_str;
+				dyn_group_str = dynamic_replace(dyn_group_str, spaced[space_index], unspaced[space_index]);
+				free(tmp_group_str);
 			}
-			else
+		}
+
+		char group_breaks[]= ",\t ";
+		unsigned long num_ranges = 0;
+		char** split_group = split_on_separators(dyn_group_str, group_breaks, 3, -1, 0, &num_ranges);
+		unsigned long range_index;
+		for(range_index = 0; range_index < num_ranges; range_index++)
+		{
+			int ip_family = 0;
+			uint32_t* range = ip_range_to_host_ints( split_group[range_index], &ip_family );
+			if(ip_family == family)
 			{
-				if(memcmp(test_ip,range,sizeof(uint32_t)*4) >= 0 && memcmp(test_ip,range+4,sizeof(uint32_t)*4) <= 0)
+				if(*num_intervals == max_intervals)
 				{
-					//overlap found! filter the ip by not adding it back!
+					ip_interval* old_intervals = intervals;
+					max_intervals = max_intervals*2;
+					intervals = (ip_interval*)malloc(max_intervals*sizeof(ip_interval));
+					memcpy(intervals, old_intervals, (*num_intervals)*sizeof(ip_interval));
+					free(old_intervals);
 				}
-				else
+				ip_interval* next = intervals + *num_intervals;
+				int word_index;
+				int num_words = family == AF_INET ? 1 : 4;
+				memset(next, 0, sizeof(ip_interval));
+				for(word_index=0; word_index < num_words; word_index++)
 				{
-					push_list(new_ip_bw_list, next_ip_bw);
+					next->start[word_index] = ntohl(range[word_index]);
+					next->end[word_index] = ntohl(range[4+word_index]);
+				}
+				if(compare_ip_words(next->start, next->end) <= 0)
+				{
+					*num_intervals = *num_intervals + 1;
 				}
 			}
+			free(range);
+		}
+		free_null_terminated_string_array(split_group);
+		free(dyn_group_str);
+	}
+
+	/* sort by start and merge overlaps, so at most one interval can contain any ip */
+	qsort(intervals, *num_intervals, sizeof(ip_interval), compare_ip_intervals);
+	unsigned long num_merged = 0;
+	unsigned long interval_index;
+	for(interval_index=0; interval_index < *num_intervals; interval_index++)
+	{
+		ip_interval* next = intervals + interval_index;
+		ip_interval* last = num_merged > 0 ? intervals + (num_merged-1) : NULL;
+		if(last != NULL && compare_ip_words(next->start, last->end) <= 0)
+		{
+			if(compare_ip_words(next->end, last->end) > 0)
+			{
+				memcpy(last->end, next->end, sizeof(last->end));
+			}
+		}
+		else
+		{
+			intervals[num_merged] = *next;
+			num_merged++;
 		}
-		free(range);
-		unsigned long num_destroyed;
-		destroy_list(*orig_ip_bw_list, DESTROY_MODE_IGNORE_VALUES, &num_destroyed);
-		*orig_ip_bw_list = new_ip_bw_list;
 	}
-	free_null_terminated_string_array(split_group);
-	free(dyn_group_str);
+	*num_intervals = num_merged;
+	return intervals;
+}
 
-	return *orig_ip_bw_list;
+int compare_ip_words(const uint32_t* a, const uint32_t* b)
+{
+	int word_index;
+	for(word_index=0; word_index < 4; word_index++)
+	{
+		if(a[word_index] != b[word_index])
+		{
+			return a[word_index] < b[word_index] ? -1 : 1;
+		}
+	}
+	return 0;
+}
 
+int compare_ip_intervals(const void* a, const void* b)
+{
+	return compare_ip_words( ((const ip_interval*)a)->start, ((const ip_interval*)b)->start );
+}
+
+int ip_in_intervals(uint32_t* ip_words, ip_interval* intervals, unsigned long num_intervals)
+{
+	/* find the last interval starting at or before ip */
+	unsigned long low = 0;
+	unsigned long high = num_intervals;
+	while(low < high)
+	{
+		unsigned long mid = low + ((high-low)/2);
+		if(compare_ip_words(intervals[mid].start, ip_words) <= 0)
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+	return low > 0 && compare_ip_words(ip_words, intervals[low-1].end) <= 0;
 }
 
 uint32_t* ip_range_to_host_ints(char* ip_str, int* family)
@@ -1107,6 +1216,8 @@ uint32_t* ip_range_to_host_ints(char* ip_str, int* family)
 				sscanf(split_ip[1], "%d", &mask_size);
 				mask = htonl(0xFFFFFFFF << (32-mask_size));
 			}
+			end = (uint32_t*)malloc(4*sizeof(uint32_t));
+			memset(end, 0, 4*sizeof(uint32_t));
 			*start = *start & mask;
 			*end = *start | ( ~mask );
 		}
@@ -1146,10 +1257,11 @@ uint32_t* ip_range_to_host_ints(char* ip_str, int* family)
 					p[mask_size/8] = 0xFF << (8-(mask_size & 7));
 				}
 			}
+			end = (uint32_t*)malloc(4*sizeof(uint32_t));
 			for(int x = 0; x < 4; x++)
 			{
-				*start = *(start+x) & mask[x];
-				*end = *(start+x) | (~mask[x]);
+				*(start+x) = *(start+x) & mask[x];
+				*(end+x) = *(start+x) | (~mask[x]);
 			}
 		}
 		else if(strstr(ip_str, "-") != NULL)
@@ -1289,7 +1401,14 @@ char* invert_bitmask(const char* input, int force_32bit)
     return result;
 }
 
-void delete_chain_from_table(char* family, char* table, char* delete_chain)
+/*
+ * Queue the removal of the given chains, and of every rule elsewhere in the table
+ * that jumps to them, onto the nft batch. The table is listed only once for all
+ * chains, and only chains that actually exist are deleted, since a single failing
+ * command would abort the whole transaction. Rules living inside chains that are
+ * themselves being deleted are removed by the flush, not by handle.
+ */
+void delete_chains_from_table(char* family, char* table, char** delete_chains, int num_chains)
 {
 	char *command = dynamic_strcat(5, "nft -a list table ", family, " ", table, " 2>/dev/null");
 	unsigned long num_lines = 0;
@@ -1298,7 +1417,13 @@ void delete_chain_from_table(char* family, char* table, char* delete_chain)
 
 	unsigned long line_index;
 	char* current_chain = NULL;
-	list* delete_commands = initialize_list();
+	int current_deleted = 0;
+	int* chain_found = (int*)malloc(sizeof(int)*num_chains);
+	int chain_index;
+	for(chain_index=0; chain_index < num_chains; chain_index++)
+	{
+		chain_found[chain_index] = 0;
+	}
 
 	for(line_index=0; line_index < num_lines; line_index++)
 	{
@@ -1306,25 +1431,37 @@ void delete_chain_from_table(char* family, char* table, char* delete_chain)
 		unsigned long num_pieces = 0;
 		char whitespace[] = { '\t', ' ', '\r', '\n' };
 		char** line_pieces = split_on_separators(line, whitespace, 4, -1, 0, &num_pieces);
-		if(strcmp(line_pieces[0], "chain") == 0)
+		if(strcmp(line_pieces[0], "chain") == 0 && num_pieces > 1)
 		{
 			if(current_chain != NULL) { free(current_chain); }
 			current_chain = strdup(line_pieces[1]);
+			current_deleted = 0;
+			for(chain_index=0; chain_index < num_chains; chain_index++)
+			{
+				if(strcmp(current_chain, delete_chains[chain_index]) == 0)
+				{
+					chain_found[chain_index] = 1;
+					current_deleted = 1;
+				}
+			}
 		}
 		else 
 		{
-			if(current_chain != NULL && num_pieces > 1)
+			if(current_chain != NULL && (!current_deleted) && num_pieces > 1)
 			{
 				unsigned long pieceidx = 0;
-				for(pieceidx = 0; pieceidx < num_pieces; pieceidx++)
+				int rule_deleted = 0;
+				for(pieceidx = 0; pieceidx < num_pieces && (!rule_deleted); pieceidx++)
 				{
 					if((strcmp(line_pieces[pieceidx], "jump") == 0 || strcmp(line_pieces[pieceidx], "goto") == 0) && (pieceidx < num_pieces - 1))
 					{
-						if(strcmp(line_pieces[pieceidx+1], delete_chain) == 0)
+						for(chain_index=0; chain_index < num_chains && (!rule_deleted); chain_index++)
 						{
-							char* delete_command = dynamic_strcat(9, "nft delete rule ", family, " ", table, " ", current_chain, " handle ", line_pieces[num_pieces-1], " 2>/dev/null");
-							push_list(delete_commands, delete_command);
-							break;
+							if(strcmp(line_pieces[pieceidx+1], delete_chains[chain_index]) == 0)
+							{
+								add_nft_command(dynamic_strcat(8, "delete rule ", family, " ", table, " ", current_chain, " handle ", line_pieces[num_pieces-1]), 1);
+								rule_deleted = 1;
+							}
 						}
 					}
 				}
@@ -1335,17 +1472,86 @@ void delete_chain_from_table(char* family, char* table, char* delete_chain)
 		free_null_terminated_string_array(line_pieces);
 	}
 	free_null_terminated_string_array(table_dump);
+	if(current_chain != NULL) { free(current_chain); }
+
+	/* flush all chains being deleted before whacking any, so jumps between them are gone */
+	for(chain_index=0; chain_index < num_chains; chain_index++)
+	{
+		if(chain_found[chain_index])
+		{
+			add_nft_command(dynamic_strcat(6, "flush chain ", family, " ", table, " ", delete_chains[chain_index]), 1);
+		}
+	}
+	for(chain_index=0; chain_index < num_chains; chain_index++)
+	{
+		if(chain_found[chain_index])
+		{
+			add_nft_command(dynamic_strcat(6, "delete chain ", family, " ", table, " ", delete_chains[chain_index]), 1);
+		}
+	}
+	free(chain_found);
+}
 
-	/* final two commands to flush chain being deleted and whack it */
-	unshift_list(delete_commands, dynamic_strcat(7, "nft flush chain ", family, " ", table, " ", delete_chain, " 2>/dev/null"));
-	unshift_list(delete_commands, dynamic_strcat(7, "nft delete chain ", family, " ", table, " ", delete_chain, " 2>/dev/null"));
+void add_nft_command(char* command, int free_command_str)
+{
+	push_list(nft_batch, free_command_str ? command : strdup(command));
+}
 
-	/* run delete commands */
-	while(delete_commands->length > 0)
+/*
+ * Feed the accumulated commands to nft -f, which applies them as one atomic
+ * transaction. Should the kernel reject the transaction (e.g. a hook chain we
+ * insert into is missing) fall back to applying each command on its own, as was
+ * done before batching, so one bad rule doesn't take every quota down with it.
+ */
+int apply_nft_batch(void)
+{
+	int ret = 0;
+	unsigned long num_commands;
+	char** commands = (char**)destroy_list(nft_batch, DESTROY_MODE_RETURN_VALUES, &num_commands);
+	nft_batch = initialize_list();
+
+	if(num_commands > 0)
 	{
-		char *next_command = (char*)pop_list(delete_commands);
-		run_shell_command(next_command, 1);
+		unsigned long command_index;
+		if(dry_run)
+		{
+			for(command_index=0; command_index < num_commands; command_index++)
+			{
+				printf("%s\n", commands[command_index]);
+			}
+		}
+		else
+		{
+			FILE* nft = popen("nft -f - 2>/dev/null", "w");
+			if(nft != NULL)
+			{
+				for(command_index=0; command_index < num_commands; command_index++)
+				{
+					fprintf(nft, "%s\n", commands[command_index]);
+				}
+				ret = pclose(nft);
+			}
+			else
+			{
+				ret = -1;
+			}
+
+			if(ret != 0)
+			{
+				for(command_index=0; command_index < num_commands; command_index++)
+				{
+					nft = popen("nft -f - 2>/dev/null", "w");
+					if(nft != NULL)
+					{
+						fprintf(nft, "%s\n", commands[command_index]);
+						pclose(nft);
+					}
+				}
+			}
+		}
 	}
+	free_null_terminated_string_array(commands);
+	return ret;
 }
 
 void run_shell_command(char* command, int free_command_str)
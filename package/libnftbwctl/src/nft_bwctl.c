@@ -19,12 +19,24 @@
  */
 
 
+#define _GNU_SOURCE /* semtimedop */
 #include "nft_bwctl.h"
 #define malloc nft_bwctl_safe_malloc
 #define strdup nft_bwctl_safe_strdup
 
 
 static int bandwidth_semaphore = -1;
+static int lock_held = 0;
+
+/* how long lock() waited, bucket n counts waits under 2^n ms (the last one everything longer) */
+static unsigned long lock_wait_histogram[BANDWIDTH_LOCK_WAIT_BUCKETS];
+static unsigned long lock_wait_timeouts = 0;
+
+/* what backups have written vs. what full rewrites would have written */
+static unsigned long long backup_bytes_written = 0;
+static unsigned long long backup_bytes_total = 0;
+static unsigned long backup_files_written = 0;
+static unsigned long backup_files_total = 0;
 
 union semun 
 {
@@ -37,11 +49,90 @@ union semun
 
 
 
+/* 
+ * callback handed each decoded ip_bw / ip_bw_history record, the record
+ * (and its history_bws) is only valid for the duration of the call.
+ * return non-zero to stop the query
+ */
+typedef int (*bw_record_visitor)(void* record, void* arg);
+
+/*
+ * Version 2 history (.bw) file layout, native byte order:
+ *
+ *	ip_bw_history_file_header
+ *	ip_bw_history_file_index[num_ips]	sorted by ip, then family
+ *	uint64_t nodes[]			one block of num_nodes per ip,
+ *						at the index entry's nodes_offset
+ *
+ * Everything is 8 byte aligned so the file can be mmap'd and used in place,
+ * and a single ip can be found with a binary search of the index.
+ * Version 1 files (no header, a uint32_t ip count first) are still read,
+ * and get rewritten as version 2 at the next backup.
+ */
+typedef struct history_file_header_struct
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_ips;
+	uint32_t index_entry_size;
+	uint64_t reset_interval;
+	uint64_t reset_time;
+	uint8_t is_constant_interval;
+	uint8_t padding[7];
+} ip_bw_history_file_header;
+
+typedef struct history_file_index_struct
+{
+	uint32_t family;
+	uint32_t ip[4];
+	uint32_t num_nodes;
+	uint64_t first_start;
+	uint64_t first_end;
+	uint64_t last_end;
+	uint64_t nodes_offset;
+} ip_bw_history_file_index;
+
+/*
+ * Backup files (usage and history alike) start with this, followed by the
+ * length bytes of data that was saved.  Changed blocks are patched in place
+ * and the header is written last, so a file that was only partly patched
+ * when the power went fails its checksum instead of loading as a mix of old
+ * and new data.  Files without the header (from before it existed) are read
+ * as they are.
+ */
+typedef struct backup_file_header_struct
+{
+	uint32_t magic;
+	uint32_t checksum;
+	uint64_t length;
+} backup_file_header;
+
+/* state for writing a history file one record at a time */
+typedef struct history_file_writer_struct
+{
+	ip_bw_history_file_header header;
+	ip_bw_history_file_index* index;
+	uint32_t max_ips;
+	FILE* nodes_file;
+	char* nodes_data;
+	size_t nodes_length;
+	uint64_t nodes_written;
+} history_file_writer;
+
+/* state for printing histories one record at a time */
+typedef struct history_printer_struct
+{
+	FILE* out;
+	char* id;
+	char output_type;
+} history_printer;
+
+
 /* semaphore functions */
-static int get_sem_val(int sid, int member);
 static int get_sem(int *sid, key_t key);
-static int lock_sem(int sid);
+static int lock_sem(int sid, unsigned long max_wait_milliseconds);
 static int unlock_sem(int sid);
+static void record_lock_wait(unsigned long wait_microseconds, int got_lock);
 static int lock(unsigned long max_wait_milliseconds);
 static int unlock(void);
 
@@ -64,6 +155,16 @@ static void parse_returned_ip_data(		void *out_data,
 						unsigned char is_constant_interval
 						);
 
+static int query_bandwidth_data(		int sockfd, 
+						char* id, 
+						unsigned char get_history, 
+						char* ip, 
+						unsigned long* num_ips, 
+						void** data, 
+						bw_record_visitor visit, 
+						void* visit_arg
+						);
+
 static int get_bandwidth_data(			char* id, 
 						unsigned char get_history, 
 						char* ip, 
@@ -72,6 +173,22 @@ static int get_bandwidth_data(			char* id,
 						unsigned long max_wait_milliseconds
 						);
 
+static unsigned long get_bandwidth_data_for_ids(	char** ids, 
+						unsigned long num_ids, 
+						unsigned char get_history, 
+						unsigned long* num_ips, 
+						void** data, 
+						unsigned long max_wait_milliseconds
+						);
+
+static int visit_bandwidth_data(		char* id, 
+						unsigned char get_history, 
+						unsigned long* num_ips, 
+						bw_record_visitor visit, 
+						void* visit_arg, 
+						unsigned long max_wait_milliseconds
+						);
+
 
 /* functions used to send/restore data to kernel module */
 static int set_ip_block(			void* ip_block_data, 
@@ -91,6 +208,52 @@ static int set_bandwidth_data(			char* id,
 						);
 
 /* utility i/o functions when saving/restoring data to/from file */
+static int write_changed_blocks(		char* out_file_path,
+						unsigned char* data,
+						unsigned long length
+						);
+static int write_new_backup_file(		char* out_file_path,
+						unsigned char* file_data,
+						unsigned long file_length
+						);
+static uint32_t backup_checksum(		unsigned char* data,
+						unsigned long length
+						);
+static unsigned char* backup_file_data(		unsigned char* file_data,
+						unsigned long* length
+						);
+
+static int open_history_writer(			history_file_writer* writer);
+static int write_history_record(		void* record, 
+						void* writer
+						);
+static int close_history_writer(		history_file_writer* writer, 
+						char* out_file_path
+						);
+
+static int print_history_record(		void* record, 
+						void* printer
+						);
+
+static int compare_history_index(		const void* a, 
+						const void* b
+						);
+static unsigned char* map_history_file(		char* in_file_path, 
+						unsigned long* length
+						);
+static ip_bw_history_file_header* get_v2_history_header(	unsigned char* map, 
+						unsigned long length
+						);
+static int read_v2_history(			unsigned char* map, 
+						unsigned long length, 
+						ip_bw_history_file_index* entry, 
+						ip_bw_history* history
+						);
+static ip_bw_history* read_v1_histories(	unsigned char* map, 
+						unsigned long length, 
+						unsigned long* num_ips
+						);
+
 static unsigned char* read_entire_file(		FILE* in, 
 						unsigned long read_block_size, 
 						unsigned long *length
@@ -106,13 +269,6 @@ static char** split_on_separators(		char* line,
 
 
 
-static int get_sem_val(int sid, int member)
-{
-        int semval;
-        semval = semctl(sid, member, GETVAL, 0);
-        return(semval);
-}
-
 static int get_sem(int *sid, key_t key)
 {
         int cntr;
@@ -138,48 +294,78 @@ static int get_sem(int *sid, key_t key)
 }
 
 
-static int lock_sem(int sid)
+/*
+ * The lock is taken with SEM_UNDO, so if we die holding it the kernel
+ * releases it for us, and with a blocking semtimedop, so waiters are woken
+ * as soon as it's released instead of polling for it.
+ */
+static int lock_sem(int sid, unsigned long max_wait_milliseconds)
 {
-	int member = 0;
-        struct sembuf sem_lock={ 0, -1, IPC_NOWAIT};
+	struct sembuf sem_lock = { 0, -1, SEM_UNDO };
+	struct timespec start;
+	struct timespec now;
 	int success = 0;
-	
-	//printf("locking sem, member count = %d\n", get_sem_member_count(sid)  );
-
-       	/* Attempt to lock the semaphore set */
-	int semval = get_sem_val(sid, member);
-	if(semval > 0)
-       	{
-       		sem_lock.sem_num = member;
-       		if((semop(sid, &sem_lock, 1)) != -1)
+	int done = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while(!done)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		unsigned long waited = (unsigned long)((now.tv_sec - start.tv_sec)*1000 + (now.tv_nsec - start.tv_nsec)/1000000);
+		unsigned long remaining = waited < max_wait_milliseconds ? max_wait_milliseconds - waited : 0;
+		struct timespec timeout = { (time_t)(remaining/1000), (long)((remaining % 1000)*1000000) };
+
+		if(semtimedop(sid, &sem_lock, 1, &timeout) == 0)
 		{
 			success = 1;
+			done = 1;
+		}
+		else
+		{
+			/* only a signal interrupting the wait is worth retrying */
+			done = (errno == EINTR && remaining > 0) ? 0 : 1;
 		}
 	}
 
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	record_lock_wait((unsigned long)((now.tv_sec - start.tv_sec)*1000000 + (now.tv_nsec - start.tv_nsec)/1000), success);
+
 	return success;
 }
 
 static int unlock_sem(int sid)
 {
-	int member = 0;
-        struct sembuf sem_unlock={ member, 1, IPC_NOWAIT};
-	
-	/* will fail if we can't can't unlock semaphore for some reason, 
-	 * will NOT fail if semaphore is already unlocked
-	 */
-	int success = 1; 
+	struct sembuf sem_unlock = { 0, 1, SEM_UNDO };
+	return semop(sid, &sem_unlock, 1) == -1 ? 0 : 1;
+}
 
+static void record_lock_wait(unsigned long wait_microseconds, int got_lock)
+{
+	if(got_lock)
+	{
+		int bucket = 0;
+		unsigned long bucket_max = 1000;
+		while(wait_microseconds >= bucket_max && bucket < BANDWIDTH_LOCK_WAIT_BUCKETS-1)
+		{
+			bucket_max = bucket_max*2;
+			bucket++;
+		}
+		lock_wait_histogram[bucket]++;
+	}
+	else
+	{
+		lock_wait_timeouts++;
+	}
+}
 
-	/* Is the semaphore set locked? */
-	int semval = get_sem_val(sid, member);
-	if(semval == 0)
+unsigned long get_lock_wait_histogram(unsigned long* histogram)
+{
+	int bucket;
+	for(bucket=0; bucket < BANDWIDTH_LOCK_WAIT_BUCKETS; bucket++)
 	{
-		/* it's locked, unlock it */
-		sem_unlock.sem_num = member;
-        	success = ((semop(sid, &sem_unlock, 1)) == -1) ? 0 : 1;
+		histogram[bucket] = lock_wait_histogram[bucket];
 	}
-	return success;
+	return lock_wait_timeouts;
 }
 
 
@@ -191,31 +377,22 @@ static int lock(unsigned long max_wait_milliseconds)
 	{
 		get_sem(&bandwidth_semaphore, (key_t)(BANDWIDTH_SEMAPHORE_KEY) );
 	}
-	if(bandwidth_semaphore != -1)
+	if(bandwidth_semaphore != -1 && !lock_held)
 	{
-		do
-		{
-			locked = lock_sem(bandwidth_semaphore);
-			if(locked == 0 && max_wait_milliseconds > 25)
-			{
-				usleep(1000*25);
-			}
-			max_wait_milliseconds = max_wait_milliseconds > 25 ? max_wait_milliseconds - 25 : 0;
-		} while(locked == 0 && max_wait_milliseconds > 0);
+		locked = lock_sem(bandwidth_semaphore, max_wait_milliseconds);
+		lock_held = locked;
 	}
 	return locked;
 }
 
+/* only ever release a lock we hold, releasing someone else's would let two queries in at once */
 static int unlock(void)
 {
-	int unlocked = 0;
-	if(bandwidth_semaphore == -1)
-	{
-		get_sem(&bandwidth_semaphore, (key_t)(BANDWIDTH_SEMAPHORE_KEY) );
-	}
-	if(bandwidth_semaphore != -1)
+	int unlocked = 1;
+	if(bandwidth_semaphore != -1 && lock_held)
 	{
 		unlocked = unlock_sem(bandwidth_semaphore);
+		lock_held = unlocked ? 0 : 1;
 	}
 	return unlocked;
 	
@@ -388,7 +565,12 @@ static void parse_returned_ip_data(	void *out_data,
 }
 
 
-static int get_bandwidth_data(char* id, unsigned char get_history, char* ip, unsigned long* num_ips, void** data, unsigned long max_wait_milliseconds)
+/*
+ * Runs the (possibly multi-request) query for one id on an already open socket.
+ * Caller must hold the lock.  If visit is non-NULL no table is built, each
+ * record is decoded into one scratch record and handed to visit instead.
+ */
+static int query_bandwidth_data(int sockfd, char* id, unsigned char get_history, char* ip, unsigned long* num_ips, void** data, bw_record_visitor visit, void* visit_arg)
 {	
 	unsigned char buf[BANDWIDTH_QUERY_LENGTH];
 	memset(buf, '\0',  BANDWIDTH_QUERY_LENGTH);
@@ -398,13 +580,6 @@ static int get_bandwidth_data(char* id, unsigned char get_history, char* ip, uns
 	*data = NULL;
 	*num_ips = 0;
 
-	int got_lock = lock(max_wait_milliseconds);
-	int sockfd = -1;
-	if(got_lock)
-	{
-		sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
-	}
-
 	uint32_t* family = (uint32_t*)buf;
 	uint32_t* request_ip = (uint32_t*)(buf + 4);
 	uint32_t* request_index = (uint32_t*)(buf + 20);
@@ -459,7 +634,7 @@ static int get_bandwidth_data(char* id, unsigned char get_history, char* ip, uns
 	uint32_t data_index = 0;
 	uint32_t next_request_index = 0;
 
-	while(!done && sockfd >= 0 && got_lock)
+	while(!done && sockfd >= 0)
 	{
 		uint32_t size = BANDWIDTH_QUERY_LENGTH;
 		getsockopt(sockfd, IPPROTO_IP, BANDWIDTH_GET, buf, &size);
@@ -478,7 +653,12 @@ static int get_bandwidth_data(char* id, unsigned char get_history, char* ip, uns
 			time_t reset_time                  = ip_bw_data->reset_time;
 			unsigned char is_constant_interval = ip_bw_data->reset_is_constant_interval;
 			
-			if(!data_initialized)
+			if(!data_initialized && visit != NULL)
+			{
+				*num_ips = total_ips;
+				data_initialized = 1;
+			}
+			else if(!data_initialized)
 			{
 				*num_ips = total_ips;
 				if(get_history)
@@ -496,12 +676,27 @@ static int get_bandwidth_data(char* id, unsigned char get_history, char* ip, uns
 
 			int response_index=0;
 			uint32_t buffer_index = 30;
-			for(response_index=0; response_index < response_ips; response_index++)
+			int stopped = 0;
+			for(response_index=0; response_index < response_ips && !stopped; response_index++)
 			{
-				parse_returned_ip_data(*data, &data_index, buf, &buffer_index, get_history, reset_interval, reset_time, is_constant_interval);
+				if(visit != NULL)
+				{
+					union { ip_bw usage; ip_bw_history history; } record;
+					uint32_t record_index = 0;
+					parse_returned_ip_data(&record, &record_index, buf, &buffer_index, get_history, reset_interval, reset_time, is_constant_interval);
+					stopped = visit(&record, visit_arg);
+					if(get_history)
+					{
+						free(record.history.history_bws);
+					}
+				}
+				else
+				{
+					parse_returned_ip_data(*data, &data_index, buf, &buffer_index, get_history, reset_interval, reset_time, is_constant_interval);
+				}
 			}
 			next_request_index = next_request_index + response_ips;
-			done = next_request_index < total_ips ? 0 : 1;
+			done = next_request_index < total_ips && !stopped ? 0 : 1;
 			if(!done)
 			{
 				memset(buf, '\0',  BANDWIDTH_QUERY_LENGTH);
@@ -544,7 +739,7 @@ static int get_bandwidth_data(char* id, unsigned char get_history, char* ip, uns
 			}
 		}
 	}
-	if( (error != 0) && data_initialized)
+	if( (error != 0) && data_initialized && visit == NULL)
 	{
 		if(get_history)
 		{
@@ -558,16 +753,81 @@ static int get_bandwidth_data(char* id, unsigned char get_history, char* ip, uns
 		*num_ips = 0;
 	}
 
-	if(sockfd >= 0)
+	return sockfd >= 0 && (error == 0);
+}
+
+static int get_bandwidth_data(char* id, unsigned char get_history, char* ip, unsigned long* num_ips, void** data, unsigned long max_wait_milliseconds)
+{
+	int success = 0;
+	*data = NULL;
+	*num_ips = 0;
+
+	int got_lock = lock(max_wait_milliseconds);
+	if(got_lock)
 	{
-		close(sockfd);
+		int sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+		success = query_bandwidth_data(sockfd, id, get_history, ip, num_ips, data, NULL, NULL);
+		if(sockfd >= 0)
+		{
+			close(sockfd);
+		}
+		unlock();
+	}
+	return success;
+}
+
+/*
+ * Queries every id in one locked session over one socket, so a caller
+ * reading many rules doesn't pay a semaphore round trip and socket
+ * setup per id.  num_ips and data must have room for num_ids entries;
+ * ids that could not be read get data[i] == NULL.  Returns the number
+ * of ids read successfully (0 if the lock could not be obtained).
+ */
+static unsigned long get_bandwidth_data_for_ids(char** ids, unsigned long num_ids, unsigned char get_history, unsigned long* num_ips, void** data, unsigned long max_wait_milliseconds)
+{
+	unsigned long num_succeeded = 0;
+	unsigned long id_index;
+	for(id_index=0; id_index < num_ids; id_index++)
+	{
+		data[id_index] = NULL;
+		num_ips[id_index] = 0;
 	}
+
+	int got_lock = lock(max_wait_milliseconds);
 	if(got_lock)
 	{
+		int sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+		for(id_index=0; id_index < num_ids && sockfd >= 0; id_index++)
+		{
+			num_succeeded = num_succeeded + query_bandwidth_data(sockfd, ids[id_index], get_history, "ALL", num_ips + id_index, data + id_index, NULL, NULL);
+		}
+		if(sockfd >= 0)
+		{
+			close(sockfd);
+		}
 		unlock();
 	}
+	return num_succeeded;
+}
+
+static int visit_bandwidth_data(char* id, unsigned char get_history, unsigned long* num_ips, bw_record_visitor visit, void* visit_arg, unsigned long max_wait_milliseconds)
+{
+	int success = 0;
+	void* unused_data = NULL;
+	*num_ips = 0;
 
-	return got_lock && (error == 0);
+	int got_lock = lock(max_wait_milliseconds);
+	if(got_lock)
+	{
+		int sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+		success = query_bandwidth_data(sockfd, id, get_history, "ALL", num_ips, &unused_data, visit, visit_arg);
+		if(sockfd >= 0)
+		{
+			close(sockfd);
+		}
+		unlock();
+	}
+	return success;
 }
 
 
@@ -974,6 +1234,24 @@ int get_ip_bandwidth_usage_for_rule_id(char* id,  char* ip, ip_bw** data, unsign
 	return get_bandwidth_data(id, 0, ip, &num_ips, (void*)data, max_wait_milliseconds);
 }
 
+unsigned long get_all_bandwidth_history_for_rule_ids(char** ids, unsigned long num_ids, unsigned long* num_ips, ip_bw_history** data, unsigned long max_wait_milliseconds)
+{
+	return get_bandwidth_data_for_ids(ids, num_ids, 1, num_ips, (void**)data, max_wait_milliseconds);
+}
+unsigned long get_all_bandwidth_usage_for_rule_ids(char** ids, unsigned long num_ids, unsigned long* num_ips, ip_bw** data, unsigned long max_wait_milliseconds)
+{
+	return get_bandwidth_data_for_ids(ids, num_ids, 0, num_ips, (void**)data, max_wait_milliseconds);
+}
+
+int for_each_bandwidth_history_for_rule_id(char* id, ip_bw_history_visitor visit, void* arg, unsigned long* num_ips, unsigned long max_wait_milliseconds)
+{
+	return visit_bandwidth_data(id, 1, num_ips, (bw_record_visitor)visit, arg, max_wait_milliseconds);
+}
+int for_each_bandwidth_usage_for_rule_id(char* id, ip_bw_visitor visit, void* arg, unsigned long* num_ips, unsigned long max_wait_milliseconds)
+{
+	return visit_bandwidth_data(id, 0, num_ips, (bw_record_visitor)visit, arg, max_wait_milliseconds);
+}
+
 
 int set_bandwidth_history_for_rule_id(char* id, unsigned char zero_unset, unsigned long num_ips, ip_bw_history* data, unsigned long max_wait_milliseconds)
 {
@@ -995,7 +1273,9 @@ int save_usage_to_file(ip_bw* data, unsigned long num_ips, char* out_file_path)
 {
 		
 	int success = 0;
-	FILE* out_file = fopen(out_file_path, "w");
+	char* out_data = NULL;
+	size_t out_length = 0;
+	FILE* out_file = open_memstream(&out_data, &out_length);
 	if(out_file != NULL)
 	{
 		//dump backup time
@@ -1029,7 +1309,8 @@ int save_usage_to_file(ip_bw* data, unsigned long num_ips, char* out_file_path)
 			}
 		}
 		fclose(out_file);
-		success = 1;
+		success = write_changed_blocks(out_file_path, (unsigned char*)out_data, (unsigned long)out_length);
+		free(out_data);
 	}
 	return success;
 }
@@ -1038,95 +1319,373 @@ int save_usage_to_file(ip_bw* data, unsigned long num_ips, char* out_file_path)
 int save_history_to_file(ip_bw_history* data, unsigned long num_ips, char* out_file_path)
 {
 	int success = 0;
-	FILE* out_file = fopen(out_file_path, "wb");
-	if(out_file != NULL)
+	history_file_writer writer;
+	if(open_history_writer(&writer))
 	{
-		//dump number of ips & history interval parameter 
-		//note that we assume interval is same for all histories
-		//(which will be the case if they all come from the same rule id)
-		fwrite((uint32_t*)(&num_ips), 4, 1, out_file);
-		if(num_ips > 0)
+		unsigned long out_index;
+		for(out_index=0; out_index < num_ips; out_index++)
 		{
-			ip_bw_history first = data[0];
-			uint64_t interval = (uint64_t)(first.reset_interval);
-			uint64_t time     = (uint64_t)(first.reset_time);
-			unsigned char is_constant = first.is_constant_interval;
-
-			fwrite( &interval, 8, 1, out_file);
-			fwrite( &time, 8, 1, out_file);
-			fwrite( &is_constant, 1, 1, out_file);
+			write_history_record(data + out_index, &writer);
 		}
+		success = close_history_writer(&writer, out_file_path);
+	}
+	return success;
+}
 
-		unsigned char  bw_fits_in_32bits = 1;
-		uint32_t out_index=0;
-		for(out_index=0; out_index < num_ips && bw_fits_in_32bits; out_index++)
+/*
+ * Same file as get_all_bandwidth_history_for_rule_id + save_history_to_file,
+ * but records are written as they are decoded, so the history table is
+ * never held in memory as ip_bw_history structs.
+ */
+int save_history_for_rule_id_to_file(char* id, char* out_file_path, unsigned long* num_ips, unsigned long max_wait_milliseconds)
+{
+	int success = 0;
+	history_file_writer writer;
+	*num_ips = 0;
+	if(open_history_writer(&writer))
+	{
+		success = visit_bandwidth_data(id, 1, num_ips, write_history_record, &writer, max_wait_milliseconds);
+		success = close_history_writer(&writer, success ? out_file_path : NULL);
+	}
+	return success;
+}
+
+/* as above for several ids, all read in one locked session.  saved (if not NULL) gets per-id results */
+unsigned long save_histories_for_rule_ids_to_files(char** ids, char** out_file_paths, unsigned long num_ids, int* saved, unsigned long max_wait_milliseconds)
+{
+	unsigned long num_succeeded = 0;
+	unsigned long id_index;
+	for(id_index=0; id_index < num_ids && saved != NULL; id_index++)
+	{
+		saved[id_index] = 0;
+	}
+
+	int got_lock = lock(max_wait_milliseconds);
+	if(got_lock)
+	{
+		int sockfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+		for(id_index=0; id_index < num_ids && sockfd >= 0; id_index++)
 		{
-			uint32_t node_index = 0;
-			ip_bw_history next = data[out_index];
-			for(node_index=0; node_index < next.num_nodes && bw_fits_in_32bits; node_index++)
+			history_file_writer writer;
+			if(open_history_writer(&writer))
 			{
-				uint64_t bw = (next.history_bws)[node_index];
-				bw_fits_in_32bits = bw_fits_in_32bits && (bw <  INT32_MAX);
+				unsigned long num_ips;
+				void* unused_data = NULL;
+				int id_saved = query_bandwidth_data(sockfd, ids[id_index], 1, "ALL", &num_ips, &unused_data, write_history_record, &writer);
+				id_saved = close_history_writer(&writer, id_saved ? out_file_paths[id_index] : NULL);
+				num_succeeded = num_succeeded + id_saved;
+				if(saved != NULL)
+				{
+					saved[id_index] = id_saved;
+				}
 			}
 		}
+		if(sockfd >= 0)
+		{
+			close(sockfd);
+		}
+		unlock();
+	}
+	return num_succeeded;
+}
 
-		//dump data for each ip
-		for(out_index=0; out_index < num_ips; out_index++)
+/* 
+ * history files are built in memory and then handed to write_changed_blocks,
+ * index entries are collected and node blocks appended as records arrive, and
+ * the index is sorted and everything laid out in one buffer on close.
+ * Closing with a NULL path just discards what was collected.
+ */
+static int open_history_writer(history_file_writer* writer)
+{
+	memset(&(writer->header), 0, sizeof(ip_bw_history_file_header));
+	writer->header.magic = BANDWIDTH_HISTORY_FILE_MAGIC;
+	writer->header.version = BANDWIDTH_HISTORY_FILE_VERSION;
+	writer->header.index_entry_size = sizeof(ip_bw_history_file_index);
+	writer->index = NULL;
+	writer->max_ips = 0;
+	writer->nodes_data = NULL;
+	writer->nodes_length = 0;
+	writer->nodes_written = 0;
+	writer->nodes_file = open_memstream(&(writer->nodes_data), &(writer->nodes_length));
+	return writer->nodes_file != NULL;
+}
+
+static int write_history_record(void* record, void* writer_ptr)
+{
+	ip_bw_history* next = (ip_bw_history*)record;
+	history_file_writer* writer = (history_file_writer*)writer_ptr;
+
+	//note that we assume interval is same for all histories
+	//(which will be the case if they all come from the same rule id)
+	if(writer->header.num_ips == 0)
+	{
+		writer->header.reset_interval = (uint64_t)next->reset_interval;
+		writer->header.reset_time = (uint64_t)next->reset_time;
+		writer->header.is_constant_interval = next->is_constant_interval;
+	}
+	if(writer->header.num_ips == writer->max_ips)
+	{
+		writer->max_ips = writer->max_ips == 0 ? 64 : writer->max_ips*2;
+		writer->index = (ip_bw_history_file_index*)realloc(writer->index, writer->max_ips*sizeof(ip_bw_history_file_index));
+		if(writer->index == NULL)
 		{
-			ip_bw_history next = data[out_index];
-			
-			fwrite( &(next.family), 4, 1, out_file);
-			fwrite( &(next.ip), 16, 1, out_file);
-			fwrite( &(next.num_nodes), 4, 1, out_file);
-			if(next.num_nodes == 0)
+			fprintf(stderr, "ERROR: MALLOC FAILURE!\n");
+			exit(1);
+		}
+	}
+
+	ip_bw_history_file_index* entry = writer->index + writer->header.num_ips;
+	memset(entry, 0, sizeof(ip_bw_history_file_index));
+	entry->family = next->family;
+	memcpy(entry->ip, next->ip, sizeof(entry->ip));
+	entry->num_nodes = next->history_bws == NULL ? 0 : next->num_nodes;
+	if(entry->num_nodes > 0)
+	{
+		entry->first_start = (uint64_t)next->first_start;
+		entry->first_end   = (uint64_t)next->first_end;
+		entry->last_end    = (uint64_t)next->last_end;
+		entry->nodes_offset = writer->nodes_written;
+		fwrite(next->history_bws, sizeof(uint64_t), entry->num_nodes, writer->nodes_file);
+		writer->nodes_written = writer->nodes_written + (entry->num_nodes*sizeof(uint64_t));
+	}
+	writer->header.num_ips = writer->header.num_ips + 1;
+	return 0;
+}
+
+static int close_history_writer(history_file_writer* writer, char* out_file_path)
+{
+	int success = 0;
+	fclose(writer->nodes_file);
+	if(out_file_path != NULL && writer->nodes_length == writer->nodes_written)
+	{
+		unsigned long index_length = writer->header.num_ips*sizeof(ip_bw_history_file_index);
+		unsigned long nodes_start = sizeof(ip_bw_history_file_header) + index_length;
+		unsigned long out_length = nodes_start + writer->nodes_length;
+		unsigned char* out_data = (unsigned char*)malloc(out_length);
+		uint32_t ip_index;
+
+		qsort(writer->index, writer->header.num_ips, sizeof(ip_bw_history_file_index), compare_history_index);
+		for(ip_index=0; ip_index < writer->header.num_ips; ip_index++)
+		{
+			if(writer->index[ip_index].num_nodes > 0)
 			{
-				uint64_t dummy = 0;
-				unsigned char bw_bits = 32;
-				fwrite( &dummy, 8, 1, out_file);
-				fwrite( &dummy, 8, 1, out_file);
-				fwrite( &dummy, 8, 1, out_file);
-				fwrite( &bw_bits,  1, 1, out_file);
+				writer->index[ip_index].nodes_offset = writer->index[ip_index].nodes_offset + nodes_start;
 			}
-			else
+		}
+		memcpy(out_data, &(writer->header), sizeof(ip_bw_history_file_header));
+		if(index_length > 0)
+		{
+			memcpy(out_data + sizeof(ip_bw_history_file_header), writer->index, index_length);
+		}
+		if(writer->nodes_length > 0)
+		{
+			memcpy(out_data + nodes_start, writer->nodes_data, writer->nodes_length);
+		}
+		success = write_changed_blocks(out_file_path, out_data, out_length);
+		free(out_data);
+	}
+	free(writer->nodes_data);
+	free(writer->index);
+	return success;
+}
+
+static int compare_history_index(const void* a, const void* b)
+{
+	const ip_bw_history_file_index* ia = (const ip_bw_history_file_index*)a;
+	const ip_bw_history_file_index* ib = (const ip_bw_history_file_index*)b;
+	int cmp = memcmp(ia->ip, ib->ip, sizeof(ia->ip));
+	if(cmp == 0)
+	{
+		cmp = ia->family == ib->family ? 0 : (ia->family < ib->family ? -1 : 1);
+	}
+	return cmp;
+}
+
+/*
+ * Backups are rewritten every few hours while most of their content stays
+ * the same (between interval rollovers only the current node of each active
+ * ip changes), so rather than truncating and rewriting the whole file only
+ * the BANDWIDTH_BACKUP_BLOCK_SIZE blocks that differ from what's on disk are
+ * written, adjacent changed blocks in one write.  jffs2 only writes the range
+ * that was actually written, so this is what saves erase cycles on flash.
+ *
+ * The backup_file_header is left for last: the changed blocks are synced
+ * before it is updated, so its checksum only ever matches complete data.
+ * The header write itself isn't synced, callers backing up several files
+ * can sync once when they're all done.  New files (and ones without a
+ * header yet) are written in full anyway, so they go to a temporary file
+ * that is renamed into place.
+ */
+static int write_changed_blocks(char* out_file_path, unsigned char* data, unsigned long length)
+{
+	int success = 0;
+	backup_file_header header;
+	unsigned long header_length = sizeof(backup_file_header);
+	unsigned long file_length = header_length + length;
+	unsigned char* file_data = (unsigned char*)malloc(file_length);
+	unsigned char* old_data = NULL;
+	unsigned long old_length = 0;
+	unsigned long written = 0;
+
+	header.magic = BANDWIDTH_BACKUP_FILE_MAGIC;
+	header.checksum = backup_checksum(data, length);
+	header.length = (uint64_t)length;
+	memcpy(file_data, &header, header_length);
+	if(length > 0)
+	{
+		memcpy(file_data + header_length, data, length);
+	}
+
+	int fd = open(out_file_path, O_RDWR);
+	if(fd >= 0)
+	{
+		struct stat old_stat;
+		if(fstat(fd, &old_stat) == 0 && old_stat.st_size > 0)
+		{
+			old_data = (unsigned char*)malloc(old_stat.st_size);
+			ssize_t read_length;
+			while(old_length < (unsigned long)old_stat.st_size && (read_length = read(fd, old_data + old_length, old_stat.st_size - old_length)) > 0)
 			{
-				uint32_t node_index = 0;
-				uint64_t first_start = (uint64_t)next.first_start;
-				uint64_t first_end   = (uint64_t)next.first_end;
-				uint64_t last_end    = (uint64_t)next.last_end;
-				unsigned char  bw_bits = 32;
-				for(node_index=0; node_index < next.num_nodes && bw_bits == 32; node_index++)
-				{
-					uint64_t bw = (next.history_bws)[node_index];
-					bw_bits = bw_bits == 32 && (bw <  INT32_MAX) ? 32 : 64;
-				}
+				old_length = old_length + read_length;
+			}
+		}
+	}
 
-				
-				fwrite( &first_start, 8, 1, out_file);
-				fwrite( &first_end,   8, 1, out_file);
-				fwrite( &last_end,    8, 1, out_file);
-				fwrite( &bw_bits,     1, 1, out_file);
-				for(node_index=0; node_index < next.num_nodes; node_index++)
-				{
-					if(bw_bits == 32)
-					{
-						uint32_t bw = (uint32_t)(next.history_bws)[node_index];
-						fwrite( &bw, 4, 1, out_file);
+	if(fd < 0 || old_length < header_length || ((backup_file_header*)old_data)->magic != BANDWIDTH_BACKUP_FILE_MAGIC)
+	{
+		success = write_new_backup_file(out_file_path, file_data, file_length);
+		written = success ? file_length : 0;
+		old_length = success ? file_length : old_length;
+	}
+	else
+	{
+		unsigned long offset = 0;
+		unsigned long run_start = 0;
+		unsigned long run_length = 0;
 
-					}
-					else
-					{
-						uint64_t bw = (next.history_bws)[node_index];
-						fwrite( &bw, 8, 1, out_file);
-					}
+		success = 1;
+		while(offset < file_length && success)
+		{
+			unsigned long block_length = file_length - offset < BANDWIDTH_BACKUP_BLOCK_SIZE ? file_length - offset : BANDWIDTH_BACKUP_BLOCK_SIZE;
+			int changed = offset + block_length > old_length || memcmp(old_data + offset, file_data + offset, block_length) != 0;
+			if(changed)
+			{
+				run_start = run_length == 0 ? offset : run_start;
+				run_length = run_length + block_length;
+			}
+			offset = offset + block_length;
+			if(run_length > 0 && (!changed || offset >= file_length))
+			{
+				/* the header itself goes last, below */
+				unsigned long write_start = run_start < header_length ? header_length : run_start;
+				unsigned long write_length = run_start + run_length - write_start;
+				if(write_length > 0)
+				{
+					success = pwrite(fd, file_data + write_start, write_length, (off_t)write_start) == (ssize_t)write_length ? 1 : 0;
 				}
+				written = written + run_length;
+				run_length = 0;
 			}
 		}
-		fclose(out_file);
-		success = 1;
+		if(success && old_length != file_length)
+		{
+			success = ftruncate(fd, (off_t)file_length) == 0 ? 1 : 0;
+		}
+		if(success && (written > 0 || old_length != file_length))
+		{
+			success = fsync(fd) == 0 && pwrite(fd, file_data, header_length, 0) == (ssize_t)header_length ? 1 : 0;
+		}
+	}
+	if(fd >= 0)
+	{
+		close(fd);
 	}
+	if(old_data != NULL)
+	{
+		free(old_data);
+	}
+	free(file_data);
+
+	backup_bytes_written = backup_bytes_written + written;
+	backup_bytes_total = backup_bytes_total + file_length;
+	backup_files_written = backup_files_written + (written > 0 || old_length != file_length ? 1 : 0);
+	backup_files_total++;
+
 	return success;
 }
 
+static int write_new_backup_file(char* out_file_path, unsigned char* file_data, unsigned long file_length)
+{
+	int success = 0;
+	char* tmp_path = (char*)malloc(strlen(out_file_path) + 8);
+	sprintf(tmp_path, "%s.XXXXXX", out_file_path);
+	int fd = mkstemp(tmp_path);
+	if(fd >= 0)
+	{
+		unsigned long file_written = 0;
+		ssize_t write_length = 0;
+		while(file_written < file_length && (write_length = write(fd, file_data + file_written, file_length - file_written)) > 0)
+		{
+			file_written = file_written + write_length;
+		}
+		success = file_written == file_length && fchmod(fd, 0644) == 0 && fsync(fd) == 0 ? 1 : 0;
+		close(fd);
+		success = success && rename(tmp_path, out_file_path) == 0 ? 1 : 0;
+		if(!success)
+		{
+			unlink(tmp_path);
+		}
+	}
+	free(tmp_path);
+	return success;
+}
+
+static uint32_t backup_checksum(unsigned char* data, unsigned long length)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261U;
+	unsigned long index;
+	for(index=0; index < length; index++)
+	{
+		hash = (hash ^ data[index]) * 16777619U;
+	}
+	return hash;
+}
+
+/*
+ * Returns where the saved data in a backup file starts and sets length to
+ * its length, or NULL if the file was left partly written.  Files without
+ * a backup_file_header are returned as they are.
+ */
+static unsigned char* backup_file_data(unsigned char* file_data, unsigned long* length)
+{
+	backup_file_header header;
+	if(*length < sizeof(backup_file_header))
+	{
+		return file_data;
+	}
+	memcpy(&header, file_data, sizeof(backup_file_header));
+	if(header.magic != BANDWIDTH_BACKUP_FILE_MAGIC)
+	{
+		return file_data;
+	}
+	if(header.length != (uint64_t)(*length - sizeof(backup_file_header)) || header.checksum != backup_checksum(file_data + sizeof(backup_file_header), header.length))
+	{
+		*length = 0;
+		return NULL;
+	}
+	*length = (unsigned long)header.length;
+	return file_data + sizeof(backup_file_header);
+}
+
+void get_backup_write_stats(unsigned long long* bytes_written, unsigned long long* bytes_total, unsigned long* files_written, unsigned long* files_total)
+{
+	*bytes_written = backup_bytes_written;
+	*bytes_total   = backup_bytes_total;
+	*files_written = backup_files_written;
+	*files_total   = backup_files_total;
+}
+
 
 ip_bw* load_usage_from_file(char* in_file_path, unsigned long* num_ips, time_t* last_backup)
 {
@@ -1139,8 +1698,10 @@ ip_bw* load_usage_from_file(char* in_file_path, unsigned long* num_ips, time_t*
 		unsigned long num_data_parts = 0;
 		char* file_data = read_entire_file(in_file, 4086, &num_data_parts);
 		fclose(in_file);
+		/* read_entire_file leaves a '\0' after the data */
+		char* usage_data = (char*)backup_file_data((unsigned char*)file_data, &num_data_parts);
 		char whitespace[] =  {'\n', '\r', '\t', ' '};
-		char** data_parts = split_on_separators(file_data, whitespace, 4, -1, 0, &num_data_parts);
+		char** data_parts = split_on_separators(usage_data == NULL ? "" : usage_data, whitespace, 4, -1, 0, &num_data_parts);
 		free(file_data);
 
 		*num_ips = (num_data_parts/3) + 1;
@@ -1224,83 +1785,298 @@ ip_bw_history* load_history_from_file(char* in_file_path, unsigned long* num_ips
 {
 	ip_bw_history* data = NULL;
 	*num_ips = 0;
-	FILE* in_file = fopen(in_file_path, "rb");
-	if(in_file != NULL)
-	{
-		uint64_t reset_interval;
-		uint64_t reset_time;
-		unsigned char is_constant_interval;
-		
-		uint32_t nips = 0;
-		fread(&nips, 4, 1, in_file);
-		*num_ips = (unsigned long)nips;
 
-		if(*num_ips > 0)
+	unsigned long file_length = 0;
+	unsigned char* file_map = map_history_file(in_file_path, &file_length);
+	unsigned long length = file_length;
+	unsigned char* map = file_map == NULL ? NULL : backup_file_data(file_map, &length);
+	if(map != NULL && length >= 4)
+	{
+		ip_bw_history_file_header* header = get_v2_history_header(map, length);
+		if(header != NULL)
+		{
+			ip_bw_history_file_index* index = (ip_bw_history_file_index*)(map + sizeof(ip_bw_history_file_header));
+			uint32_t ip_index;
+			if(header->num_ips > 0)
+			{
+				data = (ip_bw_history*)malloc(header->num_ips * sizeof(ip_bw_history));
+			}
+			for(ip_index=0; ip_index < header->num_ips && data != NULL; ip_index++)
+			{
+				if(!read_v2_history(map, length, index + ip_index, data + ip_index))
+				{
+					free_ip_bw_histories(data, ip_index);
+					data = NULL;
+				}
+			}
+			*num_ips = data == NULL ? 0 : header->num_ips;
+		}
+		else if(*((uint32_t*)map) != BANDWIDTH_HISTORY_FILE_MAGIC)
 		{
-			fread(&reset_interval, 8, 1, in_file);
-			fread(&reset_time, 8, 1, in_file);
-			fread(&is_constant_interval, 1, 1, in_file);
-			data = (ip_bw_history*)malloc( (*num_ips) * sizeof(ip_bw_history));
+			data = read_v1_histories(map, length, num_ips);
 		}
+	}
+	if(file_map != NULL)
+	{
+		munmap(file_map, file_length);
+	}
+	return data;
+}
 
-		uint32_t ip_index;
-		for(ip_index=0; ip_index < *num_ips; ip_index++)
+/*
+ * Loads the history of one ip ("COMBINED" or 0.0.0.0 for the combined
+ * total).  For version 2 files this is a binary search of the mmap'd index,
+ * only the requested history is copied.  Returns 0 if the ip isn't there.
+ */
+int load_ip_history_from_file(char* in_file_path, char* ip, ip_bw_history* history)
+{
+	int found = 0;
+	uint32_t family = AF_INET;
+	uint32_t ip_words[4] = { 0, 0, 0, 0 };
+	int any_family = 0;
+	struct in_addr addr;
+	struct in6_addr addr6;
+	if(strcmp(ip, "COMBINED") == 0 || strcmp(ip, "combined") == 0)
+	{
+		any_family = 1;
+	}
+	else if(inet_pton(AF_INET, ip, &addr) > 0)
+	{
+		ip_words[0] = (uint32_t)addr.s_addr;
+		any_family = ip_words[0] == 0;
+	}
+	else if(inet_pton(AF_INET6, ip, &addr6) > 0)
+	{
+		family = AF_INET6;
+		memcpy(ip_words, addr6.s6_addr32, sizeof(ip_words));
+		any_family = memcmp(ip_words, (uint32_t[4]){ 0, 0, 0, 0 }, sizeof(ip_words)) == 0;
+	}
+	else
+	{
+		return 0;
+	}
+
+	unsigned long file_length = 0;
+	unsigned char* file_map = map_history_file(in_file_path, &file_length);
+	unsigned long length = file_length;
+	unsigned char* map = file_map == NULL ? NULL : backup_file_data(file_map, &length);
+	if(map != NULL && length >= 4)
+	{
+		ip_bw_history_file_header* header = get_v2_history_header(map, length);
+		if(header != NULL)
 		{
-			uint32_t family;
-			uint32_t ip[4];
-			uint32_t num_nodes;
-			uint64_t first_start;	
-			uint64_t first_end;
-			uint64_t last_end;
-			unsigned char bw_bits;
-
-			fread(&family, 4, 1, in_file);
-			fread(&ip, 16, 1, in_file);
-			fread(&num_nodes, 4, 1, in_file);
-			fread(&first_start, 8, 1, in_file);
-			fread(&first_end, 8, 1, in_file);
-			fread(&last_end, 8, 1, in_file);
-			fread(&bw_bits, 1, 1, in_file);
-
-			ip_bw_history next;
-			next.reset_interval       = (time_t)reset_interval;
-			next.reset_time           = (time_t)reset_time;
-			next.is_constant_interval = is_constant_interval;
-			next.family               = family;
-			*next.ip                  = *ip;
-			*(next.ip+1)              = *(ip+1);
-			*(next.ip+2)              = *(ip+2);
-			*(next.ip+3)              = *(ip+3);
-			next.num_nodes            = num_nodes;
-			next.first_start          = (time_t)first_start;
-			next.first_end            = (time_t)first_end;
-			next.last_end             = (time_t)last_end;
-			next.history_bws          = NULL;
-			if(next.num_nodes > 0)
+			ip_bw_history_file_index* index = (ip_bw_history_file_index*)(map + sizeof(ip_bw_history_file_header));
+			
+			/* first entry with this ip, then step over the (at most two) families */
+			uint32_t low = 0;
+			uint32_t high = header->num_ips;
+			while(low < high)
 			{
-				next.history_bws = malloc( next.num_nodes * sizeof(uint64_t) );
-				uint32_t node_index = 0;
-				for(node_index=0; node_index < next.num_nodes; node_index++)
+				uint32_t mid = low + ((high - low)/2);
+				if(memcmp(index[mid].ip, ip_words, sizeof(ip_words)) < 0)
 				{
-					if(bw_bits == 32)
-					{
-						uint32_t nextbw = 0;
-						fread(&nextbw, 4, 1, in_file);
-						(next.history_bws)[node_index] = (uint64_t)nextbw;
+					low = mid + 1;
+				}
+				else
+				{
+					high = mid;
+				}
+			}
+			for( ; low < header->num_ips && !found && memcmp(index[low].ip, ip_words, sizeof(ip_words)) == 0; low++)
+			{
+				if(any_family || index[low].family == family)
+				{
+					found = read_v2_history(map, length, index + low, history);
+				}
+			}
+		}
+		else if(*((uint32_t*)map) != BANDWIDTH_HISTORY_FILE_MAGIC)
+		{
+			unsigned long num_ips = 0;
+			ip_bw_history* histories = read_v1_histories(map, length, &num_ips);
+			unsigned long ip_index;
+			for(ip_index=0; ip_index < num_ips; ip_index++)
+			{
+				if(!found && memcmp(histories[ip_index].ip, ip_words, sizeof(ip_words)) == 0 && (any_family || histories[ip_index].family == family))
+				{
+					*history = histories[ip_index];
+					histories[ip_index].history_bws = NULL;
+					found = 1;
+				}
+			}
+			free_ip_bw_histories(histories, num_ips);
+		}
+	}
+	if(file_map != NULL)
+	{
+		munmap(file_map, file_length);
+	}
+	return found;
+}
 
-					}
-					else
-					{
-						uint64_t nextbw = 0;
-						fread(&nextbw, 8, 1, in_file);
-						(next.history_bws)[node_index] = nextbw;
-					}
+static unsigned char* map_history_file(char* in_file_path, unsigned long* length)
+{
+	unsigned char* map = NULL;
+	*length = 0;
+	int fd = open(in_file_path, O_RDONLY);
+	if(fd >= 0)
+	{
+		struct stat st;
+		if(fstat(fd, &st) == 0 && st.st_size >= 4)
+		{
+			map = (unsigned char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(map == MAP_FAILED)
+			{
+				map = NULL;
+			}
+			else
+			{
+				*length = (unsigned long)st.st_size;
+			}
+		}
+		close(fd);
+	}
+	return map;
+}
+
+static ip_bw_history_file_header* get_v2_history_header(unsigned char* map, unsigned long length)
+{
+	ip_bw_history_file_header* header = (ip_bw_history_file_header*)map;
+	if(	length < sizeof(ip_bw_history_file_header) ||
+		header->magic != BANDWIDTH_HISTORY_FILE_MAGIC ||
+		header->version != BANDWIDTH_HISTORY_FILE_VERSION ||
+		header->index_entry_size != sizeof(ip_bw_history_file_index) ||
+		(length - sizeof(ip_bw_history_file_header))/sizeof(ip_bw_history_file_index) < header->num_ips
+		)
+	{
+		header = NULL;
+	}
+	return header;
+}
+
+static int read_v2_history(unsigned char* map, unsigned long length, ip_bw_history_file_index* entry, ip_bw_history* history)
+{
+	ip_bw_history_file_header* header = (ip_bw_history_file_header*)map;
+	if(entry->num_nodes > 0 && (entry->nodes_offset > length || (length - entry->nodes_offset)/sizeof(uint64_t) < entry->num_nodes))
+	{
+		return 0;
+	}
+
+	history->reset_interval       = (time_t)header->reset_interval;
+	history->reset_time           = (time_t)header->reset_time;
+	history->is_constant_interval = header->is_constant_interval;
+	history->family               = entry->family;
+	memcpy(history->ip, entry->ip, sizeof(history->ip));
+	history->num_nodes            = entry->num_nodes;
+	history->first_start          = (time_t)entry->first_start;
+	history->first_end            = (time_t)entry->first_end;
+	history->last_end             = (time_t)entry->last_end;
+	history->history_bws          = NULL;
+	if(entry->num_nodes > 0)
+	{
+		history->history_bws = (uint64_t*)malloc(entry->num_nodes * sizeof(uint64_t));
+		memcpy(history->history_bws, map + entry->nodes_offset, entry->num_nodes * sizeof(uint64_t));
+	}
+	return 1;
+}
+
+/* original format: uint32_t ip count, interval parameters, then each ip with 32 or 64 bit nodes */
+static ip_bw_history* read_v1_histories(unsigned char* map, unsigned long length, unsigned long* num_ips)
+{
+	ip_bw_history* data = NULL;
+	unsigned long offset = 0;
+	uint64_t reset_interval = 0;
+	uint64_t reset_time = 0;
+	unsigned char is_constant_interval = 0;
+	uint32_t nips = 0;
+
+	#define read_v1_field(dst, size) \
+		if(offset + (size) <= length) { memcpy((dst), map + offset, (size)); } \
+		offset = offset + (size);
+
+	*num_ips = 0;
+	read_v1_field(&nips, 4);
+
+	/* each ip takes at least 49 bytes, anything claiming more isn't a history file */
+	if(nips > length/49)
+	{
+		nips = 0;
+	}
+	if(nips > 0)
+	{
+		read_v1_field(&reset_interval, 8);
+		read_v1_field(&reset_time, 8);
+		read_v1_field(&is_constant_interval, 1);
+		data = (ip_bw_history*)malloc( nips * sizeof(ip_bw_history));
+	}
+
+	uint32_t ip_index;
+	for(ip_index=0; ip_index < nips && offset <= length; ip_index++)
+	{
+		uint32_t family = 0;
+		uint32_t ip[4] = { 0, 0, 0, 0 };
+		uint32_t num_nodes = 0;
+		uint64_t first_start = 0;
+		uint64_t first_end = 0;
+		uint64_t last_end = 0;
+		unsigned char bw_bits = 0;
+
+		read_v1_field(&family, 4);
+		read_v1_field(ip, 16);
+		read_v1_field(&num_nodes, 4);
+		read_v1_field(&first_start, 8);
+		read_v1_field(&first_end, 8);
+		read_v1_field(&last_end, 8);
+		read_v1_field(&bw_bits, 1);
+
+		ip_bw_history next;
+		next.reset_interval       = (time_t)reset_interval;
+		next.reset_time           = (time_t)reset_time;
+		next.is_constant_interval = is_constant_interval;
+		next.family               = family;
+		memcpy(next.ip, ip, sizeof(next.ip));
+		next.num_nodes            = num_nodes;
+		next.first_start          = (time_t)first_start;
+		next.first_end            = (time_t)first_end;
+		next.last_end             = (time_t)last_end;
+		next.history_bws          = NULL;
+
+		unsigned long node_size = bw_bits == 32 ? 4 : 8;
+		if(next.num_nodes > 0 && offset <= length && (length - offset)/node_size >= next.num_nodes)
+		{
+			next.history_bws = malloc( next.num_nodes * sizeof(uint64_t) );
+			uint32_t node_index = 0;
+			for(node_index=0; node_index < next.num_nodes; node_index++)
+			{
+				if(bw_bits == 32)
+				{
+					uint32_t nextbw = 0;
+					read_v1_field(&nextbw, 4);
+					(next.history_bws)[node_index] = (uint64_t)nextbw;
+				}
+				else
+				{
+					uint64_t nextbw = 0;
+					read_v1_field(&nextbw, 8);
+					(next.history_bws)[node_index] = nextbw;
 				}
 			}
-			data[ip_index] = next;
 		}
-		fclose(in_file);
+		else if(next.num_nodes > 0)
+		{
+			/* truncated file */
+			break;
+		}
+		data[ip_index] = next;
+	}
+	#undef read_v1_field
+
+	if(ip_index < nips)
+	{
+		free_ip_bw_histories(data, ip_index);
+		data = NULL;
 	}
+	*num_ips = data == NULL ? 0 : (unsigned long)nips;
 	return data;
 }
 
@@ -1345,110 +2121,141 @@ void print_usage(FILE* out, ip_bw* usage, unsigned long num_ips)
 
 void print_histories(FILE* out, char* id, ip_bw_history* histories, unsigned long num_histories, char output_type)
 {
+	history_printer printer;
+	printer.out = out;
+	printer.id = id;
+	printer.output_type = output_type;
+
 	unsigned long history_index = 0;
+	for(history_index=0; history_index < num_histories; history_index++)
+	{
+		print_history_record(histories + history_index, &printer);
+	}
+}
+
+/*
+ * Query and print the histories of one id.  out is often a pipe to a slow
+ * reader, so the table is copied out under the lock and printed after
+ * it is released, a stalled reader never holds up the other bw_* tools.
+ */
+int print_histories_for_rule_id(FILE* out, char* id, char output_type, unsigned long* num_histories, unsigned long max_wait_milliseconds)
+{
+	ip_bw_history* histories = NULL;
+	int success = get_all_bandwidth_history_for_rule_id(id, num_histories, &histories, max_wait_milliseconds);
+	if(success && histories != NULL)
+	{
+		print_histories(out, id, histories, *num_histories, output_type);
+		free_ip_bw_histories(histories, *num_histories);
+	}
+	return success;
+}
+
+static int print_history_record(void* record, void* printer)
+{
+	ip_bw_history history = *((ip_bw_history*)record);
+	FILE* out = ((history_printer*)printer)->out;
+	char* id = ((history_printer*)printer)->id;
+	char output_type = ((history_printer*)printer)->output_type;
 	uint32_t testblk[4];
 	memset(&testblk, 0, sizeof(uint32_t)*4);
-	for(history_index=0; history_index < num_histories; history_index++)
+	
+	int history_initialized = 1;
+	if( history.first_start == 0 && history.first_end == 0 && history.last_end == 0)
 	{
-		ip_bw_history history = histories[history_index];
-		
-		int history_initialized = 1;
-		if( history.first_start == 0 && history.first_end == 0 && history.last_end == 0)
-		{
-			history_initialized = 0;
-		}
+		history_initialized = 0;
+	}
 
-		if(history_initialized)
-		{
-			char ip_str[INET6_ADDRSTRLEN];
-			time_t *times = NULL;
+	if(history_initialized)
+	{
+		char ip_str[INET6_ADDRSTRLEN];
+		time_t *times = NULL;
 
 
-			if(memcmp(&testblk, history.ip, sizeof(uint32_t)*4) != 0)
+		if(memcmp(&testblk, history.ip, sizeof(uint32_t)*4) != 0)
+		{
+			if(history.family == AF_INET)
 			{
-				if(history.family == AF_INET)
-				{
-					struct in_addr ipaddr;
-					ipaddr.s_addr = *history.ip;
-					inet_ntop(history.family, &ipaddr, ip_str, INET6_ADDRSTRLEN);
-				}
-				else
-				{
-					struct in6_addr ipaddr;
-					ipaddr.s6_addr32[0] = *history.ip;
-					ipaddr.s6_addr32[1] = *(history.ip+1);
-					ipaddr.s6_addr32[2] = *(history.ip+2);
-					ipaddr.s6_addr32[3] = *(history.ip+3);
-					inet_ntop(history.family, &ipaddr, ip_str, INET6_ADDRSTRLEN);
-				}
+				struct in_addr ipaddr;
+				ipaddr.s_addr = *history.ip;
+				inet_ntop(history.family, &ipaddr, ip_str, INET6_ADDRSTRLEN);
 			}
 			else
 			{
-				sprintf(ip_str,"%s","COMBINED");
-			}
-		
-		
-			if(output_type == 'm' || output_type == 'h')
-			{
-				fprintf(out, "%s %-39s\n", id, ip_str);
+				struct in6_addr ipaddr;
+				ipaddr.s6_addr32[0] = *history.ip;
+				ipaddr.s6_addr32[1] = *(history.ip+1);
+				ipaddr.s6_addr32[2] = *(history.ip+2);
+				ipaddr.s6_addr32[3] = *(history.ip+3);
+				inet_ntop(history.family, &ipaddr, ip_str, INET6_ADDRSTRLEN);
 			}
+		}
+		else
+		{
+			sprintf(ip_str,"%s","COMBINED");
+		}
+	
+	
+		if(output_type == 'm' || output_type == 'h')
+		{
+			fprintf(out, "%s %-39s\n", id, ip_str);
+		}
 
+		if(output_type == 'm')
+		{
+			printf("%lld\n", history.first_start);
+			printf("%lld\n", history.first_end);
+			printf("%lld\n", history.last_end);
+		}
+		else
+		{
+			times = get_interval_starts_for_history(history);
+		}
+
+		int hindex = 0;
+		for(hindex=0; hindex < history.num_nodes; hindex++)
+		{
+			uint64_t bw = (history.history_bws)[hindex];
 			if(output_type == 'm')
 			{
-				printf("%lld\n", history.first_start);
-				printf("%lld\n", history.first_end);
-				printf("%lld\n", history.last_end);
+				if(hindex != 0) { printf(","); };
+				printf("%lld", (unsigned long long int)bw);
 			}
-			else
+			else if(times != NULL)
 			{
-				times = get_interval_starts_for_history(history);
-			}
+				time_t start = times[hindex];
+				time_t end = hindex+1 < history.num_nodes ? times[hindex+1] : 0 ;
 
-			int hindex = 0;
-			for(hindex=0; hindex < history.num_nodes; hindex++)
-			{
-				uint64_t bw = (history.history_bws)[hindex];
-				if(output_type == 'm')
+				char* start_str = strdup(asctime(localtime(&start)));
+				char* end_str = end == 0 ? strdup("(Now)") : strdup(asctime(localtime(&end)));
+				char* nl = strchr(start_str, '\n');
+				if(nl != NULL)
 				{
-					if(hindex != 0) { printf(","); };
-					printf("%lld", (unsigned long long int)bw);
+					*nl = '\0';
 				}
-				else if(times != NULL)
+				nl = strchr(end_str, '\n');
+				if(nl != NULL)
 				{
-					time_t start = times[hindex];
-					time_t end = hindex+1 < history.num_nodes ? times[hindex+1] : 0 ;
-	
-					char* start_str = strdup(asctime(localtime(&start)));
-					char* end_str = end == 0 ? strdup("(Now)") : strdup(asctime(localtime(&end)));
-					char* nl = strchr(start_str, '\n');
-					if(nl != NULL)
-					{
-						*nl = '\0';
-					}
-					nl = strchr(end_str, '\n');
-					if(nl != NULL)
-					{
-						*nl = '\0';
-					}
-	
-					if(output_type == 'h')
-					{
-						fprintf(out, "%lld\t%s\t%s\n", (unsigned long long int)bw, start_str, end_str);
-					}
-					else
-					{
-						fprintf(out, "%s,%s,%lld,%lld,%lld\n", id, ip_str, start, end, (unsigned long long int)bw );
-					}
-				
-	
-					free(start_str);
-					free(end_str);
+					*nl = '\0';
 				}
+
+				if(output_type == 'h')
+				{
+					fprintf(out, "%lld\t%s\t%s\n", (unsigned long long int)bw, start_str, end_str);
+				}
+				else
+				{
+					fprintf(out, "%s,%s,%lld,%lld,%lld\n", id, ip_str, start, end, (unsigned long long int)bw );
+				}
+			
+
+				free(start_str);
+				free(end_str);
 			}
-			fprintf(out, "\n");
-			if(times != NULL) { free(times); };
 		}
+		fprintf(out, "\n");
+		if(times != NULL) { free(times); };
 	}
+	return 0;
 }
 
 
@@ -35,8 +35,20 @@
 #include <sys/sem.h> 
 #include <sys/time.h>
 #include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #define BANDWIDTH_QUERY_LENGTH		16384
 
+/* granularity with which backup files are compared & rewritten */
+#define BANDWIDTH_BACKUP_BLOCK_SIZE	64
+
+/* header in front of every backup file, "BWB1" */
+#define BANDWIDTH_BACKUP_FILE_MAGIC	0x31425742
+
+/* history (.bw) file format, "BWH2" */
+#define BANDWIDTH_HISTORY_FILE_MAGIC	0x32485742
+#define BANDWIDTH_HISTORY_FILE_VERSION	2
+
 /* socket id parameters (for userspace i/o) */
 #define BANDWIDTH_SET 			2048
 #define BANDWIDTH_GET 			2049
@@ -49,6 +61,9 @@
  * freak out the crazy fundies out there ;-) */
 #define BANDWIDTH_SEMAPHORE_KEY 12699666
 
+/* lock wait histogram buckets: <1ms, <2ms, <4ms ... <1024ms, >=1024ms */
+#define BANDWIDTH_LOCK_WAIT_BUCKETS	12
+
 /* possible reset intervals */
 #define BANDWIDTH_MINUTE		  80
 #define BANDWIDTH_HOUR			  81
@@ -129,6 +144,24 @@ extern int get_ip_bandwidth_history_for_rule_id(char* id, char* ip, ip_bw_histor
 extern int get_all_bandwidth_usage_for_rule_id(char* id, unsigned long* num_ips, ip_bw** data, unsigned long max_wait_milliseconds);
 extern int get_ip_bandwidth_usage_for_rule_id(char* id,  char* ip, ip_bw** data, unsigned long max_wait_milliseconds);
 
+/* 
+ * query several ids in one locked session, data/num_ips must hold num_ids entries,
+ * ids that fail come back NULL.  Returns number of ids read successfully 
+ */
+extern unsigned long get_all_bandwidth_history_for_rule_ids(char** ids, unsigned long num_ids, unsigned long* num_ips, ip_bw_history** data, unsigned long max_wait_milliseconds);
+extern unsigned long get_all_bandwidth_usage_for_rule_ids(char** ids, unsigned long num_ids, unsigned long* num_ips, ip_bw** data, unsigned long max_wait_milliseconds);
+
+/*
+ * call visit for each ip as the kernel's reply is decoded, without building the
+ * whole table.  The record is only valid during the call, and the semaphore is
+ * held, so don't block in visit.  Return non-zero from visit to stop early.
+ * num_ips is set to the number of ips the kernel reported for the id
+ */
+typedef int (*ip_bw_visitor)(ip_bw* usage, void* arg);
+typedef int (*ip_bw_history_visitor)(ip_bw_history* history, void* arg);
+extern int for_each_bandwidth_history_for_rule_id(char* id, ip_bw_history_visitor visit, void* arg, unsigned long* num_ips, unsigned long max_wait_milliseconds);
+extern int for_each_bandwidth_usage_for_rule_id(char* id, ip_bw_visitor visit, void* arg, unsigned long* num_ips, unsigned long max_wait_milliseconds);
+
 
 
 extern int set_bandwidth_history_for_rule_id(char* id, unsigned char zero_unset, unsigned long num_ips, ip_bw_history* data, unsigned long max_wait_milliseconds);
@@ -139,13 +172,22 @@ extern int set_bandwidth_usage_for_rule_id(char* id, unsigned char zero_unset, u
 extern int save_usage_to_file(ip_bw* data, unsigned long num_ips, char* out_file_path);
 extern int save_history_to_file(ip_bw_history* data, unsigned long num_ips, char* out_file_path);
 
+/* query and save in one streaming pass */
+extern int save_history_for_rule_id_to_file(char* id, char* out_file_path, unsigned long* num_ips, unsigned long max_wait_milliseconds);
+extern unsigned long save_histories_for_rule_ids_to_files(char** ids, char** out_file_paths, unsigned long num_ids, int* saved, unsigned long max_wait_milliseconds);
+
+/* bytes/files actually written by the save functions above vs. what full rewrites would have written */
+extern void get_backup_write_stats(unsigned long long* bytes_written, unsigned long long* bytes_total, unsigned long* files_written, unsigned long* files_total);
+
 
 
 extern ip_bw* load_usage_from_file(char* in_file_path, unsigned long* num_ips, time_t* last_backup);
 extern ip_bw_history* load_history_from_file(char* in_file_path, unsigned long* num_ips);
+extern int load_ip_history_from_file(char* in_file_path, char* ip, ip_bw_history* history);
 
 extern void print_usage(FILE* out, ip_bw* usage, unsigned long num_ips);
 extern void print_histories(FILE* out, char* id, ip_bw_history* histories, unsigned long num_histories, char output_type);
+extern int print_histories_for_rule_id(FILE* out, char* id, char output_type, unsigned long* num_histories, unsigned long max_wait_milliseconds);
 
 
 
@@ -153,6 +195,9 @@ extern void print_histories(FILE* out, char* id, ip_bw_history* histories, unsig
 extern void unlock_bandwidth_semaphore(void);
 extern void unlock_bandwidth_semaphore_on_exit(void);
 
+/* fills histogram (BANDWIDTH_LOCK_WAIT_BUCKETS long) with this process's lock waits, returns number of timeouts */
+extern unsigned long get_lock_wait_histogram(unsigned long* histogram);
+
 
 /* sets kernel timezone minuteswest to match user timezone */
 extern int get_minutes_west(time_t now);
@@ -0,0 +1,181 @@
+/*  libnftbwctl --	A userspace library for querying the bandwidth nftables module
+ *  			Originally designed for use with Gargoyle router firmware (gargoyle-router.com)
+ *
+ *
+ *  Copyright  2009 by Eric Bishop <eric@gargoyle-router.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <limits.h>
+#include <nft_bwctl.h>
+#define malloc nft_bwctl_safe_malloc
+#define strdup nft_bwctl_safe_strdup
+
+/*
+ * Backs up every bandwidth id listed in a file from one process, instead of
+ * a shell script spawning one bw_get per id.  Each line of the list is
+ *
+ *	h [ID] [OUT_FILE]	(history, as bw_get -h -f)
+ *	u [ID] [OUT_FILE]	(usage, as bw_get -f)
+ *
+ * All ids of each type are read in one locked session, only the parts of each
+ * file that changed are rewritten (see save_*_to_file), and the file headers
+ * those leave unsynced are synced once after all ids are saved.
+ */
+int main(int argc, char **argv)
+{
+	char* list_file_path = NULL;
+	int verbose = 0;
+
+	int c;
+	while((c = getopt(argc, argv, "l:L:vVuU")) != -1)
+	{	
+		switch(c)
+		{
+			case 'l':
+			case 'L':
+				list_file_path = strdup(optarg);
+				break;
+			case 'v':
+			case 'V':
+				verbose = 1;
+				break;
+			case 'u':
+			case 'U':
+			default:
+				fprintf(stderr, "USAGE:\n\t%s -l [ID_LIST_FILE] [-v]\n\t-v print bytes written vs. bytes a full rewrite would take, and lock wait times\n", argv[0]);
+				exit(0);
+		}
+	}
+	if(list_file_path == NULL)
+	{
+		fprintf(stderr, "ERROR: you must specify a file listing ids to back up\n\n");
+		exit(0);
+	}
+	FILE* list_file = strcmp(list_file_path, "-") == 0 ? stdin : fopen(list_file_path, "r");
+	if(list_file == NULL)
+	{
+		fprintf(stderr, "ERROR: cannot open specified file for reading\n");
+		exit(0);
+	}
+
+	set_kernel_timezone();	
+	unlock_bandwidth_semaphore_on_exit();
+
+	/* 
+	 * read the whole list first, ids[0] holds history ids and ids[1] usage ids,
+	 * so each type can be queried in one locked session
+	 */
+	char** ids[2] = { NULL, NULL };
+	char** files[2] = { NULL, NULL };
+	unsigned long num_type_ids[2] = { 0, 0 };
+	unsigned long max_type_ids[2] = { 0, 0 };
+	char line[BANDWIDTH_MAX_ID_LENGTH + PATH_MAX + 16];
+	while(fgets(line, sizeof(line), list_file) != NULL)
+	{
+		char type;
+		char id[BANDWIDTH_MAX_ID_LENGTH];
+		char out_file_path[PATH_MAX];
+		if(sscanf(line, " %c %49s %4095s", &type, id, out_file_path) != 3 || (type != 'h' && type != 'u'))
+		{
+			continue;
+		}
+		int t = type == 'h' ? 0 : 1;
+		if(num_type_ids[t] == max_type_ids[t])
+		{
+			max_type_ids[t] = max_type_ids[t] == 0 ? 16 : max_type_ids[t]*2;
+			ids[t] = (char**)realloc(ids[t], sizeof(char*)*max_type_ids[t]);
+			files[t] = (char**)realloc(files[t], sizeof(char*)*max_type_ids[t]);
+			if(ids[t] == NULL || files[t] == NULL)
+			{
+				fprintf(stderr, "ERROR: MALLOC FAILURE!\n");
+				exit(1);
+			}
+		}
+		ids[t][ num_type_ids[t] ] = strdup(id);
+		files[t][ num_type_ids[t] ] = strdup(out_file_path);
+		num_type_ids[t]++;
+	}
+	if(list_file != stdin)
+	{
+		fclose(list_file);
+	}
+
+	unsigned long num_ids = num_type_ids[0] + num_type_ids[1];
+	unsigned long num_failed = num_ids;
+	int t;
+	for(t=0; t < 2; t++)
+	{
+		unsigned long* num_ips = (unsigned long*)malloc(sizeof(unsigned long)*(num_type_ids[t]+1));
+		void** ip_bufs = (void**)malloc(sizeof(void*)*(num_type_ids[t]+1));
+		int* saved = (int*)malloc(sizeof(int)*(num_type_ids[t]+1));
+		if(t == 0)
+		{
+			/* histories are written to file as they're decoded rather than held in memory */
+			num_failed = num_failed - save_histories_for_rule_ids_to_files(ids[t], files[t], num_type_ids[t], saved, 1000);
+		}
+		else
+		{
+			num_failed = num_failed - get_all_bandwidth_usage_for_rule_ids(ids[t], num_type_ids[t], num_ips, (ip_bw**)ip_bufs, 1000);
+		}
+
+		unsigned long id_index;
+		for(id_index=0; id_index < num_type_ids[t]; id_index++)
+		{
+			if(t == 1 && ip_bufs[id_index] != NULL)
+			{
+				save_usage_to_file( (ip_bw*)ip_bufs[id_index], num_ips[id_index], files[t][id_index]);
+				free(ip_bufs[id_index]);
+			}
+			else if(t == 1 || !saved[id_index])
+			{
+				fprintf(stderr, "ERROR: Bandwidth query failed for id \"%s\"\n", ids[t][id_index]);
+			}
+			free(ids[t][id_index]);
+			free(files[t][id_index]);
+		}
+		free(ids[t]);
+		free(files[t]);
+		free(num_ips);
+		free(ip_bufs);
+		free(saved);
+	}
+
+	/* one sync for the file headers of the whole backup, rather than one per file */
+	sync();
+
+	if(verbose)
+	{
+		unsigned long long bytes_written;
+		unsigned long long bytes_total;
+		unsigned long files_written;
+		unsigned long files_total;
+		get_backup_write_stats(&bytes_written, &bytes_total, &files_written, &files_total);
+		printf("backed up %lu of %lu ids, wrote %llu of %llu bytes (%lu of %lu files changed)\n", num_ids - num_failed, num_ids, bytes_written, bytes_total, files_written, files_total);
+
+		unsigned long lock_waits[BANDWIDTH_LOCK_WAIT_BUCKETS];
+		unsigned long lock_timeouts = get_lock_wait_histogram(lock_waits);
+		int bucket;
+		printf("lock waits:");
+		for(bucket=0; bucket < BANDWIDTH_LOCK_WAIT_BUCKETS; bucket++)
+		{
+			printf(" %s%dms:%lu", (bucket < BANDWIDTH_LOCK_WAIT_BUCKETS-1 ? "<" : ">="), (bucket < BANDWIDTH_LOCK_WAIT_BUCKETS-1 ? (1 << bucket) : (1 << (bucket-1))), lock_waits[bucket]);
+		}
+		printf(" timeouts:%lu\n", lock_timeouts);
+	}
+
+	return 0;
+}
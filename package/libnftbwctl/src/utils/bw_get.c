@@ -108,7 +108,20 @@ int main(int argc, char **argv)
 	set_kernel_timezone();	
 	unlock_bandwidth_semaphore_on_exit();
 	
-	if(get_history == 0)
+	/* full history tables can be large, stream them straight to the file, stdout gets a copy printed after unlocking */
+	int streamed = get_history && address == NULL;
+	if(streamed)
+	{
+		if(out_file_path != NULL)
+		{
+			query_succeeded = save_history_for_rule_id_to_file(id, out_file_path, &num_ips, 1000);
+		}
+		else
+		{
+			query_succeeded = print_histories_for_rule_id(stdout, id, output_type, &num_ips, 1000);
+		}
+	}
+	else if(get_history == 0)
 	{
 		if(address == NULL)
 		{
@@ -139,7 +152,11 @@ int main(int argc, char **argv)
 	}
 
 
-	if(out_file_path != NULL)
+	if(streamed)
+	{
+		/* already written */
+	}
+	else if(out_file_path != NULL)
 	{
 		if(get_history == 0)
 		{
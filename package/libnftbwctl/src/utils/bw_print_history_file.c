@@ -26,7 +26,17 @@
 
 int main(int argc, char **argv)
 {
-	if(argc > 1)
+	if(argc > 2)
+	{
+		/* single ip, only that ip's history is read */
+		ip_bw_history history;
+		if(load_ip_history_from_file(argv[1], argv[2], &history))
+		{
+			print_histories(stdout, argv[1], &history, 1, 'h');
+			free(history.history_bws);
+		}
+	}
+	else if(argc > 1)
 	{
 		unsigned long num_ips;
 		ip_bw_history* histories = load_history_from_file(argv[1], &num_ips);
@@ -35,5 +45,9 @@ int main(int argc, char **argv)
 			print_histories(stdout, argv[1], histories, num_ips, 'h');
 		}
 	}
+	else
+	{
+		fprintf(stderr, "USAGE:\n\t%s [HISTORY_FILE] [IP|COMBINED]\n", argv[0]);
+	}
 	return 0;
 }
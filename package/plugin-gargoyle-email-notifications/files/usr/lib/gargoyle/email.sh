@@ -121,9 +121,9 @@ then
 	#Bandwidth usage
 	echo -e "<br><h1>Bandwidth usage:</h1><br>" >> /tmp/email-log.txt
 	config=$(uci get email.@email[0].bandwidthInterval)
-	cat /tmp/bw_backup/do_bw_backup.sh | grep bw_get | sed 's/.*bw_get/bw_get/' | sed 's/\-f .*/-t/g' | grep $config | grep "bdist" > /tmp/tmp.bw.sh
-	sh  /tmp/tmp.bw.sh | sed 's/^[^\-]*\-//g' |  sed 's/\-/,/g' | sed '/^\s*$/d' > /tmp/work.tmp
-	rm /tmp/tmp.bw.sh
+	for bw_id in $(cat /tmp/bw_backup/do_bw_backup.ids 2>/dev/null | cut -d " " -f 2 | grep $config | grep "bdist") ; do
+		bw_get -i "$bw_id" -h -t
+	done | sed 's/^[^\-]*\-//g' |  sed 's/\-/,/g' | sed '/^\s*$/d' > /tmp/work.tmp
 	while read line           
 	do           
 		type=$(echo $line | cut -f4 -d,)
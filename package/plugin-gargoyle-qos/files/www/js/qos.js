@@ -1166,7 +1166,7 @@ function updateqosmon()
 	if (!updateInProgress)
 	{
 		updateInProgress = true;
-		var commands="cat /tmp/qosmon.status 2>/dev/null"
+		var commands="qosmon_status 2>/dev/null"
 		var param = getParameterDefinition("commands", commands) + "&" + getParameterDefinition("hash", document.cookie.replace(/^.*hash=/,"").replace(/[\t ;]+.*$/, ""));
 
 		var stateChangeFunction = function(req)
@@ -1211,7 +1211,7 @@ function updateqosmon()
 				}
 				else
 				{
-					if (lines[0].substr(0,25) == "cat: can't open '/tmp/qos")
+					if (lines[0].substr(0,23) == "Cannot open /tmp/qosmon")
 					{
 						document.getElementById("qstate").innerHTML = "State: Disabled*";
 						document.getElementById("qpinger").innerHTML = "Ping: Off";
@@ -29,6 +29,9 @@
 #include <dlfcn.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <string.h>
@@ -39,10 +42,17 @@
 #include "tc_util.h"
 #include "tc_common.h"
 
+#include "qosmon_ctl.h"
+#include "qosmon_shm.h"
+
 #include <netdb.h>
 #include <signal.h>
 #include <netinet/ip_icmp.h>
 #include <netinet/icmp6.h>
+#include <netinet/tcp.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
 
 #ifndef ONLYBG
 #include <ncurses.h>
@@ -50,6 +60,7 @@
 
 
 #define MAXPACKET   100   /* max packet size */
+#define MAXTARGETS  8     /* max ping targets */
 #define BACKGROUND  3     /* Detact and run in the background */
 #define ADDENTITLEMENT 4
 
@@ -81,19 +92,103 @@ int pingflags, options;
 #define DEAMON (pingflags & BACKGROUND)
 
 struct rtnl_handle rth;
+struct rtnl_handle rth_link; /* Listens for RTM_NEWLINK/RTM_DELLINK */
+int linkfd=-1;               /* rth_link.fd once it is open */
+
+__u32 class_handle;          /* The "1:1" class we throttle */
+__u32 parent_handle;         /* and its "1:0" parent */
 
-int s;              /* Socket file descriptor */
+int s=-1;           /* IPv4 ICMP socket file descriptor */
+int s6=-1;          /* IPv6 ICMP socket file descriptor */
+int tfd;            /* Tick timer file descriptor */
+int epfd;           /* epoll instance watching our descriptors */
+char rx_tstamp;     /* Set when the kernel stamps received pongs (SO_TIMESTAMPNS) */
 struct hostent *hp; /* Pointer to host info */
-struct timezone tz; /* leftover */
 
-struct sockaddr_storage whereto;/* Who to ping */
 int datalen=64-8;   /* How much data */
 
+#define PROBE_ICMP    0
+#define PROBE_TCP     1
+#define DROP_MISSES   5   /* A target missing this many probes in a row is dropped */
+#define READMIT_TICKS 8   /* Dropped targets are only probed every this many ticks */
+#define READMIT_HITS  2   /* and come back after answering this many in a row */
+
+// Struct of data we keep on each ping target
+struct PING_TARGET {
+   char       *name;       //As given on the command line.
+   struct sockaddr_storage addr; //Who to ping
+   u_char     proto;       //PROBE_ICMP or PROBE_TCP
+   int        sock;        //Pending TCP probe, -1 if none.
+   uint16_t   ident;       //ICMP ID, each target has its own.
+   uint16_t   seq;         //Sequence # of the last probe sent.
+   int64_t    tx_ns;       //When the pending TCP probe was sent.
+   int        rawfltime;   //Trip time of the last probe in uS, 0 if not answered.
+   u_char     probed;      //Set when last tick's pinger() sent this target a probe.
+   u_char     alive;       //Clear while the target is dropped from the filter.
+   u_char     misses;      //Probes missed in a row.
+   u_char     hits;        //Probes answered in a row while dropped.
+};
+
+struct PING_TARGET targets[MAXTARGETS];
+int ntargets;
+int nalive;                 //Targets in the filter.
+char minfilter;             //Combine targets with min-of-N rather than the median.
+
+#define PASSIVE_SYNS     256      /* Outstanding SYNs we remember */
+#define PASSIVE_DESTS    256      /* Destinations we keep a baseline handshake time for */
+#define PASSIVE_SAMPLES  64       /* Most handshakes used in a tick, the rest are skipped */
+#define PASSIVE_MIN      2        /* Handshakes in a tick that let us skip the next ping */
+#define PASSIVE_MAXRTT   3000000  /* uS, SYN-ACKs slower than this are ignored */
+#define PASSIVE_BASE_AGE 300      /* Seconds a destination's baseline is trusted without being seen again */
+
+// Identifies a TCP connection in passive mode.  Local is the address on our WAN side.
+struct FLOW_KEY {
+   uint8_t    family;
+   uint8_t    pad;
+   uint16_t   lport, rport;       //Network byte order.
+   uint8_t    local[16], remote[16];
+};
+
+struct PASSIVE_SYN {
+   struct FLOW_KEY key;
+   uint32_t   seq;                //ISN of the SYN.
+   int64_t    tx_ns;              //When it went out, 0 if free, -1 if it was retransmitted.
+};
+
+// A part of the internet we have timed handshakes to (a /24 or /48).
+struct PASSIVE_DEST {
+   uint8_t    family;
+   uint8_t    prefix[6];
+   int        base;               //Lowest handshake time seen in uS, 0 if the slot is free.
+   int64_t    base_ns;            //When a handshake last came in near base.
+};
+
+// Passive mode times the TCP handshakes going through the WAN device.  The extra
+// time a handshake takes over the fastest one seen to the same part of the internet
+// is queueing delay, mostly in the ISP's buffers that our pings also go through.
+struct PASSIVE {
+   char       *dev;               //WAN device we watch, NULL if passive mode is off.
+   int        fd;                 //Packet socket, -1 if not open.
+   char       rebind;             //Set when dev needs to be looked up and bound again.
+   struct PASSIVE_SYN syns[PASSIVE_SYNS];
+   struct PASSIVE_DEST dests[PASSIVE_DESTS];
+   int        q[PASSIVE_SAMPLES]; //This tick's queueing delays in uS.
+   int        nq;
+   int        handshakes;         //Handshakes timed this tick.
+   int        last_handshakes;    //and last tick.
+   int        last_rtt;           //Last trip time passive_combine() came up with.
+   char       skipped;            //Set when we skipped this tick's ping because of handshakes.
+};
+struct PASSIVE passive = { .fd = -1 };
+
 const char usage[] =
 "Gargoyle active congestion controller version 2.5\n\n"
 "Usage:  qosmon [options] pingtime pingtarget bandwidth [pinglimit]\n" 
 "              pingtime   - The ping interval the monitor will use when active in ms.\n"
 "              pingtarget - The URL or IP address of the target host for the monitor.\n"
+"                           Up to 8 targets may be given separated by commas, their times are\n"
+"                           combined with a median.  Prefix a target with tcp:<port>: to probe\n"
+"                           it with TCP SYNs rather than ICMP.\n"
 "              bandwidth  - The maximum download speed the WAN link will support in kbps.\n"
 "              pinglimit  - Optional pinglimit to use for control, otherwise measured.\n"
 "              Options:\n"
@@ -102,74 +197,29 @@ const char usage[] =
 "                     -s            - Skip initial link measurement.\n\n"
 "                     -t <triptime> - Set initial ping time in ms (used with -s)\n\n"
 "                     -l <limit>    - Set initial fair link limit in kbps (used with -s).\n\n"
+"                     -u <device>   - Also control the upload HFSC tree on this device.\n\n"
+"                     -U <bandwidth>- The maximum upload speed in kbps (used with -u).\n\n"
+"                     -m            - Combine ping targets with min-of-N rather than the median.\n\n"
+"                     -R <file>     - Record a trace of each tick to file for qosmon_replay.\n\n"
+"                     -P <device>   - Also time the TCP handshakes going out this (WAN) device,\n"
+"                                     pinging only while there are none.\n\n"
+"                     -H <ticks>    - Keep a history of this many ticks in the status block.\n\n"
 "        SIGUSR1 can be used to reset the link bandwidth at anytime.\n";
 
 
-uint16_t ntransmitted = 0;   /* sequence # for outbound packets = #sent */
-uint16_t ident;
-uint16_t nreceived = 0;      /* # of packets we got back */
-
-// For our digital filters we use Y = Y(-1) + alpha * (X - Y(-1))
-// where alpha = Sample_Period / (TC + Sample_Period)
+uint16_t ntransmitted = 0;   /* # of probe rounds sent */
 
-int fil_triptime;           //Filter ping times in uS 
-int alpha;                  //Actually alpha * 1000
-int period;                 //PING period In milliseconds
-int rawfltime;              //Trip time in milliseconds
-int rawfltime_max;          //The maximum measured ping time we have seen in uS.
-char nopingresponse;        //Set to true when ping response is dropped.
+struct QMON_ENGINE engine;  //The controller's ping side, see qosmon_ctl.h
 
+#define MAXCTL 2
+struct QMON_CTL ctls[MAXCTL];
+int nctl;
 
-// Struct of data we keep on our classes
-struct CLASS_STATS {
-   int        ID;          //Class leaf ID
-   __u64      bytes;       //Work bytes last query
-   u_char     rtclass;     //True if class is realtime.
-   u_char     backlog;     //Number of packets waiting
-   u_char     actflg;      //True if class is active.
-   long int   cbw_flt;     //Class bandwidth subject to filter. (bps)
-   long int   cbw_flt_rt;  //Class realtime bandwidth subject to filter. (bps)
-   int64_t    bwtime;      //Timestamp of last byte reading.
-};
-
-#define STATCNT 30
-struct CLASS_STATS dnstats[STATCNT];
-struct CLASS_STATS *classptr;
-u_char classcnt;
-u_char errorflg;
-u_char firstflg=1;       //First pass flag
-
-u_char DCA;              //Number of download classes active
-u_char RTDCA;            //Number of realtime download classes active
-u_char pingon=0;         //Set to one when pinger becomes active.
-int    pinglimit=0;      //MinRTT mode ping time. 
-int    pinglimit_cl=0;   //Ping limit entered on the commandline.
-int    plimit;           //Currently enforce ping limit
-
-float BWTC;              //Time constant of the bandwidth filter
-int DBW_UL;              //This the absolute limit of the link passed in as a parameter.
-int dbw_ul;              //This is the last value of the limit sent to the kernel.
-int new_dbw_ul;          //The new link limit proposed by the state machine.
-int saved_active_limit;  //The new link limit last known to work with active mode.
-int saved_realtime_limit;//The new link limit last known to work with realtime mode.
-long int dbw_fil;        //Filtered total download load (bps).
-
-#define QMON_CHK   0
-#define QMON_INIT  1
-#define QMON_ACTIVE 2
-#define QMON_REALTIME 3
-#define QMON_IDLE  4
-#define QMON_EXIT  5
-char *statename[]= {"CHECK","INIT","ACTIVE","MINRTT","IDLE","DISABLED"};
-unsigned char qstate=QMON_CHK;
-
-u_short cnt_mismatch=0;
-u_short cnt_errorflg=0;
-u_short last_errorflg=0;
-
-FILE *statusfd;          //Filestream for updating our status to.              
+struct QMON_SHM *shm;    //Status block we publish, see qosmon_shm.h
+int nhist;               //Ticks of history it keeps (-H).
+FILE *tracefd;           //Filestream we record a trace to, NULL if not.
 char sigterm=0;          //Set when we get a signal to terminal   
-int sel_err=0;           //Last error code returned by select
+int sel_err=0;           //Last error code returned by epoll_wait
 
 #define DAEMON_NAME "qosmon"
 
@@ -262,35 +312,46 @@ int in_cksum(u_short *addr, int len)
 }
 
 /*
- *          P I N G E R
+ *          T I M E S P E C _ N S
+ *
+ * Convert a timespec to a single nanosecond count.
+ */
+int64_t timespec_ns(struct timespec *t)
+{
+    return (int64_t)t->tv_sec * 1000000000LL + (int64_t)t->tv_nsec;
+}
+
+/*
+ *          I C M P _ P R O B E
  * 
- * Compose and transmit an ICMP ECHO REQUEST packet.  The IP packet
- * will be added on by the kernel.  The ID field is our UNIX process ID,
- * and the sequence number is an ascending integer.  The first 8 bytes
- * of the data portion are used to hold a UNIX "timeval" struct in VAX
+ * Compose and transmit an ICMP ECHO REQUEST packet to target t.  The IP packet
+ * will be added on by the kernel.  The ID field is derived from our UNIX process ID
+ * and differs per target, and the sequence number is an ascending integer.  The first bytes
+ * of the data portion hold a CLOCK_MONOTONIC "timespec" in host
  * byte-order, to compute the round-trip time.
  */
-void pinger(void)
+void icmp_probe(struct PING_TARGET *t)
 {
     static u_char outpack[MAXPACKET];
     int i, cc;
-    struct timeval *tp = (struct timeval *) &outpack[8];
-    u_char *datap = &outpack[8+sizeof(struct timeval)];
+    struct timespec tp;
+    u_char *datap = &outpack[8+sizeof(struct timespec)];
 
-    if(whereto.ss_family == AF_INET6)
+    if(t->addr.ss_family == AF_INET6)
     {
         struct icmp6_hdr *icp = (struct icmp6_hdr *) outpack;
         icp->icmp6_type = ICMP6_ECHO_REQUEST;
         icp->icmp6_code = 0;
         icp->icmp6_cksum = 0;
-        icp->icmp6_seq = ++ntransmitted;
-        icp->icmp6_id = ident;       /* ID */
+        icp->icmp6_seq = ++t->seq;
+        icp->icmp6_id = t->ident;       /* ID */
         cc = datalen+8;         /* skips ICMP portion */
 
-        gettimeofday( tp, &tz );
-
-        for( i=8; i<datalen; i++)   /* skip 8 for time */
+        for( i=sizeof(struct timespec); i<datalen; i++)   /* skip for time */
             *datap++ = i;
+
+        clock_gettime(CLOCK_MONOTONIC, &tp);
+        memcpy(&outpack[8], &tp, sizeof(tp));
     }
     else
     {
@@ -298,41 +359,144 @@ void pinger(void)
         icp->icmp_type = ICMP_ECHO;
         icp->icmp_code = 0;
         icp->icmp_cksum = 0;
-        icp->icmp_seq = ++ntransmitted;
-        icp->icmp_id = ident;       /* ID */
+        icp->icmp_seq = ++t->seq;
+        icp->icmp_id = t->ident;       /* ID */
         cc = datalen+8;         /* skips ICMP portion */
 
-        gettimeofday( tp, &tz );
-
-        for( i=8; i<datalen; i++)   /* skip 8 for time */
+        for( i=sizeof(struct timespec); i<datalen; i++)   /* skip for time */
             *datap++ = i;
 
+        //Stamp as late as possible so the checksum is all that sits between us and sendto().
+        clock_gettime(CLOCK_MONOTONIC, &tp);
+        memcpy(&outpack[8], &tp, sizeof(tp));
+
         /* Compute ICMP checksum here */
         icp->icmp_cksum = in_cksum( (u_short *) icp, cc );
     }
     
-    //printf("Sent pkt at %ld.%06ld\n", (long int)(tp->tv_sec), (long int)(tp->tv_usec));
+    //printf("Sent pkt at %ld.%09ld\n", (long int)(tp.tv_sec), (long int)(tp.tv_nsec));
 
     /* cc = sendto(s, msg, len, flags, to, tolen) */
-    i = sendto( s, outpack, cc, 0, (const struct sockaddr *)  &whereto, sizeof(whereto) );
+    i = sendto( (t->addr.ss_family == AF_INET6) ? s6 : s, outpack, cc, 0, (const struct sockaddr *)  &t->addr, sizeof(t->addr) );
     
 }
 
+/* Close target t's pending TCP probe, if it has one. */
+void tcp_close(struct PING_TARGET *t)
+{
+    if (t->sock >= 0) {
+        close(t->sock);
+        t->sock = -1;
+    }
+}
 
 /*
- *          T V S U B
- * 
- * Subtract 2 timeval structs:  out = out - in.
- * 
- * Out is assumed to be >= in.
+ *          T C P _ P R O B E
+ *
+ * Start a non-blocking connect() to target t.  The kernel sends the SYN and
+ * tcp_pong() picks up the SYN-ACK or RST when epoll says the socket is done.
+ */
+void tcp_probe(struct PING_TARGET *t)
+{
+    struct epoll_event ev;
+    struct linger lg;
+    struct timespec tp;
+
+    tcp_close(t);
+
+    t->sock = socket(t->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (t->sock < 0) return;
+
+    //Close with a RST rather than a FIN so our probes don't pile up in TIME_WAIT.
+    lg.l_onoff = 1;
+    lg.l_linger = 0;
+    setsockopt(t->sock, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    t->tx_ns = timespec_ns(&tp);
+
+    if ((connect(t->sock, (struct sockaddr *) &t->addr, sizeof(t->addr)) < 0) && (errno != EINPROGRESS)) {
+        tcp_close(t);
+        return;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLOUT;
+    ev.data.fd = t->sock;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, t->sock, &ev);
+}
+
+/*
+ *          P I N G E R
+ *
+ * Send this tick's probe to each target.  Targets that have been dropped
+ * are only probed every READMIT_TICKS ticks to see if they came back.
+ */
+void pinger(void)
+{
+    struct PING_TARGET *t;
+    int i;
+
+    ntransmitted++;
+
+    for (i = 0, t = targets; i < ntargets; i++, t++) {
+        t->rawfltime = 0;
+        t->probed = 0;
+        if (!t->alive && (ntransmitted % READMIT_TICKS)) continue;
+
+        t->probed = 1;
+        if (t->proto == PROBE_TCP) tcp_probe(t);
+          else icmp_probe(t);
+    }
+}
+
+
+/*
+ *          R X _ T I M E
+ *
+ * Work out when a pong arrived on the CLOCK_MONOTONIC time line, in ns.
+ * The kernel RX stamp (SO_TIMESTAMPNS) is CLOCK_REALTIME, so we take its age
+ * against the realtime clock now and subtract that from the monotonic clock now.
+ * That keeps the scheduler delay between packet arrival and our wakeup out of
+ * the RTT while still comparing against our monotonic TX stamps.  If there is
+ * no kernel stamp, or the realtime clock was stepped, the wakeup time is used.
  */
-void tvsub(register struct timeval *out, register struct timeval *in)
+int64_t rx_time(struct msghdr *msg)
 {
-    if( (out->tv_usec -= in->tv_usec) < 0 )   {
-        out->tv_sec--;
-        out->tv_usec += 1000000;
+    struct cmsghdr *cmsg;
+    struct timespec mono, real, kstamp;
+    int64_t age;
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    if (!rx_tstamp) return timespec_ns(&mono);
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPNS) &&
+            (cmsg->cmsg_len >= CMSG_LEN(sizeof(kstamp)))) {
+
+            memcpy(&kstamp, CMSG_DATA(cmsg), sizeof(kstamp));
+            clock_gettime(CLOCK_REALTIME, &real);
+            age = timespec_ns(&real) - timespec_ns(&kstamp);
+
+            //A packet can not have arrived in the future or more than a tick ago.
+            if ((age >= 0) && (age <= engine.period*1000000LL)) return timespec_ns(&mono) - age;
+            break;
+        }
     }
-    out->tv_sec -= in->tv_sec;
+
+    return timespec_ns(&mono);
+}
+
+/* Record a trip time for target t if it answered the probe we sent this tick. */
+void record_triptime(struct PING_TARGET *t, int64_t triptime)
+{
+    //Check for some possible errors first.
+    if (triptime > engine.period*1000) triptime = engine.period*1000; 
+
+    //Zero means no pong, so never report less than 1uS.
+    if (triptime < 1) triptime = 1;
+
+    t->rawfltime = triptime;
 }
 
 /*
@@ -343,21 +507,20 @@ void tvsub(register struct timeval *out, register struct timeval *in)
  * which arrive ('tis only fair).  This permits multiple copies of this
  * program to be run without having intermingled output (or statistics!).
  */
-char pr_pack( void *buf, int cc, struct sockaddr_storage *from )
+char pr_pack( void *buf, int cc, struct sockaddr_storage *from, int64_t rx_ns )
 {
     struct ip *ip;
     struct icmp *icp;
     struct icmp6_hdr *icp6;
-    struct timeval tv;
-    struct timeval *tp;
-    int hlen,triptime;
-    uint16_t seq;
-
-    gettimeofday( &tv, &tz );
+    struct timespec tp;
+    u_char *tpp;
+    struct PING_TARGET *t;
+    int hlen, i;
+    uint16_t id, seq;
 
     if(from->ss_family == AF_INET6)
     {
-        if(cc < sizeof(struct icmp6_hdr))
+        if(cc < sizeof(struct icmp6_hdr) + sizeof(struct timespec))
         {
             return 0;
         }
@@ -366,20 +529,16 @@ char pr_pack( void *buf, int cc, struct sockaddr_storage *from )
         {
             return 0;
         }
-        if(icp6->icmp6_id != ident)
-        {
-            return 0;
-        }
-        
+        id = icp6->icmp6_id;
         seq = icp6->icmp6_seq;
         
-        tp = (struct timeval *)&icp6->icmp6_dataun.icmp6_un_data32[1];
+        tpp = (u_char *)&icp6->icmp6_dataun.icmp6_un_data32[1];
     }
     else
     {
         ip = (struct ip *) buf;
         hlen = ip->ip_hl << 2;
-        if (cc < hlen + ICMP_MINLEN) {
+        if (cc < hlen + ICMP_MINLEN + sizeof(struct timespec)) {
             return 0;
         }
 
@@ -388,40 +547,359 @@ char pr_pack( void *buf, int cc, struct sockaddr_storage *from )
             return 0;
         }
 
-        if( icp->icmp_id != ident )
-            return 0;           /* 'Twas not our ECHO */
-        
+        id = icp->icmp_id;
         seq = icp->icmp_seq;
         
-        tp = (struct timeval *)&icp->icmp_data[0];
+        tpp = (u_char *)&icp->icmp_data[0];
     }
-    
-    //printf("Rcvd pkt at %ld.%06ld\n", (long int)(tp->tv_sec), (long int)(tp->tv_usec));
-    
 
-    nreceived++;
+    //Find which target this was, each has its own ID.
+    for (i = 0, t = targets; i < ntargets; i++, t++) {
+        if ((t->proto == PROBE_ICMP) && (t->addr.ss_family == from->ss_family) && (t->ident == id)) break;
+    }
+    if (i == ntargets) return 0;           /* 'Twas not our ECHO */
 
     //If it was not the packet we are looking for return now.
-    if (seq != ntransmitted) return 0;
-    
-    tvsub( &tv, tp );
-    triptime = tv.tv_sec*1000+(tv.tv_usec/1000);
-            
-    //We are now ready to update the filtered round trip time.
-    //Check for some possible errors first.
-    if (triptime > period) triptime = period; 
+    if (seq != t->seq) return 0;
+
+    //The stamp is not aligned in the IPv4 case so copy it out.
+    memcpy(&tp, tpp, sizeof(tp));
 
-    //If this was the most recent one we sent then update the rawfltime.
-    rawfltime=triptime;
+    //printf("Rcvd pkt at %lld ns\n", (long long int)rx_ns);
 
-    //Is this a new maximum?
-    if (rawfltime > rawfltime_max/1000) rawfltime_max = rawfltime*1000;
+    record_triptime(t, (rx_ns - timespec_ns(&tp)) / 1000);
 
     //return 1 if we got a valid time.
     return 1;
 
 }
 
+/* The TCP probe socket for target t is done, a SYN-ACK or RST both mean the SYN made the trip. */
+void tcp_pong(struct PING_TARGET *t)
+{
+    struct timespec tp;
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    //There is no kernel RX stamp for a connect() so the wakeup time has to do.
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    getsockopt(t->sock, SOL_SOCKET, SO_ERROR, &err, &len);
+
+    if ((err == 0) || (err == ECONNREFUSED)) record_triptime(t, (timespec_ns(&tp) - t->tx_ns) / 1000);
+    tcp_close(t);
+}
+
+/*
+ *          C O M B I N E _ T A R G E T S
+ *
+ * Fold the results of the probes sent last tick into one trip time.  A target
+ * that misses DROP_MISSES probes in a row is dropped from the filter (never the
+ * last one) and is let back in after READMIT_HITS answers in a row.  A probe missed
+ * by a target still in the filter counts as rawfltime_max, so the median only
+ * reports a loss when most of the targets lost their probe.  The min filter
+ * takes the fastest answer.  Returns 0 if no target in the filter answered.
+ */
+int combine_targets(void)
+{
+    struct PING_TARGET *t;
+    int samples[MAXTARGETS];
+    int i, j, n=0, fastest=0;
+
+    for (i = 0, t = targets; i < ntargets; i++, t++) {
+        if (!t->probed) continue;
+        t->probed = 0;
+
+        //An answer that shows up after the tick is a miss, like a late pong.
+        tcp_close(t);
+
+        if (t->rawfltime) {
+            t->misses = 0;
+            if (!t->alive && (++t->hits >= READMIT_HITS)) {
+                t->alive = 1;
+                nalive++;
+                if (DEAMON) syslog(LOG_INFO, "ping target %s answering again", t->name);
+            }
+        } else {
+            t->hits = 0;
+            if (t->alive && (++t->misses >= DROP_MISSES) && (nalive > 1)) {
+                t->alive = 0;
+                nalive--;
+                if (DEAMON) syslog(LOG_INFO, "ping target %s not answering, dropped", t->name);
+            }
+        }
+
+        if (!t->alive) continue;
+
+        if (t->rawfltime) {
+            if (!fastest || (t->rawfltime < fastest)) fastest = t->rawfltime;
+            samples[n++] = t->rawfltime;
+        } else {
+            samples[n++] = engine.rawfltime_max;
+        }
+    }
+
+    if (!fastest) return 0;
+    if (minfilter) return fastest;
+
+    //Insertion sort is plenty for MAXTARGETS samples.
+    for (i = 1; i < n; i++) {
+        int v = samples[i];
+        for (j = i; (j > 0) && (samples[j-1] > v); j--) samples[j] = samples[j-1];
+        samples[j] = v;
+    }
+
+    //With an even count take the lower middle so one of two targets dropping a probe is not a loss.
+    return samples[(n-1)/2];
+}
+
+/*
+ * Classic BPF run on the packet socket.  The socket is SOCK_DGRAM so the
+ * packet starts at the IP header.  Only TCP segments with SYN set get through,
+ * IPv6 ones only without extension headers, and only their first 128 bytes.
+ */
+struct sock_filter syn_filter[] = {
+    BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 0),                 // 0: IP version
+    BPF_STMT(BPF_ALU|BPF_RSH|BPF_K, 4),                // 1:
+    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 6, 7, 0),          // 2: IPv6 -> 10
+    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 4, 0, 12),         // 3: not IPv4 -> drop
+    BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 9),                 // 4: IPv4 protocol
+    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, IPPROTO_TCP, 0, 10), // 5: not TCP -> drop
+    BPF_STMT(BPF_LD|BPF_H|BPF_ABS, 6),                 // 6: fragment offset
+    BPF_JUMP(BPF_JMP|BPF_JSET|BPF_K, 0x1fff, 8, 0),    // 7: not the first fragment -> drop
+    BPF_STMT(BPF_LDX|BPF_B|BPF_MSH, 0),                // 8: X = IPv4 header length
+    BPF_STMT(BPF_JMP|BPF_JA, 3),                       // 9: -> 13
+    BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 6),                 //10: IPv6 next header
+    BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, IPPROTO_TCP, 0, 4), //11: not TCP -> drop
+    BPF_STMT(BPF_LDX|BPF_W|BPF_IMM, 40),               //12: X = IPv6 header length
+    BPF_STMT(BPF_LD|BPF_B|BPF_IND, 13),                //13: TCP flags
+    BPF_JUMP(BPF_JMP|BPF_JSET|BPF_K, TH_SYN, 0, 1),    //14: no SYN -> drop
+    BPF_STMT(BPF_RET|BPF_K, 128),                      //15: accept
+    BPF_STMT(BPF_RET|BPF_K, 0),                        //16: drop
+};
+
+/* FNV-1a, good enough to spread flows and prefixes over our small tables. */
+uint32_t passive_hash(const void *data, int len)
+{
+    const u_char *p = data;
+    uint32_t h = 2166136261U;
+
+    while (len--) {
+        h ^= *p++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/*
+ * A handshake to key's remote end took rtt uS.  Turn it into a queueing delay
+ * by taking off the fastest handshake seen to the same /24 (IPv4) or /48 (IPv6).
+ * The baseline is dropped if nothing near it has been seen for PASSIVE_BASE_AGE
+ * seconds in case the route changed.
+ */
+void passive_sample(struct FLOW_KEY *key, int rtt, int64_t ns)
+{
+    struct PASSIVE_DEST *d;
+    uint8_t prefix[6];
+
+    memset(prefix, 0, sizeof(prefix));
+    memcpy(prefix, key->remote, (key->family == AF_INET) ? 3 : 6);
+    d = &passive.dests[(passive_hash(prefix, sizeof(prefix)) ^ key->family) % PASSIVE_DESTS];
+
+    //All we learn from a new destination (or one that pushed another out) is its baseline.
+    if (!d->base || (d->family != key->family) || memcmp(d->prefix, prefix, sizeof(prefix)) ||
+        (ns - d->base_ns > PASSIVE_BASE_AGE * 1000000000LL)) {
+        d->family = key->family;
+        memcpy(d->prefix, prefix, sizeof(prefix));
+        d->base = rtt;
+        d->base_ns = ns;
+        return;
+    }
+
+    if (rtt < d->base) d->base = rtt;
+    if (rtt <= d->base + d->base/8) d->base_ns = ns;
+
+    passive.handshakes++;
+    if (passive.nq < PASSIVE_SAMPLES) passive.q[passive.nq++] = rtt - d->base;
+}
+
+/* Look at a SYN the filter let through, pairing SYNs we send with the SYN-ACKs that answer them. */
+void passive_packet(u_char *p, int cc, u_char pkttype, int64_t ns)
+{
+    struct FLOW_KEY key;
+    struct PASSIVE_SYN *syn;
+    u_char *tcp, *src, *dst;
+    int hlen, alen;
+    uint32_t seq, ack;
+    u_char flags;
+
+    memset(&key, 0, sizeof(key));
+    if ((cc >= 20) && ((p[0] >> 4) == 4)) {
+        hlen = (p[0] & 0xf) * 4;
+        key.family = AF_INET;
+        src = p+12;
+        dst = p+16;
+        alen = 4;
+    } else if ((cc >= 40) && ((p[0] >> 4) == 6)) {
+        hlen = 40;
+        key.family = AF_INET6;
+        src = p+8;
+        dst = p+24;
+        alen = 16;
+    } else return;
+
+    if (cc < hlen + 14) return;
+    tcp = p + hlen;
+    flags = tcp[13];
+    memcpy(&seq, tcp+4, 4);
+    memcpy(&ack, tcp+8, 4);
+    seq = ntohl(seq);
+    ack = ntohl(ack);
+
+    if ((pkttype == PACKET_OUTGOING) && ((flags & (TH_SYN|TH_ACK)) == TH_SYN)) {
+        memcpy(key.local, src, alen);
+        memcpy(key.remote, dst, alen);
+        memcpy(&key.lport, tcp, 2);
+        memcpy(&key.rport, tcp+2, 2);
+        syn = &passive.syns[passive_hash(&key, sizeof(key)) % PASSIVE_SYNS];
+
+        //We can't tell which copy of a retransmitted SYN gets answered so don't time it.
+        if (syn->tx_ns && (syn->seq == seq) && !memcmp(&syn->key, &key, sizeof(key))) {
+            syn->tx_ns = -1;
+            return;
+        }
+        syn->key = key;
+        syn->seq = seq;
+        syn->tx_ns = ns;
+
+    } else if ((pkttype == PACKET_HOST) && ((flags & (TH_SYN|TH_ACK)) == (TH_SYN|TH_ACK))) {
+        int64_t rtt;
+
+        memcpy(key.local, dst, alen);
+        memcpy(key.remote, src, alen);
+        memcpy(&key.lport, tcp+2, 2);
+        memcpy(&key.rport, tcp, 2);
+        syn = &passive.syns[passive_hash(&key, sizeof(key)) % PASSIVE_SYNS];
+
+        if ((syn->tx_ns <= 0) || (ack != syn->seq + 1) || memcmp(&syn->key, &key, sizeof(key))) return;
+
+        rtt = (ns - syn->tx_ns) / 1000;
+        syn->tx_ns = 0;
+        if ((rtt > 0) && (rtt < PASSIVE_MAXRTT)) passive_sample(&key, rtt, ns);
+    }
+}
+
+/* Drain the packet socket. */
+void passive_read(void)
+{
+    u_char buf[128];
+    struct sockaddr_ll from;
+    int cc;
+
+    while (1) {
+        union {
+            struct cmsghdr cm;
+            char buf[CMSG_SPACE(sizeof(struct timespec)) * 2];
+        } control;
+        struct iovec iov;
+        struct msghdr msg;
+
+        iov.iov_base = buf;
+        iov.iov_len = sizeof(buf);
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &from;
+        msg.msg_namelen = sizeof(from);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control;
+        msg.msg_controllen = sizeof(control);
+
+        if ((cc = recvmsg(passive.fd, &msg, 0)) < 0) break;
+
+        if (cc > sizeof(buf)) cc = sizeof(buf);
+        passive_packet(buf, cc, from.sll_pkttype, rx_time(&msg));
+    }
+}
+
+/*
+ * Open the packet socket for passive mode.  It gets no packets until
+ * passive_bind() gives it a device.
+ */
+int passive_open(void)
+{
+    struct sock_fprog prog;
+    int on = 1;
+
+    passive.fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (passive.fd < 0) return -1;
+
+    prog.len = sizeof(syn_filter) / sizeof(syn_filter[0]);
+    prog.filter = syn_filter;
+    if (setsockopt(passive.fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+        close(passive.fd);
+        passive.fd = -1;
+        return -1;
+    }
+
+    if (setsockopt(passive.fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == 0) rx_tstamp = 1;
+
+    passive.rebind = 1;
+    return 0;
+}
+
+/*
+ * Bind the packet socket to the WAN device, again whenever link_notify() says
+ * it came back (a PPPoE reconnect gives it a new ifindex).  Without the link
+ * listener we try again each tick until the device is there.
+ */
+void passive_bind(void)
+{
+    struct sockaddr_ll sll;
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+
+    ll_init_map(&rth);
+    sll.sll_ifindex = ll_name_to_index(passive.dev);
+    passive.rebind = (sll.sll_ifindex == 0) && (linkfd < 0);
+    if (sll.sll_ifindex == 0) return;
+
+    if (bind(passive.fd, (struct sockaddr *) &sll, sizeof(sll)) < 0) passive.rebind = (linkfd < 0);
+}
+
+/*
+ * Fold this tick's handshakes into the tick's trip time.  Each is a queueing delay so
+ * it is added to the unloaded ping time to be comparable with a ping.  The median of
+ * those and the ping's answer, if there is one, is used.  Handshakes are left out
+ * until the CHECK and INIT states have measured the unloaded link.
+ */
+int passive_combine(int ping)
+{
+    int samples[PASSIVE_SAMPLES+1];
+    int i, j, n=0;
+
+    passive.last_handshakes = passive.handshakes;
+    passive.handshakes = 0;
+
+    if (engine.base_triptime && (ctls->qstate > QMON_INIT)) {
+        for (i = 0; i < passive.nq; i++) samples[n++] = engine.base_triptime + passive.q[i];
+    }
+    passive.nq = 0;
+    if (ping) samples[n++] = ping;
+
+    //If we skipped the ping for handshakes that then did not come, hold the last value.
+    if (n == 0) return passive.skipped ? passive.last_rtt : 0;
+
+    for (i = 1; i < n; i++) {
+        int v = samples[i];
+        for (j = i; (j > 0) && (samples[j-1] > v); j--) samples[j] = samples[j-1];
+        samples[j] = v;
+    }
+
+    passive.last_rtt = samples[(n-1)/2];
+    return passive.last_rtt;
+}
+
 //These variables referenced but not used by the tc code we link to.
 int filter_ifindex;
 int use_iec = 0;
@@ -429,14 +907,14 @@ int use_iec = 0;
 
 int print_class(struct nlmsghdr *n, void *arg)
 {
+    struct QMON_CTL *ctl = arg;
+    struct CLASS_STATS *classptr;
     struct tcmsg *t = NLMSG_DATA(n);
     int len = n->nlmsg_len;
     struct rtattr * tb[TCA_MAX+1];
+    struct tc_stats st;
     int leafid;
-    u_char actflg=0;
-    unsigned long long work=0;
     struct timespec newtime;
-    int64_t now_ns;
 
     if (n->nlmsg_type != RTM_NEWTCLASS && n->nlmsg_type != RTM_DELTCLASS) {
         fprintf(stderr, "Not a class\n");
@@ -466,141 +944,140 @@ int print_class(struct nlmsghdr *n, void *arg)
     if (t->tcm_parent == TC_H_ROOT) return 0;
 
     //A previous error backs us out.
-    if (errorflg) return 0;
-
-    //If something has changed about the class structure or we reached the 
-    //end of the array we need to reset and back out.
-    if (classcnt >= STATCNT) {
-       errorflg=1;
-       return 0;
-    }
+    if (ctl->errorflg) return 0;
 
     //Get the leafid or set to -1 if parent.
     if (t->tcm_info) leafid = t->tcm_info>>16;
      else leafid = -1;
 
-    //If this is not the first pass and the leafid does not
-    //match then the class list changed so backout.
-    if ((!firstflg) && (leafid != classptr->ID) ) {
-       errorflg=1;
-       return 0;
-    }
- 
-    //First time through so record the ID.
-    if (firstflg) {
-       classptr->ID = leafid;      
-    }  
- 
     //Pickup some hfsc basic stats
     if (tb[TCA_STATS2]) {
-
-        struct tc_stats st;
-
         /* handle case where kernel returns more/less than we know about */
         memset(&st, 0, sizeof(st));
         memcpy(&st, RTA_DATA(tb[TCA_STATS]), MIN(RTA_PAYLOAD(tb[TCA_STATS]), sizeof(st)));
-        work = st.bytes;
-        classptr->backlog = st.qlen;
+    } else {
+        ctl->errorflg=1;
+        return 0;
+    }
 
-		/*Checkout if this class will trigger realtime mode by looking to see if either
-		  the realtime or fair service curves are two part. */
-		if (firstflg) {
+    //The table work (lookup, filters) is the controller's, see qosmon_ctl.c.
+    classptr = qmon_class_find(ctl, t->tcm_handle, leafid);
 
-			struct tc_service_curve *sc = NULL;
-			struct rtattr *tbs[TCA_STATS_MAX + 1];
+	/*Checkout if this class will trigger realtime mode by looking to see if either
+	  the realtime or fair service curves are two part. */
+	if (classptr && ctl->firstflg) {
 
-			classptr->rtclass=0;
-			parse_rtattr_nested(tbs, TCA_HFSC_MAX, tb[TCA_OPTIONS]);
-			if (tbs[TCA_HFSC_RSC] && (RTA_PAYLOAD(tbs[TCA_HFSC_RSC]) >= sizeof(*sc))) {
-				sc = RTA_DATA(tbs[TCA_HFSC_RSC]);
-				classptr->rtclass |= (sc && sc->m1);
-    	    }
+		struct tc_service_curve *sc = NULL;
+		struct rtattr *tbs[TCA_STATS_MAX + 1];
 
-			if (tbs[TCA_HFSC_FSC] && (RTA_PAYLOAD(tbs[TCA_HFSC_FSC]) >= sizeof(*sc))) {
-				sc = RTA_DATA(tbs[TCA_HFSC_FSC]);
-				classptr->rtclass |= (sc && sc->m1);
+		classptr->rtclass=0;
+		parse_rtattr_nested(tbs, TCA_HFSC_MAX, tb[TCA_OPTIONS]);
+		if (tbs[TCA_HFSC_RSC] && (RTA_PAYLOAD(tbs[TCA_HFSC_RSC]) >= sizeof(*sc))) {
+			sc = RTA_DATA(tbs[TCA_HFSC_RSC]);
+			classptr->rtclass |= (sc && sc->m1);
     	    }
 
-		}
-
-    } else {
-        errorflg=1;
-        return 0;
-    }
-
-    now_ns = (int64_t)newtime.tv_sec * 1000000000LL + (int64_t)newtime.tv_nsec;
+		if (tbs[TCA_HFSC_FSC] && (RTA_PAYLOAD(tbs[TCA_HFSC_FSC]) >= sizeof(*sc))) {
+			sc = RTA_DATA(tbs[TCA_HFSC_FSC]);
+			classptr->rtclass |= (sc && sc->m1);
+    	    }
 
-    //Avoid a big jolt on the first pass.
-    if (firstflg) {
-		classptr->bytes = work;
 	}
 
-    //Update the filtered bandwidth based on what happened unless a rollover occured.
-    if (work >= classptr->bytes) {
-        long int bw;
-        long bperiod; // always in ms
+    //Classes that changed are recorded too so a replay sees the same churn.
+    if (tracefd) fprintf(tracefd, "c %d %x %d %llu %u %u\n", (int)(ctl - ctls), t->tcm_handle, leafid,
+                         (unsigned long long)st.bytes, st.qlen, classptr ? classptr->rtclass : 0);
 
-        //Calculate an accurate time period for the bps calculation.
-        bperiod = (now_ns - classptr->bwtime) / 1000000LL; // ns -> ms
-        if (bperiod<period/2) bperiod=period;
-        bw = (work - classptr->bytes)*8000/bperiod;  //bps per second x 1000 here
+    if (classptr) qmon_class_sample(&engine, ctl, classptr, st.bytes, st.qlen, timespec_ns(&newtime));
 
-        //Convert back to bps as part of the filter calculation 
-        classptr->cbw_flt=(bw-classptr->cbw_flt)*BWTC/1000+classptr->cbw_flt;
+    return 0;
+}
 
-        //A class is considered active if its BW exceeds 4000bps 
-        if ((leafid != -1) && (classptr->cbw_flt > 4000)) {
-            DCA++;actflg=1;
-            if (classptr->rtclass) RTDCA++;
+/*
+ * Return the ifindex of ctl's device.  Dumping the whole link table is expensive on
+ * routers with lots of interfaces so we only do it when link_notify() tells us
+ * the device may have come or gone.  Without the link listener we look every time.
+ */
+int device_ifindex(struct QMON_CTL *ctl)
+{
+    if (ctl->link_changed || (linkfd < 0)) {
+        ll_init_map(&rth);
+        ctl->ifindex = ll_name_to_index(ctl->dev);
+        ctl->link_changed = 0;
+    }
+    return ctl->ifindex;
+}
+
+/* Drain the link listener and flag a controller's ifindex for a refresh if its device changed. */
+void link_notify(void)
+{
+    char buf[8192];
+    struct nlmsghdr *h;
+    int len, i;
+
+    while ((len = recv(linkfd, buf, sizeof(buf), MSG_DONTWAIT)) != 0) {
+        if (len < 0) {
+            //If the kernel had to drop notifications we can't tell what we missed.
+            if (errno == ENOBUFS) {
+                for (i = 0; i < nctl; i++) ctls[i].link_changed = 1;
+                if (passive.dev) passive.rebind = 1;
+            }
+            if ((errno == EINTR) || (errno == ENOBUFS)) continue;
+            break;
         }
 
-        //Calculate the total link load by adding up all the classes.
-        if (leafid == -1) {
-            dbw_fil = 0;
-        } else {
-            dbw_fil += classptr->cbw_flt;
-        } 
+        for (h = (struct nlmsghdr *)buf; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+            struct ifinfomsg *ifi = NLMSG_DATA(h);
+            struct rtattr *tb[IFLA_MAX+1];
 
-    }
+            if ((h->nlmsg_type != RTM_NEWLINK) && (h->nlmsg_type != RTM_DELLINK)) continue;
+            if (h->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi))) continue;
 
-    classptr->bwtime=now_ns;
-    classptr->bytes = work;
-    classptr->actflg = actflg;
+            parse_rtattr(tb, IFLA_MAX, IFLA_RTA(ifi), IFLA_PAYLOAD(h));
+            for (i = 0; i < nctl; i++) {
+                if ((ifi->ifi_index == ctls[i].ifindex) ||
+                    (tb[IFLA_IFNAME] && !strcmp((char*)RTA_DATA(tb[IFLA_IFNAME]), ctls[i].dev))) {
+                    ctls[i].link_changed = 1;
+                }
+            }
 
-    classptr++;
-    classcnt++;
-    return 0;
+            //The passive device is bound by ifindex so a new one needs a new bind.
+            if (passive.dev && (h->nlmsg_type == RTM_NEWLINK) && tb[IFLA_IFNAME] &&
+                !strcmp((char*)RTA_DATA(tb[IFLA_IFNAME]), passive.dev)) passive.rebind = 1;
+        }
+    }
 }
 
-/*Gather stats for classes attached to device d */
-int class_list(char *d)
+/*Gather stats for classes attached to ctl's device */
+int class_list(struct QMON_CTL *ctl)
 {
     struct tcmsg t;
 
-    RTDCA=DCA =0;
+    qmon_classes_begin(ctl);
+
     memset(&t, 0, sizeof(t));
     t.tcm_family = AF_UNSPEC;
 
-    ll_init_map(&rth);
-
-    if (d[0]) {
-        if ((t.tcm_ifindex = ll_name_to_index(d)) == 0) {
-            fprintf(stderr, "Cannot find device \"%s\"\n", d);
-            return 1;
-        }
-        filter_ifindex = t.tcm_ifindex;
+    //The kernel only dumps the classes of tcm_ifindex, so this costs us
+    //the classes on this device and nothing else.
+    if ((t.tcm_ifindex = device_ifindex(ctl)) == 0) {
+        fprintf(stderr, "Cannot find device \"%s\"\n", ctl->dev);
+        return 1;
     }
+    filter_ifindex = t.tcm_ifindex;
 
     if (rtnl_dump_request(&rth, RTM_GETTCLASS, &t, sizeof(t)) < 0) {
         perror("Cannot send dump request");
         return 1;
     }
 
-    if (dump_filter(&rth, print_class, stdout) < 0) {
+    if (dump_filter(&rth, print_class, ctl) < 0) {
         fprintf(stderr, "Dump terminated\n");
         return 1;
     }
 
+    qmon_classes_end(ctl);
+
     return 0;
 }
 
@@ -608,14 +1085,14 @@ int class_list(char *d)
 /*
  *       tc_class_modify
  *
- * This function changes the upper limit rate of the 'DEVICE' class to match
- * the rate passed in as the sole parameter.  This is the throttle means
+ * This function changes the upper limit rate of the 1:1 class on ctl's device
+ * to match the rate passed in.  This is the throttle means
  * we will use to maintian the QoS performance as the link becomes saturated.
  *
  * The structure of this code is gleaned from the source code of 'tc' and is
  * specific the the gargoyle QoS design.
  */
-int tc_class_modify(__u32 rate)
+int tc_class_modify(struct QMON_CTL *ctl, __u32 rate)
 {
     struct {
         struct nlmsghdr     n;
@@ -624,10 +1101,6 @@ int tc_class_modify(__u32 rate)
     } req;
 
     char  k[16];
-    __u32 handle;
-
-    if (dbw_ul == rate) return 0;
-    dbw_ul=rate;
 
     memset(&req, 0, sizeof(req));
     memset(k, 0, sizeof(k));
@@ -638,17 +1111,8 @@ int tc_class_modify(__u32 rate)
     req.t.tcm_family = AF_UNSPEC;
 
     //We are only going to modify the upper limit rate of the parent class.
-    if (get_tc_classid(&handle, "1:1")) {
-         fprintf(stderr,"invalid class ID");
-         return 1;
-    }
-    req.t.tcm_handle = handle;
-
-    if (get_tc_classid(&handle, "1:0")) {
-        fprintf(stderr,"invalid parent ID");
-        return 1;
-    }
-    req.t.tcm_parent = handle;
+    req.t.tcm_handle = class_handle;
+    req.t.tcm_parent = parent_handle;
      
     strcpy(k,"hsfc");
     addattr_l(&req.n, sizeof(req), TCA_KIND, k, strlen(k)+1);
@@ -671,10 +1135,8 @@ int tc_class_modify(__u32 rate)
 
 
     //Communicate our change to the kernel.
-    ll_init_map(&rth);
-
-    if ((req.t.tcm_ifindex = ll_name_to_index(DEVICE)) == 0) {
-            fprintf(stderr, "Cannot find device %s\n",DEVICE);
+    if ((req.t.tcm_ifindex = device_ifindex(ctl)) == 0) {
+            fprintf(stderr, "Cannot find device %s\n",ctl->dev);
             return 1;
     }
 
@@ -685,56 +1147,153 @@ int tc_class_modify(__u32 rate)
     return 0;
 }
 
+/* Send the limit the controller settled on to the kernel if it changed. */
+void apply_limit(struct QMON_CTL *ctl)
+{
+    if ((ctl->dbw_ul == ctl->sent_ul) && !ctl->resend) return;
+    ctl->sent_ul = ctl->dbw_ul;
+    ctl->resend = 0;
+    tc_class_modify(ctl, ctl->dbw_ul);
+}
+
 /*
-    This function is periodically called and updates the
-    status file for the deamon.  The status file can then
-    be viewed by other processes to tell what is going on.
+ * Create the status block.  It is built under another name and renamed
+ * into place so a reader never sees it half made.
+ */
+int status_open(void)
+{
+    size_t size;
+    int fd;
+
+    if (nhist < 0) nhist = 0;
+    size = sizeof(struct QMON_SHM) + nhist * sizeof(struct QMON_SHM_HIST);
+
+    unlink(QMON_SHM_FILE ".new");
+    fd = open(QMON_SHM_FILE ".new", O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        shm = NULL;
+        return -1;
+    }
+
+    shm->magic = QMON_SHM_MAGIC;
+    shm->version = QMON_SHM_VERSION;
+    shm->hdrsize = sizeof(struct QMON_SHM);
+    shm->pid = getpid();
+    shm->period = engine.period;
+    shm->nhist = nhist;
+
+    return rename(QMON_SHM_FILE ".new", QMON_SHM_FILE);
+}
+
+/* Filtered load of a controller, including our pings when they are on. */
+int ctl_load(struct QMON_CTL *ctl)
+{
+    if (engine.pingon) return ctl->dbw_fil + 64 * 8 * 1000/engine.period * nalive;
+    return ctl->dbw_fil;
+}
+
+/*
+    This function is called each tick and updates the
+    status block for the deamon.  The status block can then
+    be viewed by other processes (qosmon_status) to tell what
+    is going on.  It is only memory writes, no file I/O.
 */
-void update_status( FILE* fd )
+void update_status(void)
 {
 
-    struct CLASS_STATS *cptr=dnstats;
-    u_char i;
+    struct QMON_SHM_STATUS *st = &shm->status;
+    struct QMON_SHM_HIST *h = NULL;
+    struct QMON_CTL *ctl;
+    struct CLASS_STATS *cptr;
+    struct timespec now;
+    int i, c;
+#ifndef ONLYBG
     char nstr[10];
-    int dbw;
+#endif
 
-    //Link load includes the ping traffic when the pinger is on.
-    if (pingon) dbw = dbw_fil + 64 * 8 * 1000/period;
-           else dbw = dbw_fil; 
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    //Odd sequence count while we write, readers retry.
+    __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    st->time_ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+    st->pingon = engine.pingon;
+    st->nopingresponse = engine.nopingresponse;
+    st->rawfltime = engine.rawfltime;
+    st->fil_triptime = engine.fil_triptime;
+    st->rawfltime_max = engine.rawfltime_max;
+    st->pinglimit = engine.pinglimit;
+    st->active_pinglimit = engine.pinglimit+135*engine.pinglimit_cl/100;
+    st->sel_err = sel_err;
+
+    //With more than one ping target say how each is doing.
+    st->ntargets = (ntargets > 1) ? ntargets : 0;
+    for (i = 0; i < st->ntargets; i++) {
+        strncpy(st->targets[i].name, targets[i].name, QMON_SHM_NAMELEN-1);
+        st->targets[i].alive = targets[i].alive;
+        st->targets[i].misses = targets[i].misses;
+        st->targets[i].rawfltime = targets[i].rawfltime;
+    }
 
-    //Update the status file.
-    rewind(fd);
-    fprintf(fd,"State: %s\n",statename[qstate]);
-    fprintf(fd,"Link limit: %d (kbps)\n",dbw_ul/1000);
-    fprintf(fd,"Fair Link limit: %d (kbps)\n",new_dbw_ul/1000);
-    fprintf(fd,"Link load: %d (kbps)\n",dbw/1000);
+    if (passive.dev) strncpy(st->passive_dev, passive.dev, QMON_SHM_DEVLEN-1);
+    st->handshakes = passive.last_handshakes;
+    st->ping_skipped = passive.skipped;
 
-    if (pingon) {
-        if (nopingresponse) fprintf(fd,"Ping: Dropped, assume %d mS\n",rawfltime_max/1000);
-        else fprintf(fd,"Ping: %d (ms)\n",rawfltime);
+    if (shm->nhist) {
+        h = &shm->hist[shm->ticks % shm->nhist];
+        h->time_ms = st->time_ms;
+        h->rawfltime = engine.rawfltime;
+        h->fil_triptime = engine.fil_triptime;
     }
-    else
-        fprintf(fd,"Ping: off\n");
-
-    fprintf(fd,"Filtered/Max recent RTT: %d/%d (ms)\n",fil_triptime/1000,rawfltime_max/1000);
-    fprintf(fd,"RTT time limit: %d (ms) [%d/%d]\n",plimit/1000,pinglimit/1000,(pinglimit+135*pinglimit_cl/100)/1000);
-    fprintf(fd,"Classes Active: %u\n",DCA);
 
-    fprintf(fd,"Errors: (mismatch,errors,last err,selerr): %u,%u,%u,%i\n", cnt_mismatch, cnt_errorflg,last_errorflg,sel_err); 
-	
+    st->nctl = nctl;
+    for (c = 0, ctl = ctls; c < nctl; c++, ctl++) {
+        struct QMON_SHM_CTL *sc = &st->ctls[c];
+
+        strncpy(sc->dev, ctl->dev, QMON_SHM_DEVLEN-1);
+        sc->qstate = ctl->qstate;
+        sc->DCA = ctl->DCA;
+        sc->RTDCA = ctl->RTDCA;
+        sc->dbw_ul = ctl->dbw_ul;
+        sc->new_dbw_ul = ctl->new_dbw_ul;
+        sc->load = ctl_load(ctl);
+        sc->plimit = ctl->plimit;
+        sc->cnt_mismatch = ctl->cnt_mismatch;
+        sc->cnt_errorflg = ctl->cnt_errorflg;
+        sc->last_errorflg = ctl->last_errorflg;
+
+        sc->nclasses = (ctl->classcnt < QMON_SHM_CLASSES) ? ctl->classcnt : QMON_SHM_CLASSES;
+        for (i=0, cptr=ctl->classes; i<sc->nclasses; i++, cptr++) {
+            sc->classes[i].ID = cptr->ID;
+            sc->classes[i].actflg = cptr->actflg;
+            sc->classes[i].rtclass = cptr->rtclass;
+            sc->classes[i].backlog = cptr->backlog;
+            sc->classes[i].cbw_flt = cptr->cbw_flt;
+        }
 
-    i=0;
-    while ((i++<STATCNT) && (cptr->ID != 0)) {
-        fprintf(fd,"ID %4X, Active %u, Backlog %u, BW bps (filtered): %ld\n",
-              (short unsigned) cptr->ID,
-              cptr->actflg,
-              cptr->backlog,
-              cptr->cbw_flt);
-        cptr++;
+        if (h) {
+            h->ctls[c].qstate = sc->qstate;
+            h->ctls[c].DCA = sc->DCA;
+            h->ctls[c].dbw_ul = sc->dbw_ul;
+            h->ctls[c].new_dbw_ul = sc->new_dbw_ul;
+            h->ctls[c].load = sc->load;
+            h->ctls[c].plimit = sc->plimit;
+        }
     }
+    shm->ticks++;
 
-    fflush(fd);
-    ftruncate(fileno(fd), ftell(fd));
+    //Even again, the block is consistent.
+    __atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
 
 #ifndef ONLYBG
     if (DEAMON) return;
@@ -743,65 +1302,147 @@ void update_status( FILE* fd )
     mvprintw(0,0,"");
     printw("\nqosmon status\n");
 
-    if (pingon) {
-        sprintf(nstr,"%d",rawfltime);
+    if (engine.pingon) {
+        sprintf(nstr,"%d",engine.rawfltime/1000);
     } else {
         strcpy(nstr,"*");
     }
 
-    printw("ping (%s/%d) DCA=%d, RTDCA=%d, plim=%d, plim2=%d, state=%s\n",nstr,fil_triptime/1000,
-		DCA,RTDCA,pinglimit/1000,plimit/1000,statename[qstate]);
-    printw("Link Limit=%6d, Fair Limit=%6d, Current Load=%6d (kbps)\n", 
-		dbw_ul/1000,new_dbw_ul/1000,dbw/1000);
-    printw("Saved Active Limit=%6d, Saved Realtime Limit=%6d\n",saved_active_limit/1000,saved_realtime_limit/1000);
+    printw("ping (%s/%d) pinglimit=%d\n",nstr,engine.fil_triptime/1000,engine.pinglimit/1000);
     printw("pings sent=%d, pings received=%d\n", 
-		ntransmitted,nreceived);
-
-    printw("Defined classes for %s\n",DEVICE); 
-    printw("Errors: (mismatches,errors,last err,selerr): %u,%u,%u,%i\n", cnt_mismatch, cnt_errorflg,last_errorflg,sel_err); 
-    cptr=dnstats;
-    i=0; 
-    while ((i++<STATCNT) && (cptr->ID != 0)) {
-        printw("ID %4X, Active %u, Realtime %u. Backlog %u, BW (filtered kbps): %ld\n",
-              (short unsigned) cptr->ID,
-              cptr->actflg,
-			  cptr->rtclass,
-              cptr->backlog,
-              cptr->cbw_flt/1000);
-        cptr++;
-    }
-    time_t now;
-    time(&now);
-    printw("Print time: %s\n",ctime(&now));
+		ntransmitted,engine.nreceived);
+    printw("Errors: (selerr): %i\n", sel_err); 
+    if (passive.dev) printw("Passive %s: handshakes=%d%s\n", passive.dev, passive.last_handshakes, passive.skipped ? ", ping skipped" : "");
+
+    for (c=0, ctl=ctls; c<nctl; c++, ctl++) {
+        printw("\nDefined classes for %s: DCA=%d, RTDCA=%d, plim2=%d, state=%s\n",ctl->dev,
+			ctl->DCA,ctl->RTDCA,ctl->plimit/1000,statename[ctl->qstate]);
+        printw("Link Limit=%6d, Fair Limit=%6d, Current Load=%6ld (kbps)\n", 
+			ctl->dbw_ul/1000,ctl->new_dbw_ul/1000,ctl->dbw_fil/1000);
+        printw("Saved Active Limit=%6d, Saved Realtime Limit=%6d\n",ctl->saved_active_limit/1000,ctl->saved_realtime_limit/1000);
+        printw("Errors: (mismatches,errors,last err): %u,%u,%u\n", ctl->cnt_mismatch, ctl->cnt_errorflg,ctl->last_errorflg); 
+        for (i=0, cptr=ctl->classes; i<ctl->classcnt; i++, cptr++) {
+            printw("ID %4X, Active %u, Realtime %u. Backlog %u, BW (filtered kbps): %ld\n",
+                  (short unsigned) cptr->ID,
+                  cptr->actflg,
+				  cptr->rtclass,
+                  cptr->backlog,
+                  cptr->cbw_flt/1000);
+        }
+    }
+    printw("Print time: %s\n",ctime(&now.tv_sec));
 
     refresh();
 #endif
 
 }
 
-/* v2.3 feature allows reseting the link limit to the initial value by sending the process SIGUSR1. */
-sig_atomic_t resetbw=1;
+/* v2.3 feature allows reseting the link limit to the initial value by sending the process SIGUSR1.
+   The first limit comes from qmon_init(). */
+sig_atomic_t resetbw=0;
 void resetsig(int parm)
 {
     resetbw=1;
 }
 
 
+/*
+ * Fill in target t from spec, "host" to ping it or "tcp:<port>:host" to
+ * probe it with TCP SYNs.  Returns 0 on success.
+ */
+int parse_target(char *spec, struct PING_TARGET *t)
+{
+    struct addrinfo* ainfo;
+    char *host = spec;
+    int port = 0;
+
+    memset(t, 0, sizeof(*t));
+    t->name = spec;
+    t->sock = -1;
+    t->alive = 1;
+    t->proto = PROBE_ICMP;
+
+    if (strncmp(spec, "tcp:", 4) == 0) {
+        port = atoi(spec+4);
+        host = strchr(spec+4, ':');
+        if ((port <= 0) || (port > 65535) || (host == NULL)) return 1;
+        host++;
+        t->proto = PROBE_TCP;
+    }
+
+    if(inet_pton(AF_INET6, host, &(((struct sockaddr_in6*)&t->addr)->sin6_addr)) == 1)
+    {
+        ((struct sockaddr_in6*)&t->addr)->sin6_family = AF_INET6;
+    }
+    else if(inet_pton(AF_INET, host, &(((struct sockaddr_in*)&t->addr)->sin_addr)) == 1)
+    {
+        ((struct sockaddr_in*)&t->addr)->sin_family = AF_INET;
+    }
+    else
+    {
+        if(getaddrinfo(host,NULL,NULL,&ainfo) == 0)
+        {
+            memcpy(&t->addr, ainfo->ai_addr, ainfo->ai_addrlen);
+            freeaddrinfo(ainfo);
+        }
+        else
+        {
+            return 1;
+        }
+    }
+
+    if (t->addr.ss_family == AF_INET6) ((struct sockaddr_in6*)&t->addr)->sin6_port = htons(port);
+      else ((struct sockaddr_in*)&t->addr)->sin_port = htons(port);
+
+    return 0;
+}
+
+/* Open a raw ICMP socket for family, with RX stamps, non-blocking and watched by epoll. */
+int open_ping_socket(int family)
+{
+    struct protoent *proto;
+    int fd, on = 1;
+
+    if ((proto = getprotobyname(family == AF_INET ? "icmp" : "ipv6-icmp")) == NULL) {
+        fprintf(stderr, "%s: unknown protocol\n",(family == AF_INET ? "icmp" : "ipv6-icmp"));
+        exit(10);
+    }
+
+    fd = socket(family, SOCK_RAW, proto->p_proto);
+    if (fd < 0) return fd;
+
+    //Ask the kernel to stamp pongs as they arrive.  Without it we fall back
+    //to reading the clock when we wake up.
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == 0) rx_tstamp = 1;
+
+    //Pongs are drained without blocking so a stray wakeup can not stall the tick.
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    return fd;
+}
+
 /*
  *          M A I N
  */
 int main(int argc, char *argv[])
 {
     struct sockaddr_storage from;
+    struct epoll_event ev;
+    struct itimerspec tick;
     char **av = argv;
-    struct sockaddr_storage *to = &whereto;
-    int on = 1;
-    struct protoent *proto;
-    float err;
-    struct addrinfo* ainfo;
+    struct QMON_CTL *ctl;
+    struct PING_TARGET *t;
+    char *spec, *next;
+    char need4 = 0, need6 = 0;
+    int c;
     int skip_initial_measurement = 0;
     int custom_triptime = -1;
     int custom_bwlimit = -1;
+    char *upload_dev = NULL;
+    int upload_bw = 0;
+    char *tracefile = NULL;
+    int period, bandwidth, pinglimit = 0;
+    struct timespec now;
 
 
     argc--, av++;
@@ -824,6 +1465,7 @@ int main(int argc, char *argv[])
                     if(argc > 1) {
                         custom_triptime = atoi(*++av);
                         argc--;
+                        av[0] += strlen(av[0]) - 1;  //The value is not more switches.
                     }
                     break;
 
@@ -831,6 +1473,51 @@ int main(int argc, char *argv[])
                     if(argc > 1) {
                         custom_bwlimit = atoi(*++av);
                         argc--;
+                        av[0] += strlen(av[0]) - 1;  //The value is not more switches.
+                    }
+                    break;
+
+                case 'u':
+                    if(argc > 1) {
+                        upload_dev = *++av;
+                        argc--;
+                        av[0] += strlen(av[0]) - 1;  //The value is not more switches.
+                    }
+                    break;
+
+                case 'U':
+                    if(argc > 1) {
+                        upload_bw = atoi(*++av);
+                        argc--;
+                        av[0] += strlen(av[0]) - 1;  //The value is not more switches.
+                    }
+                    break;
+
+                case 'm':
+                    minfilter = 1;
+                    break;
+
+                case 'R':
+                    if(argc > 1) {
+                        tracefile = *++av;
+                        argc--;
+                        av[0] += strlen(av[0]) - 1;  //The value is not more switches.
+                    }
+                    break;
+
+                case 'P':
+                    if(argc > 1) {
+                        passive.dev = *++av;
+                        argc--;
+                        av[0] += strlen(av[0]) - 1;  //The value is not more switches.
+                    }
+                    break;
+
+                case 'H':
+                    if(argc > 1) {
+                        nhist = atoi(*++av);
+                        argc--;
+                        av[0] += strlen(av[0]) - 1;  //The value is not more switches.
                     }
                     break;
             }
@@ -856,58 +1543,60 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    bzero((char *)&whereto, sizeof(whereto) );
-    if(inet_pton(AF_INET6, av[1], &(((struct sockaddr_in6*)to)->sin6_addr)) == 1)
-    {
-        ((struct sockaddr_in6*)to)->sin6_family = AF_INET6;
-    }
-    else if(inet_pton(AF_INET, av[1], &(((struct sockaddr_in*)to)->sin_addr)) == 1)
-    {
-        ((struct sockaddr_in*)to)->sin_family = AF_INET;
-    }
-    else
-    {
-        if(getaddrinfo(av[1],NULL,NULL,&ainfo) == 0)
-        {
-            memcpy(to, ainfo->ai_addr, ainfo->ai_addrlen);
-            freeaddrinfo(ainfo);
+    //The second parameter is the ping target(s).
+    for (spec = av[1]; spec != NULL; spec = next) {
+        if ((next = strchr(spec, ',')) != NULL) *next++ = '\0';
+        if (*spec == '\0') continue;
+
+        if (ntargets == MAXTARGETS) {
+            fprintf(stderr, "Too many ping targets, the limit is %d\n", MAXTARGETS);
+            exit(1);
         }
-        else
-        {
-            fprintf(stderr, "%s: unknown host %s\n", argv[1], av[1]);
+
+        t = &targets[ntargets];
+        if (parse_target(spec, t)) {
+            fprintf(stderr, "%s: unknown host %s\n", argv[0], spec);
             exit(1);
         }
+        t->ident = (getpid() + ntargets) & 0xFFFF;
+
+        if (t->proto == PROBE_ICMP) {
+            if (t->addr.ss_family == AF_INET6) need6 = 1;
+              else need4 = 1;
+        }
+        ntargets++;
     }
+    if (ntargets == 0) {
+        fprintf(stderr, "%s: unknown host %s\n", argv[0], av[1]);
+        exit(1);
+    }
+    nalive = ntargets;
 
     //The third parameter is the maximum download speed in kbps.
-    DBW_UL = atoi( av[2] );
-    if ((DBW_UL < 100) || (DBW_UL >= INT_MAX/1000)) {
+    bandwidth = atoi( av[2] );
+    if ((bandwidth < 100) || (bandwidth >= INT_MAX/1000)) {
         fprintf(stderr, "Invalid download bandwidth '%s'\n", av[2]);
         exit(1);
     }
+    qmon_ctl_init(&ctls[0], DEVICE, bandwidth);
+    nctl = 1;
 
-    //Convert kbps to bps.
-    dbw_ul = DBW_UL = DBW_UL*1000;
+    //Optionally we control the upload HFSC tree too.
+    if (upload_dev != NULL) {
+        if ((upload_bw < 100) || (upload_bw >= INT_MAX/1000)) {
+            fprintf(stderr, "Invalid upload bandwidth '%d'\n", upload_bw);
+            exit(1);
+        }
+        qmon_ctl_init(&ctls[1], upload_dev, upload_bw);
+        nctl = 2;
+    }
 
     //The fourth optional parameter is the ping limit in ms.
     if (argc == 4) {
-        pinglimit_cl = pinglimit = atoi( av[3] )*1000;
+        pinglimit = atoi( av[3] );
     }
 
-
-    ident = getpid() & 0xFFFF;
-
-    if ((proto = getprotobyname(to->ss_family == AF_INET ? "icmp" : "ipv6-icmp")) == NULL) {
-        fprintf(stderr, "%s: unknown protocol\n",(to->ss_family == AF_INET ? "icmp" : "ipv6-icmp"));
-        exit(10);
-    }
-
-    // where alpha = Sample_Period / (TC + Sample_Period)
-    // TC needs to be not less than 3 times the sample period
-    alpha = (period*1000. / (period*4 + period)); 
-
-    //Class bandwidth filter time constants  
-    BWTC= (period*1000. / (7500. + period));
+    qmon_init(&engine, period, pinglimit, (pingflags & ADDENTITLEMENT) != 0);
 
     //Check that we have access to tc functions.
     tc_core_init();
@@ -916,15 +1605,21 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    //Make sure the device is present and that we can scan it.
-    classptr=dnstats;
-    errorflg=0;       
-    class_list(DEVICE);
-    if (errorflg) {
-        fprintf(stderr, "Cannot scan ingress device %s\n",DEVICE);
+    //The class handles never change so parse them once.
+    if (get_tc_classid(&class_handle, "1:1") || get_tc_classid(&parent_handle, "1:0")) {
+        fprintf(stderr, "Invalid class ID\n");
         exit(1);
     }
 
+    //Make sure the devices are present and that we can scan them.
+    for (c = 0, ctl = ctls; c < nctl; c++, ctl++) {
+        class_list(ctl);
+        if (ctl->errorflg) {
+            fprintf(stderr, "Cannot scan device %s\n",ctl->dev);
+            exit(1);
+        }
+    }
+
    //If running in the background fork()
     if (DEAMON) {
 
@@ -963,40 +1658,71 @@ int main(int argc, char *argv[])
     //SIGUSR1 resets the link speed.
     signal( SIGUSR1, (sighandler_t) resetsig );
 
-    //Create the status file and ping socket
+    //Create the status block and ping socket
     //These are called here because the above daemon() call closes
     //open files.
-    statusfd = fopen("/tmp/qosmon.status","w");
-    s = socket(to->ss_family, SOCK_RAW, proto->p_proto);
+    status_open();
+    if (tracefile) {
+        if ((tracefd = fopen(tracefile,"w")) == NULL) {
+            if (DEAMON) syslog( LOG_ERR, "Cannot open trace file %s - %i",tracefile,errno );
+              else fprintf(stderr, "Cannot open trace file %s - %i\n",tracefile,errno );
+        }
+    }
+    if (need4) s = open_ping_socket(AF_INET);
+    if (need6) s6 = open_ping_socket(AF_INET6);
+    if (passive.dev && (passive_open() < 0)) {
+        if (DEAMON) syslog( LOG_ERR, "Cannot open packet socket for passive mode - %i",errno );
+          else fprintf(stderr, "Cannot open packet socket for passive mode - %i\n",errno );
+    }
+
+    //The tick runs at a fixed cadence whether pongs come back or not.
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
 
+    //Link notifications tell us when the cached ifindex goes stale.
+    //Look once more after subscribing so nothing slips between the two.
+    if (rtnl_open(&rth_link, RTMGRP_LINK) == 0) {
+        linkfd = rth_link.fd;
+        for (c = 0, ctl = ctls; c < nctl; c++, ctl++) ctl->link_changed = 1;
+    }
 
     //Check that things opened correctly.
     if (DEAMON) {
-        if (statusfd == NULL) {
-            syslog( LOG_CRIT, "Cannot open /tmp/qosmon.status - %i",errno );
+        if (shm == NULL) {
+            syslog( LOG_CRIT, "Cannot create " QMON_SHM_FILE " - %i",errno );
             exit(EXIT_FAILURE);
         }
   
-        if (s < 0) {
+        if ((need4 && (s < 0)) || (need6 && (s6 < 0))) {
             syslog( LOG_CRIT, "Cannot open ping socket - %i",errno );
             exit(EXIT_FAILURE);
         }
 
-        syslog(LOG_INFO, "starting socketfd = %i, statusfd = %i",s,fileno(statusfd));
+        if ((tfd < 0) || (epfd < 0)) {
+            syslog( LOG_CRIT, "Cannot create tick timer - %i",errno );
+            exit(EXIT_FAILURE);
+        }
+
+        syslog(LOG_INFO, "starting socketfd = %i",s);
     }
 
 #ifndef ONLYBG
     else {
-        if (statusfd == NULL) {
-	        fprintf(stderr, "Cannot open /tmp/qosmon.status - %i",errno );
+        if (shm == NULL) {
+	        fprintf(stderr, "Cannot create " QMON_SHM_FILE " - %i",errno );
             exit(EXIT_FAILURE);
         }
   
-        if (s < 0) {
+        if ((need4 && (s < 0)) || (need6 && (s6 < 0))) {
 	        fprintf( stderr, "Cannot open ping socket - %i",errno );
             exit(EXIT_FAILURE);
         }
 
+        if ((tfd < 0) || (epfd < 0)) {
+	        fprintf( stderr, "Cannot create tick timer - %i",errno );
+            exit(EXIT_FAILURE);
+        }
+
         //Ctrl-C terminates       
         signal( SIGINT, (sighandler_t) finish );
 
@@ -1011,337 +1737,175 @@ int main(int argc, char *argv[])
     }
 #endif
 
-    //Clear all initial stats.
-    memset((void *)&dnstats,0,sizeof(dnstats));
+    if (!rx_tstamp && (need4 || need6) && DEAMON) syslog(LOG_WARNING, "SO_TIMESTAMPNS not available");
 
-    //Initialize the max ping to something reasonable.
-    //We will fix it later.
-    rawfltime_max = period*1000;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    if (s >= 0) {
+        ev.data.fd = s;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, s, &ev);
+    }
+    if (s6 >= 0) {
+        ev.data.fd = s6;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, s6, &ev);
+    }
+    ev.data.fd = tfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+    if (linkfd >= 0) {
+        ev.data.fd = linkfd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, linkfd, &ev);
+    }
+    if (passive.fd >= 0) {
+        ev.data.fd = passive.fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, passive.fd, &ev);
+    }
+
+    tick.it_interval.tv_sec = period / 1000;
+    tick.it_interval.tv_nsec = (period % 1000) * 1000000L;
+    tick.it_value = tick.it_interval;
+    timerfd_settime(tfd, 0, &tick, NULL);
+
+    //Clear all initial stats.
+    for (c = 0, ctl = ctls; c < nctl; c++, ctl++) {
+        ctl->classcnt = 0;
+        ctl->firstflg = 1;
+    }
 
     //If we are skipping initial link unload + measure, set some reasonable defaults and push us
     //straight into the IDLE state
     if (skip_initial_measurement) {
-        int default_bw = DBW_UL * 0.9;
-        qstate = QMON_IDLE;
-        pingon = 0;
-        fil_triptime = (custom_triptime > 0) ? custom_triptime * 1000 : 20000; // Start with 20ms, it will update as needed
-        if (pingflags & ADDENTITLEMENT) {
-            pinglimit += (1.1 * fil_triptime);
-        } else {
-            pinglimit = 2.0 * fil_triptime;
-        }
-        rawfltime_max = 2 * pinglimit;
-        saved_realtime_limit = saved_active_limit = new_dbw_ul = (custom_bwlimit > 0) ? custom_bwlimit * 1000 : default_bw;
-        tc_class_modify(new_dbw_ul);
-        //firstflg = 0; // We can't set this until after we have checked class counts below
+        qmon_skip_measurement(&engine, ctls, nctl, custom_triptime, custom_bwlimit);
+        for (c = 0, ctl = ctls; c < nctl; c++, ctl++) apply_limit(ctl);
     }
 
-    while (!sigterm) {
-        int len = sizeof (packet);
-        socklen_t fromlen = sizeof (from);
-        int cc;
-        u_char chill;
-        struct timeval timeout;
-        fd_set fdmask;
-        FD_ZERO(&fdmask);
-        FD_SET(s , &fdmask);
-
-        //rawfltime variable will be set in pr_pack() if we get a pong that matched
-        //our ping, but clearing it here will let us know we did not get a response to our
-        //ping.
-        rawfltime=0;
-
-        //Send the next ping
-        if (pingon) pinger();
-        
-        //Wait for the pong(s).
-        timeout.tv_sec = 0;
-        timeout.tv_usec = period*1000;
-    
-        //Need a loop here to clean out any old pongs that show up.
-        //select() returns 1 if there is data to read.
-        //                 0 if the time has expired.
-        //                -1 if a signal arrived. 
-        while  (sel_err=select(s+1, &fdmask, NULL, NULL, &timeout))
-        {
-              //Reset timeout value which may have been overwritten by select()
-              //Also halve it so that the loop is tighter
-              timeout.tv_sec = 0;
-              timeout.tv_usec = period*0.5*1000;
-
-              //Signal arrived, just loop and keep waiting.
-              if (sel_err == -1) continue;
-        
-              //If we got here then data must be waiting, try to read the whole packet
-              if ( (cc=recvfrom(s,packet,len,0,(struct sockaddr *) &from, &fromlen)) < 0) {
-                  continue;
-              }
-              
-              //OK there is a whole packet, get it and record the triptime. 
-              pr_pack( packet, cc, &from );      
-
-        }
-
-        //Gather new statistics
-        classptr=dnstats;
-        cc=classcnt;
-        classcnt=0;
-        errorflg=0;       
-        class_list(DEVICE);
-
-        //If there was an error or the number of classes changed then reset everything
-        if (errorflg || (!firstflg && (cc !=classcnt))) {
-
-            if (errorflg) {cnt_errorflg++; last_errorflg=errorflg;}
-              else if (cc != classcnt) cnt_mismatch++;
+    //The trace starts with what qosmon_replay needs to set itself up the same way.
+    if (tracefd) {
+        fprintf(tracefd, "p %d %d %d\n", period, pinglimit, engine.addentitlement);
+        for (c = 0, ctl = ctls; c < nctl; c++, ctl++) fprintf(tracefd, "d %d %s %d\n", c, ctl->dev, ctl->DBW_UL/1000);
+        if (skip_initial_measurement) fprintf(tracefd, "s %d %d\n", custom_triptime, custom_bwlimit);
+    }
 
-            firstflg=1;
-            pingon=0;
-            qstate=QMON_CHK; 
+    while (!sigterm) {
+        struct epoll_event events[MAXTARGETS+4];
+        int cc, n, i, j;
+        int rawfltime;
+        char ticked = 0;
+
+        //Wait for the next tick or pong(s).
+        //epoll_wait() returns the number of ready descriptors
+        //                 -1 if a signal arrived.
+        n = epoll_wait(epfd, events, MAXTARGETS+4, -1);
+        if (n < 0) {
+            //Signal arrived, just loop and check sigterm.
+            if (errno != EINTR) sel_err = errno;
             continue;
         }
-        else if(skip_initial_measurement) {
-            firstflg=0;
-        }
-        skip_initial_measurement=0; //Reset this now
- 
-        //Initialize or reinitialize the fair linklimit.
-        if (resetbw) {
-           saved_realtime_limit=saved_active_limit=new_dbw_ul= DBW_UL * .9;
-           resetbw=0;
-        }
 
-        //Look at an ping response time we got.  If we did not get any then it most likely
-        //got dropped so use the maximum value that we have recently seen as we know the downlink
-        //queue must be at least this long.
-        if (!rawfltime) {
-           rawfltime = rawfltime_max/1000;
-           nopingresponse=1;
-        } else
-           nopingresponse=0;
-
-        //Update the filtered ping response time based on what happened.
-        //If we are not pinging then no change in the filtered value.
-        if (pingon) 
-           fil_triptime = ((rawfltime*1000 - fil_triptime)*alpha)/1000 + fil_triptime;
-
-        //Run the state machine
-        switch (qstate) {
-
-            // Wait to see if the ping targer will respond at all before doing anything
-            case QMON_CHK: 
-                pingon=1;
-
-                //If we get two pings go ahead and lower the link speed.
-                if (nreceived >= 2) {
-
-                    //If the pinglimit was entered on the command line 
-                    //without the add flag then go directly to the 
-                    //IDLE state otherwise automatically determine an appropriate 
-                    //ping limit.
-                    if ((pinglimit) && !(pingflags & ADDENTITLEMENT)) {
-                        dbw_ul=0;                  //Forces an update in tc_class_modify()
-                        tc_class_modify(new_dbw_ul); 
-                        fil_triptime = rawfltime*1000;
-                        qstate=QMON_IDLE;
-                     } else {
-                        tc_class_modify(1000);  //Unload the link for the measurement.
-                        nreceived=0;
-                        qstate=QMON_INIT;
-                     }
-                } 
-                break; 
-
-            // Take a measurement of the practical ping time we can expect in an unsaturated
-            // link.  We do this by making pings and using the filter response after
-            // throttling all traffic in the link.
-            case QMON_INIT:
-                //Filter starts at ten seconds and runs until 15 seconds.
-                //For the first ten seconds we initialize the filter to the last ping time we saw.
-                //After the seventh second we start filtering.
-                if (nreceived < (10000/period)+1) fil_triptime = rawfltime*1000;
-
-                //After 15 seconds we have measured our ping response entitlement.
-                //Move on to the active state. 
-                if (nreceived > (15000/period)+1) {
-                    qstate=QMON_IDLE;
-                    tc_class_modify(new_dbw_ul);  //Restore reasonable bandwidth
-
-                    //If the user specified no limit then the RTT ping limit is computed from what was
-                    //entered on the command line.
-                    if (pingflags & ADDENTITLEMENT) {
-                        //Add what the user specified to the 110% of the measure ping time.
-                        pinglimit += (fil_triptime*1.1);
-                    } else {
-                        //Without the '-a' flag we just use 200% of measure ping time.  
-                        //This works OK in my system but I have no evidence that it will work in other systems.
-                        pinglimit = fil_triptime*2.0;
-                    }
+        for (i = 0; i < n; i++) {
 
-                    //Sanity Checks
-                    if (pinglimit < 10000) pinglimit=10000;
-                    if (pinglimit > 800000) pinglimit=800000;
+            if (events[i].data.fd == tfd) {
+                uint64_t expirations;
 
-                    //Reasonable max ping. 
-                    rawfltime_max = 2*pinglimit;
-                }
-                break;
-
-            // In the idle state we have a nearly idle link.
-            // In these cases it is not necessary to monitor delay times so the active
-            // ping is disabled.
-            case QMON_IDLE:
-                pingon=0;
-
-            //Add a hysterisis band when going in/out of IDLE mode.
-            //to try and prevent getting stuck in IDLE mode at the edge of the dynamic range
-            //
-            //We exit idle mode when the link gets above 12% of the upper limit.
-            //We enter idle mode when we get below 10%. (2% hysterisis band).
-            //With this setup at 15% it would be possible to get stuck here since the dynamic limit
-            //can fall as low as 15% which would mean we might not be able to get above 15% to restart the ACTIVE mode.
-            //Hopefully we will always be able to get above 12% at least.
-            if (dbw_fil < 0.12 * DBW_UL) break;
-
-            // In the ACTIVE & REALTIME states we observe ping times as long as the
-            // link remains active.  While we are observing we adjust the 
-            // link upper limit speed to maintain the specified pinglimit.
-            // If the amount of data we are recieving dies down we enter the WAIT state
-            case QMON_ACTIVE:
-            case QMON_REALTIME:
-                pingon=1;
-
-                //Save the bandwidth limit for each mode.
-                if (qstate == QMON_REALTIME) saved_realtime_limit = new_dbw_ul;
-                if (qstate == QMON_ACTIVE) saved_active_limit = new_dbw_ul;
-
-                //The pinglimit we will use depends on if any realtime classes are active
-                //or not.  In realtime mode we only allow 'pinglimit' round trip times which
-                //makes our pings low but also lowers our throughput.  The automatic measurement 
-                //above set pinglimit to the average RTT of the ping assuming it has to wait on
-                //average for 2/3 of an single MTU sized packet to transmit.  The means on 
-                //average there is nothing in the buffer but a packet is transmitting.
-
-                //When not in realtime mode the stradegy is that we allow enough packets in the queue
-                //to fully utilize the downlink.
-
-                //We are talking about a queue controlled by the ISP so we don't know much about it.
-                //We make an assumption that the queue is long enough to allow full utilization of the link.
-                //This should be the case and often the queue is much longer than needed (bufferbloat).  
-                //When not in realtime mode we can allow this buffer to fill but we don't want it to overflow 
-                //because it will then drop packets which will cause our QoS to breakdown.  So we want it to fill
-                //just enough to promote full link utilization.
-
-                //The classical optimum queue size would be equal to the bandwidth * RTT and the 
-                //additional time it will take our ping to pass through such a queue turns out to be the RTT. 
-                //But Barman et all, Globecomm2004 indicates that only 20-30% of this is really needed.  
-                //
-                //When we measured an RTT above that it was to the ISPs gateway so we do not really know what the average 
-                //RTT time to other IPs on the internet.  And since not all hosts respond the same anyway I doubt there
-                //is consistant RTT that we could use.
-				//	
-                //For ACTIVE mode on a 925kbps/450kbps link I measured the following 
-                //relationship between ping limit and throughput with large packets downloading.
-                //
-                //Ping Limit   Throughput   Percent
-                // 612ms       918kbps      100 
-                // 525ms       915kbps      99.6
-                // 437ms       898kbps      97.8
-                // 350ms       875kbps      95.3 
-                // 262ms       862kbps      93.8 
-                //  81ms       870kbps      94.7
-                //  60ms       680kbps      69.8
-                //  50ms       630kbps      68.6
-                //  40ms       490kbps      53.3      
-                //
-                //The 1500 byte packet time is 1500*10/925kbps download and 1500*10/425kbps upload for a total
-                //RTT of around 48ms.  Idle ping times on this link are around 35ms.
-                //
-                //These results indicate that on my link not much is gained by increasing beyond 81ms.  This is pretty much
-                //the MINRTT mode computed with the -a switch.  Still other links may be different so I suspect that
-                //switching to active mode will benefit some people.
-                //
-                //The statedgy I will use for the ACTIVE mode limit will be to add an additional 135% packet delay over
-                //what we have in RTT mode.  The packet delay was entered on the command line or zero if nothing was entered.
-
-                //I hope that this will work well for a broad range of users from satellite links with RTTs of 1 second or more
-                //to users with hot connections that have small queues upstream of them.
-
-                if ((RTDCA == 0) && (pingflags & ADDENTITLEMENT)) {
-                    plimit=135*pinglimit_cl/100+pinglimit;
-
-                    //When switching into active mode for the first time initialize the bandwidth
-                    //limit to the last value that was known to work.
-                    if (qstate != QMON_ACTIVE) {
-                        qstate=QMON_ACTIVE;
-                        new_dbw_ul=saved_active_limit;
-                        tc_class_modify(new_dbw_ul);
-                    }
+                //We only run one pass even if ticks were missed so the filters see one sample.
+                if (read(tfd, &expirations, sizeof(expirations)) == sizeof(expirations)) ticked = 1;
+                continue;
+            }
 
-                } else {
-                    plimit = pinglimit;
+            if (events[i].data.fd == linkfd) {
+                link_notify();
+                continue;
+            }
 
-                    //When switching into realtime mode for the first time initialize the bandwidth
-                    //limit to the last value that was known to work.
-                    if (qstate != QMON_REALTIME) {
-                        qstate=QMON_REALTIME;
-                        new_dbw_ul=saved_realtime_limit;
-                        tc_class_modify(new_dbw_ul);
-                    }
+            if (events[i].data.fd == passive.fd) {
+                passive_read();
+                continue;
+            }
 
+            //Anything else that is not an ICMP socket is a TCP probe finishing.
+            if ((events[i].data.fd != s) && (events[i].data.fd != s6)) {
+                for (j = 0, t = targets; j < ntargets; j++, t++) {
+                    if (t->sock == events[i].data.fd) {
+                        tcp_pong(t);
+                        break;
+                    }
                 }
+                continue;
+            }
 
-                //When the downlink falls below 10% utilization we turn off the pinger.
-                if (dbw_fil < 0.1 * DBW_UL) qstate=QMON_IDLE;
-
-                //Compute the ping error
-                err = fil_triptime - plimit;
-
-                //Negative error means we might be able to increase the link limit.
-                if (err < 0) {
+            //Clean out every pong that is waiting, the last one matching our ping wins.
+            while (1) {
+                union {
+                    struct cmsghdr cm;
+                    char buf[CMSG_SPACE(sizeof(struct timespec)) * 2];
+                } control;
+                struct iovec iov;
+                struct msghdr msg;
+
+                iov.iov_base = packet;
+                iov.iov_len = sizeof(packet);
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_name = &from;
+                msg.msg_namelen = sizeof(from);
+                msg.msg_iov = &iov;
+                msg.msg_iovlen = 1;
+                msg.msg_control = &control;
+                msg.msg_controllen = sizeof(control);
+
+                if ((cc = recvmsg(events[i].data.fd, &msg, 0)) < 0) break;
+
+                //OK there is a whole packet, get it and record the triptime. 
+                pr_pack( packet, cc, &from, rx_time(&msg) );
+            }
+        }
 
-                   //Do not increase the bandwidth until we reach 85% of the current limit.
-                   if  (dbw_fil < dbw_ul * 0.85) break;
+        if (!ticked) continue;
 
-                   //Increase slowly (0.4%/sec).  err is negative here.  
-                   new_dbw_ul = new_dbw_ul * (1.0 - 0.004*err*(float)period/(float)plimit/1000.0);
-                   if (new_dbw_ul > DBW_UL) new_dbw_ul=DBW_UL;
+        //Fold the answers to last tick's probes into one trip time.
+        rawfltime = combine_targets();
+        if (passive.fd >= 0) {
+            rawfltime = passive_combine(rawfltime);
+            if (passive.rebind) passive_bind();
+        }
 
-                } else {
-                //Positive error means we need to decrease the bandwidth.
+        if (tracefd) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            fprintf(tracefd, "t %lld %d\n", (long long)(timespec_ns(&now)/1000), rawfltime);
+        }
 
-                   new_dbw_ul = new_dbw_ul * (1.0 - 0.004*err*(float)period/(float)plimit/1000.0);
+        //SIGUSR1 puts the fair link limits back at the next step.
+        if (resetbw) {
+            engine.resetbw=1;
+            resetbw=0;
+            if (tracefd) fprintf(tracefd, "r\n");
+        }
 
-                   //Dynamic range is 1/.15 or 6.67 : 1.  
-                   if (new_dbw_ul < DBW_UL*.15) new_dbw_ul=DBW_UL*.15;
-                }   
+        //Gather new statistics
+        for (c = 0, ctl = ctls; c < nctl; c++, ctl++) class_list(ctl);
 
-                //Modify parent download limit as needed.
-                tc_class_modify(new_dbw_ul);
+        //Run the controllers and hand the kernel whatever limits they came up with.
+        qmon_step(&engine, ctls, nctl, rawfltime);
+        for (c = 0, ctl = ctls; c < nctl; c++, ctl++) apply_limit(ctl);
 
-                //Keep downward pressure on rawfltime_max to keep it fresh.
-                if (rawfltime_max > plimit) rawfltime_max -= 100;
+        update_status();
+        if (tracefd) fflush(tracefd);
 
-                break;
-                    
-                      
+        //Send the next probes, their answers are measured over the coming tick.
+        //While handshakes keep coming in they tell us all a ping would.
+        if (engine.pingon) {
+            passive.skipped = (passive.fd >= 0) && engine.base_triptime && (ctls->qstate > QMON_INIT) &&
+                              (passive.last_handshakes >= PASSIVE_MIN);
+            if (!passive.skipped) pinger();
         }
-
-        update_status(statusfd);
-
-        //If we get here the first pass is over. 
-        firstflg=0;
  
-    }  //Next ping
-
+    }  //Next tick
 
-    qstate=QMON_EXIT;
 
     //We got a signal to terminate so start by restoring the root TC class to
     //the original upper limit.
-    tc_class_modify(DBW_UL);
+    qmon_exit(ctls, nctl);
+    for (c = 0, ctl = ctls; c < nctl; c++, ctl++) apply_limit(ctl);
     
-    update_status(statusfd);
+    update_status();
 
     //Write a message in the system log
     if (DEAMON) {
@@ -0,0 +1,512 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*  qosmon_ctl - The qosmon congestion controller without any of its I/O.
+ *               qosmon feeds it from the kernel, qosmon_replay from traces.
+ *
+ *  Copyright © 2010 by Paul Bixel <pbix@bigfoot.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include "qosmon_ctl.h"
+
+char *statename[]= {"CHECK","INIT","ACTIVE","MINRTT","IDLE","DISABLED"};
+
+
+/* Set up the ping engine.  period is in ms and pinglimit in ms, 0 to measure it. */
+void qmon_init(struct QMON_ENGINE *e, int period, int pinglimit, char addentitlement)
+{
+    memset(e, 0, sizeof(*e));
+    e->period = period;
+    e->addentitlement = addentitlement;
+    e->pinglimit_cl = e->pinglimit = pinglimit*1000;
+
+    // where alpha = Sample_Period / (TC + Sample_Period)
+    // TC needs to be not less than 3 times the sample period
+    e->alpha = (period*1000. / (period*4 + period)); 
+
+    //Class bandwidth filter time constants  
+    e->BWTC= (period*1000. / (7500. + period));
+
+    //Initialize the max ping to something reasonable.
+    //We will fix it later.
+    e->rawfltime_max = period*1000;
+
+    //The first tick sets the initial fair link limits.
+    e->resetbw = 1;
+}
+
+/* Set up a controller for dev, whose link limit is bandwidth in kbps. */
+void qmon_ctl_init(struct QMON_CTL *ctl, char *dev, int bandwidth)
+{
+    memset(ctl, 0, sizeof(*ctl));
+    ctl->dev = dev;
+
+    //Convert kbps to bps.  The kernel is assumed to start at the full limit.
+    ctl->sent_ul = ctl->dbw_ul = ctl->DBW_UL = bandwidth*1000;
+    ctl->qstate = QMON_CHK;
+    ctl->firstflg = 1;
+    ctl->link_changed = 1;
+}
+
+/*
+ * Skip the initial link unload + measure, set some reasonable defaults and push us
+ * straight into the IDLE state.  triptime (ms) and bwlimit (kbps, the download
+ * controller's) are used if they are positive.
+ */
+void qmon_skip_measurement(struct QMON_ENGINE *e, struct QMON_CTL *ctls, int nctl, int triptime, int bwlimit)
+{
+    struct QMON_CTL *ctl;
+    int c;
+
+    e->pingon = 0;
+    e->fil_triptime = (triptime > 0) ? triptime * 1000 : 20000; // Start with 20ms, it will update as needed
+    if (e->addentitlement) {
+        e->pinglimit += (1.1 * e->fil_triptime);
+    } else {
+        e->pinglimit = 2.0 * e->fil_triptime;
+    }
+    e->rawfltime_max = 2 * e->pinglimit;
+    e->base_triptime = e->fil_triptime;
+    for (c = 0, ctl = ctls; c < nctl; c++, ctl++) {
+        int default_bw = ctl->DBW_UL * 0.9;
+        ctl->qstate = QMON_IDLE;
+        //The fair limit on the command line is the download one.
+        if ((c == 0) && (bwlimit > 0)) default_bw = bwlimit * 1000;
+        ctl->saved_realtime_limit = ctl->saved_active_limit = ctl->new_dbw_ul = default_bw;
+        ctl->dbw_ul = ctl->new_dbw_ul;
+    }
+}
+
+
+/* Order classes by handle for qsort() and bsearch(). */
+static int compare_classes(const void *a, const void *b)
+{
+    uint32_t ha = ((const struct CLASS_STATS *)a)->handle;
+    uint32_t hb = ((const struct CLASS_STATS *)b)->handle;
+    return (ha > hb) - (ha < hb);
+}
+
+/* Start a new pass over ctl's classes. */
+void qmon_classes_begin(struct QMON_CTL *ctl)
+{
+    ctl->RTDCA=ctl->DCA =0;
+    ctl->dbw_fil=0;
+    ctl->nseen=0;
+    ctl->errorflg=0;
+    if (ctl->firstflg) ctl->classcnt=0;
+}
+
+/*
+ * Return the table entry of class handle, whose leafid is -1 for a parent.
+ * The first time through we add the class to the table, it gets sorted once
+ * the pass is over.  After that we look it up by handle.  Returns NULL and sets
+ * errorflg if the class list changed or we ran out of memory.
+ */
+struct CLASS_STATS *qmon_class_find(struct QMON_CTL *ctl, uint32_t handle, int leafid)
+{
+    struct CLASS_STATS *classptr;
+
+    //A previous error backs us out.
+    if (ctl->errorflg) return NULL;
+
+    if (ctl->firstflg) {
+        if (ctl->classcnt >= ctl->classalloc) {
+            int newalloc = ctl->classalloc ? ctl->classalloc*2 : 32;
+            struct CLASS_STATS *newclasses = realloc(ctl->classes, newalloc*sizeof(struct CLASS_STATS));
+            if (newclasses == NULL) {
+                ctl->errorflg=1;
+                return NULL;
+            }
+            ctl->classes = newclasses;
+            ctl->classalloc = newalloc;
+        }
+        classptr = &ctl->classes[ctl->classcnt++];
+        memset(classptr, 0, sizeof(*classptr));
+        classptr->handle = handle;
+        classptr->ID = leafid;
+    } else {
+        struct CLASS_STATS key;
+
+        //If the class or its leafid is new then the class list changed so backout.
+        key.handle = handle;
+        classptr = bsearch(&key, ctl->classes, ctl->classcnt, sizeof(struct CLASS_STATS), compare_classes);
+        if ((classptr == NULL) || (leafid != classptr->ID)) {
+            ctl->errorflg=1;
+            return NULL;
+        }
+    }
+    ctl->nseen++;
+
+    return classptr;
+}
+
+/* Feed the byte count and backlog read at now_ns into classptr's filtered bandwidth. */
+void qmon_class_sample(struct QMON_ENGINE *e, struct QMON_CTL *ctl, struct CLASS_STATS *classptr, uint64_t work, u_char backlog, int64_t now_ns)
+{
+    u_char actflg=0;
+
+    classptr->backlog = backlog;
+
+    //Avoid a big jolt on the first pass.
+    if (ctl->firstflg) {
+        classptr->bytes = work;
+    }
+
+    //Update the filtered bandwidth based on what happened unless a rollover occured.
+    if (work >= classptr->bytes) {
+        long int bw;
+        long bperiod; // always in ms
+
+        //Calculate an accurate time period for the bps calculation.
+        bperiod = (now_ns - classptr->bwtime) / 1000000LL; // ns -> ms
+        if (bperiod<e->period/2) bperiod=e->period;
+        bw = (work - classptr->bytes)*8000/bperiod;  //bps per second x 1000 here
+
+        //Convert back to bps as part of the filter calculation 
+        classptr->cbw_flt=(bw-classptr->cbw_flt)*e->BWTC/1000+classptr->cbw_flt;
+
+        //A class is considered active if its BW exceeds 4000bps 
+        if ((classptr->ID != -1) && (classptr->cbw_flt > 4000)) {
+            ctl->DCA++;actflg=1;
+            if (classptr->rtclass) ctl->RTDCA++;
+        }
+
+        //Calculate the total link load by adding up all the leaf classes.
+        if (classptr->ID != -1) ctl->dbw_fil += classptr->cbw_flt;
+
+    }
+
+    classptr->bwtime=now_ns;
+    classptr->bytes = work;
+    classptr->actflg = actflg;
+}
+
+/* The pass over ctl's classes is done. */
+void qmon_classes_end(struct QMON_CTL *ctl)
+{
+    if (ctl->firstflg) qsort(ctl->classes, ctl->classcnt, sizeof(struct CLASS_STATS), compare_classes);
+}
+
+
+/*
+ * Run one tick of the IDLE/ACTIVE/MINRTT state machine for one controller.
+ * fil_triptime is shared by all of them.  Returns 1 if this controller wants
+ * the pinger on.
+ */
+static char control_step(struct QMON_ENGINE *e, struct QMON_CTL *ctl)
+{
+    float err;
+    char wantping=0;
+
+    switch (ctl->qstate) {
+
+        // In the idle state we have a nearly idle link.
+        // In these cases it is not necessary to monitor delay times so the active
+        // ping is disabled.
+        case QMON_IDLE:
+
+        //Add a hysterisis band when going in/out of IDLE mode.
+        //to try and prevent getting stuck in IDLE mode at the edge of the dynamic range
+        //
+        //We exit idle mode when the link gets above 12% of the upper limit.
+        //We enter idle mode when we get below 10%. (2% hysterisis band).
+        //With this setup at 15% it would be possible to get stuck here since the dynamic limit
+        //can fall as low as 15% which would mean we might not be able to get above 15% to restart the ACTIVE mode.
+        //Hopefully we will always be able to get above 12% at least.
+        if (ctl->dbw_fil < 0.12 * ctl->DBW_UL) break;
+
+        // In the ACTIVE & REALTIME states we observe ping times as long as the
+        // link remains active.  While we are observing we adjust the 
+        // link upper limit speed to maintain the specified pinglimit.
+        // If the amount of data we are recieving dies down we enter the WAIT state
+        case QMON_ACTIVE:
+        case QMON_REALTIME:
+            wantping=1;
+
+            //Save the bandwidth limit for each mode.
+            if (ctl->qstate == QMON_REALTIME) ctl->saved_realtime_limit = ctl->new_dbw_ul;
+            if (ctl->qstate == QMON_ACTIVE) ctl->saved_active_limit = ctl->new_dbw_ul;
+
+            //The pinglimit we will use depends on if any realtime classes are active
+            //or not.  In realtime mode we only allow 'pinglimit' round trip times which
+            //makes our pings low but also lowers our throughput.  The automatic measurement 
+            //above set pinglimit to the average RTT of the ping assuming it has to wait on
+            //average for 2/3 of an single MTU sized packet to transmit.  The means on 
+            //average there is nothing in the buffer but a packet is transmitting.
+
+            //When not in realtime mode the stradegy is that we allow enough packets in the queue
+            //to fully utilize the downlink.
+
+            //We are talking about a queue controlled by the ISP so we don't know much about it.
+            //We make an assumption that the queue is long enough to allow full utilization of the link.
+            //This should be the case and often the queue is much longer than needed (bufferbloat).  
+            //When not in realtime mode we can allow this buffer to fill but we don't want it to overflow 
+            //because it will then drop packets which will cause our QoS to breakdown.  So we want it to fill
+            //just enough to promote full link utilization.
+
+            //The classical optimum queue size would be equal to the bandwidth * RTT and the 
+            //additional time it will take our ping to pass through such a queue turns out to be the RTT. 
+            //But Barman et all, Globecomm2004 indicates that only 20-30% of this is really needed.  
+            //
+            //When we measured an RTT above that it was to the ISPs gateway so we do not really know what the average 
+            //RTT time to other IPs on the internet.  And since not all hosts respond the same anyway I doubt there
+            //is consistant RTT that we could use.
+				//	
+            //For ACTIVE mode on a 925kbps/450kbps link I measured the following 
+            //relationship between ping limit and throughput with large packets downloading.
+            //
+            //Ping Limit   Throughput   Percent
+            // 612ms       918kbps      100 
+            // 525ms       915kbps      99.6
+            // 437ms       898kbps      97.8
+            // 350ms       875kbps      95.3 
+            // 262ms       862kbps      93.8 
+            //  81ms       870kbps      94.7
+            //  60ms       680kbps      69.8
+            //  50ms       630kbps      68.6
+            //  40ms       490kbps      53.3      
+            //
+            //The 1500 byte packet time is 1500*10/925kbps download and 1500*10/425kbps upload for a total
+            //RTT of around 48ms.  Idle ping times on this link are around 35ms.
+            //
+            //These results indicate that on my link not much is gained by increasing beyond 81ms.  This is pretty much
+            //the MINRTT mode computed with the -a switch.  Still other links may be different so I suspect that
+            //switching to active mode will benefit some people.
+            //
+            //The statedgy I will use for the ACTIVE mode limit will be to add an additional 135% packet delay over
+            //what we have in RTT mode.  The packet delay was entered on the command line or zero if nothing was entered.
+
+            //I hope that this will work well for a broad range of users from satellite links with RTTs of 1 second or more
+            //to users with hot connections that have small queues upstream of them.
+
+            if ((ctl->RTDCA == 0) && e->addentitlement) {
+                ctl->plimit=135*e->pinglimit_cl/100+e->pinglimit;
+
+                //When switching into active mode for the first time initialize the bandwidth
+                //limit to the last value that was known to work.
+                if (ctl->qstate != QMON_ACTIVE) {
+                    ctl->qstate=QMON_ACTIVE;
+                    ctl->new_dbw_ul=ctl->saved_active_limit;
+                    ctl->dbw_ul = ctl->new_dbw_ul;
+                }
+
+            } else {
+                ctl->plimit = e->pinglimit;
+
+                //When switching into realtime mode for the first time initialize the bandwidth
+                //limit to the last value that was known to work.
+                if (ctl->qstate != QMON_REALTIME) {
+                    ctl->qstate=QMON_REALTIME;
+                    ctl->new_dbw_ul=ctl->saved_realtime_limit;
+                    ctl->dbw_ul = ctl->new_dbw_ul;
+                }
+
+            }
+
+            //When the downlink falls below 10% utilization we turn off the pinger.
+            if (ctl->dbw_fil < 0.1 * ctl->DBW_UL) ctl->qstate=QMON_IDLE;
+
+            //Compute the ping error
+            err = e->fil_triptime - ctl->plimit;
+
+            //Negative error means we might be able to increase the link limit.
+            if (err < 0) {
+
+               //Do not increase the bandwidth until we reach 85% of the current limit.
+               if  (ctl->dbw_fil < ctl->dbw_ul * 0.85) break;
+
+               //Increase slowly (0.4%/sec).  err is negative here.  
+               ctl->new_dbw_ul = ctl->new_dbw_ul * (1.0 - 0.004*err*(float)e->period/(float)ctl->plimit/1000.0);
+               if (ctl->new_dbw_ul > ctl->DBW_UL) ctl->new_dbw_ul=ctl->DBW_UL;
+
+            } else {
+            //Positive error means we need to decrease the bandwidth.
+
+               ctl->new_dbw_ul = ctl->new_dbw_ul * (1.0 - 0.004*err*(float)e->period/(float)ctl->plimit/1000.0);
+
+               //Dynamic range is 1/.15 or 6.67 : 1.  
+               if (ctl->new_dbw_ul < ctl->DBW_UL*.15) ctl->new_dbw_ul=ctl->DBW_UL*.15;
+            }   
+
+            //Modify parent download limit as needed.
+            ctl->dbw_ul = ctl->new_dbw_ul;
+
+            //Keep downward pressure on rawfltime_max to keep it fresh.
+            //It is shared so only the first controller to get here each tick does it.
+            if (!e->max_decayed && (e->rawfltime_max > ctl->plimit)) {
+                e->rawfltime_max -= 100;
+                e->max_decayed=1;
+            }
+
+            break;
+    }
+
+    return wantping;
+}
+
+/*
+ * Run one tick of the controllers.  rawfltime is this tick's trip time in uS,
+ * 0 if no pong came back.  See qosmon_ctl.h for what comes out.
+ */
+void qmon_step(struct QMON_ENGINE *e, struct QMON_CTL *ctls, int nctl, int rawfltime)
+{
+    struct QMON_CTL *ctl;
+    char reset=0;
+    int c;
+
+    for (c = 0, ctl = ctls; c < nctl; c++, ctl++) {
+        //If there was an error or the number of classes changed then reset everything
+        if (ctl->errorflg || (!ctl->firstflg && (ctl->nseen != ctl->classcnt))) {
+            if (ctl->errorflg) {ctl->cnt_errorflg++; ctl->last_errorflg=ctl->errorflg;}
+              else ctl->cnt_mismatch++;
+            reset=1;
+        }
+    }
+
+    //The controllers share the ping engine so they all start over together.
+    if (reset) {
+        for (c = 0, ctl = ctls; c < nctl; c++, ctl++) {
+            ctl->firstflg=1;
+            ctl->qstate=QMON_CHK; 
+        }
+        e->pingon=0;
+        return;
+    }
+ 
+    //Initialize or reinitialize the fair linklimit.
+    if (e->resetbw) {
+       for (c = 0, ctl = ctls; c < nctl; c++, ctl++) {
+           ctl->saved_realtime_limit=ctl->saved_active_limit=ctl->new_dbw_ul= ctl->DBW_UL * .9;
+       }
+       e->resetbw=0;
+    }
+
+    //Look at an ping response time we got.  If we did not get any then it most likely
+    //got dropped so use the maximum value that we have recently seen as we know the downlink
+    //queue must be at least this long.
+    if (!rawfltime) {
+       rawfltime = e->rawfltime_max;
+       e->nopingresponse=1;
+    } else {
+       e->nreceived++;
+       e->nopingresponse=0;
+
+       //Is this a new maximum?
+       if (rawfltime > e->rawfltime_max) e->rawfltime_max = rawfltime;
+    }
+    e->rawfltime = rawfltime;
+
+    //Update the filtered ping response time based on what happened.
+    //If we are not pinging then no change in the filtered value.
+    if (e->pingon) 
+       e->fil_triptime = ((rawfltime - e->fil_triptime)*e->alpha)/1000 + e->fil_triptime;
+
+    //Run the state machine
+    switch (ctls->qstate) {
+
+        // Wait to see if the ping targer will respond at all before doing anything
+        case QMON_CHK: 
+            e->pingon=1;
+
+            //If we get two pings go ahead and lower the link speed.
+            if (e->nreceived >= 2) {
+
+                //If the pinglimit was entered on the command line 
+                //without the add flag then go directly to the 
+                //IDLE state otherwise automatically determine an appropriate 
+                //ping limit.
+                if ((e->pinglimit) && !e->addentitlement) {
+                    for (c = 0, ctl = ctls; c < nctl; c++, ctl++) {
+                        ctl->dbw_ul = ctl->new_dbw_ul;
+                        ctl->resend = 1;
+                        ctl->qstate=QMON_IDLE;
+                    }
+                    e->base_triptime = e->fil_triptime = rawfltime;
+                 } else {
+                    for (c = 0, ctl = ctls; c < nctl; c++, ctl++) {
+                        ctl->dbw_ul = 1000;  //Unload the link for the measurement.
+                        ctl->qstate=QMON_INIT;
+                    }
+                    e->nreceived=0;
+                 }
+            } 
+            break; 
+
+        // Take a measurement of the practical ping time we can expect in an unsaturated
+        // link.  We do this by making pings and using the filter response after
+        // throttling all traffic in the link.
+        case QMON_INIT:
+            //Filter starts at ten seconds and runs until 15 seconds.
+            //For the first ten seconds we initialize the filter to the last ping time we saw.
+            //After the seventh second we start filtering.
+            if (e->nreceived < (10000/e->period)+1) e->fil_triptime = rawfltime;
+
+            //After 15 seconds we have measured our ping response entitlement.
+            //Move on to the active state. 
+            if (e->nreceived > (15000/e->period)+1) {
+                for (c = 0, ctl = ctls; c < nctl; c++, ctl++) {
+                    ctl->qstate=QMON_IDLE;
+                    ctl->dbw_ul = ctl->new_dbw_ul;  //Restore reasonable bandwidth
+                }
+
+                //If the user specified no limit then the RTT ping limit is computed from what was
+                //entered on the command line.
+                if (e->addentitlement) {
+                    //Add what the user specified to the 110% of the measure ping time.
+                    e->pinglimit += (e->fil_triptime*1.1);
+                } else {
+                    //Without the '-a' flag we just use 200% of measure ping time.  
+                    //This works OK in my system but I have no evidence that it will work in other systems.
+                    e->pinglimit = e->fil_triptime*2.0;
+                }
+
+                //Sanity Checks
+                if (e->pinglimit < 10000) e->pinglimit=10000;
+                if (e->pinglimit > 800000) e->pinglimit=800000;
+
+                //Reasonable max ping. 
+                e->rawfltime_max = 2*e->pinglimit;
+                e->base_triptime = e->fil_triptime;
+            }
+            break;
+
+        //Past the measurement each controller runs its own state machine
+        //and the pinger stays on while any of them wants it.
+        default:
+            e->pingon=0;
+            e->max_decayed=0;
+            for (c = 0, ctl = ctls; c < nctl; c++, ctl++) {
+                if (control_step(e, ctl)) e->pingon=1;
+            }
+            break;
+    }
+
+    //If we get here the first pass is over. 
+    for (c = 0, ctl = ctls; c < nctl; c++, ctl++) ctl->firstflg=0;
+}
+
+/* We are shutting down, put the links back to their full limit. */
+void qmon_exit(struct QMON_CTL *ctls, int nctl)
+{
+    struct QMON_CTL *ctl;
+    int c;
+
+    for (c = 0, ctl = ctls; c < nctl; c++, ctl++) {
+        ctl->qstate=QMON_EXIT;
+        ctl->dbw_ul = ctl->DBW_UL;
+    }
+}
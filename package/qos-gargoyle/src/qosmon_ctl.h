@@ -0,0 +1,124 @@
+/*  qosmon_ctl - The qosmon congestion controller without any of its I/O.
+ *               qosmon feeds it from the kernel, qosmon_replay from traces.
+ *
+ *  Copyright © 2010 by Paul Bixel <pbix@bigfoot.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+#ifndef QOSMON_CTL_H
+#define QOSMON_CTL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define QMON_CHK   0
+#define QMON_INIT  1
+#define QMON_ACTIVE 2
+#define QMON_REALTIME 3
+#define QMON_IDLE  4
+#define QMON_EXIT  5
+extern char *statename[];
+
+// Struct of data we keep on our classes
+struct CLASS_STATS {
+   uint32_t   handle;      //Class handle, the table is sorted on this.
+   int        ID;          //Class leaf ID
+   uint64_t   bytes;       //Work bytes last query
+   u_char     rtclass;     //True if class is realtime.
+   u_char     backlog;     //Number of packets waiting
+   u_char     actflg;      //True if class is active.
+   long int   cbw_flt;     //Class bandwidth subject to filter. (bps)
+   long int   cbw_flt_rt;  //Class realtime bandwidth subject to filter. (bps)
+   int64_t    bwtime;      //Timestamp of last byte reading.
+};
+
+// One of these for each HFSC tree we control (download on ifb0, optionally upload).
+// They all run off the one ping engine.  The CHECK and INIT states measure that
+// engine so every controller is in them together.
+struct QMON_CTL {
+   char       *dev;                 //Device the HFSC tree is on.
+   int        ifindex;              //Cached ifindex of dev, 0 if not found.
+   char       link_changed;         //Set when ifindex needs another lookup.
+
+   struct CLASS_STATS *classes;     //Class table sorted by handle.
+   int        classcnt;             //Number of classes in the table.
+   int        classalloc;           //Number of classes allocated.
+   int        nseen;                //Classes seen in this dump.
+   u_char     errorflg;
+   u_char     firstflg;             //First pass flag
+
+   u_char     DCA;                  //Number of classes active
+   u_char     RTDCA;                //Number of realtime classes active
+   int        plimit;               //Currently enforce ping limit
+   unsigned char qstate;
+
+   int        DBW_UL;               //This the absolute limit of the link passed in as a parameter.
+   int        dbw_ul;               //The link limit the kernel should have, output of qmon_step().
+   char       resend;               //Set when dbw_ul must be sent even if it did not change.
+   int        sent_ul;              //The last limit actually sent, kept by whoever applies dbw_ul.
+   int        new_dbw_ul;           //The new link limit proposed by the state machine.
+   int        saved_active_limit;   //The new link limit last known to work with active mode.
+   int        saved_realtime_limit; //The new link limit last known to work with realtime mode.
+   long int   dbw_fil;              //Filtered total load (bps).
+
+   u_short    cnt_mismatch;
+   u_short    cnt_errorflg;
+   u_short    last_errorflg;
+};
+
+// The ping side of the controller, shared by all the QMON_CTLs.
+// For our digital filters we use Y = Y(-1) + alpha * (X - Y(-1))
+// where alpha = Sample_Period / (TC + Sample_Period)
+struct QMON_ENGINE {
+   int        period;               //PING period In milliseconds
+   int        alpha;                //Actually alpha * 1000
+   float      BWTC;                 //Time constant of the bandwidth filter
+   char       addentitlement;       //Add entitlement to pinglimit (-a).
+   int        pinglimit_cl;         //Ping limit entered on the commandline.
+
+   int        pinglimit;            //MinRTT mode ping time.
+   int        fil_triptime;         //Filter ping times in uS
+   int        base_triptime;        //Ping time of the unloaded link in uS, 0 until measured.
+   int        rawfltime;            //Trip time in uS
+   int        rawfltime_max;        //The maximum measured ping time we have seen in uS.
+   char       nopingresponse;       //Set to true when ping response is dropped.
+   u_char     pingon;               //Set to one when pinger becomes active.
+   uint16_t   nreceived;            //# of ticks we got an answer for
+   char       resetbw;              //Set to put the fair link limits back to their initial value.
+   char       max_decayed;          //Set once rawfltime_max has been decayed this tick.
+};
+
+/*
+ * A tick goes like this.  For each controller call qmon_classes_begin(), then
+ * qmon_class_find() and qmon_class_sample() for each HFSC class in its tree, then
+ * qmon_classes_end().  Then call qmon_step() once with the tick's trip time.
+ * Afterwards each controller's dbw_ul is the limit the 1:1 class should have
+ * (send it when it differs from sent_ul or resend is set) and pingon says
+ * whether to probe for the next tick.  Nothing in here reads a clock or
+ * talks to the kernel.
+ */
+extern void qmon_init(struct QMON_ENGINE *e, int period, int pinglimit, char addentitlement);
+extern void qmon_ctl_init(struct QMON_CTL *ctl, char *dev, int bandwidth);
+extern void qmon_skip_measurement(struct QMON_ENGINE *e, struct QMON_CTL *ctls, int nctl, int triptime, int bwlimit);
+
+extern void qmon_classes_begin(struct QMON_CTL *ctl);
+extern struct CLASS_STATS *qmon_class_find(struct QMON_CTL *ctl, uint32_t handle, int leafid);
+extern void qmon_class_sample(struct QMON_ENGINE *e, struct QMON_CTL *ctl, struct CLASS_STATS *classptr, uint64_t work, u_char backlog, int64_t now_ns);
+extern void qmon_classes_end(struct QMON_CTL *ctl);
+
+extern void qmon_step(struct QMON_ENGINE *e, struct QMON_CTL *ctls, int nctl, int rawfltime);
+extern void qmon_exit(struct QMON_CTL *ctls, int nctl);
+
+#endif
@@ -0,0 +1,459 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*  qosmon_replay - Runs the qosmon controller against a trace recorded with
+ *                  qosmon -R, or against a simulated bufferbloated link, and
+ *                  reports how well it did.  It needs nothing from the router
+ *                  so it can be built and run on any Linux box.
+ *
+ *  Copyright © 2010 by Paul Bixel <pbix@bigfoot.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+#define _GNU_SOURCE 1
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "qosmon_ctl.h"
+
+#define MAXCTL      2
+#define SIMCLASSES  4     /* Leaf classes in the simulated HFSC tree */
+#define SETTLE_BAND 5     /* The limit has settled once it stays within this % of its final value */
+
+const char usage[] =
+"qosmon_replay - Run the qosmon controller against a trace and report how it did.\n\n"
+"Usage:  qosmon_replay [options] tracefile   - Replay a trace recorded with qosmon -R.\n"
+"        qosmon_replay [options] -S scenario - Simulate a bufferbloated link, scenario is one of\n"
+"              ramp  - The load climbs from nothing to 150% of the link.\n"
+"              loss  - 120% load with 5% of the pongs lost and a 3 second outage.\n"
+"              churn - 120% load with a class coming and going.\n"
+"              Options for the simulation:\n"
+"                     -p <ms>       - The ping interval, default 100.\n"
+"                     -b <kbps>     - The bandwidth qosmon is given, default 10000.\n"
+"                     -c <kbps>     - What the link really carries, default 80% of the bandwidth.\n"
+"                     -r <ms>       - The RTT of the unloaded link, default 20.\n"
+"                     -q <ms>       - The depth of the ISP's buffer, default 500.\n"
+"                     -d <seconds>  - How long to run, default 180.\n"
+"                     -l <limit>    - The pinglimit, as given to qosmon.\n"
+"                     -a            - As qosmon -a.\n"
+"              Options:\n"
+"                     -v            - Print each tick.\n";
+
+
+struct QMON_ENGINE engine;
+struct QMON_CTL ctls[MAXCTL];
+int nctl;
+
+char verbose;
+int64_t now_ns;          //Time of the current tick.
+int rawfltime;           //Trip time of the current tick in uS, 0 if none.
+char pinged;             //Set when the last step asked for pings.
+int64_t ctl_ns;          //Time spent in the controller.
+
+// What we learn about each controller over the run
+struct RUN_STATS {
+   long       ticks;
+   long       state_ticks[QMON_EXIT+1];
+   long       first_ctl;           //Tick the controller first went ACTIVE/MINRTT, -1 if never.
+   int        *limits;             //Fair limit at each tick.
+   long       limalloc;
+   double     util_sum;            //Sum of the per tick utilizations.
+   long       util_ticks;
+};
+struct RUN_STATS stats[MAXCTL];
+
+int *rtts;               //Pongs seen while a controller was ACTIVE/MINRTT (uS).
+long nrtts, rttalloc;
+long lost, probes;       //Pongs lost and pings sent while controlling.
+
+// The simulated link
+int sim_capacity;        //What the link really carries (bps).
+int sim_base_rtt;        //Unloaded RTT (uS).
+int sim_buffer;          //ISP buffer depth (uS at capacity).
+double sim_queue;        //Bits sitting in the ISP buffer.
+double sim_offered[SIMCLASSES+1];  //Offered load of each leaf (bps).
+double sim_bytes[SIMCLASSES+1];
+char *scenario;
+
+
+int64_t clock_ns(void)
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (int64_t)tp.tv_sec * 1000000000LL + (int64_t)tp.tv_nsec;
+}
+
+/* Hand the controller one class of the current tick. */
+void feed_class(struct QMON_CTL *ctl, uint32_t handle, int leafid, uint64_t bytes, u_char backlog, u_char rt)
+{
+    struct CLASS_STATS *classptr;
+    int64_t t0 = clock_ns();
+
+    classptr = qmon_class_find(ctl, handle, leafid);
+    if (classptr) {
+        if (ctl->firstflg) classptr->rtclass = rt;
+        qmon_class_sample(&engine, ctl, classptr, bytes, backlog, now_ns);
+    }
+
+    ctl_ns += clock_ns() - t0;
+}
+
+void begin_tick(void)
+{
+    int c;
+    for (c = 0; c < nctl; c++) qmon_classes_begin(&ctls[c]);
+}
+
+/*
+ * The classes are all in so run the step and write down what happened.
+ * utilization is the share of what the link could have carried that got
+ * through, negative if we don't know.
+ */
+void end_tick(double utilization)
+{
+    struct QMON_CTL *ctl;
+    struct RUN_STATS *st;
+    char controlling = 0;
+    int64_t t0 = clock_ns();
+    int c;
+
+    for (c = 0; c < nctl; c++) qmon_classes_end(&ctls[c]);
+    qmon_step(&engine, ctls, nctl, rawfltime);
+    ctl_ns += clock_ns() - t0;
+
+    for (c = 0, ctl = ctls, st = stats; c < nctl; c++, ctl++, st++) {
+        if ((ctl->qstate == QMON_ACTIVE) || (ctl->qstate == QMON_REALTIME)) {
+            controlling = 1;
+            if (st->first_ctl < 0) st->first_ctl = st->ticks;
+            if (utilization >= 0) {
+                st->util_sum += utilization;
+                st->util_ticks++;
+            } else if (ctl->DBW_UL) {
+                st->util_sum += (double)ctl->dbw_fil / ctl->DBW_UL;
+                st->util_ticks++;
+            }
+        }
+
+        if (st->ticks >= st->limalloc) {
+            st->limalloc = st->limalloc ? st->limalloc*2 : 4096;
+            st->limits = realloc(st->limits, st->limalloc*sizeof(int));
+            if (st->limits == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+        st->limits[st->ticks++] = ctl->new_dbw_ul;
+        st->state_ticks[ctl->qstate]++;
+
+        //The simulated kernel takes whatever limit we hand it.
+        ctl->sent_ul = ctl->dbw_ul;
+        ctl->resend = 0;
+    }
+
+    //Only pongs to pings the step asked for count.
+    if (controlling && pinged) {
+        probes++;
+        if (rawfltime) {
+            if (nrtts >= rttalloc) {
+                rttalloc = rttalloc ? rttalloc*2 : 4096;
+                rtts = realloc(rtts, rttalloc*sizeof(int));
+                if (rtts == NULL) {
+                    fprintf(stderr, "Out of memory\n");
+                    exit(1);
+                }
+            }
+            rtts[nrtts++] = rawfltime;
+        } else lost++;
+    }
+
+    if (verbose) {
+        ctl = ctls;
+        printf("%8.1f %-8s limit %6d fair %6d load %6ld rtt %6.1f fil %6.1f\n",
+              now_ns/1e9, statename[ctl->qstate], ctl->dbw_ul/1000, ctl->new_dbw_ul/1000,
+              ctl->dbw_fil/1000, rawfltime/1000.0, engine.fil_triptime/1000.0);
+    }
+
+    pinged = engine.pingon;
+}
+
+/*
+ * Replay a trace from qosmon -R.  The trace is what the link did under the recorded
+ * qosmon, so the limits we come up with don't feed back into it.
+ */
+int replay_file(char *name)
+{
+    FILE *fd;
+    char line[256], dev[64];
+    int a, b, c, n;
+    unsigned int handle, backlog, rt;
+    unsigned long long bytes, us;
+    int leafid;
+    char intick = 0;
+
+    if ((fd = fopen(name, "r")) == NULL) {
+        fprintf(stderr, "Cannot open %s\n", name);
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), fd) != NULL) {
+        switch (line[0]) {
+            case 'p':
+                if (sscanf(line, "p %d %d %d", &a, &b, &c) == 3) qmon_init(&engine, a, b, c);
+                break;
+
+            case 'd':
+                if ((sscanf(line, "d %d %63s %d", &n, dev, &a) == 3) && (n >= 0) && (n < MAXCTL)) {
+                    qmon_ctl_init(&ctls[n], strdup(dev), a);
+                    stats[n].first_ctl = -1;
+                    if (n >= nctl) nctl = n+1;
+                }
+                break;
+
+            case 's':
+                if (sscanf(line, "s %d %d", &a, &b) == 2) qmon_skip_measurement(&engine, ctls, nctl, a, b);
+                break;
+
+            case 'r':
+                engine.resetbw = 1;
+                break;
+
+            case 't':
+                if ((sscanf(line, "t %llu %d", &us, &a) != 2) || !engine.period || !nctl) break;
+                if (intick) end_tick(-1);
+                now_ns = us * 1000;
+                rawfltime = a;
+                begin_tick();
+                intick = 1;
+                break;
+
+            case 'c':
+                if (!intick) break;
+                if ((sscanf(line, "c %d %x %d %llu %u %u", &n, &handle, &leafid, &bytes, &backlog, &rt) == 6) &&
+                    (n >= 0) && (n < nctl)) {
+                    feed_class(&ctls[n], handle, leafid, bytes, backlog, rt);
+                }
+                break;
+        }
+    }
+    if (intick) end_tick(-1);
+
+    fclose(fd);
+    return 0;
+}
+
+/* Set this tick's offered load for each leaf.  Leaf 0 is the realtime one. */
+int sim_load(double t, int *nclass)
+{
+    double total = 0;
+    int i;
+
+    *nclass = SIMCLASSES-1;
+
+    if (!strcmp(scenario, "ramp")) {
+        if (t > 20) total = 1.5 * sim_capacity * (t < 80 ? (t-20)/60 : 1);
+    } else if (!strcmp(scenario, "loss") || !strcmp(scenario, "churn")) {
+        if (t > 20) total = 1.2 * sim_capacity;
+        if (!strcmp(scenario, "churn") && (t >= 80) && (t < 130)) *nclass = SIMCLASSES;
+    } else {
+        return 1;
+    }
+
+    //A little realtime traffic (a game, VoIP) and the rest is bulk downloads.
+    sim_offered[0] = (total > 0) ? 0.02 * sim_capacity : 0;
+    for (i = 1; i < SIMCLASSES; i++) sim_offered[i] = (i < *nclass) ? total / (*nclass-1) : 0;
+
+    return 0;
+}
+
+/*
+ * Run a scenario against a simple model of a bufferbloated link.  Our shaper sits
+ * behind the ISP's buffer so the senders slow to whichever is less, our limit or what
+ * they offer, and anything above the link's real capacity piles up in the ISP's
+ * buffer where our pings have to wait behind it.  When the buffer overflows some
+ * pongs are lost.
+ */
+int simulate(int period, int duration)
+{
+    struct QMON_CTL *ctl = ctls;
+    double dt = period/1000.0;
+    double offered, admitted, delivered, buffer_bits;
+    char overflow;
+    int nclass, ticks, i;
+
+    buffer_bits = (double)sim_capacity * sim_buffer / 1e6;
+    stats[0].first_ctl = -1;
+    srand(1);
+
+    for (ticks = 0; ticks < duration*1000/period; ticks++) {
+        now_ns = (int64_t)ticks * period * 1000000LL;
+        if (sim_load(ticks * dt, &nclass)) {
+            fprintf(stderr, "Unknown scenario %s\n", scenario);
+            return 1;
+        }
+
+        for (offered = 0, i = 0; i < nclass; i++) offered += sim_offered[i];
+        admitted = (offered < ctl->dbw_ul) ? offered : ctl->dbw_ul;
+
+        delivered = admitted*dt + sim_queue;
+        if (delivered > sim_capacity*dt) delivered = sim_capacity*dt;
+        sim_queue += (admitted - sim_capacity)*dt;
+        if (sim_queue < 0) sim_queue = 0;
+        overflow = (sim_queue > buffer_bits);
+        if (overflow) sim_queue = buffer_bits;
+
+        //The pong waits behind whatever is in the ISP's buffer, plus up to 1ms of jitter.
+        rawfltime = 0;
+        if (pinged) {
+            rawfltime = sim_base_rtt + sim_queue*1e6/sim_capacity + rand()%1000;
+            if (overflow && (rand()%2)) rawfltime = 0;
+            if (!strcmp(scenario, "loss") && (((rand()%100) < 5) || ((ticks*dt >= 90) && (ticks*dt < 93)))) rawfltime = 0;
+        }
+
+        //The parent is 1:1, the leaves 1:2 and up.
+        begin_tick();
+        feed_class(ctl, 0x10001, -1, 0, 0, 0);
+        for (i = 0; i < nclass; i++) {
+            if (offered > 0) sim_bytes[i] += delivered * sim_offered[i] / offered / 8;
+            feed_class(ctl, 0x10002+i, 0x100+i, (uint64_t)sim_bytes[i], 0, (i == 0));
+        }
+
+        if (offered > 0) {
+            end_tick(delivered/dt / (offered < sim_capacity ? offered : sim_capacity));
+        } else {
+            end_tick(-1);
+        }
+    }
+
+    return 0;
+}
+
+int compare_ints(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+void report(void)
+{
+    struct QMON_CTL *ctl;
+    struct RUN_STATS *st;
+    long i, settled, last;
+    double final, band;
+    int c, s;
+
+    for (c = 0, ctl = ctls, st = stats; c < nctl; c++, ctl++, st++) {
+        printf("%s: %ld ticks (%.1f s)", ctl->dev, st->ticks, st->ticks*engine.period/1000.0);
+        for (s = 0; s <= QMON_EXIT; s++) {
+            if (st->state_ticks[s]) printf(", %s %.1f s", statename[s], st->state_ticks[s]*engine.period/1000.0);
+        }
+        printf("\n");
+
+        if ((st->first_ctl < 0) || (st->ticks == 0)) {
+            printf("%s: never went ACTIVE or MINRTT\n", ctl->dev);
+            continue;
+        }
+
+        //The final limit is the average over the last tenth of the run.
+        last = st->ticks/10;
+        if (last < 1) last = 1;
+        for (final = 0, i = st->ticks-last; i < st->ticks; i++) final += st->limits[i];
+        final /= last;
+
+        //It has settled once it stays within the band for the rest of the run.
+        band = final * SETTLE_BAND / 100;
+        for (settled = st->ticks; settled > st->first_ctl; settled--) {
+            if ((st->limits[settled-1] < final - band) || (st->limits[settled-1] > final + band)) break;
+        }
+
+        printf("%s: fair limit settled at %.0f kbps (%d%% of %d kbps)", ctl->dev, final/1000,
+              (int)(final*100/ctl->DBW_UL), ctl->DBW_UL/1000);
+        if (settled == st->ticks) printf(", still moving at the end\n");
+          else printf(" %.1f s after control started at %.1f s\n", (settled - st->first_ctl)*engine.period/1000.0,
+                      st->first_ctl*engine.period/1000.0);
+
+        if (st->util_ticks) {
+            if (scenario) printf("%s: link utilization while controlling %.1f%%\n", ctl->dev, st->util_sum*100/st->util_ticks);
+              else printf("%s: load while controlling %.1f%% of the bandwidth\n", ctl->dev, st->util_sum*100/st->util_ticks);
+        }
+    }
+
+    if (nrtts) {
+        qsort(rtts, nrtts, sizeof(int), compare_ints);
+        printf("RTT while controlling (ms): p50 %.1f, p90 %.1f, p99 %.1f, max %.1f, limit %d\n",
+              rtts[(nrtts-1)*50/100]/1000.0, rtts[(nrtts-1)*90/100]/1000.0,
+              rtts[(nrtts-1)*99/100]/1000.0, rtts[nrtts-1]/1000.0, ctls->plimit/1000);
+    }
+    if (probes) printf("Pongs lost while controlling: %ld of %ld (%.1f%%)\n", lost, probes, lost*100.0/probes);
+
+    if (stats[0].ticks) printf("Controller: %.0f ns per tick\n", (double)ctl_ns/stats[0].ticks);
+}
+
+int main(int argc, char *argv[])
+{
+    int period = 100, bandwidth = 10000, capacity = 0, duration = 180;
+    int pinglimit = 0, base_rtt = 20, buffer = 500;
+    char addentitlement = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "S:p:b:c:r:q:d:l:av")) != -1) {
+        switch (opt) {
+            case 'S': scenario = optarg; break;
+            case 'p': period = atoi(optarg); break;
+            case 'b': bandwidth = atoi(optarg); break;
+            case 'c': capacity = atoi(optarg); break;
+            case 'r': base_rtt = atoi(optarg); break;
+            case 'q': buffer = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'l': pinglimit = atoi(optarg); break;
+            case 'a': addentitlement = 1; break;
+            case 'v': verbose = 1; break;
+            default:
+                printf("%s", usage);
+                exit(1);
+        }
+    }
+
+    if (scenario) {
+        if ((period > 2000) || (period < 100) || (bandwidth < 100) || (bandwidth >= INT_MAX/1000) ||
+            (capacity < 0) || (capacity >= INT_MAX/1000) || (duration <= 0) || (base_rtt < 0) || (buffer <= 0)) {
+            printf("%s", usage);
+            exit(1);
+        }
+
+        qmon_init(&engine, period, pinglimit, addentitlement);
+        qmon_ctl_init(&ctls[0], "ifb0", bandwidth);
+        nctl = 1;
+
+        sim_capacity = capacity ? capacity * 1000 : bandwidth * 800;
+        sim_base_rtt = base_rtt * 1000;
+        sim_buffer = buffer * 1000;
+        if (simulate(period, duration)) exit(1);
+    } else {
+        if (optind != argc-1) {
+            printf("%s", usage);
+            exit(1);
+        }
+        if (replay_file(argv[optind])) exit(1);
+        if (nctl == 0) {
+            fprintf(stderr, "%s is not a qosmon trace\n", argv[optind]);
+            exit(1);
+        }
+    }
+
+    report();
+    return 0;
+}
@@ -0,0 +1,126 @@
+/*  qosmon_shm - The status block qosmon publishes in a small mmap'd file.
+ *               qosmon_status (or anything else) maps it read only.
+ *
+ *  Copyright © 2010 by Paul Bixel <pbix@bigfoot.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+#ifndef QOSMON_SHM_H
+#define QOSMON_SHM_H
+
+#include <stdint.h>
+
+#define QMON_SHM_FILE     "/tmp/qosmon.shm"
+#define QMON_SHM_MAGIC    0x514d4f4e  /* "QMON" */
+#define QMON_SHM_VERSION  1
+
+#define QMON_SHM_CTLS     2           /* Controllers, same as MAXCTL in qosmon */
+#define QMON_SHM_TARGETS  8           /* Ping targets, same as MAXTARGETS in qosmon */
+#define QMON_SHM_CLASSES  64          /* Classes per controller, the rest are left out */
+#define QMON_SHM_NAMELEN  64          /* Target specs longer than this are cut short */
+#define QMON_SHM_DEVLEN   16          /* IFNAMSIZ */
+
+struct QMON_SHM_CLASS {
+   uint16_t   ID;                   //Class leaf ID
+   uint8_t    actflg;               //True if class is active.
+   uint8_t    rtclass;              //True if class is realtime.
+   uint8_t    backlog;              //Number of packets waiting
+   uint8_t    pad[3];
+   int32_t    cbw_flt;              //Filtered class bandwidth (bps).
+};
+
+struct QMON_SHM_CTL {
+   char       dev[QMON_SHM_DEVLEN];
+   uint8_t    qstate;
+   uint8_t    DCA;                  //Number of classes active
+   uint8_t    RTDCA;                //Number of realtime classes active
+   uint8_t    nclasses;             //Entries used in classes[]
+   int32_t    dbw_ul;               //Link limit (bps)
+   int32_t    new_dbw_ul;           //Fair link limit (bps)
+   int32_t    load;                 //Filtered load including the pings (bps)
+   int32_t    plimit;               //Ping limit being enforced (uS)
+   uint16_t   cnt_mismatch;
+   uint16_t   cnt_errorflg;
+   uint16_t   last_errorflg;
+   uint16_t   pad;
+   struct QMON_SHM_CLASS classes[QMON_SHM_CLASSES];
+};
+
+struct QMON_SHM_TARGET {
+   char       name[QMON_SHM_NAMELEN];
+   uint8_t    alive;                //Target is in the filter.
+   uint8_t    pad;
+   uint16_t   misses;               //Ticks in a row without an answer.
+   int32_t    rawfltime;            //Last trip time (uS)
+};
+
+// Everything the old /tmp/qosmon.status text file had.
+struct QMON_SHM_STATUS {
+   int64_t    time_ms;              //Wall clock time of the tick.
+   uint8_t    pingon;
+   uint8_t    nopingresponse;
+   uint8_t    nctl;
+   uint8_t    ntargets;             //Targets are only filled in when there is more than one.
+   int32_t    rawfltime;            //Trip time (uS)
+   int32_t    fil_triptime;         //Filtered trip time (uS)
+   int32_t    rawfltime_max;        //Max recent trip time (uS)
+   int32_t    pinglimit;            //MinRTT mode ping limit (uS)
+   int32_t    active_pinglimit;     //Active mode ping limit (uS)
+   int32_t    sel_err;
+   char       passive_dev[QMON_SHM_DEVLEN]; //Empty if passive mode is off.
+   int32_t    handshakes;           //Handshakes timed last tick.
+   uint8_t    ping_skipped;
+   uint8_t    pad[3];
+   struct QMON_SHM_TARGET targets[QMON_SHM_TARGETS];
+   struct QMON_SHM_CTL ctls[QMON_SHM_CTLS];
+};
+
+// One tick in the history ring, enough to graph what the controllers did.
+struct QMON_SHM_HIST {
+   int64_t    time_ms;
+   int32_t    rawfltime;            //(uS), 0 if there was no answer
+   int32_t    fil_triptime;         //(uS)
+   struct {
+      uint8_t qstate;
+      uint8_t DCA;
+      uint8_t pad[2];
+      int32_t dbw_ul;               //(bps)
+      int32_t new_dbw_ul;           //(bps)
+      int32_t load;                 //(bps)
+      int32_t plimit;               //(uS)
+   } ctls[QMON_SHM_CTLS];
+};
+
+/*
+ * The file is one of these followed by nhist QMON_SHM_HIST.  qosmon makes
+ * seq odd while it writes, and even again once status and hist[(ticks-1) % nhist]
+ * are consistent.  A reader copies what it wants and tries again if seq was odd
+ * or changed in the meantime.  A new qosmon renames a new file into place so a
+ * reader that still has the old one mapped is never cut short.
+ */
+struct QMON_SHM {
+   uint32_t   magic;
+   uint16_t   version;
+   uint16_t   hdrsize;              //sizeof(struct QMON_SHM)
+   uint32_t   seq;                  //Sequence count, odd while being written.
+   uint32_t   pid;                  //qosmon writing it.
+   uint32_t   period;               //Tick period (mS)
+   uint32_t   nhist;                //Entries in the history ring, 0 if none.
+   uint64_t   ticks;                //Ticks written so far.
+   struct QMON_SHM_STATUS status;
+   struct QMON_SHM_HIST hist[];
+};
+
+#endif
@@ -0,0 +1,235 @@
+/* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
+/*  qosmon_status - Prints the status block qosmon publishes in /tmp/qosmon.shm
+ *                  in the text format of the old /tmp/qosmon.status file,
+ *                  or the history ring kept with qosmon -H.
+ *
+ *  Copyright © 2010 by Paul Bixel <pbix@bigfoot.com>
+ *
+ *  This file is free software: you may copy, redistribute and/or modify it
+ *  under the terms of the GNU General Public License as published by the
+ *  Free Software Foundation, either version 2 of the License, or (at your
+ *  option) any later version.
+ *
+ *  This file is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+*/
+#define _GNU_SOURCE 1
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "qosmon_ctl.h"
+#include "qosmon_shm.h"
+
+#define RETRIES 1000      /* Give up on a block that stays odd this many mS, its writer died */
+
+const char usage[] =
+"qosmon_status - Print the status qosmon publishes.\n\n"
+"Usage:  qosmon_status [options]\n"
+"              Options:\n"
+"                     -f <file>     - The status block, default " QMON_SHM_FILE ".\n"
+"                     -H            - Print the history ring (qosmon -H) instead, oldest tick first.\n";
+
+
+/*
+ * Copy size bytes of the block at shm into copy once qosmon is not in the
+ * middle of writing it.  Returns 0 on success.
+ */
+int snapshot(struct QMON_SHM *shm, struct QMON_SHM *copy, size_t size)
+{
+    uint32_t seq;
+    int tries;
+
+    for (tries = 0; tries < RETRIES; tries++) {
+        seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            usleep(1000);
+            continue;
+        }
+
+        memcpy(copy, shm, size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq) return 0;
+    }
+    return -1;
+}
+
+const char *state(int qstate)
+{
+    return (qstate <= QMON_EXIT) ? statename[qstate] : "?";
+}
+
+/* Print the status exactly as qosmon used to write it to /tmp/qosmon.status. */
+void print_status(struct QMON_SHM_STATUS *st)
+{
+    struct QMON_SHM_CTL *ctl = st->ctls;
+    struct QMON_SHM_CLASS *cptr;
+    int i, c;
+
+    fprintf(stdout,"State: %s\n",state(ctl->qstate));
+    fprintf(stdout,"Link limit: %d (kbps)\n",ctl->dbw_ul/1000);
+    fprintf(stdout,"Fair Link limit: %d (kbps)\n",ctl->new_dbw_ul/1000);
+    fprintf(stdout,"Link load: %d (kbps)\n",ctl->load/1000);
+
+    if (st->pingon) {
+        if (st->nopingresponse) fprintf(stdout,"Ping: Dropped, assume %d mS\n",st->rawfltime_max/1000);
+        else fprintf(stdout,"Ping: %d (ms)\n",st->rawfltime/1000);
+    }
+    else
+        fprintf(stdout,"Ping: off\n");
+
+    fprintf(stdout,"Filtered/Max recent RTT: %d/%d (ms)\n",st->fil_triptime/1000,st->rawfltime_max/1000);
+    fprintf(stdout,"RTT time limit: %d (ms) [%d/%d]\n",ctl->plimit/1000,st->pinglimit/1000,st->active_pinglimit/1000);
+    fprintf(stdout,"Classes Active: %u\n",ctl->DCA);
+
+    fprintf(stdout,"Errors: (mismatch,errors,last err,selerr): %u,%u,%u,%i\n", ctl->cnt_mismatch, ctl->cnt_errorflg,ctl->last_errorflg,st->sel_err);
+
+    for (i=0, cptr=ctl->classes; i<ctl->nclasses; i++, cptr++) {
+        fprintf(stdout,"ID %4X, Active %u, Backlog %u, BW bps (filtered): %d\n",
+              cptr->ID,
+              cptr->actflg,
+              cptr->backlog,
+              cptr->cbw_flt);
+    }
+
+    for (i=0; i<st->ntargets && i<QMON_SHM_TARGETS; i++) {
+        fprintf(stdout,"Target %.*s: %s, RTT %d (ms), Missed %u\n",
+              QMON_SHM_NAMELEN, st->targets[i].name,
+              st->targets[i].alive ? "in use" : "dropped",
+              st->targets[i].rawfltime/1000,
+              st->targets[i].misses);
+    }
+
+    if (st->passive_dev[0]) {
+        fprintf(stdout,"Passive %.*s: %d handshakes last tick%s\n",
+              QMON_SHM_DEVLEN, st->passive_dev,
+              st->handshakes,
+              st->ping_skipped ? ", ping skipped" : "");
+    }
+
+    for (c=1, ctl=st->ctls+1; c<st->nctl && c<QMON_SHM_CTLS; c++, ctl++) {
+        fprintf(stdout,"Device %.*s: State %s, Limit %d, Fair limit %d, Load %d (kbps), RTT limit %d (ms), Active %u, Errors %u,%u,%u\n",
+              QMON_SHM_DEVLEN, ctl->dev,
+              state(ctl->qstate),
+              ctl->dbw_ul/1000,
+              ctl->new_dbw_ul/1000,
+              ctl->load/1000,
+              ctl->plimit/1000,
+              ctl->DCA,
+              ctl->cnt_mismatch, ctl->cnt_errorflg, ctl->last_errorflg);
+
+        for (i=0, cptr=ctl->classes; i<ctl->nclasses; i++, cptr++) {
+            fprintf(stdout,"Device %.*s: Leaf %4X, Active %u, Backlog %u, BW bps (filtered): %d\n",
+                  QMON_SHM_DEVLEN, ctl->dev,
+                  cptr->ID,
+                  cptr->actflg,
+                  cptr->backlog,
+                  cptr->cbw_flt);
+        }
+    }
+}
+
+/* Print the ticks in the history ring, one per line, oldest first. */
+void print_history(struct QMON_SHM *shm)
+{
+    struct QMON_SHM_HIST *h;
+    uint64_t n, t;
+    int c, nctl = shm->status.nctl;
+
+    if (nctl > QMON_SHM_CTLS) nctl = QMON_SHM_CTLS;
+
+    printf("#time(ms) ping(ms) filtered(ms)");
+    for (c = 0; c < nctl; c++) {
+        printf(" | %.*s: state limit fair load(kbps) rttlimit(ms) active", QMON_SHM_DEVLEN, shm->status.ctls[c].dev);
+    }
+    printf("\n");
+
+    n = (shm->ticks < shm->nhist) ? shm->ticks : shm->nhist;
+    for (t = shm->ticks - n; t < shm->ticks; t++) {
+        h = &shm->hist[t % shm->nhist];
+        printf("%lld %d %d", (long long) h->time_ms, h->rawfltime/1000, h->fil_triptime/1000);
+        for (c = 0; c < nctl; c++) {
+            printf(" | %s %d %d %d %d %u",
+                  state(h->ctls[c].qstate),
+                  h->ctls[c].dbw_ul/1000,
+                  h->ctls[c].new_dbw_ul/1000,
+                  h->ctls[c].load/1000,
+                  h->ctls[c].plimit/1000,
+                  h->ctls[c].DCA);
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    char *file = QMON_SHM_FILE;
+    char history = 0;
+    struct QMON_SHM *shm, *copy;
+    struct stat sb;
+    size_t size;
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "f:H")) != -1) {
+        switch (opt) {
+            case 'f': file = optarg; break;
+            case 'H': history = 1; break;
+            default:
+                printf("%s", usage);
+                exit(1);
+        }
+    }
+
+    if (((fd = open(file, O_RDONLY)) < 0) || (fstat(fd, &sb) < 0)) {
+        fprintf(stderr, "Cannot open %s\n", file);
+        exit(1);
+    }
+
+    if ((sb.st_size < 0) || ((uint64_t) sb.st_size < sizeof(struct QMON_SHM))) {
+        fprintf(stderr, "%s is not a qosmon status block\n", file);
+        exit(1);
+    }
+
+    shm = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %s\n", file);
+        exit(1);
+    }
+
+    if ((shm->magic != QMON_SHM_MAGIC) || (shm->version != QMON_SHM_VERSION) ||
+        (shm->hdrsize != sizeof(struct QMON_SHM)) ||
+        ((uint64_t) sb.st_size < sizeof(struct QMON_SHM) + (uint64_t) shm->nhist * sizeof(struct QMON_SHM_HIST))) {
+        fprintf(stderr, "%s is not a qosmon status block\n", file);
+        exit(1);
+    }
+
+    //Only copy the history when it is wanted, the status alone is a few kB.
+    size = sizeof(struct QMON_SHM);
+    if (history) size += shm->nhist * sizeof(struct QMON_SHM_HIST);
+    if ((copy = malloc(size)) == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    if (snapshot(shm, copy, size)) {
+        fprintf(stderr, "%s is not being updated\n", file);
+        exit(1);
+    }
+
+    if (history) print_history(copy);
+        else print_status(&copy->status);
+
+    return 0;
+}